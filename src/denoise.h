@@ -0,0 +1,532 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "math/Vectors.h"
+#include "utils/threadpool.h"
+#include "utils/writePPM.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DENOISE_SIMD 1
+#else
+#define DENOISE_SIMD 0
+#endif
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al.) run on the image
+// once it is rendered. The color is divided by the first-hit albedo, so
+// texture detail is kept out of the blur, and each pass spreads a 5x5 B3
+// spline kernel twice as wide as the one before. Taps are weighted down when
+// their normal or depth is off from the pixel, or when their luminance is
+// further away than the noise of the pixel explains; that noise is the
+// variance of its mean, which every pass filters along with the color.
+// Rows are spread over the render threads and filtered 4 or 8 pixels at a
+// time with SSE or AVX2, picked at runtime. Every kernel does the same
+// operations in the same order, so the image does not depend on the CPU.
+
+#define DENOISE_ITERATIONS 5
+// Reach of the widest pass, the planes are padded with that many pixels of
+// zero normals that no tap gives any weight to
+#define DENOISE_PADDING (2 << (DENOISE_ITERATIONS - 1))
+// Power the cosine between two normals is raised to
+#define DENOISE_NORMAL_POWER_LOG2 7
+// Luminance differences are compared to this many standard deviations
+#define DENOISE_SIGMA_LUMINANCE 4.0f
+// Depth differences are compared to this many times the depth gradient
+#define DENOISE_SIGMA_DEPTH 1.0f
+// Albedo channels below this are not divided out
+#define DENOISE_MIN_ALBEDO 0.01f
+#define DENOISE_EPSILON 1e-4f
+
+enum {
+    DENOISE_COLOR_R,
+    DENOISE_COLOR_G,
+    DENOISE_COLOR_B,
+    DENOISE_VARIANCE,
+    // Ping-pong copies of the four planes above
+    DENOISE_OUT_R,
+    DENOISE_OUT_G,
+    DENOISE_OUT_B,
+    DENOISE_OUT_VARIANCE,
+    DENOISE_ALBEDO_R,
+    DENOISE_ALBEDO_G,
+    DENOISE_ALBEDO_B,
+    DENOISE_NORMAL_X,
+    DENOISE_NORMAL_Y,
+    DENOISE_NORMAL_Z,
+    DENOISE_DEPTH,
+    DENOISE_DEPTH_GRADIENT,
+    DENOISE_PLANE_COUNT
+};
+
+struct Denoiser;
+
+typedef struct DenoiseKernels {
+    const char* name;
+    int width;
+    // Filters row y with taps step pixels apart, from the four planes of src
+    // to the four planes of dst
+    void (*row)(const struct Denoiser* d, int y, int step, float* const* src, float* const* dst);
+} DenoiseKernels;
+
+// One plane per channel, stride floats per row with the padding around
+typedef struct Denoiser {
+    int width;
+    int height;
+    int stride;
+    float* block;
+    float* planes[DENOISE_PLANE_COUNT];
+    DenoiseKernels kernels;
+} Denoiser;
+
+static const float denoiseKernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// exp(x) for x <= 0 on the same operations as the SIMD versions: a Cephes
+// polynomial on the remainder after taking out a power of two
+float denoise_exp(float x) {
+    x = x < -87.0f ? -87.0f : (x > 0.0f ? 0.0f : x);
+    float v = x * 1.44269504f + 0.5f;
+    int n = (int)v;
+    n -= (float)n > v;
+    float fn = (float)n;
+    float r = x - fn * 0.693359375f;
+    r = r - fn * -2.12194440e-4f;
+    float y = 1.9875691500e-4f;
+    y = y * r + 1.3981999507e-3f;
+    y = y * r + 8.3334519073e-3f;
+    y = y * r + 4.1665795894e-2f;
+    y = y * r + 1.6666665459e-1f;
+    y = y * r + 5.0000001201e-1f;
+    y = y * (r * r) + r;
+    y = y + 1.0f;
+    uint32_t bits = (uint32_t)(n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return y * scale;
+}
+
+float denoise_luminance(float r, float g, float b) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+int denoise_index(const Denoiser* d, int x, int y) {
+    return (y + DENOISE_PADDING) * d->stride + x + DENOISE_PADDING;
+}
+
+// Albedo actually divided out of a channel
+float denoise_albedo(float albedo) {
+    return albedo < DENOISE_MIN_ALBEDO ? 1.0f : albedo;
+}
+
+void denoise_pixel(const Denoiser* d, int x, int y, int step, float* const* src, float* const* dst) {
+    float* const* p = d->planes;
+    int center = denoise_index(d, x, y);
+    float nx = p[DENOISE_NORMAL_X][center], ny = p[DENOISE_NORMAL_Y][center], nz = p[DENOISE_NORMAL_Z][center];
+    float depth = p[DENOISE_DEPTH][center];
+    float gradient = p[DENOISE_DEPTH_GRADIENT][center] * DENOISE_SIGMA_DEPTH;
+    float r = src[0][center], g = src[1][center], b = src[2][center];
+    float luminance = denoise_luminance(r, g, b);
+    float sigma = DENOISE_SIGMA_LUMINANCE * sqrtf(src[3][center]) + DENOISE_EPSILON;
+    float h = denoiseKernel[2] * denoiseKernel[2];
+    float sumR = h * r, sumG = h * g, sumB = h * b;
+    float sumVariance = h * h * src[3][center];
+    float sumWeight = h;
+    for(int ty = 0; ty < 5; ty++) {
+        for(int tx = 0; tx < 5; tx++) {
+            if(tx == 2 && ty == 2) {
+                continue;
+            }
+            int q = center + ((ty - 2) * d->stride + (tx - 2)) * step;
+            float cosine = nx * p[DENOISE_NORMAL_X][q] + ny * p[DENOISE_NORMAL_Y][q] + nz * p[DENOISE_NORMAL_Z][q];
+            float normalWeight = cosine > 0.0f ? cosine : 0.0f;
+            for(int i = 0; i < DENOISE_NORMAL_POWER_LOG2; i++) {
+                normalWeight = normalWeight * normalWeight;
+            }
+            float distance = sqrtf((float)((tx - 2) * (tx - 2) + (ty - 2) * (ty - 2))) * (float)step;
+            float depthTerm = fabsf(depth - p[DENOISE_DEPTH][q]) / (gradient * distance + DENOISE_EPSILON);
+            float luminanceTerm = fabsf(luminance - denoise_luminance(src[0][q], src[1][q], src[2][q])) / sigma;
+            float weight = denoiseKernel[tx] * denoiseKernel[ty] * normalWeight * denoise_exp(-(depthTerm + luminanceTerm));
+            sumR += weight * src[0][q];
+            sumG += weight * src[1][q];
+            sumB += weight * src[2][q];
+            sumVariance += weight * weight * src[3][q];
+            sumWeight += weight;
+        }
+    }
+    dst[0][center] = sumR / sumWeight;
+    dst[1][center] = sumG / sumWeight;
+    dst[2][center] = sumB / sumWeight;
+    dst[3][center] = sumVariance / (sumWeight * sumWeight);
+}
+
+void denoise_row_scalar(const Denoiser* d, int y, int step, float* const* src, float* const* dst) {
+    for(int x = 0; x < d->width; x++) {
+        denoise_pixel(d, x, y, step, src, dst);
+    }
+}
+
+#if DENOISE_SIMD
+
+__m128 denoise_exp_sse(__m128 x) {
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.0f)), _mm_setzero_ps());
+    __m128 v = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _mm_set1_ps(0.5f));
+    __m128i n = _mm_cvttps_epi32(v);
+    // Truncation rounds the negative values up, step them back down
+    n = _mm_add_epi32(n, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(n), v)));
+    __m128 fn = _mm_cvtepi32_ps(n);
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(fn, _mm_set1_ps(0.693359375f)));
+    r = _mm_sub_ps(r, _mm_mul_ps(fn, _mm_set1_ps(-2.12194440e-4f)));
+    __m128 y = _mm_set1_ps(1.9875691500e-4f);
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(1.3981999507e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(8.3334519073e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(4.1665795894e-2f));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(1.6666665459e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(5.0000001201e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(r, r)), r);
+    y = _mm_add_ps(y, _mm_set1_ps(1.0f));
+    __m128i bits = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(bits));
+}
+
+__m128 denoise_luminance_sse(__m128 r, __m128 g, __m128 b) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.2126f), r), _mm_mul_ps(_mm_set1_ps(0.7152f), g)), _mm_mul_ps(_mm_set1_ps(0.0722f), b));
+}
+
+void denoise_row_sse(const Denoiser* d, int y, int step, float* const* src, float* const* dst) {
+    float* const* p = d->planes;
+    __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    int x = 0;
+    for(; x + 4 <= d->width; x += 4) {
+        int center = denoise_index(d, x, y);
+        __m128 nx = _mm_loadu_ps(&p[DENOISE_NORMAL_X][center]);
+        __m128 ny = _mm_loadu_ps(&p[DENOISE_NORMAL_Y][center]);
+        __m128 nz = _mm_loadu_ps(&p[DENOISE_NORMAL_Z][center]);
+        __m128 depth = _mm_loadu_ps(&p[DENOISE_DEPTH][center]);
+        __m128 gradient = _mm_mul_ps(_mm_loadu_ps(&p[DENOISE_DEPTH_GRADIENT][center]), _mm_set1_ps(DENOISE_SIGMA_DEPTH));
+        __m128 r = _mm_loadu_ps(&src[0][center]);
+        __m128 g = _mm_loadu_ps(&src[1][center]);
+        __m128 b = _mm_loadu_ps(&src[2][center]);
+        __m128 variance = _mm_loadu_ps(&src[3][center]);
+        __m128 luminance = denoise_luminance_sse(r, g, b);
+        __m128 sigma = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(DENOISE_SIGMA_LUMINANCE), _mm_sqrt_ps(variance)), _mm_set1_ps(DENOISE_EPSILON));
+        __m128 h = _mm_set1_ps(denoiseKernel[2] * denoiseKernel[2]);
+        __m128 sumR = _mm_mul_ps(h, r), sumG = _mm_mul_ps(h, g), sumB = _mm_mul_ps(h, b);
+        __m128 sumVariance = _mm_mul_ps(_mm_mul_ps(h, h), variance);
+        __m128 sumWeight = h;
+        for(int ty = 0; ty < 5; ty++) {
+            for(int tx = 0; tx < 5; tx++) {
+                if(tx == 2 && ty == 2) {
+                    continue;
+                }
+                int q = center + ((ty - 2) * d->stride + (tx - 2)) * step;
+                __m128 cosine = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(&p[DENOISE_NORMAL_X][q])), _mm_mul_ps(ny, _mm_loadu_ps(&p[DENOISE_NORMAL_Y][q]))), _mm_mul_ps(nz, _mm_loadu_ps(&p[DENOISE_NORMAL_Z][q])));
+                __m128 normalWeight = _mm_max_ps(cosine, _mm_setzero_ps());
+                for(int i = 0; i < DENOISE_NORMAL_POWER_LOG2; i++) {
+                    normalWeight = _mm_mul_ps(normalWeight, normalWeight);
+                }
+                __m128 distance = _mm_set1_ps(sqrtf((float)((tx - 2) * (tx - 2) + (ty - 2) * (ty - 2))) * (float)step);
+                __m128 depthTerm = _mm_div_ps(_mm_and_ps(_mm_sub_ps(depth, _mm_loadu_ps(&p[DENOISE_DEPTH][q])), absMask), _mm_add_ps(_mm_mul_ps(gradient, distance), _mm_set1_ps(DENOISE_EPSILON)));
+                __m128 qr = _mm_loadu_ps(&src[0][q]);
+                __m128 qg = _mm_loadu_ps(&src[1][q]);
+                __m128 qb = _mm_loadu_ps(&src[2][q]);
+                __m128 luminanceTerm = _mm_div_ps(_mm_and_ps(_mm_sub_ps(luminance, denoise_luminance_sse(qr, qg, qb)), absMask), sigma);
+                __m128 weight = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(denoiseKernel[tx] * denoiseKernel[ty]), normalWeight), denoise_exp_sse(_mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(depthTerm, luminanceTerm))));
+                sumR = _mm_add_ps(sumR, _mm_mul_ps(weight, qr));
+                sumG = _mm_add_ps(sumG, _mm_mul_ps(weight, qg));
+                sumB = _mm_add_ps(sumB, _mm_mul_ps(weight, qb));
+                sumVariance = _mm_add_ps(sumVariance, _mm_mul_ps(_mm_mul_ps(weight, weight), _mm_loadu_ps(&src[3][q])));
+                sumWeight = _mm_add_ps(sumWeight, weight);
+            }
+        }
+        _mm_storeu_ps(&dst[0][center], _mm_div_ps(sumR, sumWeight));
+        _mm_storeu_ps(&dst[1][center], _mm_div_ps(sumG, sumWeight));
+        _mm_storeu_ps(&dst[2][center], _mm_div_ps(sumB, sumWeight));
+        _mm_storeu_ps(&dst[3][center], _mm_div_ps(sumVariance, _mm_mul_ps(sumWeight, sumWeight)));
+    }
+    for(; x < d->width; x++) {
+        denoise_pixel(d, x, y, step, src, dst);
+    }
+}
+
+__attribute__((target("avx2")))
+__m256 denoise_exp_avx2(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)), _mm256_setzero_ps());
+    __m256 v = _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _mm256_set1_ps(0.5f));
+    __m256i n = _mm256_cvttps_epi32(v);
+    n = _mm256_add_epi32(n, _mm256_castps_si256(_mm256_cmp_ps(_mm256_cvtepi32_ps(n), v, _CMP_GT_OQ)));
+    __m256 fn = _mm256_cvtepi32_ps(n);
+    __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(fn, _mm256_set1_ps(0.693359375f)));
+    r = _mm256_sub_ps(r, _mm256_mul_ps(fn, _mm256_set1_ps(-2.12194440e-4f)));
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, _mm256_mul_ps(r, r)), r);
+    y = _mm256_add_ps(y, _mm256_set1_ps(1.0f));
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(bits));
+}
+
+__attribute__((target("avx2")))
+__m256 denoise_luminance_avx2(__m256 r, __m256 g, __m256 b) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.2126f), r), _mm256_mul_ps(_mm256_set1_ps(0.7152f), g)), _mm256_mul_ps(_mm256_set1_ps(0.0722f), b));
+}
+
+__attribute__((target("avx2")))
+void denoise_row_avx2(const Denoiser* d, int y, int step, float* const* src, float* const* dst) {
+    float* const* p = d->planes;
+    __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    int x = 0;
+    for(; x + 8 <= d->width; x += 8) {
+        int center = denoise_index(d, x, y);
+        __m256 nx = _mm256_loadu_ps(&p[DENOISE_NORMAL_X][center]);
+        __m256 ny = _mm256_loadu_ps(&p[DENOISE_NORMAL_Y][center]);
+        __m256 nz = _mm256_loadu_ps(&p[DENOISE_NORMAL_Z][center]);
+        __m256 depth = _mm256_loadu_ps(&p[DENOISE_DEPTH][center]);
+        __m256 gradient = _mm256_mul_ps(_mm256_loadu_ps(&p[DENOISE_DEPTH_GRADIENT][center]), _mm256_set1_ps(DENOISE_SIGMA_DEPTH));
+        __m256 r = _mm256_loadu_ps(&src[0][center]);
+        __m256 g = _mm256_loadu_ps(&src[1][center]);
+        __m256 b = _mm256_loadu_ps(&src[2][center]);
+        __m256 variance = _mm256_loadu_ps(&src[3][center]);
+        __m256 luminance = denoise_luminance_avx2(r, g, b);
+        __m256 sigma = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(DENOISE_SIGMA_LUMINANCE), _mm256_sqrt_ps(variance)), _mm256_set1_ps(DENOISE_EPSILON));
+        __m256 h = _mm256_set1_ps(denoiseKernel[2] * denoiseKernel[2]);
+        __m256 sumR = _mm256_mul_ps(h, r), sumG = _mm256_mul_ps(h, g), sumB = _mm256_mul_ps(h, b);
+        __m256 sumVariance = _mm256_mul_ps(_mm256_mul_ps(h, h), variance);
+        __m256 sumWeight = h;
+        for(int ty = 0; ty < 5; ty++) {
+            for(int tx = 0; tx < 5; tx++) {
+                if(tx == 2 && ty == 2) {
+                    continue;
+                }
+                int q = center + ((ty - 2) * d->stride + (tx - 2)) * step;
+                __m256 cosine = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, _mm256_loadu_ps(&p[DENOISE_NORMAL_X][q])), _mm256_mul_ps(ny, _mm256_loadu_ps(&p[DENOISE_NORMAL_Y][q]))), _mm256_mul_ps(nz, _mm256_loadu_ps(&p[DENOISE_NORMAL_Z][q])));
+                __m256 normalWeight = _mm256_max_ps(cosine, _mm256_setzero_ps());
+                for(int i = 0; i < DENOISE_NORMAL_POWER_LOG2; i++) {
+                    normalWeight = _mm256_mul_ps(normalWeight, normalWeight);
+                }
+                __m256 distance = _mm256_set1_ps(sqrtf((float)((tx - 2) * (tx - 2) + (ty - 2) * (ty - 2))) * (float)step);
+                __m256 depthTerm = _mm256_div_ps(_mm256_and_ps(_mm256_sub_ps(depth, _mm256_loadu_ps(&p[DENOISE_DEPTH][q])), absMask), _mm256_add_ps(_mm256_mul_ps(gradient, distance), _mm256_set1_ps(DENOISE_EPSILON)));
+                __m256 qr = _mm256_loadu_ps(&src[0][q]);
+                __m256 qg = _mm256_loadu_ps(&src[1][q]);
+                __m256 qb = _mm256_loadu_ps(&src[2][q]);
+                __m256 luminanceTerm = _mm256_div_ps(_mm256_and_ps(_mm256_sub_ps(luminance, denoise_luminance_avx2(qr, qg, qb)), absMask), sigma);
+                __m256 weight = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(denoiseKernel[tx] * denoiseKernel[ty]), normalWeight), denoise_exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), _mm256_add_ps(depthTerm, luminanceTerm))));
+                sumR = _mm256_add_ps(sumR, _mm256_mul_ps(weight, qr));
+                sumG = _mm256_add_ps(sumG, _mm256_mul_ps(weight, qg));
+                sumB = _mm256_add_ps(sumB, _mm256_mul_ps(weight, qb));
+                sumVariance = _mm256_add_ps(sumVariance, _mm256_mul_ps(_mm256_mul_ps(weight, weight), _mm256_loadu_ps(&src[3][q])));
+                sumWeight = _mm256_add_ps(sumWeight, weight);
+            }
+        }
+        _mm256_storeu_ps(&dst[0][center], _mm256_div_ps(sumR, sumWeight));
+        _mm256_storeu_ps(&dst[1][center], _mm256_div_ps(sumG, sumWeight));
+        _mm256_storeu_ps(&dst[2][center], _mm256_div_ps(sumB, sumWeight));
+        _mm256_storeu_ps(&dst[3][center], _mm256_div_ps(sumVariance, _mm256_mul_ps(sumWeight, sumWeight)));
+    }
+    for(; x < d->width; x++) {
+        denoise_pixel(d, x, y, step, src, dst);
+    }
+}
+
+#endif /* DENOISE_SIMD */
+
+// Picks the widest row kernel the CPU supports
+DenoiseKernels denoise_select_kernels() {
+    DenoiseKernels kernels;
+    kernels.name = "scalar";
+    kernels.width = 1;
+    kernels.row = denoise_row_scalar;
+#if DENOISE_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernels.name = "AVX2";
+        kernels.width = 8;
+        kernels.row = denoise_row_avx2;
+    }
+    else {
+        kernels.name = "SSE";
+        kernels.width = 4;
+        kernels.row = denoise_row_sse;
+    }
+#endif
+    return kernels;
+}
+
+// Allocates zeroed planes for an image. Returns 0 when they cannot be allocated.
+int denoiser_init(Denoiser* d, int width, int height) {
+    memset(d, 0, sizeof(Denoiser));
+    // Rows are a multiple of 16 floats so every plane starts on a cache line
+    int stride = (width + 2 * DENOISE_PADDING + 15) & ~15;
+    size_t planeSize = (size_t)stride * (height + 2 * DENOISE_PADDING);
+    d->block = (float*)aligned_alloc(64, planeSize * DENOISE_PLANE_COUNT * sizeof(float));
+    if(d->block == NULL) {
+        perror("Failed to allocate denoiser");
+        return 0;
+    }
+    memset(d->block, 0, planeSize * DENOISE_PLANE_COUNT * sizeof(float));
+    d->width = width;
+    d->height = height;
+    d->stride = stride;
+    for(int i = 0; i < DENOISE_PLANE_COUNT; i++) {
+        d->planes[i] = d->block + planeSize * i;
+    }
+    d->kernels = denoise_select_kernels();
+    return 1;
+}
+
+void freeDenoiser(Denoiser* d) {
+    free(d->block);
+    d->block = NULL;
+}
+
+// Sets the color of a pixel, the variance of its mean luminance and its
+// features. normal is zero where the camera ray escaped.
+void denoiser_set_pixel(Denoiser* d, int x, int y, Vec3 color, float variance, Vec3 albedo, Vec3 normal, float depth) {
+    float* const* p = d->planes;
+    int i = denoise_index(d, x, y);
+    float r = denoise_albedo(albedo.x), g = denoise_albedo(albedo.y), b = denoise_albedo(albedo.z);
+    p[DENOISE_COLOR_R][i] = color.x / r;
+    p[DENOISE_COLOR_G][i] = color.y / g;
+    p[DENOISE_COLOR_B][i] = color.z / b;
+    float luminance = denoise_luminance(r, g, b);
+    p[DENOISE_VARIANCE][i] = variance / (luminance * luminance);
+    p[DENOISE_ALBEDO_R][i] = albedo.x;
+    p[DENOISE_ALBEDO_G][i] = albedo.y;
+    p[DENOISE_ALBEDO_B][i] = albedo.z;
+    p[DENOISE_NORMAL_X][i] = normal.x;
+    p[DENOISE_NORMAL_Y][i] = normal.y;
+    p[DENOISE_NORMAL_Z][i] = normal.z;
+    p[DENOISE_DEPTH][i] = depth;
+}
+
+// Filtered color of a pixel, with the albedo put back
+Vec3 denoiser_color(const Denoiser* d, int x, int y) {
+    float* const* p = d->planes;
+    int i = denoise_index(d, x, y);
+    return vec3_build(p[DENOISE_COLOR_R][i] * denoise_albedo(p[DENOISE_ALBEDO_R][i]),
+                      p[DENOISE_COLOR_G][i] * denoise_albedo(p[DENOISE_ALBEDO_G][i]),
+                      p[DENOISE_COLOR_B][i] * denoise_albedo(p[DENOISE_ALBEDO_B][i]));
+}
+
+// How much the depth changes from a pixel to the next, taken on the side
+// where it changes least so the edges of objects do not count
+void denoiser_depth_gradient(Denoiser* d) {
+    float* depth = d->planes[DENOISE_DEPTH];
+    for(int y = 0; y < d->height; y++) {
+        for(int x = 0; x < d->width; x++) {
+            int i = denoise_index(d, x, y);
+            float dx = fminf(x > 0 ? fabsf(depth[i] - depth[i - 1]) : INFINITY, x + 1 < d->width ? fabsf(depth[i + 1] - depth[i]) : INFINITY);
+            float dy = fminf(y > 0 ? fabsf(depth[i] - depth[i - d->stride]) : INFINITY, y + 1 < d->height ? fabsf(depth[i + d->stride] - depth[i]) : INFINITY);
+            dx = isfinite(dx) ? dx : 0.0f;
+            dy = isfinite(dy) ? dy : 0.0f;
+            d->planes[DENOISE_DEPTH_GRADIENT][i] = sqrtf(dx * dx + dy * dy);
+        }
+    }
+}
+
+typedef struct DenoisePass {
+    Denoiser* d;
+    int step;
+    float* src[4];
+    float* dst[4];
+} DenoisePass;
+
+void denoise_row_task(void* ctx, int workerId, int row) {
+    (void)workerId;
+    DenoisePass* pass = (DenoisePass*)ctx;
+    pass->d->kernels.row(pass->d, row, pass->step, pass->src, pass->dst);
+}
+
+// Runs every pass of the filter with nbThreads threads, the result ends up
+// in the color planes. Returns 0 when it could not be allocated.
+int denoiser_run(Denoiser* d, int nbThreads) {
+    int* rows = (int*)malloc(d->height * sizeof(int));
+    if(rows == NULL) {
+        perror("Failed to allocate denoiser rows");
+        return 0;
+    }
+    for(int y = 0; y < d->height; y++) {
+        rows[y] = y;
+    }
+    denoiser_depth_gradient(d);
+    DenoisePass pass;
+    pass.d = d;
+    for(int i = 0; i < 4; i++) {
+        pass.src[i] = d->planes[DENOISE_COLOR_R + i];
+        pass.dst[i] = d->planes[DENOISE_OUT_R + i];
+    }
+    for(int iteration = 0; iteration < DENOISE_ITERATIONS; iteration++) {
+        pass.step = 1 << iteration;
+        threadpool_run(nbThreads, rows, d->height, denoise_row_task, &pass);
+        for(int i = 0; i < 4; i++) {
+            float* swap = pass.src[i];
+            pass.src[i] = pass.dst[i];
+            pass.dst[i] = swap;
+        }
+    }
+    // An odd number of passes leaves the result in the other planes
+    if(pass.src[0] != d->planes[DENOISE_COLOR_R]) {
+        size_t planeSize = (size_t)d->stride * (d->height + 2 * DENOISE_PADDING);
+        for(int i = 0; i < 4; i++) {
+            memcpy(d->planes[DENOISE_COLOR_R + i], pass.src[i], planeSize * sizeof(float));
+        }
+    }
+    free(rows);
+    return 1;
+}
+
+// Writes the albedo, normal (mapped to [0, 1]) and depth (white close, black
+// far or escaped) features as prefix_albedo.ppm, prefix_normal.ppm and
+// prefix_depth.ppm
+void denoiser_write_features(const Denoiser* d, const char* prefix) {
+    unsigned char* image = (unsigned char*)malloc((size_t)d->width * d->height * 3);
+    char filename[4096];
+    if(image == NULL) {
+        perror("Failed to allocate feature image");
+        return;
+    }
+    float maxDepth = 0.0f;
+    for(int y = 0; y < d->height; y++) {
+        for(int x = 0; x < d->width; x++) {
+            maxDepth = fmaxf(maxDepth, d->planes[DENOISE_DEPTH][denoise_index(d, x, y)]);
+        }
+    }
+    const char* names[3] = { "albedo", "normal", "depth" };
+    for(int feature = 0; feature < 3; feature++) {
+        for(int y = 0; y < d->height; y++) {
+            for(int x = 0; x < d->width; x++) {
+                int i = denoise_index(d, x, y);
+                float value[3];
+                for(int c = 0; c < 3; c++) {
+                    if(feature == 0) {
+                        value[c] = d->planes[DENOISE_ALBEDO_R + c][i];
+                    }
+                    else if(feature == 1) {
+                        value[c] = 0.5f + 0.5f * d->planes[DENOISE_NORMAL_X + c][i];
+                    }
+                    else {
+                        float depth = d->planes[DENOISE_DEPTH][i];
+                        value[c] = depth > 0.0f ? 1.0f - depth / (maxDepth * 1.01f) : 0.0f;
+                    }
+                    value[c] = value[c] < 0.0f ? 0.0f : (value[c] > 1.0f ? 1.0f : value[c]);
+                    image[(y * d->width + x) * 3 + c] = (unsigned char)(255.999f * value[c]);
+                }
+            }
+        }
+        snprintf(filename, sizeof(filename), "%s_%s.ppm", prefix, names[feature]);
+        writePPM(filename, d->width, d->height, image);
+    }
+    free(image);
+}
+
+#endif /* DENOISE_H */
@@ -0,0 +1,594 @@
+#include "scene.h"
+#include "framebuffer.h"
+#include "utils/net.h"
+#include "utils/utils.h"
+#include "utils/threadpool.h"
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Distributed rendering, built on the tile renderer of pathtracer.c. A
+// coordinator hands the tiles of the image to worker processes as leases and
+// merges the tiles they send back into its framebuffer. Every process sets
+// up the scene from the same command line; a worker first sends the
+// settings it renders with and is turned away when they differ from the
+// coordinator's. A lease carries the samples the tile already has, so the
+// worker goes on from there (resumed checkpoints included) and the image is
+// the same as a render in one process. The tiles of a worker that
+// disconnects, or holds a lease longer than the lease timeout, are leased
+// again to the others. Messages are in the byte order of the machines, which
+// have to share it.
+
+#define DIST_MAGIC 0x56445450u
+#define DIST_VERSION 4
+// Tiles a worker asks for per render thread, so its threads keep busy
+// while the slowest tile of a lease finishes
+#define DIST_TILES_PER_THREAD 2
+// Seconds a worker keeps trying to reach the coordinator
+#define DIST_CONNECT_TIMEOUT 30.0
+#define DIST_SEND_TIMEOUT 30.0
+// Seconds the coordinator waits for the workers to hang up once the image is done
+#define DIST_DRAIN_TIMEOUT 2.0
+#define DIST_MAX_WORKERS 256
+
+enum {
+    // Worker to coordinator: DistHello
+    DIST_HELLO = 1,
+    // Worker to coordinator: DistRequest
+    DIST_REQUEST,
+    // Both ways: DistTileHeader then the PixelStats of the tile, row by row
+    DIST_TILE,
+    // Coordinator to worker: every tile of the lease was sent
+    DIST_LEASE_END,
+    // Coordinator to worker: the image is finished
+    DIST_DONE
+};
+
+typedef struct DistMessage {
+    uint32_t type;
+    uint32_t size;
+} DistMessage;
+
+typedef struct DistHello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    int32_t width;
+    int32_t height;
+    int32_t rayPerPixel;
+    int32_t minRayPerPixel;
+    float targetError;
+    CheckpointSettings settings;
+} DistHello;
+
+typedef struct DistRequest {
+    int32_t maxTiles;
+    int32_t padding;
+    // Rays traced since the previous request
+    int64_t rays;
+} DistRequest;
+
+typedef struct DistTileHeader {
+    int32_t tile;
+    int32_t count;
+} DistTileHeader;
+
+#define DIST_MAX_PAYLOAD (sizeof(DistTileHeader) + TILE_SIZE * TILE_SIZE * sizeof(PixelStats))
+
+DistHello dist_hello_create(Scene* scene, const CheckpointSettings* settings) {
+    DistHello hello;
+    memset(&hello, 0, sizeof(DistHello));
+    hello.magic = DIST_MAGIC;
+    hello.version = DIST_VERSION;
+    hello.recordSize = sizeof(PixelStats);
+    hello.width = scene->info->width;
+    hello.height = scene->info->height;
+    hello.rayPerPixel = scene->info->rayPerPixel;
+    hello.minRayPerPixel = scene->info->minRayPerPixel;
+    hello.targetError = scene->info->targetError;
+    hello.settings = *settings;
+    return hello;
+}
+
+int dist_send(int fd, uint32_t type, const void* payload, uint32_t size) {
+    DistMessage message = { type, size };
+    return net_send_all(fd, &message, sizeof(DistMessage)) && (size == 0 || net_send_all(fd, payload, size));
+}
+
+// Sends the pixels the framebuffer holds for a tile
+int dist_send_tile(int fd, const Framebuffer* fb, int tile) {
+    int startX, startY, endX, endY;
+    tileBounds(tile, fb->width, fb->height, &startX, &startY, &endX, &endY);
+    char buffer[sizeof(DistMessage) + DIST_MAX_PAYLOAD];
+    DistTileHeader* header = (DistTileHeader*)(buffer + sizeof(DistMessage));
+    PixelStats* pixels = (PixelStats*)(header + 1);
+    header->tile = tile;
+    header->count = (endX - startX) * (endY - startY);
+    for (int y = startY; y < endY; y++) {
+        memcpy(&pixels[(y - startY) * (endX - startX)], &fb->pixels[y * fb->width + startX], (endX - startX) * sizeof(PixelStats));
+    }
+    uint32_t size = sizeof(DistTileHeader) + header->count * sizeof(PixelStats);
+    DistMessage message = { DIST_TILE, size };
+    memcpy(buffer, &message, sizeof(DistMessage));
+    return net_send_all(fd, buffer, sizeof(DistMessage) + size);
+}
+
+// Checks a tile message against the image. Returns the tile or -1.
+int dist_tile_check(const Framebuffer* fb, const void* payload, uint32_t size) {
+    if(size < sizeof(DistTileHeader)) {
+        return -1;
+    }
+    DistTileHeader header;
+    memcpy(&header, payload, sizeof(DistTileHeader));
+    int tilesX = (fb->width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (fb->height + TILE_SIZE - 1) / TILE_SIZE;
+    if(header.tile < 0 || header.tile >= tilesX * tilesY) {
+        return -1;
+    }
+    int startX, startY, endX, endY;
+    tileBounds(header.tile, fb->width, fb->height, &startX, &startY, &endX, &endY);
+    int count = (endX - startX) * (endY - startY);
+    if(header.count != count || size != sizeof(DistTileHeader) + count * sizeof(PixelStats)) {
+        return -1;
+    }
+    return header.tile;
+}
+
+// Copies the pixels of a checked tile message into the framebuffer. Returns
+// the samples the tile gained.
+long long dist_store_tile(Framebuffer* fb, const void* payload, int tile) {
+    const PixelStats* pixels = (const PixelStats*)((const char*)payload + sizeof(DistTileHeader));
+    int startX, startY, endX, endY;
+    tileBounds(tile, fb->width, fb->height, &startX, &startY, &endX, &endY);
+    long long samples = 0;
+    for (int y = startY; y < endY; y++) {
+        for (int x = startX; x < endX; x++) {
+            PixelStats* pixel = &fb->pixels[y * fb->width + x];
+            samples -= pixel->count;
+            memcpy(pixel, &pixels[(y - startY) * (endX - startX) + (x - startX)], sizeof(PixelStats));
+            samples += pixel->count;
+        }
+    }
+    return samples;
+}
+
+// Renders the tiles leased by the coordinator at address until the image is
+// finished. Returns 0 when the coordinator could not be reached or went away.
+int renderWorker(Scene* scene, const char* address) {
+    int verbose = scene->info->verbose;
+    double start = wallTime();
+    int fd = net_connect(address, DIST_CONNECT_TIMEOUT);
+    if(fd < 0) {
+        return 0;
+    }
+    net_set_send_timeout(fd, DIST_SEND_TIMEOUT);
+
+    scene_refit_accel(scene);
+    scene_collect_lights(scene);
+    int width = scene->info->width;
+    int height = scene->info->height;
+    unsigned char* pixelData = (unsigned char*)malloc(width * height * 3 * sizeof(unsigned char));
+    int maxTiles = scene->info->nbThreads * DIST_TILES_PER_THREAD;
+    int* tiles = (int*)malloc(maxTiles * sizeof(int));
+    char* payload = (char*)malloc(DIST_MAX_PAYLOAD);
+    RenderJob job;
+    if(pixelData == NULL || tiles == NULL || payload == NULL || !framebuffer_reset(&scene->framebuffer, width, height) || !render_job_init(&job, scene, pixelData, NULL)) {
+        if(pixelData == NULL || tiles == NULL || payload == NULL) {
+            perror("Failed to allocate worker buffers");
+        }
+        free(pixelData);
+        free(tiles);
+        free(payload);
+        close(fd);
+        return 0;
+    }
+    // The coordinator reports the progress of the image, renderTile would
+    // count the tiles of this worker against the whole image
+    scene->info->verbose = 0;
+
+    CheckpointSettings settings = renderCheckpointSettings(scene);
+    DistHello hello = dist_hello_create(scene, &settings);
+    int ok = dist_send(fd, DIST_HELLO, &hello, sizeof(DistHello));
+    if(verbose && ok) {
+        printf("Connected to %s, rendering up to %d tiles at a time on %d threads\n", address, maxTiles, scene->info->nbThreads);
+    }
+    long long raysReported = 0;
+    int tilesRendered = 0;
+    int finished = 0;
+    while(ok && !finished) {
+        long long rays = atomic_load(&job.raysDone);
+        DistRequest request = { maxTiles, 0, rays - raysReported };
+        raysReported = rays;
+        ok = dist_send(fd, DIST_REQUEST, &request, sizeof(DistRequest));
+
+        int count = 0;
+        while(ok) {
+            DistMessage message;
+            ok = net_recv_all(fd, &message, sizeof(DistMessage));
+            if(!ok) {
+                break;
+            }
+            if(message.type == DIST_LEASE_END || message.type == DIST_DONE) {
+                finished = message.type == DIST_DONE;
+                break;
+            }
+            int tile = -1;
+            if(message.type == DIST_TILE && message.size <= DIST_MAX_PAYLOAD && count < maxTiles && net_recv_all(fd, payload, message.size)) {
+                tile = dist_tile_check(&scene->framebuffer, payload, message.size);
+            }
+            if(tile < 0) {
+                fprintf(stderr, "Bad message from the coordinator\n");
+                finished = -1;
+                break;
+            }
+            // The tile goes on from the samples the coordinator has
+            dist_store_tile(&scene->framebuffer, payload, tile);
+            tiles[count++] = tile;
+        }
+        if(!ok || finished != 0) {
+            break;
+        }
+
+        threadpool_run(scene->info->nbThreads, tiles, count, renderTile, &job);
+        for(int i = 0; i < count && ok; i++) {
+            ok = dist_send_tile(fd, &scene->framebuffer, tiles[i]);
+        }
+        tilesRendered += count;
+    }
+    close(fd);
+    scene->info->verbose = verbose;
+    if(!ok) {
+        fprintf(stderr, "Lost the coordinator at %s (was it started with the same scene and settings?)\n", address);
+    }
+    finished = finished > 0;
+
+    scene->stats.renderTime = wallTime() - start;
+    scene->stats.samples = atomic_load(&job.samplesDone);
+    scene->stats.rays = atomic_load(&job.raysDone);
+    render_job_free(&job);
+    free(pixelData);
+    free(tiles);
+    free(payload);
+    if(verbose && finished) {
+        printf("Image finished: rendered %d tiles, %lld samples and %lld rays in %.3f s\n", tilesRendered, scene->stats.samples, scene->stats.rays, scene->stats.renderTime);
+    }
+    return finished;
+}
+
+#define DIST_TILE_PENDING -1
+#define DIST_TILE_DONE -2
+
+// A connection to a worker, fd is -1 for a free slot
+typedef struct DistWorker {
+    int fd;
+    int ready;
+    // Tiles the worker asked for and has not been given yet
+    int wanted;
+    // Tiles it holds
+    int leased;
+    double leaseStart;
+    // Bytes received that do not make a whole message yet
+    char* buffer;
+    size_t have;
+} DistWorker;
+
+typedef struct Coordinator {
+    Scene* scene;
+    DistHello hello;
+    double leaseTimeout;
+    int nbTiles;
+    // Worker slot holding each tile, or DIST_TILE_PENDING / DIST_TILE_DONE
+    int* owner;
+    // Ring of the pending tiles, a tile is in it at most once
+    int* queue;
+    int queueHead;
+    int queueCount;
+    int tilesDone;
+    long long samples;
+    long long rays;
+    DistWorker workers[DIST_MAX_WORKERS];
+} Coordinator;
+
+void coordinator_push_tile(Coordinator* c, int tile) {
+    c->owner[tile] = DIST_TILE_PENDING;
+    c->queue[(c->queueHead + c->queueCount) % c->nbTiles] = tile;
+    c->queueCount++;
+}
+
+int coordinator_pop_tile(Coordinator* c) {
+    int tile = c->queue[c->queueHead];
+    c->queueHead = (c->queueHead + 1) % c->nbTiles;
+    c->queueCount--;
+    return tile;
+}
+
+// Closes the connection and puts the tiles the worker held back in the queue
+void coordinator_drop(Coordinator* c, int slot, const char* reason) {
+    DistWorker* worker = &c->workers[slot];
+    if(reason != NULL) {
+        fprintf(stderr, "Worker %d %s, %d tiles go back to the queue\n", slot, reason, worker->leased);
+    }
+    for(int tile = 0; tile < c->nbTiles; tile++) {
+        if(c->owner[tile] == slot) {
+            coordinator_push_tile(c, tile);
+        }
+    }
+    close(worker->fd);
+    free(worker->buffer);
+    memset(worker, 0, sizeof(DistWorker));
+    worker->fd = -1;
+}
+
+// Handles one message. Returns 0 when the worker has to be dropped.
+int coordinator_handle(Coordinator* c, int slot, const DistMessage* message, const char* payload) {
+    DistWorker* worker = &c->workers[slot];
+    if(message->type == DIST_HELLO) {
+        if(message->size != sizeof(DistHello) || memcmp(payload, &c->hello, sizeof(DistHello)) != 0) {
+            coordinator_drop(c, slot, "was started with another scene, size or settings");
+            return 0;
+        }
+        worker->ready = 1;
+        if(c->scene->info->verbose) {
+            printf("Worker %d joined\n", slot);
+        }
+        return 1;
+    }
+    if(!worker->ready) {
+        coordinator_drop(c, slot, "did not say hello");
+        return 0;
+    }
+    if(message->type == DIST_REQUEST && message->size == sizeof(DistRequest)) {
+        DistRequest request;
+        memcpy(&request, payload, sizeof(DistRequest));
+        worker->wanted = request.maxTiles > 0 ? request.maxTiles : 1;
+        c->rays += request.rays;
+        return 1;
+    }
+    if(message->type == DIST_TILE) {
+        Framebuffer* fb = &c->scene->framebuffer;
+        int tile = dist_tile_check(fb, payload, message->size);
+        if(tile < 0 || c->owner[tile] != slot) {
+            coordinator_drop(c, slot, "sent a tile it was not leased");
+            return 0;
+        }
+        c->samples += dist_store_tile(fb, payload, tile);
+        c->owner[tile] = DIST_TILE_DONE;
+        worker->leased--;
+        c->tilesDone++;
+        int step = c->nbTiles / 20 > 0 ? c->nbTiles / 20 : 1;
+        if(c->scene->info->verbose && (c->tilesDone % step == 0 || c->tilesDone == c->nbTiles)) {
+            printf("Tiles left: %d\n", c->nbTiles - c->tilesDone);
+        }
+        return 1;
+    }
+    coordinator_drop(c, slot, "sent a bad message");
+    return 0;
+}
+
+// Reads what the worker sent and handles every whole message
+void coordinator_receive(Coordinator* c, int slot) {
+    DistWorker* worker = &c->workers[slot];
+    size_t capacity = sizeof(DistMessage) + DIST_MAX_PAYLOAD;
+    ssize_t received = recv(worker->fd, worker->buffer + worker->have, capacity - worker->have, 0);
+    if(received < 0 && errno == EINTR) {
+        return;
+    }
+    if(received <= 0) {
+        coordinator_drop(c, slot, worker->leased > 0 ? "disconnected" : NULL);
+        return;
+    }
+    worker->have += (size_t)received;
+    while(worker->have >= sizeof(DistMessage)) {
+        DistMessage message;
+        memcpy(&message, worker->buffer, sizeof(DistMessage));
+        if(message.size > DIST_MAX_PAYLOAD) {
+            coordinator_drop(c, slot, "sent a bad message");
+            return;
+        }
+        size_t length = sizeof(DistMessage) + message.size;
+        if(worker->have < length) {
+            return;
+        }
+        if(!coordinator_handle(c, slot, &message, worker->buffer + sizeof(DistMessage))) {
+            return;
+        }
+        worker->have -= length;
+        memmove(worker->buffer, worker->buffer + length, worker->have);
+    }
+}
+
+// Leases pending tiles to the workers waiting for some
+void coordinator_lease(Coordinator* c) {
+    for(int slot = 0; slot < DIST_MAX_WORKERS && c->queueCount > 0; slot++) {
+        DistWorker* worker = &c->workers[slot];
+        if(worker->fd < 0 || !worker->ready || worker->wanted == 0 || worker->leased > 0) {
+            continue;
+        }
+        int count = worker->wanted < c->queueCount ? worker->wanted : c->queueCount;
+        int ok = 1;
+        for(int i = 0; i < count && ok; i++) {
+            int tile = coordinator_pop_tile(c);
+            c->owner[tile] = slot;
+            worker->leased++;
+            ok = dist_send_tile(worker->fd, &c->scene->framebuffer, tile);
+        }
+        ok = ok && dist_send(worker->fd, DIST_LEASE_END, NULL, 0);
+        if(!ok) {
+            coordinator_drop(c, slot, "stopped answering");
+            continue;
+        }
+        worker->wanted = 0;
+        worker->leaseStart = wallTime();
+    }
+}
+
+// Renders the scene with the workers that connect to address and returns the
+// image like renderScene. Tiles held longer than leaseTimeout seconds (0 for
+// no limit) are leased again.
+unsigned char* renderCoordinator(Scene* scene, const char* address, double leaseTimeout) {
+    SceneInfo* info = scene->info;
+    double start = wallTime();
+    scene_refit_accel(scene);
+    scene_collect_lights(scene);
+    // Worked out once, the hello needs them whether or not there are checkpoints
+    CheckpointSettings settings = renderCheckpointSettings(scene);
+    if(!renderPrepareFramebuffer(scene, &settings)) {
+        return NULL;
+    }
+
+    Coordinator* c = (Coordinator*)calloc(1, sizeof(Coordinator));
+    int tilesX = (info->width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (info->height + TILE_SIZE - 1) / TILE_SIZE;
+    int* order = mortonTileOrder(tilesX, tilesY);
+    if(c == NULL || order == NULL) {
+        perror("Failed to allocate the coordinator");
+        free(c);
+        free(order);
+        return NULL;
+    }
+    c->scene = scene;
+    c->hello = dist_hello_create(scene, &settings);
+    c->leaseTimeout = leaseTimeout;
+    c->nbTiles = tilesX * tilesY;
+    c->owner = (int*)malloc(c->nbTiles * sizeof(int));
+    c->queue = (int*)malloc(c->nbTiles * sizeof(int));
+    for(int slot = 0; slot < DIST_MAX_WORKERS; slot++) {
+        c->workers[slot].fd = -1;
+    }
+    int listenFd = c->owner != NULL && c->queue != NULL ? net_listen(address) : -1;
+    if(listenFd < 0) {
+        free(c->owner);
+        free(c->queue);
+        free(c);
+        free(order);
+        return NULL;
+    }
+    for(int i = 0; i < c->nbTiles; i++) {
+        coordinator_push_tile(c, order[i]);
+    }
+    free(order);
+    if(info->verbose) {
+        printf("Leasing %d tiles to the workers connecting to %s\n", c->nbTiles, address);
+    }
+
+    double lastCheckpoint = wallTime();
+    struct pollfd fds[DIST_MAX_WORKERS + 1];
+    int slots[DIST_MAX_WORKERS + 1];
+    while(c->tilesDone < c->nbTiles) {
+        int nbFds = 0;
+        fds[nbFds].fd = listenFd;
+        fds[nbFds++].events = POLLIN;
+        for(int slot = 0; slot < DIST_MAX_WORKERS; slot++) {
+            if(c->workers[slot].fd >= 0) {
+                slots[nbFds] = slot;
+                fds[nbFds].fd = c->workers[slot].fd;
+                fds[nbFds++].events = POLLIN;
+            }
+        }
+        if(poll(fds, nbFds, 250) < 0 && errno != EINTR) {
+            perror("Failed to wait for the workers");
+            break;
+        }
+
+        if(fds[0].revents & POLLIN) {
+            int fd = accept(listenFd, NULL, NULL);
+            int slot = 0;
+            while(fd >= 0 && slot < DIST_MAX_WORKERS && c->workers[slot].fd >= 0) {
+                slot++;
+            }
+            if(fd >= 0 && slot == DIST_MAX_WORKERS) {
+                fprintf(stderr, "Too many workers, turning one away\n");
+                close(fd);
+            }
+            else if(fd >= 0) {
+                net_set_nodelay(fd);
+                net_set_send_timeout(fd, DIST_SEND_TIMEOUT);
+                c->workers[slot].fd = fd;
+                c->workers[slot].buffer = (char*)malloc(sizeof(DistMessage) + DIST_MAX_PAYLOAD);
+                if(c->workers[slot].buffer == NULL) {
+                    coordinator_drop(c, slot, "could not get a buffer");
+                }
+            }
+        }
+        for(int i = 1; i < nbFds; i++) {
+            // The worker may have been dropped and its slot taken since the poll
+            if(fds[i].revents != 0 && c->workers[slots[i]].fd == fds[i].fd) {
+                coordinator_receive(c, slots[i]);
+            }
+        }
+
+        double now = wallTime();
+        for(int slot = 0; slot < DIST_MAX_WORKERS; slot++) {
+            DistWorker* worker = &c->workers[slot];
+            if(worker->fd >= 0 && worker->leased > 0 && leaseTimeout > 0.0 && now - worker->leaseStart > leaseTimeout) {
+                coordinator_drop(c, slot, "held its lease too long");
+            }
+        }
+        coordinator_lease(c);
+
+        if(info->checkpointFile != NULL && now - lastCheckpoint >= info->checkpointInterval) {
+            framebuffer_save_checkpoint(&scene->framebuffer, &settings, info->checkpointFile);
+            lastCheckpoint = now;
+        }
+    }
+    int finished = c->tilesDone == c->nbTiles;
+
+    // Workers may still be sending their last request, closing on it would
+    // reset the connection before they read that the image is done. They
+    // close once they have, or are given up on after a while.
+    for(int slot = 0; slot < DIST_MAX_WORKERS; slot++) {
+        if(c->workers[slot].fd >= 0) {
+            dist_send(c->workers[slot].fd, DIST_DONE, NULL, 0);
+            shutdown(c->workers[slot].fd, SHUT_WR);
+        }
+    }
+    double drainStart = wallTime();
+    while(wallTime() - drainStart < DIST_DRAIN_TIMEOUT) {
+        int nbFds = 0;
+        for(int slot = 0; slot < DIST_MAX_WORKERS; slot++) {
+            if(c->workers[slot].fd >= 0) {
+                slots[nbFds] = slot;
+                fds[nbFds].fd = c->workers[slot].fd;
+                fds[nbFds++].events = POLLIN;
+            }
+        }
+        if(nbFds == 0 || (poll(fds, nbFds, 100) < 0 && errno != EINTR)) {
+            break;
+        }
+        for(int i = 0; i < nbFds; i++) {
+            char discard[256];
+            if(fds[i].revents != 0 && recv(fds[i].fd, discard, sizeof(discard), 0) <= 0) {
+                coordinator_drop(c, slots[i], NULL);
+            }
+        }
+    }
+    for(int slot = 0; slot < DIST_MAX_WORKERS; slot++) {
+        if(c->workers[slot].fd >= 0) {
+            coordinator_drop(c, slot, NULL);
+        }
+    }
+    close(listenFd);
+    if(strncmp(address, NET_UNIX_PREFIX, strlen(NET_UNIX_PREFIX)) == 0) {
+        unlink(address + strlen(NET_UNIX_PREFIX));
+    }
+
+    scene->stats.renderTime = wallTime() - start;
+    scene->stats.samples = c->samples;
+    scene->stats.rays = c->rays;
+    free(c->owner);
+    free(c->queue);
+    free(c);
+    if(!finished) {
+        return NULL;
+    }
+    renderReport(scene, &settings);
+    // The workers only send samples, the coordinator denoises the whole image
+    unsigned char* image = framebuffer_to_image(&scene->framebuffer);
+    scene->stats.denoiseTime = 0.0;
+    scene->stats.featureRays = 0;
+    if(image != NULL && scene->info->denoise) {
+        renderDenoise(scene, image);
+    }
+    return image;
+}
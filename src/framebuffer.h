@@ -0,0 +1,262 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "math/Vectors.h"
+#include "utils/writePPM.h"
+
+// Unclamped running sums of every pixel. A render adds its samples to what
+// the framebuffer already holds, so it can go on from a checkpoint written
+// by an earlier render: a header followed by the pixel records as they are
+// in memory, 64 byte aligned, written to a temporary file then renamed over
+// the old checkpoint so a render killed while writing keeps the previous one.
+
+#define CHECKPOINT_MAGIC "PTACCUM"
+#define CHECKPOINT_VERSION 5
+
+// Running sum of a pixel, with the mean and variance of its luminance
+// updated with Welford's method
+typedef struct PixelStats {
+    Vec3 sum;
+    float mean;
+    float m2;
+    int count;
+} PixelStats;
+
+PixelStats pixel_stats_create() {
+    PixelStats stats;
+    stats.sum = vec3_build(0.0f, 0.0f, 0.0f);
+    stats.mean = 0.0f;
+    stats.m2 = 0.0f;
+    stats.count = 0;
+    return stats;
+}
+
+void pixel_stats_add(PixelStats* stats, Vec3 color) {
+    stats->sum = vec3_add(stats->sum, color);
+    // The error is measured on what ends up in the image, which is clamped
+    vec3_clamp(vec3_build(0.0f, 0.0f, 0.0f), vec3_build(1.0f, 1.0f, 1.0f), &color);
+    float luminance = 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+    stats->count++;
+    float delta = luminance - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (luminance - stats->mean);
+}
+
+// Black for a pixel without samples
+Vec3 pixel_stats_color(const PixelStats* stats) {
+    if(stats->count == 0) {
+        return vec3_build(0.0f, 0.0f, 0.0f);
+    }
+    return vec3_div(stats->sum, stats->count);
+}
+
+typedef struct Framebuffer {
+    int width;
+    int height;
+    PixelStats* pixels;
+} Framebuffer;
+
+// What the samples depend on besides the image size. A checkpoint only
+// resumes a render whose settings are the same.
+typedef struct CheckpointSettings {
+    int32_t maxRayDepth;
+    int32_t directLighting;
+    int32_t rouletteDepth;
+    int32_t textureFilter;
+    int32_t sampler;
+    // Strata of the stratified sampler, which are laid out for one sample
+    // count (0 for the other samplers, which can take more samples)
+    int32_t strata;
+    int32_t compactMeshes;
+    int32_t nbSpheres;
+    int32_t nbModels;
+    int32_t nbMaterials;
+    // scene_content_hash of the scene, the counts above do not tell two
+    // scenes of the same size apart
+    uint64_t sceneHash;
+} CheckpointSettings;
+
+typedef struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    int32_t width, height;
+    CheckpointSettings settings;
+    uint64_t samples;
+    uint64_t dataOffset;
+    uint64_t fileSize;
+} CheckpointHeader;
+
+// Resizes the framebuffer and clears every pixel
+int framebuffer_reset(Framebuffer* fb, int width, int height) {
+    if(fb->pixels == NULL || fb->width != width || fb->height != height) {
+        free(fb->pixels);
+        fb->pixels = (PixelStats*)malloc((size_t)width * height * sizeof(PixelStats));
+        if(fb->pixels == NULL) {
+            perror("Failed to allocate framebuffer");
+            fb->width = 0;
+            fb->height = 0;
+            return 0;
+        }
+        fb->width = width;
+        fb->height = height;
+    }
+    for(int i = 0; i < width * height; i++) {
+        fb->pixels[i] = pixel_stats_create();
+    }
+    return 1;
+}
+
+void freeFramebuffer(Framebuffer* fb) {
+    free(fb->pixels);
+    fb->pixels = NULL;
+    fb->width = 0;
+    fb->height = 0;
+}
+
+long long framebuffer_samples(const Framebuffer* fb) {
+    long long samples = 0;
+    for(int i = 0; i < fb->width * fb->height; i++) {
+        samples += fb->pixels[i].count;
+    }
+    return samples;
+}
+
+// Mean of every pixel clamped to 8 bits, in the layout writePPM takes.
+// Returns NULL when it cannot be allocated.
+unsigned char* framebuffer_to_image(const Framebuffer* fb) {
+    unsigned char* image = (unsigned char*)malloc((size_t)fb->width * fb->height * 3);
+    if(image == NULL) {
+        perror("Failed to allocate image");
+        return NULL;
+    }
+    for(int i = 0; i < fb->width * fb->height; i++) {
+        Vec3 color = pixel_stats_color(&fb->pixels[i]);
+        vec3_clamp(vec3_build(0.0f, 0.0f, 0.0f), vec3_build(1.0f, 1.0f, 1.0f), &color);
+        image[i * 3] = (int)(255.999 * color.x);
+        image[i * 3 + 1] = (int)(255.999 * color.y);
+        image[i * 3 + 2] = (int)(255.999 * color.z);
+    }
+    return image;
+}
+
+// Writes the mean of every pixel, unclamped
+int framebuffer_write_pfm(const Framebuffer* fb, const char* filename) {
+    float* data = (float*)malloc((size_t)fb->width * fb->height * 3 * sizeof(float));
+    if(data == NULL) {
+        perror("Failed to allocate HDR image");
+        return 0;
+    }
+    for(int i = 0; i < fb->width * fb->height; i++) {
+        Vec3 color = pixel_stats_color(&fb->pixels[i]);
+        data[i * 3] = color.x;
+        data[i * 3 + 1] = color.y;
+        data[i * 3 + 2] = color.z;
+    }
+    int ok = writePFM(filename, fb->width, fb->height, data);
+    free(data);
+    return ok;
+}
+
+void checkpoint_header_init(CheckpointHeader* header, const Framebuffer* fb, const CheckpointSettings* settings) {
+    memset(header, 0, sizeof(CheckpointHeader));
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->version = CHECKPOINT_VERSION;
+    header->recordSize = sizeof(PixelStats);
+    header->width = fb->width;
+    header->height = fb->height;
+    header->settings = *settings;
+    header->dataOffset = (sizeof(CheckpointHeader) + 63) & ~(uint64_t)63;
+    header->fileSize = header->dataOffset + (uint64_t)fb->width * fb->height * sizeof(PixelStats);
+}
+
+int framebuffer_save_checkpoint(const Framebuffer* fb, const CheckpointSettings* settings, const char* path) {
+    CheckpointHeader header;
+    checkpoint_header_init(&header, fb, settings);
+    header.samples = (uint64_t)framebuffer_samples(fb);
+
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int)getpid());
+    FILE* file = fopen(tmpPath, "wb");
+    if(file == NULL) {
+        perror("Failed to create checkpoint");
+        return 0;
+    }
+    size_t count = (size_t)fb->width * fb->height;
+    int ok = fwrite(&header, sizeof(CheckpointHeader), 1, file) == 1;
+    ok = ok && fseek(file, (long)header.dataOffset, SEEK_SET) == 0;
+    ok = ok && fwrite(fb->pixels, sizeof(PixelStats), count, file) == count;
+    ok = fclose(file) == 0 && ok;
+    if(!ok || rename(tmpPath, path) != 0) {
+        perror("Failed to write checkpoint");
+        remove(tmpPath);
+        return 0;
+    }
+    return 1;
+}
+
+// Fills the framebuffer from a checkpoint. Returns 1 when it was loaded, 0
+// when there is no checkpoint and -1 when it cannot be used.
+int framebuffer_load_checkpoint(Framebuffer* fb, const CheckpointSettings* settings, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CheckpointHeader)) {
+        fprintf(stderr, "Checkpoint %s is truncated\n", path);
+        close(fd);
+        return -1;
+    }
+    void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        perror("Failed to map checkpoint");
+        return -1;
+    }
+
+    const CheckpointHeader* header = (const CheckpointHeader*)base;
+    CheckpointHeader expected;
+    checkpoint_header_init(&expected, fb, settings);
+    int result = 1;
+    if(memcmp(header->magic, expected.magic, sizeof(header->magic)) != 0 || header->version != expected.version ||
+       header->recordSize != expected.recordSize || header->dataOffset != expected.dataOffset ||
+       header->fileSize != (uint64_t)st.st_size) {
+        fprintf(stderr, "Checkpoint %s is not a checkpoint of this version or is truncated\n", path);
+        result = -1;
+    }
+    else if(header->width != expected.width || header->height != expected.height) {
+        fprintf(stderr, "Checkpoint %s is %dx%d, the render is %dx%d\n", path, header->width, header->height, expected.width, expected.height);
+        result = -1;
+    }
+    else if(header->settings.strata != expected.settings.strata) {
+        fprintf(stderr, "Checkpoint %s was stratified for %d samples per pixel, the render for %d, the strata would not match\n", path, header->settings.strata, expected.settings.strata);
+        result = -1;
+    }
+    else if(header->settings.sceneHash != expected.settings.sceneHash) {
+        fprintf(stderr, "Checkpoint %s was rendered from another scene, its camera, objects, materials or meshes changed since\n", path);
+        result = -1;
+    }
+    else if(memcmp(&header->settings, &expected.settings, sizeof(CheckpointSettings)) != 0) {
+        fprintf(stderr, "Checkpoint %s was rendered with other settings\n", path);
+        result = -1;
+    }
+    else {
+        memcpy(fb->pixels, (const char*)base + header->dataOffset, (size_t)fb->width * fb->height * sizeof(PixelStats));
+    }
+    munmap(base, (size_t)st.st_size);
+    return result;
+}
+
+#endif /* FRAMEBUFFER_H */
@@ -1,12 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include <unistd.h>
 #include "math/Vectors.h"
 #include "math/camera.h"
 #include "utils/writePPM.h"
 #include "utils/utils.h"
 #include "scene.h"
+#include "meshCache.h"
+#include "presets.h"
+#include "sceneFile.h"
 #include "pathtracer.c"
+#include "distributed.c"
 #include "texture.h"
 
 void printInformation(Camera cam, Scene scene) {
@@ -24,10 +29,27 @@ void printInformation(Camera cam, Scene scene) {
     printf("-----------------------------------------\n");
     printf("Scene Information: \n");
     printf("Rays Per Pixel: %d\n", scene.info->rayPerPixel);
+    if(scene.info->targetError > 0.0f) {
+        printf("Adaptive Sampling: %d to %d rays per pixel, target error %.3f\n", scene.info->minRayPerPixel, scene.info->rayPerPixel, scene.info->targetError);
+    }
     printf("Max Ray Depth: %d\n", scene.info->maxRayDepth);
-    printf("Quantity of Spheres: %d\n", scene.info->nbSpheres);
+    printf("Direct Light Sampling: %s\n", scene.info->directLighting ? "on" : "off");
+    printf("Russian Roulette After: %d bounces\n", scene.info->rouletteDepth);
+    printf("Quantity of Spheres: %d, %s sphere tests\n", scene.info->nbSpheres, scene.sphereKernels.name);
+    printf("Quantity of Models: %d\n", scene.info->nbModels);
+    size_t meshBytes = 0;
+    for(int i = 0; i < scene.nbMeshes; i++) {
+        meshBytes += mesh_memory_bytes(scene.meshes[i]);
+    }
+    printf("Meshes: %d, %s, %.2f MB\n", scene.nbMeshes, scene.info->compactMeshes ? "compact" : "full precision", (double)meshBytes / (1024.0 * 1024.0));
+    arena_print_stats(&scene.arena, stdout);
     printf("Image Width: %d\n", scene.info->width);
     printf("Image Height: %d\n", scene.info->height);
+    printf("Render Engine: %s\n", scene.info->wavefront ? "wavefront" : "one path at a time");
+    printf("Texture Filter: %s\n", textureFilterNames[scene.info->textureFilter]);
+    printf("Sampler: %s\n", samplerTypeNames[scene.info->sampler]);
+    printf("Render Threads: %d\n", scene.info->nbThreads);
+    printf("Camera Ray Packet Size: %d\n", scene.info->packetSize);
     printf("Scene Ambiant Light: ");
     vec3_print(scene.ambiantLight);
     printf("-----------------------------------------\n");
@@ -37,8 +59,8 @@ void displayTexture(Texture tex) {
     printf("Displaying texture data:\n");
     for(int i = 0; i < tex.width; i++) {
         for(int j = 0; j < tex.height; j++) {
-            int index = i + j * tex.width;
-            printf("Color display: %d %d %d\n", tex.texture[index].r, tex.texture[index].g, tex.texture[index].b);
+            Pixel* texel = texture_texel(&tex.levels[0], i, j);
+            printf("Color display: %d %d %d\n", texel->r, texel->g, texel->b);
         }
     }
 }
@@ -60,64 +82,717 @@ void createRedPPM() {
     fclose(file);
 }
 
-int main(int argc, char const *argv[])
-{
-    printf("Hello world\n");
+typedef struct Options {
+    int width;
+    int height;
+    int rayPerPixel;
+    int minRayPerPixel;
+    float targetError;
+    int maxRayDepth;
+    int nbThreads;
+    int packetSize;
+    const char* output;
+    const char* heatmap;
+    const char* scene;
+    // Scene description file, used instead of the built-in scene
+    const char* sceneFile;
+    int directLighting;
+    int rouletteDepth;
+    int wavefront;
+    TextureFilter textureFilter;
+    SamplerType sampler;
+    int compactMeshes;
+    int hugePages;
+    int denoise;
+    // Prefix of the feature images of the denoiser
+    const char* features;
+    // Unclamped image written as PFM
+    const char* hdr;
+    const char* checkpoint;
+    float checkpointInterval;
+    const char* resume;
+    // Address the coordinator listens on or the worker connects to
+    const char* coordinator;
+    const char* worker;
+    float leaseTimeout;
+    // Number of timed renders, 0 renders once normally
+    int bench;
+    // Where the benchmark results go, stdout when NULL
+    const char* json;
+    // Where the counters of the render are written as JSON
+    const char* counters;
+} Options;
 
-    srand(42);
+void printUsage(const char* program) {
+    printf("Usage: %s [options]\n", program);
+    printf("  --width N          image width (default 400)\n");
+    printf("  --height N         image height (default 300)\n");
+    printf("  --spp N            rays per pixel, the maximum with adaptive sampling (default 25)\n");
+    printf("  --min-spp N        minimum rays per pixel with adaptive sampling (default 8)\n");
+    printf("  --target-error E   turn on adaptive sampling with this error target (e.g. 0.05)\n");
+    printf("  --heatmap FILE     draw the rays taken by every pixel to FILE\n");
+    printf("  --depth N          maximum ray depth (default 50)\n");
+    printf("  --rr-depth N       bounces before Russian roulette can end paths, --depth or more turns it off (default 3)\n");
+    printf("  --nee 0|1          sample the emissive spheres directly at diffuse hits (default 1)\n");
+    printf("  --wavefront 0|1    trace the paths of a tile together, one bounce at a time (default 0)\n");
+    printf("  --texture-filter F nearest, bilinear or trilinear with mip levels picked from the ray footprint (default trilinear)\n");
+    printf("  --sampler S        where pixel samples come from: random, stratified, sobol or halton, the last three low discrepancy patterns that converge faster (default random)\n");
+    printf("  --compact-meshes 0|1  store meshes with deduplicated, quantized vertices to save memory (default 0)\n");
+    printf("  --huge-pages 0|1   back the memory of the scene with huge pages (default 0)\n");
+    printf("  --denoise 0|1      filter the image with the denoiser, guided by first-hit albedo, normal and depth (default 0)\n");
+    printf("  --features PREFIX  with --denoise, also draw the features to PREFIX_albedo.ppm, PREFIX_normal.ppm and PREFIX_depth.ppm\n");
+    printf("  --threads N        render threads (default every core)\n");
+    printf("  --packet N         camera ray packet size: 0, 4, 8 or 16 (default 8)\n");
+    printf("  --output FILE      output image (default test.ppm)\n");
+    printf("  --hdr FILE         also write the unclamped image to FILE as PFM\n");
+    printf("  --checkpoint FILE  save the accumulated samples to FILE while rendering and at the end\n");
+    printf("  --checkpoint-interval S  seconds between checkpoints (default 60)\n");
+    printf("  --resume FILE      start from the samples saved in FILE, and keep checkpointing to it unless --checkpoint is given\n");
+    printf("  --coordinator ADDR lease the tiles to the workers connecting to ADDR (unix:PATH or HOST:PORT) instead of rendering\n");
+    printf("  --worker ADDR      render the tiles leased by the coordinator at ADDR\n");
+    printf("  --lease-timeout S  seconds a worker can hold its tiles before they are leased again, 0 for no limit (default 600)\n");
+    printf("  --scene NAME       built-in scene:");
+    for(int i = 0; i < SCENE_PRESET_COUNT; i++) {
+        printf(" %s", scenePresets[i].name);
+    }
+    printf(" (default default)\n");
+    printf("  --scene-file FILE  render the scene described in FILE, every frame of it (its settings are used unless given here)\n");
+    printf("  --bench N          render N times and report the timings as JSON\n");
+    printf("  --json FILE        write the benchmark JSON to FILE instead of stdout\n");
+    printf("  --counters FILE    write the ray and intersection counters of the render to FILE as JSON\n");
+    for(int i = 0; i < SCENE_PRESET_COUNT; i++) {
+        printf("Scene %s: %s\n", scenePresets[i].name, scenePresets[i].description);
+    }
+}
 
-    int width, height;
+int parseInt(const char* flag, const char* value, int min, int* out) {
+    char* end;
+    long parsed = strtol(value, &end, 10);
+    if(*value == '\0' || *end != '\0' || parsed < min || parsed > 1000000000L) {
+        fprintf(stderr, "Invalid value '%s' for %s\n", value, flag);
+        return 0;
+    }
+    *out = (int)parsed;
+    return 1;
+}
 
-    // Ask the user for the dimensions of the image
-    printf("Enter the width of the image: ");
-    scanf("%d", &width);
-    printf("Enter the height of the image: ");
-    scanf("%d", &height);
+int parseFloat(const char* flag, const char* value, float* out) {
+    char* end;
+    float parsed = strtof(value, &end);
+    if(*value == '\0' || *end != '\0' || !(parsed >= 0.0f)) {
+        fprintf(stderr, "Invalid value '%s' for %s\n", value, flag);
+        return 0;
+    }
+    *out = parsed;
+    return 1;
+}
 
-    Camera cam = camera_create(60.0f, vec3_build(0.0f, 0.0f, 0.0f), vec3_build(0.0f, 0.0f, -1.0f), vec3_build(0.0f, 1.0f, 0.0f), 1.0f, 1000.0f, (float)(width)/(float)(height));
+int parseTextureFilter(const char* value, TextureFilter* out) {
+    for(int i = 0; i < TEXTURE_FILTER_COUNT; i++) {
+        if(strcmp(value, textureFilterNames[i]) == 0) {
+            *out = (TextureFilter)i;
+            return 1;
+        }
+    }
+    fprintf(stderr, "Invalid texture filter '%s' (expected nearest, bilinear or trilinear)\n", value);
+    return 0;
+}
 
-    SceneInfo info = scene_info_create(25, width, height, 50, 5, 0);
-    Scene scene = scene_create(&cam, &info);
+int parseSamplerType(const char* value, SamplerType* out) {
+    for(int i = 0; i < SAMPLER_TYPE_COUNT; i++) {
+        if(strcmp(value, samplerTypeNames[i]) == 0) {
+            *out = (SamplerType)i;
+            return 1;
+        }
+    }
+    fprintf(stderr, "Invalid sampler '%s' (expected random, stratified, sobol or halton)\n", value);
+    return 0;
+}
 
-    Texture tex = loadTexture("cc.ppm");
+// Finds where the frame number goes in an output name: "%d", or "%0Nd" for
+// N digits padded with zeros. start is -1 when the name has no conversion.
+// Returns 0 when it holds any other '%' or more than one conversion.
+int findFrameConversion(const char* pattern, int* start, int* length, int* width) {
+    *start = -1;
+    *length = 0;
+    *width = 0;
+    for(const char* p = strchr(pattern, '%'); p != NULL; p = strchr(p, '%')) {
+        if(*start >= 0) {
+            return 0;
+        }
+        const char* q = p + 1;
+        int digits = 0;
+        if(*q == '0') {
+            q++;
+            for(; *q >= '0' && *q <= '9' && digits < 2; q++, digits++) {
+                *width = *width * 10 + (*q - '0');
+            }
+            if(digits == 0) {
+                return 0;
+            }
+        }
+        if(*q != 'd') {
+            return 0;
+        }
+        *start = (int)(p - pattern);
+        *length = (int)(q + 1 - p);
+        p = q + 1;
+    }
+    return 1;
+}
 
-    Material red = material_create(vec3_build(0.0f, 1.0f, 0.0f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, &tex);
-    Material green = material_green();
-    Material blue = material_blue();
-    Material light = material_create(vec3_build(0.0f, 0.0f, 0.0f), vec3_build(1.0f, 1.0f, 1.0f), 2.0f, 0.0f, NULL);
+int checkOutputName(const char* flag, const char* value) {
+    int start, length, width;
+    if(value != NULL && !findFrameConversion(value, &start, &length, &width)) {
+        fprintf(stderr, "Invalid name '%s' for %s: the only '%%' it can hold is the frame number, %%d or %%0Nd\n", value, flag);
+        return 0;
+    }
+    return 1;
+}
 
-    const char* filename = "../assets/mesh/sphere.obj";
-    Mesh mesh;
-    loadObj(filename, &mesh);
-    printf("Mesh Size: %d\n", mesh.faceCount);
+// Value given to a flag, NULL when it is not on the command line
+const char* findOption(int argc, char const *argv[], const char* flag) {
+    for(int i = 1; i + 1 < argc; i++) {
+        if(strcmp(argv[i], flag) == 0) {
+            return argv[i + 1];
+        }
+    }
+    return NULL;
+}
 
-    scene.spheres[0] = sphere_create(0.5f, vec3_build(0.0f, 0.0f, -5.0f), green);
-    scene.spheres[1] = sphere_create(100.0f, vec3_build(0.0f, -100.5f, -5.0f), red);
-    scene.spheres[2] = sphere_create(0.75f, vec3_build(-1.0f, 0.25f, -5.5f), material_create(vec3_build(1.0f, 1.0f, 1.0f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, &tex));
-    scene.spheres[3] = sphere_create(10.0f, vec3_build(7.5f, 2.5f, -25.0f), light);
-    scene.spheres[4] = sphere_create(20.0f, vec3_build(-7.5f, 2.5f, 25.0f), light);
-    //scene.models[0] = model_create(mesh, vec3_build(0.5f, 0.0f, -5.0f), material_create(vec3_build(0.0f, 1.0f, 0.0f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, &tex));
+// Returns 1 to go on, 0 on a bad command line and -1 when only the help was
+// asked for. The render settings of the scene file, when there is one, come
+// before the defaults but after the command line.
+int parseOptions(int argc, char const *argv[], Options* options, const SceneFile* sceneFile) {
+    options->width = 400;
+    options->height = 300;
+    options->rayPerPixel = 25;
+    options->minRayPerPixel = 8;
+    options->targetError = 0.0f;
+    options->maxRayDepth = 50;
+    options->directLighting = 1;
+    options->rouletteDepth = 3;
+    options->wavefront = 0;
+    options->compactMeshes = 0;
+    options->hugePages = 0;
+    options->denoise = 0;
+    options->features = NULL;
+    options->textureFilter = TEXTURE_TRILINEAR;
+    options->sampler = SAMPLER_RANDOM;
+    options->hdr = NULL;
+    options->checkpoint = NULL;
+    options->checkpointInterval = 60.0f;
+    options->resume = NULL;
+    options->coordinator = NULL;
+    options->worker = NULL;
+    options->leaseTimeout = 600.0f;
+    options->nbThreads = threadpool_default_thread_count();
+    options->packetSize = 8;
+    options->output = "test.ppm";
+    options->heatmap = NULL;
+    options->scene = "default";
+    options->bench = 0;
+    options->json = NULL;
+    options->counters = NULL;
+    options->sceneFile = NULL;
+    if(sceneFile != NULL) {
+        options->width = sceneFile->width > 0 ? sceneFile->width : options->width;
+        options->height = sceneFile->height > 0 ? sceneFile->height : options->height;
+        options->rayPerPixel = sceneFile->rayPerPixel > 0 ? sceneFile->rayPerPixel : options->rayPerPixel;
+        options->maxRayDepth = sceneFile->maxRayDepth > 0 ? sceneFile->maxRayDepth : options->maxRayDepth;
+    }
+
+    for(int i = 1; i < argc; i++) {
+        const char* flag = argv[i];
+        if(strcmp(flag, "--help") == 0 || strcmp(flag, "-h") == 0) {
+            printUsage(argv[0]);
+            return -1;
+        }
+        if(i + 1 >= argc) {
+            fprintf(stderr, "Unknown option or missing value: %s\n", flag);
+            return 0;
+        }
+        const char* value = argv[++i];
+        int ok = 1;
+        if(strcmp(flag, "--width") == 0) {
+            ok = parseInt(flag, value, 1, &options->width);
+        }
+        else if(strcmp(flag, "--height") == 0) {
+            ok = parseInt(flag, value, 1, &options->height);
+        }
+        else if(strcmp(flag, "--spp") == 0) {
+            ok = parseInt(flag, value, 1, &options->rayPerPixel);
+        }
+        else if(strcmp(flag, "--min-spp") == 0) {
+            ok = parseInt(flag, value, 1, &options->minRayPerPixel);
+        }
+        else if(strcmp(flag, "--target-error") == 0) {
+            ok = parseFloat(flag, value, &options->targetError);
+        }
+        else if(strcmp(flag, "--heatmap") == 0) {
+            options->heatmap = value;
+        }
+        else if(strcmp(flag, "--depth") == 0) {
+            ok = parseInt(flag, value, 0, &options->maxRayDepth);
+        }
+        else if(strcmp(flag, "--rr-depth") == 0) {
+            ok = parseInt(flag, value, 0, &options->rouletteDepth);
+        }
+        else if(strcmp(flag, "--nee") == 0) {
+            ok = parseInt(flag, value, 0, &options->directLighting);
+            if(ok && options->directLighting > 1) {
+                fprintf(stderr, "Invalid value '%s' for %s (expected 0 or 1)\n", value, flag);
+                ok = 0;
+            }
+        }
+        else if(strcmp(flag, "--wavefront") == 0) {
+            ok = parseInt(flag, value, 0, &options->wavefront);
+            if(ok && options->wavefront > 1) {
+                fprintf(stderr, "Invalid value '%s' for %s (expected 0 or 1)\n", value, flag);
+                ok = 0;
+            }
+        }
+        else if(strcmp(flag, "--compact-meshes") == 0) {
+            ok = parseInt(flag, value, 0, &options->compactMeshes);
+            if(ok && options->compactMeshes > 1) {
+                fprintf(stderr, "Invalid value '%s' for %s (expected 0 or 1)\n", value, flag);
+                ok = 0;
+            }
+        }
+        else if(strcmp(flag, "--denoise") == 0) {
+            ok = parseInt(flag, value, 0, &options->denoise);
+            if(ok && options->denoise > 1) {
+                fprintf(stderr, "Invalid value '%s' for %s (expected 0 or 1)\n", value, flag);
+                ok = 0;
+            }
+        }
+        else if(strcmp(flag, "--features") == 0) {
+            options->features = value;
+        }
+        else if(strcmp(flag, "--huge-pages") == 0) {
+            ok = parseInt(flag, value, 0, &options->hugePages);
+            if(ok && options->hugePages > 1) {
+                fprintf(stderr, "Invalid value '%s' for %s (expected 0 or 1)\n", value, flag);
+                ok = 0;
+            }
+        }
+        else if(strcmp(flag, "--texture-filter") == 0) {
+            ok = parseTextureFilter(value, &options->textureFilter);
+        }
+        else if(strcmp(flag, "--sampler") == 0) {
+            ok = parseSamplerType(value, &options->sampler);
+        }
+        else if(strcmp(flag, "--threads") == 0) {
+            ok = parseInt(flag, value, 1, &options->nbThreads);
+        }
+        else if(strcmp(flag, "--packet") == 0) {
+            ok = parseInt(flag, value, 0, &options->packetSize);
+            if(ok && options->packetSize != 0 && options->packetSize != 4 && options->packetSize != 8 && options->packetSize != 16) {
+                fprintf(stderr, "Invalid packet size '%s' (expected 0, 4, 8 or 16)\n", value);
+                ok = 0;
+            }
+        }
+        else if(strcmp(flag, "--output") == 0) {
+            options->output = value;
+        }
+        else if(strcmp(flag, "--hdr") == 0) {
+            options->hdr = value;
+        }
+        else if(strcmp(flag, "--checkpoint") == 0) {
+            options->checkpoint = value;
+        }
+        else if(strcmp(flag, "--checkpoint-interval") == 0) {
+            ok = parseFloat(flag, value, &options->checkpointInterval);
+        }
+        else if(strcmp(flag, "--resume") == 0) {
+            options->resume = value;
+        }
+        else if(strcmp(flag, "--coordinator") == 0) {
+            options->coordinator = value;
+        }
+        else if(strcmp(flag, "--worker") == 0) {
+            options->worker = value;
+        }
+        else if(strcmp(flag, "--lease-timeout") == 0) {
+            ok = parseFloat(flag, value, &options->leaseTimeout);
+        }
+        else if(strcmp(flag, "--scene") == 0) {
+            options->scene = value;
+        }
+        else if(strcmp(flag, "--scene-file") == 0) {
+            options->sceneFile = value;
+        }
+        else if(strcmp(flag, "--bench") == 0) {
+            ok = parseInt(flag, value, 1, &options->bench);
+        }
+        else if(strcmp(flag, "--json") == 0) {
+            options->json = value;
+        }
+        else if(strcmp(flag, "--counters") == 0) {
+            options->counters = value;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", flag);
+            ok = 0;
+        }
+        if(!ok) {
+            return 0;
+        }
+    }
+    if(options->minRayPerPixel > options->rayPerPixel) {
+        options->minRayPerPixel = options->rayPerPixel;
+    }
+    if(!checkOutputName("--output", options->output) || !checkOutputName("--hdr", options->hdr) || !checkOutputName("--heatmap", options->heatmap) || !checkOutputName("--features", options->features) || !checkOutputName("--counters", options->counters)) {
+        return 0;
+    }
+    if(options->coordinator != NULL && options->worker != NULL) {
+        fprintf(stderr, "--coordinator and --worker cannot be used together\n");
+        return 0;
+    }
+    if((options->coordinator != NULL || options->worker != NULL) && options->bench > 0) {
+        fprintf(stderr, "--bench renders in one process, it cannot be used with --coordinator or --worker\n");
+        return 0;
+    }
+    if(options->worker != NULL && (options->hdr != NULL || options->heatmap != NULL || options->checkpoint != NULL || options->resume != NULL || options->denoise || options->features != NULL)) {
+        fprintf(stderr, "--hdr, --heatmap, --checkpoint, --resume, --denoise and --features are given to the coordinator, not the workers\n");
+        return 0;
+    }
+    if(options->features != NULL && !options->denoise) {
+        fprintf(stderr, "--features draws what the denoiser uses, it needs --denoise 1\n");
+        return 0;
+    }
+    if(sceneFile != NULL && sceneFile->frames > 1 && (options->checkpoint != NULL || options->resume != NULL || options->coordinator != NULL || options->worker != NULL)) {
+        fprintf(stderr, "--checkpoint, --resume, --coordinator and --worker render a single frame, the scene file has %d\n", sceneFile->frames);
+        return 0;
+    }
+    if(options->resume != NULL && options->checkpoint == NULL) {
+        options->checkpoint = options->resume;
+    }
+    return 1;
+}
+
+typedef struct BenchStat {
+    double mean;
+    double stddev;
+    double min;
+    double max;
+} BenchStat;
+
+BenchStat benchStat(const double* values, int count) {
+    BenchStat stat = { 0.0, 0.0, values[0], values[0] };
+    for(int i = 0; i < count; i++) {
+        stat.mean += values[i];
+        stat.min = values[i] < stat.min ? values[i] : stat.min;
+        stat.max = values[i] > stat.max ? values[i] : stat.max;
+    }
+    stat.mean /= count;
+    if(count > 1) {
+        double sum = 0.0;
+        for(int i = 0; i < count; i++) {
+            sum += (values[i] - stat.mean) * (values[i] - stat.mean);
+        }
+        stat.stddev = sqrt(sum / (count - 1));
+    }
+    return stat;
+}
+
+void printBenchStat(FILE* file, const char* name, BenchStat stat, int last) {
+    fprintf(file, "  \"%s\": { \"mean\": %.6g, \"stddev\": %.6g, \"min\": %.6g, \"max\": %.6g }%s\n", name, stat.mean, stat.stddev, stat.min, stat.max, last ? "" : ",");
+}
+
+// Renders the scene options->bench times and writes the timings as JSON
+int runBenchmark(Scene* scene, const Options* options, double loadTime) {
+    int runs = options->bench;
+    double* times = (double*)malloc(5 * runs * sizeof(double));
+    if(times == NULL) {
+        perror("Failed to allocate benchmark results");
+        return 0;
+    }
+    double* primaryRate = times + runs;
+    double* rayRate = times + 2 * runs;
+    double* sampleRate = times + 3 * runs;
+    double* denoiseTimes = times + 4 * runs;
+    unsigned char* image = NULL;
+    for(int i = 0; i < runs; i++) {
+        free(image);
+        image = renderScene(scene);
+        if(image == NULL) {
+            free(times);
+            return 0;
+        }
+        RenderStats stats = scene->stats;
+        times[i] = stats.renderTime;
+        // Every sample traces one camera ray, the feature rays of the
+        // denoiser are not timed with the render and are reported apart
+        primaryRate[i] = stats.samples / stats.renderTime;
+        rayRate[i] = stats.rays / stats.renderTime;
+        sampleRate[i] = stats.samples / stats.renderTime;
+        denoiseTimes[i] = stats.denoiseTime;
+        fprintf(stderr, "Run %d/%d: %.3f s\n", i + 1, runs, stats.renderTime);
+    }
+    writePPM(options->output, options->width, options->height, image);
+    free(image);
+    if(options->hdr != NULL) {
+        framebuffer_write_pfm(&scene->framebuffer, options->hdr);
+    }
+
+    FILE* file = stdout;
+    if(options->json != NULL) {
+        file = fopen(options->json, "w");
+        if(file == NULL) {
+            perror("Failed to open benchmark output");
+            free(times);
+            return 0;
+        }
+    }
+    fprintf(file, "{\n");
+    fprintf(file, "  \"scene\": \"%s\",\n", options->scene);
+    fprintf(file, "  \"width\": %d,\n", options->width);
+    fprintf(file, "  \"height\": %d,\n", options->height);
+    fprintf(file, "  \"spp\": %d,\n", options->rayPerPixel);
+    fprintf(file, "  \"min_spp\": %d,\n", options->minRayPerPixel);
+    fprintf(file, "  \"target_error\": %g,\n", options->targetError);
+    fprintf(file, "  \"depth\": %d,\n", options->maxRayDepth);
+    fprintf(file, "  \"nee\": %d,\n", options->directLighting);
+    fprintf(file, "  \"rr_depth\": %d,\n", options->rouletteDepth);
+    fprintf(file, "  \"wavefront\": %d,\n", options->wavefront);
+    fprintf(file, "  \"compact_meshes\": %d,\n", options->compactMeshes);
+    fprintf(file, "  \"huge_pages\": %d,\n", options->hugePages);
+    fprintf(file, "  \"denoise\": %d,\n", options->denoise);
+    fprintf(file, "  \"texture_filter\": \"%s\",\n", textureFilterNames[options->textureFilter]);
+    fprintf(file, "  \"sampler\": \"%s\",\n", samplerTypeNames[options->sampler]);
+    fprintf(file, "  \"threads\": %d,\n", options->nbThreads);
+    fprintf(file, "  \"packet_size\": %d,\n", options->packetSize);
+    fprintf(file, "  \"runs\": %d,\n", runs);
+    fprintf(file, "  \"load_time\": %.6g,\n", loadTime);
+    fprintf(file, "  \"scene_memory\": %zu,\n", arena_used(&scene->arena));
+    fprintf(file, "  \"samples\": %lld,\n", scene->stats.samples);
+    fprintf(file, "  \"rays\": %lld,\n", scene->stats.rays);
+    fprintf(file, "  \"feature_rays\": %lld,\n", scene->stats.featureRays);
+    printBenchStat(file, "wall_time", benchStat(times, runs), 0);
+    printBenchStat(file, "primary_rays_per_second", benchStat(primaryRate, runs), 0);
+    printBenchStat(file, "rays_per_second", benchStat(rayRate, runs), 0);
+    printBenchStat(file, "samples_per_second", benchStat(sampleRate, runs), 0);
+    printBenchStat(file, "denoise_time", benchStat(denoiseTimes, runs), 0);
+    // Counters of the last run, they are the same for every run
+    fprintf(file, "  \"counters\": ");
+    counters_write_json(file, 2);
+    fprintf(file, "\n}\n");
+    if(file != stdout) {
+        fclose(file);
+    }
+    free(times);
+    return 1;
+}
+
+int writeCounters(const char* filename) {
+    if(filename == NULL) {
+        return 1;
+    }
+    FILE* file = fopen(filename, "w");
+    if(file == NULL) {
+        perror("Failed to open counters output");
+        return 0;
+    }
+    counters_write_json(file, 0);
+    fprintf(file, "\n");
+    fclose(file);
+    return 1;
+}
+
+// Name of the output of a frame. A pattern with a conversion such as
+// "frame_%04d.ppm" is given the frame number, otherwise the number goes
+// before the extension. A single frame keeps the name as it is.
+void frameFilename(const char* pattern, int frame, int frames, char* out, size_t size) {
+    if(frames <= 1) {
+        snprintf(out, size, "%s", pattern);
+        return;
+    }
+    int start, length, width;
+    if(findFrameConversion(pattern, &start, &length, &width) && start >= 0) {
+        // The name is never used as a format, parseOptions only lets this one conversion through
+        snprintf(out, size, "%.*s%0*d%s", start, pattern, width, frame, pattern + start + length);
+        return;
+    }
+    const char* dot = strrchr(pattern, '.');
+    const char* slash = strrchr(pattern, '/');
+    int stem = dot != NULL && (slash == NULL || dot > slash) ? (int)(dot - pattern) : (int)strlen(pattern);
+    snprintf(out, size, "%.*s_%04d%s", stem, pattern, frame, pattern + stem);
+}
+
+void freeLoaded(Scene* scene, Texture* tex, SceneFile* sceneFile) {
+    freeScene(scene);
+    freeTexture(tex);
+    freeSceneFile(sceneFile);
+}
+
+int main(int argc, char const *argv[])
+{
+    // The scene file is read first, since its render settings are defaults the command line overrides
+    double fileLoadStart = wallTime();
+    SceneFile sceneFile;
+    memset(&sceneFile, 0, sizeof(SceneFile));
+    const char* sceneFilePath = findOption(argc, argv, "--scene-file");
+    if(sceneFilePath != NULL && !loadSceneFile(sceneFilePath, &sceneFile)) {
+        return 1;
+    }
+    double fileLoadTime = wallTime() - fileLoadStart;
+
+    Options options;
+    int parsed = parseOptions(argc, argv, &options, sceneFilePath != NULL ? &sceneFile : NULL);
+    if(parsed <= 0) {
+        if(parsed == 0) {
+            printUsage(argv[0]);
+        }
+        freeSceneFile(&sceneFile);
+        return parsed == 0 ? 1 : 0;
+    }
+    const ScenePreset* preset = NULL;
+    if(sceneFilePath == NULL) {
+        preset = preset_find(options.scene);
+        if(preset == NULL) {
+            fprintf(stderr, "Unknown scene '%s'\n", options.scene);
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    int bench = options.bench > 0;
+    int frames = sceneFilePath != NULL ? sceneFile.frames : 1;
+
+    Camera cam = camera_create(60.0f, vec3_build(0.0f, 0.0f, 0.0f), vec3_build(0.0f, 0.0f, -1.0f), vec3_build(0.0f, 1.0f, 0.0f), 1.0f, 1000.0f, (float)(options.width)/(float)(options.height));
+    if(sceneFilePath != NULL) {
+        cam = sceneFile.camera;
+        cam.aspectRatio = (float)(options.width)/(float)(options.height);
+    }
+
+    int nbSpheres = preset != NULL ? preset->nbSpheres : sceneFile.nbSpheres;
+    int nbModels = preset != NULL ? preset->nbModels : sceneFile.nbModels;
+    SceneInfo info = scene_info_create(options.rayPerPixel, options.width, options.height, options.maxRayDepth, nbSpheres, nbModels);
+    info.nbThreads = options.nbThreads;
+    info.packetSize = options.packetSize;
+    info.minRayPerPixel = options.minRayPerPixel;
+    info.targetError = options.targetError;
+    info.heatmapFile = options.heatmap;
+    info.directLighting = options.directLighting;
+    info.rouletteDepth = options.rouletteDepth;
+    info.wavefront = options.wavefront;
+    info.compactMeshes = options.compactMeshes;
+    info.hugePages = options.hugePages;
+    info.textureFilter = options.textureFilter;
+    info.sampler = options.sampler;
+    info.checkpointFile = options.checkpoint;
+    info.checkpointInterval = options.checkpointInterval;
+    info.resumeFile = options.resume;
+    info.denoise = options.denoise;
+    info.featuresFile = options.features;
+    // The benchmark JSON is the only thing meant to be read on stdout
+    info.verbose = !bench;
+
+    // In benchmark mode the loading messages go to stderr, so stdout only holds the JSON
+    int savedStdout = -1;
+    if(bench && options.json == NULL) {
+        fflush(stdout);
+        savedStdout = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    double loadStart = wallTime();
+    Scene scene = scene_create(&cam, &info);
+    Texture tex;
+    memset(&tex, 0, sizeof(Texture));
+    int loaded;
+    if(preset != NULL) {
+        tex = loadTexture("cc.ppm", &scene.arena);
+        loaded = preset->setup(&scene, &tex);
+        if(!loaded) {
+            // Nothing was loaded into the models
+            scene.info->nbModels = 0;
+        }
+    }
+    else {
+        loaded = scene_file_setup(&sceneFile, &scene);
+    }
+    double loadTime = fileLoadTime + wallTime() - loadStart;
+    if(savedStdout >= 0) {
+        fflush(stdout);
+        dup2(savedStdout, STDOUT_FILENO);
+        close(savedStdout);
+    }
+    if(!loaded) {
+        fprintf(stderr, "Failed to set up scene '%s'\n", preset != NULL ? preset->name : sceneFilePath);
+        freeLoaded(&scene, &tex, &sceneFile);
+        return 1;
+    }
+    if(sceneFilePath != NULL) {
+        scene_file_apply_frame(&sceneFile, &scene, 0);
+    }
+
+    if(bench) {
+        int ok = runBenchmark(&scene, &options, loadTime) && writeCounters(options.counters);
+        freeLoaded(&scene, &tex, &sceneFile);
+        return ok ? 0 : 1;
+    }
+
+    if(options.worker != NULL) {
+        int ok = renderWorker(&scene, options.worker);
+        if(ok && options.counters != NULL && writeCounters(options.counters)) {
+            printf("Counters written to %s\n", options.counters);
+        }
+        freeLoaded(&scene, &tex, &sceneFile);
+        return ok ? 0 : 1;
+    }
 
     printInformation(cam, scene);
-    
-    clock_t start = clock();
+    if(frames > 1) {
+        printf("Rendering %d frames, loading took %.3f s\n", frames, loadTime);
+    }
 
-    unsigned char* ppmImage = renderScene(&scene);
+    // Every frame reuses what was loaded, only the camera and the objects move
+    double sequenceStart = wallTime();
+    for(int frame = 0; frame < frames; frame++) {
+        char output[4096], hdr[4096], heatmap[4096], features[4096], counters[4096];
+        frameFilename(options.output, frame, frames, output, sizeof(output));
+        frameFilename(options.hdr != NULL ? options.hdr : "", frame, frames, hdr, sizeof(hdr));
+        frameFilename(options.heatmap != NULL ? options.heatmap : "", frame, frames, heatmap, sizeof(heatmap));
+        frameFilename(options.features != NULL ? options.features : "", frame, frames, features, sizeof(features));
+        frameFilename(options.counters != NULL ? options.counters : "", frame, frames, counters, sizeof(counters));
+        if(frames > 1) {
+            printf("-----------------------------------------\n");
+            printf("Frame %d/%d\n", frame + 1, frames);
+            scene_file_apply_frame(&sceneFile, &scene, frame);
+            info.heatmapFile = options.heatmap != NULL ? heatmap : NULL;
+            info.featuresFile = options.features != NULL ? features : NULL;
+        }
 
-    clock_t end = clock();
+        unsigned char* ppmImage = options.coordinator != NULL ? renderCoordinator(&scene, options.coordinator, options.leaseTimeout) : renderScene(&scene);
+        if(ppmImage == NULL) {
+            freeLoaded(&scene, &tex, &sceneFile);
+            return 1;
+        }
 
-    float timeTaken = (float)(end - start) / CLOCKS_PER_SEC;
+        // Wall-clock time, since clock() adds up the CPU time of every render thread
+        float timeTaken = (float)scene.stats.renderTime;
 
-    printf("Time Taken to render in seconds: %.3f s\n", timeTaken);
-    printf("Time Taken to render in minutes: %.3f min\n", timeTaken/60);
-    printf("Time Taken to render in hours: %.3f h\n", timeTaken/3600);
+        printf("Time Taken to render in seconds: %.3f s\n", timeTaken);
+        printf("Time Taken to render in minutes: %.3f min\n", timeTaken/60);
+        printf("Time Taken to render in hours: %.3f h\n", timeTaken/3600);
 
-    writePPM("test.ppm", width, height, ppmImage);
-    printf("Result Drawn to image test.ppm");
+        writePPM(output, options.width, options.height, ppmImage);
+        printf("Result Drawn to image %s\n", output);
+        if(options.hdr != NULL && framebuffer_write_pfm(&scene.framebuffer, hdr)) {
+            printf("Unclamped result drawn to %s\n", hdr);
+        }
+        if(options.counters != NULL && writeCounters(counters)) {
+            printf("Counters written to %s\n", counters);
+        }
+        free(ppmImage);
+    }
+    if(frames > 1) {
+        double sequenceTime = wallTime() - sequenceStart;
+        printf("-----------------------------------------\n");
+        printf("%d frames rendered in %.3f s, %.3f s per frame\n", frames, sequenceTime, sequenceTime / frames);
+    }
 
-    free(ppmImage);
-    freeScene(&scene);
-    freeTexture(&tex);
+    freeLoaded(&scene, &tex, &sceneFile);
 
     return 0;
 }
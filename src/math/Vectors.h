@@ -7,6 +7,7 @@
 #include <stdio.h>
 
 #include "../utils/utils.h"
+#include "../utils/counters.h"
 
 typedef struct Vec2
 {
@@ -145,26 +146,34 @@ Vec3 vec3_reflect(Vec3 v, Vec3 n) {
     return w;
 }
 
-Vec3 random_vec301() {
-    return vec3_build(random01(), random01(), random01());
+Vec3 random_vec301(Sampler* sampler) {
+    return vec3_build(random01(sampler), random01(sampler), random01(sampler));
 }
 
-Vec3 random_vec3_range(float min, float max) {
-    return vec3_build(random_range(min, max), random_range(min, max), random_range(min, max));
+Vec3 random_vec3_range(Sampler* sampler, float min, float max) {
+    return vec3_build(random_range(sampler, min, max), random_range(sampler, min, max), random_range(sampler, min, max));
 }
 
-Vec3 random_unit_vector() {
+Vec3 random_unit_vector(Sampler* sampler) {
+    // Patterns need the same two dimensions for every direction
+    if(sampler->type != SAMPLER_RANDOM) {
+        float z = 1.0f - 2.0f * random01(sampler);
+        float r = sqrtf(fmaxf(0.0f, 1.0f - z * z));
+        float phi = 2.0f * PI * random01(sampler);
+        return vec3_build(r * cosf(phi), r * sinf(phi), z);
+    }
     while(1) {
-        Vec3 p = random_vec3_range(-1, 1);
-        float lensq = pow(vec3_length(p), 2);
-        if(1e-160 < lensq && lensq <= 1) {
-            return vec3_normalize(p);
+        COUNTER_INC(COUNTER_UNIT_VECTOR_ITERATIONS);
+        Vec3 p = random_vec3_range(sampler, -1, 1);
+        float lensq = vec3_dot(p, p);
+        if(1e-30f < lensq && lensq <= 1) {
+            return vec3_div(p, sqrtf(lensq));
         }
     }
 }
 
-Vec3 random_on_hemisphere(Vec3 normal) {
-    Vec3 on_unit_sphere = random_unit_vector();
+Vec3 random_on_hemisphere(Sampler* sampler, Vec3 normal) {
+    Vec3 on_unit_sphere = random_unit_vector(sampler);
     if(vec3_dot(on_unit_sphere, normal) > 0.0f) {
         return on_unit_sphere;
     }
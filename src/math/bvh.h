@@ -0,0 +1,478 @@
+#ifndef BVH_H
+#define BVH_H
+
+#pragma once
+
+#include <assert.h>
+#include <float.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Vectors.h"
+#include "../utils/arena.h"
+#include "../utils/counters.h"
+
+#define BVH_BINS 16
+// Largest cost of the primitives of a leaf, a primitive costing one node
+// traversal unless bvh_build is given other costs
+#define BVH_MAX_LEAF_SIZE 4
+// Cheap primitives tested several at a time still stop at this many per leaf
+#define BVH_MAX_LEAF_PRIMS 16
+#define BVH_STACK_SIZE 64
+// Deepest level of a leaf, so traversal never pushes more than BVH_STACK_SIZE
+// nodes: a node at depth d has at most 2^(BVH_MAX_DEPTH - d) primitives
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 1)
+// Subtrees with more primitives than this are built on their own thread
+#define BVH_PARALLEL_THRESHOLD 16384
+#define BVH_PARALLEL_DEPTH 5
+
+typedef struct AABB {
+    Vec3 min;
+    Vec3 max;
+} AABB;
+
+// 32 bytes so a pair of siblings shares one cache line. For inner nodes
+// leftFirst is the index of the left child (the right child follows it),
+// for leaves it is the first entry in primIndices and count is non zero.
+typedef struct BVHNode {
+    float min[3];
+    int leftFirst;
+    float max[3];
+    int count;
+} BVHNode;
+
+typedef struct BVH {
+    BVHNode* nodes;
+    int* primIndices;
+    int nodeCount;
+    int primCount;
+    double buildTime;
+} BVH;
+
+typedef struct BVHBuilder {
+    BVH* bvh;
+    const AABB* primBounds;
+    const Vec3* centroids;
+    const float* primCosts;
+    atomic_int nodeCount;
+} BVHBuilder;
+
+typedef struct BVHBuildTask {
+    BVHBuilder* builder;
+    int nodeIndex;
+    int depth;
+} BVHBuildTask;
+
+AABB aabb_empty() {
+    AABB box;
+    box.min = vec3_build(FLT_MAX, FLT_MAX, FLT_MAX);
+    box.max = vec3_build(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    return box;
+}
+
+AABB aabb_grow(AABB box, Vec3 p) {
+    box.min = vec3_build(fminf(box.min.x, p.x), fminf(box.min.y, p.y), fminf(box.min.z, p.z));
+    box.max = vec3_build(fmaxf(box.max.x, p.x), fmaxf(box.max.y, p.y), fmaxf(box.max.z, p.z));
+    return box;
+}
+
+AABB aabb_union(AABB a, AABB b) {
+    AABB box;
+    box.min = vec3_build(fminf(a.min.x, b.min.x), fminf(a.min.y, b.min.y), fminf(a.min.z, b.min.z));
+    box.max = vec3_build(fmaxf(a.max.x, b.max.x), fmaxf(a.max.y, b.max.y), fmaxf(a.max.z, b.max.z));
+    return box;
+}
+
+float aabb_area(AABB box) {
+    Vec3 e = vec3_sub(box.max, box.min);
+    if(e.x < 0.0f) {
+        return 0.0f;
+    }
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+float vec3_axis(Vec3 v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+void bvh_node_set_bounds(BVHNode* node, AABB box) {
+    node->min[0] = box.min.x;
+    node->min[1] = box.min.y;
+    node->min[2] = box.min.z;
+    node->max[0] = box.max.x;
+    node->max[1] = box.max.y;
+    node->max[2] = box.max.z;
+}
+
+AABB bvh_node_bounds(const BVHNode* node) {
+    AABB box;
+    box.min = vec3_build(node->min[0], node->min[1], node->min[2]);
+    box.max = vec3_build(node->max[0], node->max[1], node->max[2]);
+    return box;
+}
+
+// Distance at which the ray enters the node, or FLT_MAX if it misses it or
+// only reaches it past tMax
+float bvh_node_intersect(const BVHNode* node, Vec3 origin, Vec3 invDir, float tMax) {
+    float tx1 = (node->min[0] - origin.x) * invDir.x;
+    float tx2 = (node->max[0] - origin.x) * invDir.x;
+    float tNear = fminf(tx1, tx2);
+    float tFar = fmaxf(tx1, tx2);
+    float ty1 = (node->min[1] - origin.y) * invDir.y;
+    float ty2 = (node->max[1] - origin.y) * invDir.y;
+    tNear = fmaxf(tNear, fminf(ty1, ty2));
+    tFar = fminf(tFar, fmaxf(ty1, ty2));
+    float tz1 = (node->min[2] - origin.z) * invDir.z;
+    float tz2 = (node->max[2] - origin.z) * invDir.z;
+    tNear = fmaxf(tNear, fminf(tz1, tz2));
+    tFar = fminf(tFar, fmaxf(tz1, tz2));
+    if(tFar >= tNear && tFar > 0.0f && tNear < tMax) {
+        return tNear;
+    }
+    return FLT_MAX;
+}
+
+Vec3 ray_inverse_direction(Vec3 direction) {
+    return vec3_build(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+}
+
+void* bvh_subdivide_task(void* arg);
+
+float bvh_prim_cost(const BVHBuilder* builder, int prim) {
+    return builder->primCosts != NULL ? builder->primCosts[prim] : 1.0f;
+}
+
+// Puts the half of the primitives with the smallest centroids on axis first
+// (quickselect), for nodes the SAH split would take too deep
+void bvh_median_partition(BVHBuilder* builder, int first, int count, int axis) {
+    int* prims = &builder->bvh->primIndices[first];
+    int lo = 0;
+    int hi = count - 1;
+    int k = count / 2;
+    while(lo < hi) {
+        float pivot = vec3_axis(builder->centroids[prims[(lo + hi) / 2]], axis);
+        int i = lo;
+        int j = hi;
+        while(i <= j) {
+            while(vec3_axis(builder->centroids[prims[i]], axis) < pivot) {
+                i++;
+            }
+            while(vec3_axis(builder->centroids[prims[j]], axis) > pivot) {
+                j--;
+            }
+            if(i <= j) {
+                int tmp = prims[i];
+                prims[i++] = prims[j];
+                prims[j--] = tmp;
+            }
+        }
+        if(k <= j) {
+            hi = j;
+        }
+        else if(k >= i) {
+            lo = i;
+        }
+        else {
+            break;
+        }
+    }
+}
+
+void bvh_subdivide(BVHBuilder* builder, int nodeIndex, int depth) {
+    BVH* bvh = builder->bvh;
+    BVHNode* node = &bvh->nodes[nodeIndex];
+    int first = node->leftFirst;
+    int count = node->count;
+
+    AABB bounds = aabb_empty();
+    AABB centroidBounds = aabb_empty();
+    float leafCost = 0.0f;
+    for(int i = first; i < first + count; i++) {
+        int prim = bvh->primIndices[i];
+        bounds = aabb_union(bounds, builder->primBounds[prim]);
+        centroidBounds = aabb_grow(centroidBounds, builder->centroids[prim]);
+        leafCost += bvh_prim_cost(builder, prim);
+    }
+    bvh_node_set_bounds(node, bounds);
+
+    if(count <= 1 || depth >= BVH_MAX_DEPTH) {
+        return;
+    }
+
+    // Binned SAH: pick the bin boundary with the lowest split cost on any axis
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float bestCost = FLT_MAX;
+    for(int axis = 0; axis < 3; axis++) {
+        float cMin = vec3_axis(centroidBounds.min, axis);
+        float cMax = vec3_axis(centroidBounds.max, axis);
+        if(cMax - cMin <= 0.0f) {
+            continue;
+        }
+        AABB binBounds[BVH_BINS];
+        int binCount[BVH_BINS];
+        float binCost[BVH_BINS];
+        for(int b = 0; b < BVH_BINS; b++) {
+            binBounds[b] = aabb_empty();
+            binCount[b] = 0;
+            binCost[b] = 0.0f;
+        }
+        float scale = BVH_BINS / (cMax - cMin);
+        for(int i = first; i < first + count; i++) {
+            int prim = bvh->primIndices[i];
+            int b = (int)((vec3_axis(builder->centroids[prim], axis) - cMin) * scale);
+            b = b < BVH_BINS - 1 ? b : BVH_BINS - 1;
+            binBounds[b] = aabb_union(binBounds[b], builder->primBounds[prim]);
+            binCount[b]++;
+            binCost[b] += bvh_prim_cost(builder, prim);
+        }
+
+        float leftArea[BVH_BINS - 1];
+        int leftCount[BVH_BINS - 1];
+        float leftCost[BVH_BINS - 1];
+        AABB box = aabb_empty();
+        int sum = 0;
+        float costSum = 0.0f;
+        for(int b = 0; b < BVH_BINS - 1; b++) {
+            box = aabb_union(box, binBounds[b]);
+            sum += binCount[b];
+            costSum += binCost[b];
+            leftArea[b] = aabb_area(box);
+            leftCount[b] = sum;
+            leftCost[b] = costSum;
+        }
+        box = aabb_empty();
+        sum = 0;
+        costSum = 0.0f;
+        for(int b = BVH_BINS - 1; b > 0; b--) {
+            box = aabb_union(box, binBounds[b]);
+            sum += binCount[b];
+            costSum += binCost[b];
+            float cost = leftCost[b - 1] * leftArea[b - 1] + costSum * aabb_area(box);
+            if(leftCount[b - 1] > 0 && sum > 0 && cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    // Traversing a node costs about as much as one primitive test
+    float splitCost = 1.0f + bestCost / aabb_area(bounds);
+    if(bestAxis < 0 || (splitCost >= leafCost && leafCost <= BVH_MAX_LEAF_SIZE && count <= BVH_MAX_LEAF_PRIMS)) {
+        return;
+    }
+
+    float cMin = vec3_axis(centroidBounds.min, bestAxis);
+    float scale = BVH_BINS / (vec3_axis(centroidBounds.max, bestAxis) - cMin);
+    int i = first;
+    int j = first + count - 1;
+    while(i <= j) {
+        int b = (int)((vec3_axis(builder->centroids[bvh->primIndices[i]], bestAxis) - cMin) * scale);
+        b = b < BVH_BINS - 1 ? b : BVH_BINS - 1;
+        if(b < bestSplit) {
+            i++;
+        }
+        else {
+            int tmp = bvh->primIndices[i];
+            bvh->primIndices[i] = bvh->primIndices[j];
+            bvh->primIndices[j--] = tmp;
+        }
+    }
+
+    int leftCount = i - first;
+    // Children deeper than the traversal stack allows get a median split
+    // instead, which halves the primitives at every level
+    int childLimit = BVH_MAX_DEPTH - depth - 1 >= 30 ? INT_MAX : 1 << (BVH_MAX_DEPTH - depth - 1);
+    if(leftCount > childLimit || count - leftCount > childLimit) {
+        int axis = 0;
+        Vec3 extent = vec3_sub(centroidBounds.max, centroidBounds.min);
+        if(extent.y > vec3_axis(extent, axis)) {
+            axis = 1;
+        }
+        if(extent.z > vec3_axis(extent, axis)) {
+            axis = 2;
+        }
+        bvh_median_partition(builder, first, count, axis);
+        leftCount = count / 2;
+        i = first + leftCount;
+    }
+    int left = atomic_fetch_add(&builder->nodeCount, 2);
+    bvh->nodes[left].leftFirst = first;
+    bvh->nodes[left].count = leftCount;
+    bvh->nodes[left + 1].leftFirst = i;
+    bvh->nodes[left + 1].count = count - leftCount;
+    node->leftFirst = left;
+    node->count = 0;
+
+    // Both halves work on disjoint ranges of primIndices and take their
+    // nodes from the shared atomic counter, so they can be built in parallel
+    pthread_t thread;
+    BVHBuildTask task = { builder, left, depth + 1 };
+    int spawned = 0;
+    if(count > BVH_PARALLEL_THRESHOLD && depth < BVH_PARALLEL_DEPTH) {
+        spawned = pthread_create(&thread, NULL, bvh_subdivide_task, &task) == 0;
+    }
+    if(!spawned) {
+        bvh_subdivide(builder, left, depth + 1);
+    }
+    bvh_subdivide(builder, left + 1, depth + 1);
+    if(spawned) {
+        pthread_join(thread, NULL);
+    }
+}
+
+void* bvh_subdivide_task(void* arg) {
+    BVHBuildTask* task = (BVHBuildTask*)arg;
+    bvh_subdivide(task->builder, task->nodeIndex, task->depth);
+    return NULL;
+}
+
+// Builds a BVH over primCount primitives given their bounds and centroids,
+// with its storage taken from arena (the C allocator when NULL, freeBVH then
+// frees it). primCosts, when not NULL, is the cost of testing each primitive
+// relative to a node traversal. Returns 0 if the node storage could not be
+// allocated.
+int bvh_build(BVH* bvh, const AABB* primBounds, const Vec3* centroids, const float* primCosts, int primCount, Arena* arena, ArenaTag tag) {
+    double start = wallTime();
+    memset(bvh, 0, sizeof(BVH));
+    if(primCount <= 0) {
+        return 1;
+    }
+
+    // Node 0 is the root and node 1 is left unused so sibling pairs start on even indices
+    size_t nodeBytes = (size_t)(2 * primCount + 1) * sizeof(BVHNode);
+    bvh->nodes = (BVHNode*)arena_alloc(arena, tag, nodeBytes, 64);
+    bvh->primIndices = (int*)arena_alloc(arena, tag, primCount * sizeof(int), 64);
+    if(bvh->nodes == NULL || bvh->primIndices == NULL) {
+        perror("Failed to allocate BVH");
+        arena_free(arena, bvh->nodes);
+        arena_free(arena, bvh->primIndices);
+        memset(bvh, 0, sizeof(BVH));
+        return 0;
+    }
+    for(int i = 0; i < primCount; i++) {
+        bvh->primIndices[i] = i;
+    }
+    bvh->primCount = primCount;
+
+    BVHBuilder builder;
+    builder.bvh = bvh;
+    builder.primBounds = primBounds;
+    builder.centroids = centroids;
+    builder.primCosts = primCosts;
+    atomic_init(&builder.nodeCount, 2);
+
+    bvh->nodes[0].leftFirst = 0;
+    bvh->nodes[0].count = primCount;
+    memset(&bvh->nodes[1], 0, sizeof(BVHNode));
+    bvh_subdivide(&builder, 0, 0);
+
+    bvh->nodeCount = atomic_load(&builder.nodeCount);
+    bvh->buildTime = wallTime() - start;
+    return 1;
+}
+
+// Recomputes every node's bounds for primitives that moved, keeping the
+// tree topology. Children always sit after their parent in the node array,
+// so a single backward pass updates the leaves before the nodes above them.
+void bvh_refit(BVH* bvh, const AABB* primBounds) {
+    for(int i = bvh->nodeCount - 1; i >= 0; i--) {
+        if(i == 1) {
+            continue;
+        }
+        BVHNode* node = &bvh->nodes[i];
+        AABB box = aabb_empty();
+        if(node->count > 0) {
+            for(int k = node->leftFirst; k < node->leftFirst + node->count; k++) {
+                box = aabb_union(box, primBounds[bvh->primIndices[k]]);
+            }
+        }
+        else {
+            box = aabb_union(bvh_node_bounds(&bvh->nodes[node->leftFirst]), bvh_node_bounds(&bvh->nodes[node->leftFirst + 1]));
+        }
+        bvh_node_set_bounds(node, box);
+    }
+}
+
+// Called with the primitives of each leaf the ray reaches. It must lower the
+// value behind the tMax pointer given to bvh_intersect when it finds a closer hit.
+typedef void (*BVHLeafFunc)(void* ctx, const int* prims, int count);
+
+// Closest hit traversal. The nearer child is visited first and the other one
+// is skipped when popped if a closer hit was found in the meantime.
+void bvh_intersect(const BVH* bvh, Vec3 origin, Vec3 direction, const float* tMax, BVHLeafFunc leafFunc, void* ctx) {
+    const BVHNode* nodes = bvh->nodes;
+    if(nodes == NULL) {
+        return;
+    }
+
+    Vec3 invDir = ray_inverse_direction(direction);
+    if(bvh_node_intersect(&nodes[0], origin, invDir, *tMax) == FLT_MAX) {
+        COUNTER_INC(COUNTER_BVH_TRAVERSALS);
+        COUNTER_INC(COUNTER_BVH_NODES);
+        return;
+    }
+
+    int stack[BVH_STACK_SIZE];
+    float stackDist[BVH_STACK_SIZE];
+    int stackSize = 0;
+    int nodeIndex = 0;
+    unsigned long long visited = 1;
+    while(1) {
+        const BVHNode* node = &nodes[nodeIndex];
+        if(node->count > 0) {
+            leafFunc(ctx, &bvh->primIndices[node->leftFirst], node->count);
+        }
+        else {
+            int left = node->leftFirst;
+            float distLeft = bvh_node_intersect(&nodes[left], origin, invDir, *tMax);
+            float distRight = bvh_node_intersect(&nodes[left + 1], origin, invDir, *tMax);
+            visited += 2;
+            int near = left, far = left + 1;
+            if(distRight < distLeft) {
+                float tmp = distLeft;
+                distLeft = distRight;
+                distRight = tmp;
+                near = left + 1;
+                far = left;
+            }
+            if(distLeft != FLT_MAX) {
+                if(distRight != FLT_MAX) {
+                    // bvh_subdivide keeps leaves within BVH_MAX_DEPTH
+                    assert(stackSize < BVH_STACK_SIZE);
+                    stack[stackSize] = far;
+                    stackDist[stackSize++] = distRight;
+                }
+                nodeIndex = near;
+                continue;
+            }
+        }
+
+        nodeIndex = -1;
+        while(stackSize > 0) {
+            stackSize--;
+            if(stackDist[stackSize] < *tMax) {
+                nodeIndex = stack[stackSize];
+                break;
+            }
+        }
+        if(nodeIndex < 0) {
+            break;
+        }
+    }
+    COUNTER_INC(COUNTER_BVH_TRAVERSALS);
+    COUNTER_ADD(COUNTER_BVH_NODES, visited);
+}
+
+void freeBVH(BVH* bvh) {
+    free(bvh->nodes);
+    free(bvh->primIndices);
+    memset(bvh, 0, sizeof(BVH));
+}
+
+#endif /* BVH_H */
@@ -27,6 +27,12 @@ Camera camera_create(float fov, Vec3 position, Vec3 target, Vec3 up, float near,
     return cam;
 }
 
+// Angle between the rays of neighbouring pixels, the spread of the ray cone
+// of a camera ray
+float camera_pixel_spread(const Camera* cam, int height) {
+    return 2.0f * tanf(cam->fov / 2.0f * PI / 180.0f) / (float)height;
+}
+
 void computeCamToWorld(Camera* cam, float* matrix) {
     Vec3 f = vec3_normalize(vec3_sub(cam->target, cam->position));
     Vec3 u = vec3_normalize(cam->up);
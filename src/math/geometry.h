@@ -6,10 +6,15 @@
 #include <float.h>
 
 #include "Vectors.h"
+#include "bvh.h"
+#include "transform.h"
+#include "quantize.h"
 #include "../texture.h"
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <string.h>
 
@@ -23,14 +28,30 @@ typedef struct {
     Texture* texture;
 } Material;
 
+// What the intersection tests record for the closest hit so far. The
+// surface attributes are only worked out once the query is over, with
+// scene_hit_surface.
 typedef struct HitInfo {
-    int hasHit;
     float hitDistance;
-    Vec3 hitPosition;
-    Material material;
+    // Object hit, spheres first then models like the top level BVH, -1 for none
+    int object;
+    // Triangle hit in the compiled triangles of the model and the barycentric
+    // coordinates of its first two vertices
+    int prim;
+    float u, v;
+} HitInfo;
+
+// Attributes of the surface at the closest hit
+typedef struct SurfaceHit {
+    Vec3 position;
     Vec3 normal;
     Vec2 uv;
-} HitInfo;
+    // Square root of the uv area per unit of surface area around the hit,
+    // used to pick the mip level of textures
+    float uvScale;
+    // Index in the material table of the scene
+    int material;
+} SurfaceHit;
 
 typedef struct Ray {
     Vec3 origin;
@@ -40,7 +61,7 @@ typedef struct Ray {
 typedef struct Sphere {
     float radius;
     Vec3 center;
-    Material material;
+    int material;
 } Sphere;
 
 typedef struct Face {
@@ -49,6 +70,50 @@ typedef struct Face {
     int vn[3];
 } Face;
 
+// Per triangle attributes only read once the closest hit is known
+typedef struct TriangleShading {
+    Vec3 normals[3];
+    Vec2 uvs[3];
+    // Square root of the uv area over the triangle area, how fast the uvs
+    // change along the surface
+    float uvScale;
+} TriangleShading;
+
+// Vertex of a compact mesh, one per unique (v, vt, vn) of the OBJ
+typedef struct CompactVertex {
+    // On the quantization grid of the mesh
+    uint16_t position[3];
+    // Half floats
+    uint16_t uv[2];
+    // Octahedral
+    uint32_t normal;
+} CompactVertex;
+
+// Triangles compiled for intersection, stored in the BVH leaf order so a
+// leaf covers a contiguous range. Positions are split in one array per
+// vertex and axis, all carved out of a single aligned block. The shading
+// attributes either follow as one TriangleShading per triangle, or for a
+// compact mesh as three indices per triangle into its CompactVertex stream
+// (shading is then NULL).
+typedef struct TriangleSoA {
+    float* x[3];
+    float* y[3];
+    float* z[3];
+    TriangleShading* shading;
+    uint32_t* indices;
+    const CompactVertex* vertices;
+    QuantizeGrid grid;
+    int count;
+    void* block;
+} TriangleSoA;
+
+// Ray constants of the watertight test: the ray is sheared so it runs
+// along +kz, which makes the edge tests exact for shared edges
+typedef struct WatertightRay {
+    int kx, ky, kz;
+    float sx, sy, sz;
+} WatertightRay;
+
 typedef struct Mesh {
     Vec3* vertices;
     Vec3* normals;
@@ -56,12 +121,36 @@ typedef struct Mesh {
     Face* faces;
 
     int vertexCount, normalCount, uvCount, faceCount;
+
+    BVH bvh;
+    TriangleSoA tris;
+
+    // Compact meshes only keep the unique vertices of the faces, and drop the
+    // arrays above once the triangles are compiled (see mesh_build_compact)
+    CompactVertex* compactVertices;
+    int compactVertexCount;
+
+    // Set when the arrays live in a memory mapped mesh cache file
+    void* mapping;
+    size_t mappingSize;
+    // Where the arrays are allocated, the C allocator when NULL
+    Arena* arena;
+    // Size and modification time of the OBJ file the mesh was loaded from,
+    // zero for meshes built in memory
+    uint64_t sourceSize;
+    int64_t sourceMtimeSec, sourceMtimeNsec;
 } Mesh;
 
+// An instance of a mesh. The mesh stays in object space and is shared by
+// every model placed with it, rays are moved into object space to be
+// intersected with it.
 typedef struct Model {
-    Mesh mesh;
-    Vec3 center;
-    Material material;
+    const Mesh* mesh;
+    Transform toWorld;
+    Transform toObject;
+    // How much the transform scales lengths, see transform_scale_factor
+    float scale;
+    int material;
 } Model;
 
 Material material_create(Vec3 albedo, Vec3 emissionColor, float emissionStrength, float specular, Texture* texture) {
@@ -113,7 +202,7 @@ Material material_blue() {
     return blue;
 }
 
-Sphere sphere_create(float radius, Vec3 center, Material material) {
+Sphere sphere_create(float radius, Vec3 center, int material) {
     Sphere sphere;
     sphere.radius = radius;
     sphere.center = center;
@@ -121,87 +210,376 @@ Sphere sphere_create(float radius, Vec3 center, Material material) {
     return sphere;
 }
 
-Model model_create(Mesh mesh, Vec3 center, Material mat) {
-    Model model;
-    model.mesh = mesh;
-    for(int i = 0; i < mesh.vertexCount; i++) {
-        mesh.vertices[i] = vec3_add(mesh.vertices[i], center);
+int mesh_is_mapped(const Mesh* mesh, const void* ptr) {
+    return mesh->mapping != NULL && (const char*)ptr >= (const char*)mesh->mapping && (const char*)ptr < (const char*)mesh->mapping + mesh->mappingSize;
+}
+
+// Frees one of the mesh arrays unless it points into the mapped cache file
+// or the arena
+void mesh_free_array(Mesh* mesh, void* ptr) {
+    if(!mesh_is_mapped(mesh, ptr)) {
+        arena_free(mesh->arena, ptr);
     }
-    model.center = center;
-    model.material = mat;
-    return model;
 }
 
-int loadObj(const char *filename, Mesh *mesh) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Unable to open file %s\n", filename);
+void mesh_release_accel(Mesh* mesh) {
+    mesh_free_array(mesh, mesh->bvh.nodes);
+    mesh_free_array(mesh, mesh->bvh.primIndices);
+    memset(&mesh->bvh, 0, sizeof(BVH));
+    mesh_free_array(mesh, mesh->tris.block);
+    memset(&mesh->tris, 0, sizeof(TriangleSoA));
+}
+
+size_t triangles_plane_bytes(int count) {
+    return ((size_t)count * sizeof(float) + 63) & ~(size_t)63;
+}
+
+size_t triangles_block_bytes(int count, int compact) {
+    size_t shadingBytes = compact ? (size_t)count * 3 * sizeof(uint32_t) : (size_t)count * sizeof(TriangleShading);
+    size_t bytes = 9 * triangles_plane_bytes(count) + shadingBytes;
+    return (bytes + 63) & ~(size_t)63;
+}
+
+// Points the arrays of tris into a block laid out by triangles_block_bytes.
+// The vertices and grid of a compact mesh are set by the caller.
+void triangles_bind(TriangleSoA* tris, void* block, int count, int compact) {
+    size_t planeBytes = triangles_plane_bytes(count);
+    char* base = (char*)block;
+    tris->block = block;
+    tris->count = count;
+    for(int k = 0; k < 3; k++) {
+        tris->x[k] = (float*)(base + (3 * k) * planeBytes);
+        tris->y[k] = (float*)(base + (3 * k + 1) * planeBytes);
+        tris->z[k] = (float*)(base + (3 * k + 2) * planeBytes);
+    }
+    tris->shading = compact ? NULL : (TriangleShading*)(base + 9 * planeBytes);
+    tris->indices = compact ? (uint32_t*)(base + 9 * planeBytes) : NULL;
+    tris->vertices = NULL;
+}
+
+// Square root of the uv area over the triangle area
+float triangle_uv_scale(const Vec3 p[3], const Vec2 uv[3]) {
+    float uvArea = fabsf((uv[1].x - uv[0].x) * (uv[2].y - uv[0].y) - (uv[2].x - uv[0].x) * (uv[1].y - uv[0].y));
+    float area = vec3_length(vec3_cross(vec3_sub(p[1], p[0]), vec3_sub(p[2], p[0])));
+    return area > 0.0f ? sqrtf(uvArea / area) : 0.0f;
+}
+
+// Copies the faces into a TriangleSoA following the BVH leaf order. Missing
+// normals fall back to the geometric normal and missing uvs to (0, 0).
+int mesh_compile_triangles(Mesh* mesh) {
+    TriangleSoA* tris = &mesh->tris;
+    mesh_free_array(mesh, tris->block);
+    memset(tris, 0, sizeof(TriangleSoA));
+    int count = mesh->faceCount;
+    if(count <= 0) {
+        return 1;
+    }
+
+    void* block = arena_alloc(mesh->arena, ARENA_MESH, triangles_block_bytes(count, 0), 64);
+    if(block == NULL) {
+        perror("Failed to allocate triangles");
+        return 0;
+    }
+    triangles_bind(tris, block, count, 0);
+
+    for(int i = 0; i < count; i++) {
+        int faceIndex = mesh->bvh.primIndices != NULL ? mesh->bvh.primIndices[i] : i;
+        Face face = mesh->faces[faceIndex];
+        Vec3 p[3];
+        for(int k = 0; k < 3; k++) {
+            p[k] = mesh->vertices[face.v[k]];
+            tris->x[k][i] = p[k].x;
+            tris->y[k][i] = p[k].y;
+            tris->z[k][i] = p[k].z;
+        }
+        Vec3 geometricNormal = vec3_normalize(vec3_cross(vec3_sub(p[1], p[0]), vec3_sub(p[2], p[0])));
+        TriangleShading* shading = &tris->shading[i];
+        for(int k = 0; k < 3; k++) {
+            int vn = face.vn[k];
+            int vt = face.vt[k];
+            shading->normals[k] = (vn >= 0 && vn < mesh->normalCount) ? mesh->normals[vn] : geometricNormal;
+            shading->uvs[k] = (vt >= 0 && vt < mesh->uvCount) ? mesh->uvs[vt] : vec2_build(0.0f, 0.0f);
+        }
+        shading->uvScale = triangle_uv_scale(p, shading->uvs);
+    }
+    return 1;
+}
+
+// Builds the BVH over the faces, leaving the compiled triangles to the caller
+int mesh_build_bvh(Mesh* mesh) {
+    AABB* bounds = (AABB*)malloc(mesh->faceCount * sizeof(AABB));
+    Vec3* centroids = (Vec3*)malloc(mesh->faceCount * sizeof(Vec3));
+    if(bounds == NULL || centroids == NULL) {
+        perror("Failed to allocate BVH build data");
+        free(bounds);
+        free(centroids);
+        return 0;
+    }
+    for(int i = 0; i < mesh->faceCount; i++) {
+        Face face = mesh->faces[i];
+        AABB box = aabb_empty();
+        for(int k = 0; k < 3; k++) {
+            box = aabb_grow(box, mesh->vertices[face.v[k]]);
+        }
+        bounds[i] = box;
+        centroids[i] = vec3_mul(vec3_add(box.min, box.max), 0.5f);
+    }
+
+    mesh_release_accel(mesh);
+    bvh_build(&mesh->bvh, bounds, centroids, NULL, mesh->faceCount, mesh->arena, ARENA_MESH);
+    printf("Mesh BVH: %d triangles, %d nodes, built in %.3f ms\n", mesh->faceCount, mesh->bvh.nodeCount, mesh->bvh.buildTime * 1000.0);
+
+    free(bounds);
+    free(centroids);
+    return 1;
+}
+
+// Builds the BVH and the compiled triangles the intersection code runs on
+void mesh_build_accel(Mesh* mesh) {
+    if(mesh_build_bvh(mesh)) {
+        mesh_compile_triangles(mesh);
+    }
+}
+
+// Open addressing table from (v, vt, vn) to the index of a compact vertex,
+// doubled whenever it gets half full
+typedef struct VertexTable {
+    int* keys;
+    int* values;
+    size_t mask;
+    size_t count;
+} VertexTable;
+
+int vertex_table_alloc(VertexTable* table, size_t capacity) {
+    table->keys = (int*)malloc(capacity * 3 * sizeof(int));
+    table->values = (int*)malloc(capacity * sizeof(int));
+    table->mask = capacity - 1;
+    table->count = 0;
+    if(table->keys == NULL || table->values == NULL) {
+        free(table->keys);
+        free(table->values);
+        return 0;
+    }
+    memset(table->values, 0xff, capacity * sizeof(int));
+    return 1;
+}
+
+void vertex_table_free(VertexTable* table) {
+    free(table->keys);
+    free(table->values);
+}
+
+size_t vertex_table_slot(const VertexTable* table, const int* key) {
+    uint32_t hash = (uint32_t)key[0] * 0x9E3779B1u ^ (uint32_t)key[1] * 0x85EBCA77u ^ (uint32_t)key[2] * 0xC2B2AE3Du;
+    size_t slot = (hash ^ (hash >> 15)) & table->mask;
+    while(table->values[slot] >= 0) {
+        const int* other = &table->keys[3 * slot];
+        if(other[0] == key[0] && other[1] == key[1] && other[2] == key[2]) {
+            break;
+        }
+        slot = (slot + 1) & table->mask;
+    }
+    return slot;
+}
+
+int vertex_table_grow(VertexTable* table) {
+    VertexTable grown;
+    if(!vertex_table_alloc(&grown, (table->mask + 1) * 2)) {
+        return 0;
+    }
+    for(size_t i = 0; i <= table->mask; i++) {
+        if(table->values[i] >= 0) {
+            size_t slot = vertex_table_slot(&grown, &table->keys[3 * i]);
+            memcpy(&grown.keys[3 * slot], &table->keys[3 * i], 3 * sizeof(int));
+            grown.values[slot] = table->values[i];
+        }
+    }
+    grown.count = table->count;
+    vertex_table_free(table);
+    *table = grown;
+    return 1;
+}
+
+// Index of the vertex with this key, or value when the key is new. Returns
+// -1 when the table cannot grow.
+int vertex_table_insert(VertexTable* table, int v, int vt, int vn, int value) {
+    if((table->count + 1) * 2 > table->mask + 1 && !vertex_table_grow(table)) {
+        return -1;
+    }
+    int key[3] = { v, vt, vn };
+    size_t slot = vertex_table_slot(table, key);
+    if(table->values[slot] < 0) {
+        memcpy(&table->keys[3 * slot], key, sizeof(key));
+        table->values[slot] = value;
+        table->count++;
+    }
+    return table->values[slot];
+}
+
+// Builds the acceleration structure of a mesh in compact form: positions are
+// snapped to a 16 bit grid over the mesh bounds before the BVH is built, the
+// unique (v, vt, vn) of the faces become one stream of CompactVertex, and the
+// compiled triangles index it instead of carrying their shading attributes.
+// The OBJ arrays are freed at the end. Returns 0 on failure, the mesh then
+// has no triangles.
+int mesh_build_compact(Mesh* mesh) {
+    if(mesh->faceCount <= 0 || mesh->vertexCount <= 0) {
+        return 0;
+    }
+    AABB bounds = aabb_empty();
+    for(int i = 0; i < mesh->vertexCount; i++) {
+        bounds = aabb_grow(bounds, mesh->vertices[i]);
+    }
+    QuantizeGrid grid = quantize_grid_create(bounds.min, bounds.max);
+    for(int i = 0; i < mesh->vertexCount; i++) {
+        uint16_t q[3];
+        quantize_position(&grid, mesh->vertices[i], q);
+        mesh->vertices[i] = dequantize_position(&grid, q);
+    }
+    mesh_release_accel(mesh);
+    if(!mesh_build_bvh(mesh) || mesh->bvh.primIndices == NULL) {
+        mesh_release_accel(mesh);
+        return 0;
+    }
+
+    int count = mesh->faceCount;
+    size_t capacity = 16;
+    while(capacity < (size_t)mesh->vertexCount * 2) {
+        capacity *= 2;
+    }
+    // The vertices are gathered in a growing array, then copied to the arena
+    int vertexCapacity = mesh->vertexCount;
+    CompactVertex* vertices = (CompactVertex*)malloc((size_t)vertexCapacity * sizeof(CompactVertex));
+    void* block = arena_alloc(mesh->arena, ARENA_MESH, triangles_block_bytes(count, 1), 64);
+    VertexTable table;
+    if(vertices == NULL || block == NULL || !vertex_table_alloc(&table, capacity)) {
+        perror("Failed to allocate compact mesh");
+        free(vertices);
+        mesh_free_array(mesh, block);
+        mesh_release_accel(mesh);
         return 0;
     }
 
+    TriangleSoA tris;
+    triangles_bind(&tris, block, count, 1);
+    int vertexCount = 0;
+    int ok = 1;
+    for(int i = 0; i < count && ok; i++) {
+        int faceIndex = mesh->bvh.primIndices[i];
+        Face face = mesh->faces[faceIndex];
+        Vec3 p[3];
+        for(int k = 0; k < 3; k++) {
+            p[k] = mesh->vertices[face.v[k]];
+            tris.x[k][i] = p[k].x;
+            tris.y[k][i] = p[k].y;
+            tris.z[k][i] = p[k].z;
+        }
+        for(int k = 0; k < 3 && ok; k++) {
+            int vt = face.vt[k] >= 0 && face.vt[k] < mesh->uvCount ? face.vt[k] : -1;
+            int vn = face.vn[k] >= 0 && face.vn[k] < mesh->normalCount ? face.vn[k] : -1;
+            if(vertexCount == vertexCapacity) {
+                CompactVertex* grown = (CompactVertex*)realloc(vertices, (size_t)vertexCapacity * 2 * sizeof(CompactVertex));
+                if(grown == NULL) {
+                    ok = 0;
+                    break;
+                }
+                vertices = grown;
+                vertexCapacity *= 2;
+            }
+            // Without a normal the vertex takes the geometric normal of its
+            // face, so it is only shared within that face
+            int index = vertex_table_insert(&table, face.v[k], vt, vn >= 0 ? vn : -2 - faceIndex, vertexCount);
+            if(index < 0) {
+                ok = 0;
+                break;
+            }
+            if(index == vertexCount) {
+                Vec3 normal = vn >= 0 ? mesh->normals[vn] : vec3_normalize(vec3_cross(vec3_sub(p[1], p[0]), vec3_sub(p[2], p[0])));
+                Vec2 uv = vt >= 0 ? mesh->uvs[vt] : vec2_build(0.0f, 0.0f);
+                CompactVertex* vertex = &vertices[vertexCount++];
+                quantize_position(&grid, p[k], vertex->position);
+                vertex->uv[0] = float_to_half(uv.x);
+                vertex->uv[1] = float_to_half(uv.y);
+                vertex->normal = octahedral_encode(normal);
+            }
+            tris.indices[3 * i + k] = (uint32_t)index;
+        }
+    }
+    vertex_table_free(&table);
+    CompactVertex* stored = ok ? (CompactVertex*)arena_alloc(mesh->arena, ARENA_MESH, (size_t)vertexCount * sizeof(CompactVertex), 64) : NULL;
+    if(stored == NULL) {
+        perror("Failed to allocate compact mesh");
+        free(vertices);
+        mesh_free_array(mesh, block);
+        mesh_release_accel(mesh);
+        return 0;
+    }
+    memcpy(stored, vertices, (size_t)vertexCount * sizeof(CompactVertex));
+    free(vertices);
+    mesh_free_array(mesh, mesh->vertices);
+    mesh_free_array(mesh, mesh->normals);
+    mesh_free_array(mesh, mesh->uvs);
+    mesh_free_array(mesh, mesh->faces);
     mesh->vertices = NULL;
-    mesh->vertexCount = 0;
     mesh->normals = NULL;
-    mesh->normalCount = 0;
     mesh->uvs = NULL;
-    mesh->uvCount = 0;
     mesh->faces = NULL;
-    mesh->faceCount = 0;
-
-    char line[256];
-    while (fgets(line, sizeof(line), file)) {
-        if (strncmp(line, "v ", 2) == 0) {
-            Vec3 v;
-            if (sscanf(line, "v %f %f %f", &v.x, &v.y, &v.z) == 3) {
-                mesh->vertices = realloc(mesh->vertices, (mesh->vertexCount + 1) * sizeof(Vec3));
-                mesh->vertices[mesh->vertexCount] = v;
-                mesh->vertexCount++;
-            }
-        } else if (strncmp(line, "vt ", 3) == 0) {
-            Vec2 uv;
-            if (sscanf(line, "vt %f %f", &uv.x, &uv.y) == 2) {
-                mesh->uvs = realloc(mesh->uvs, (mesh->uvCount + 1) * sizeof(Vec2));
-                mesh->uvs[mesh->uvCount] = uv;
-                mesh->uvCount++;
-            }
-        } else if (strncmp(line, "vn ", 3) == 0) {
-            Vec3 n;
-            if (sscanf(line, "vn %f %f %f", &n.x, &n.y, &n.z) == 3) {
-                mesh->normals = realloc(mesh->normals, (mesh->normalCount + 1) * sizeof(Vec3));
-                mesh->normals[mesh->normalCount] = n;
-                mesh->normalCount++;
-            }
-        } else if (strncmp(line, "f ", 2) == 0) {
-            Face f = {0};
-            int vert[3] = {0}, tex[3] = {0}, norm[3] = {0};
-            for (int i = 0; i < 3; i++) {
-                vert[i] = tex[i] = norm[i] = -1;
-            }
-            
-            int matches = sscanf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d",
-                &vert[0], &tex[0], &norm[0],
-                &vert[1], &tex[1], &norm[1],
-                &vert[2], &tex[2], &norm[2]);
-            
-            if (matches != 9) {
-                fprintf(stderr, "bad line: %s\n", line);
-                continue;
-            }
+    mesh->vertexCount = 0;
+    mesh->normalCount = 0;
+    mesh->uvCount = 0;
+    mesh->compactVertices = stored;
+    mesh->compactVertexCount = vertexCount;
+    tris.vertices = mesh->compactVertices;
+    tris.grid = grid;
+    mesh->tris = tris;
+    return 1;
+}
 
-            for(int i = 0; i < 3; i++) {
-                f.v[i] = vert[i] - 1 ;
-                f.vt[i] = tex[i] - 1;
-                f.vn[i] = norm[i] - 1;
-            }
-            
-            // Save
-            mesh->faces = realloc(mesh->faces, (mesh->faceCount + 1) * sizeof(Face));
-            mesh->faces[mesh->faceCount++] = f;
-        }
+// Bytes taken by the geometry of a mesh once loaded
+size_t mesh_memory_bytes(const Mesh* mesh) {
+    size_t bytes = (size_t)mesh->vertexCount * sizeof(Vec3) + (size_t)mesh->normalCount * sizeof(Vec3) + (size_t)mesh->uvCount * sizeof(Vec2);
+    bytes += (size_t)(mesh->vertices != NULL || mesh->faces != NULL ? mesh->faceCount : 0) * sizeof(Face);
+    bytes += (size_t)mesh->compactVertexCount * sizeof(CompactVertex);
+    bytes += (size_t)mesh->bvh.nodeCount * sizeof(BVHNode) + (size_t)mesh->bvh.primCount * sizeof(int);
+    if(mesh->tris.count > 0) {
+        bytes += triangles_block_bytes(mesh->tris.count, mesh->tris.shading == NULL);
     }
+    return bytes;
+}
 
-    fclose(file);
-    return 1;
+// Places a mesh in the world. A transform that flattens space leaves the
+// model with an identity transform.
+Model model_create(const Mesh* mesh, Transform toWorld, int material) {
+    Model model;
+    model.mesh = mesh;
+    model.material = material;
+    if(!transform_invert(&toWorld, &model.toObject)) {
+        fprintf(stderr, "Model transform cannot be inverted, using the identity\n");
+        toWorld = transform_identity();
+        model.toObject = toWorld;
+    }
+    model.toWorld = toWorld;
+    model.scale = transform_scale_factor(&toWorld);
+    return model;
+}
+
+// Moves the model so its object space origin lands on position
+void model_set_position(Model* model, Vec3 position) {
+    model->toWorld.m[0][3] = position.x;
+    model->toWorld.m[1][3] = position.y;
+    model->toWorld.m[2][3] = position.z;
+    transform_invert(&model->toWorld, &model->toObject);
+}
+
+AABB model_bounds(const Model* model) {
+    if(model->mesh->bvh.nodes != NULL) {
+        return transform_bounds(&model->toWorld, bvh_node_bounds(&model->mesh->bvh.nodes[0]));
+    }
+    AABB box = aabb_empty();
+    for(int i = 0; i < model->mesh->vertexCount; i++) {
+        box = aabb_grow(box, transform_point(&model->toWorld, model->mesh->vertices[i]));
+    }
+    return box;
 }
 
 Ray ray_create(Vec3 origin, Vec3 direction) {
@@ -211,11 +589,19 @@ Ray ray_create(Vec3 origin, Vec3 direction) {
     return ray;
 }
 
+// The direction is not normalized, so distances along the ray are the same
+// in both spaces and hits can be compared across models
+Ray model_object_ray(const Model* model, Ray ray) {
+    return ray_create(transform_point(&model->toObject, ray.origin), transform_vector(&model->toObject, ray.direction));
+}
+
 HitInfo hitInfo_create() {
     HitInfo info;
-    info.hasHit = 0;
     info.hitDistance = FLT_MAX;
-    info.material = material_create(vec3_build(0.0f, 0.0f, 0.0f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, NULL);
+    info.object = -1;
+    info.prim = -1;
+    info.u = 0.0f;
+    info.v = 0.0f;
     return info;
 }
 
@@ -223,143 +609,224 @@ Vec3 ray_hit_position(Ray ray, float t) {
     return vec3_add(ray.origin, vec3_mul(ray.direction, t));
 }
 
-void sphere_intersect(Sphere sphere, Ray ray, HitInfo* info) {
-    //printf("Sphere Intersect test\n");
-    Vec3 oc = vec3_sub(sphere.center, ray.origin);
-    float a = vec3_dot(ray.direction, ray.direction);
-    float b = -2.0f * vec3_dot(ray.direction, oc);
-    float c = vec3_dot(oc, oc) - sphere.radius * sphere.radius;
+// Distance along the ray to where it enters the sphere. Returns 0 when it
+// misses it or enters it behind its origin.
+int sphere_hit_distance(const Sphere* sphere, const Ray* ray, float* t) {
+    Vec3 oc = vec3_sub(sphere->center, ray->origin);
+    float a = vec3_dot(ray->direction, ray->direction);
+    float b = -2.0f * vec3_dot(ray->direction, oc);
+    float c = vec3_dot(oc, oc) - sphere->radius * sphere->radius;
     float discriminant = b * b - 4 * a * c;
 
     if(discriminant >= 0) {
         float tMin = (-b - sqrt(discriminant)) / (2.0f * a);
-        if(tMin > 0.0f && tMin < info->hitDistance) {
-            info->hitDistance = tMin;
-            info->material = sphere.material;
-            info->hasHit = 1;
-            Vec3 hitPosition = ray_hit_position(ray, tMin);
-            info->hitPosition = hitPosition;
-            info->normal = vec3_normalize(vec3_sub(hitPosition, sphere.center));
-
-            float theta = acos(hitPosition.y / sphere.radius);
-            float phi = atan2(hitPosition.x, hitPosition.z);
-            if(phi < 0.0f) {
-                phi += 2 * PI;
-            }
-
-            float u = phi / (2.0f * PI);
-            float v = theta / PI;
-            info->uv = vec2_build(u, v);
+        if(tMin > 0.0f) {
+            *t = tMin;
+            return 1;
         }
     }
+    return 0;
 }
 
-void face_intersect(Vec3* verts, Vec3* norms, Vec2* uvs, Ray ray, HitInfo* info, Material mat) {
-    Vec3 p1 = verts[0];
-    Vec3 p2 = verts[1];
-    Vec3 p3 = verts[2];
-    Vec3 e1 = vec3_sub(p2, p1);
-    Vec3 e2 = vec3_sub(p3, p1);
-    Vec3 q = vec3_cross(ray.direction, e2);
-    float a = vec3_dot(e1, q);
-    if(a > -EPSILON && a < EPSILON) {
-        return;
+void sphere_intersect(const Sphere* sphere, const Ray* ray, HitInfo* info) {
+    COUNTER_INC(COUNTER_SPHERE_TESTS);
+    float t;
+    if(sphere_hit_distance(sphere, ray, &t) && t < info->hitDistance) {
+        COUNTER_INC(COUNTER_SPHERE_HITS);
+        info->hitDistance = t;
+        info->prim = -1;
     }
+}
 
-    float f = 1/a;
-    Vec3 s = vec3_sub(ray.origin, p1);
-    float u = f * vec3_dot(s, q);
-
-    if(u < 0) {
-        return;
+SurfaceHit sphere_surface(const Sphere* sphere, Ray ray, float t) {
+    SurfaceHit surface;
+    Vec3 hitPosition = ray_hit_position(ray, t);
+    surface.position = hitPosition;
+    surface.normal = vec3_normalize(vec3_sub(hitPosition, sphere->center));
+    surface.material = sphere->material;
+
+    float theta = acos(hitPosition.y / sphere->radius);
+    float phi = atan2(hitPosition.x, hitPosition.z);
+    if(phi < 0.0f) {
+        phi += 2 * PI;
     }
 
-    Vec3 r = vec3_cross(s, e1);
-    float v = f * vec3_dot(ray.direction, r);
+    float u = phi / (2.0f * PI);
+    float v = theta / PI;
+    surface.uv = vec2_build(u, v);
+    // The whole uv square is spread over the sphere
+    surface.uvScale = 1.0f / (2.0f * sphere->radius * sqrtf(PI));
+    return surface;
+}
 
-    if(v < 0 || u + v > 1) {
-        return;
+WatertightRay watertight_ray_create(Vec3 direction) {
+    WatertightRay wr;
+    float d[3] = { direction.x, direction.y, direction.z };
+    wr.kz = 0;
+    if(fabsf(d[1]) > fabsf(d[wr.kz])) {
+        wr.kz = 1;
+    }
+    if(fabsf(d[2]) > fabsf(d[wr.kz])) {
+        wr.kz = 2;
+    }
+    wr.kx = (wr.kz + 1) % 3;
+    wr.ky = (wr.kx + 1) % 3;
+    // Swap to keep the winding of the triangles when looking down -kz
+    if(d[wr.kz] < 0.0f) {
+        int tmp = wr.kx;
+        wr.kx = wr.ky;
+        wr.ky = tmp;
     }
+    wr.sx = d[wr.kx] / d[wr.kz];
+    wr.sy = d[wr.ky] / d[wr.kz];
+    wr.sz = 1.0f / d[wr.kz];
+    return wr;
+}
 
-    float t = f * vec3_dot(e2, r);
+// Watertight ray/triangle test (Woop et al. 2013) on triangle i of tris.
+// Only front faces are hit, like before. Only the distance, the triangle and
+// its barycentric coordinates are recorded, see triangle_surface.
+void face_intersect(const TriangleSoA* tris, int i, const WatertightRay* wr, Ray ray, HitInfo* info) {
+    COUNTER_INC(COUNTER_TRIANGLE_TESTS);
+    float o[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    float a[3] = { tris->x[0][i] - o[0], tris->y[0][i] - o[1], tris->z[0][i] - o[2] };
+    float b[3] = { tris->x[1][i] - o[0], tris->y[1][i] - o[1], tris->z[1][i] - o[2] };
+    float c[3] = { tris->x[2][i] - o[0], tris->y[2][i] - o[1], tris->z[2][i] - o[2] };
+
+    float ax = a[wr->kx] - wr->sx * a[wr->kz];
+    float ay = a[wr->ky] - wr->sy * a[wr->kz];
+    float bx = b[wr->kx] - wr->sx * b[wr->kz];
+    float by = b[wr->ky] - wr->sy * b[wr->kz];
+    float cx = c[wr->kx] - wr->sx * c[wr->kz];
+    float cy = c[wr->ky] - wr->sy * c[wr->kz];
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+
+    // Edges going exactly through the ray are decided in double precision
+    if(u == 0.0f || v == 0.0f || w == 0.0f) {
+        u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+        v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+        w = (float)((double)bx * (double)ay - (double)by * (double)ax);
+    }
 
-    if(t < 0 || t > info->hitDistance) {
+    if(u < 0.0f || v < 0.0f || w < 0.0f) {
         return;
     }
 
-    if(vec3_dot(ray.direction, vec3_cross(e1, e2)) > 0) {
+    float det = u + v + w;
+    if(det == 0.0f) {
         return;
     }
 
-    info->hasHit = 1;
-    info->hitDistance = t;
-    info->hitPosition = ray_hit_position(ray, t);
-    info->material = mat;
-    
-    Vec2 uvA = uvs[0];
-    Vec2 uvB = uvs[1];
-    Vec2 uvC = uvs[2];
+    float az = wr->sz * a[wr->kz];
+    float bz = wr->sz * b[wr->kz];
+    float cz = wr->sz * c[wr->kz];
+    float t = u * az + v * bz + w * cz;
 
-    Vec3 normA = norms[0];
-    Vec3 normB = norms[1];
-    Vec3 normC = norms[2];
+    if(t < 0.0f || t > info->hitDistance * det) {
+        return;
+    }
 
-    Vec3 v0 = vec3_sub(p2, p1);
-    Vec3 v1 = vec3_sub(p3, p1);
-    Vec3 v2 = vec3_sub(info->hitPosition, p1);
+    float invDet = 1.0f / det;
+    COUNTER_INC(COUNTER_TRIANGLE_HITS);
+    info->hitDistance = t * invDet;
+    info->prim = i;
+    info->u = u * invDet;
+    info->v = v * invDet;
+}
 
-    float d00 = vec3_dot(v0, v0);
-    float d01 = vec3_dot(v0, v1);
-    float d11 = vec3_dot(v1, v1);
-    float d20 = vec3_dot(v2, v0);
-    float d21 = vec3_dot(v2, v1);
-    float denom = d00 * d11 - d01 * d01;
+// Shading attributes of a compact triangle, decoded from its vertices
+TriangleShading triangle_decode_shading(const TriangleSoA* tris, int i) {
+    TriangleShading shading;
+    Vec3 p[3];
+    for(int k = 0; k < 3; k++) {
+        const CompactVertex* vertex = &tris->vertices[tris->indices[3 * i + k]];
+        p[k] = dequantize_position(&tris->grid, vertex->position);
+        shading.uvs[k] = vec2_build(half_to_float(vertex->uv[0]), half_to_float(vertex->uv[1]));
+        shading.normals[k] = octahedral_decode(vertex->normal);
+    }
+    shading.uvScale = triangle_uv_scale(p, shading.uvs);
+    return shading;
+}
 
-    float baryV = (d11 * d20 - d01 * d21) / denom;
-    float baryW = (d00 * d21 - d01 * d20) / denom;
-    float baryU = 1.0f - baryV - baryW;
+SurfaceHit triangle_surface(const TriangleSoA* tris, int i, float baryU, float baryV, Ray ray, float t, int material) {
+    SurfaceHit surface;
+    float baryW = 1.0f - baryU - baryV;
+    surface.position = ray_hit_position(ray, t);
+    surface.material = material;
 
-    float texU = baryU * uvA.x + baryV * uvB.x + baryW * uvC.x;
-    float texV = baryU * uvA.y + baryV * uvB.y + baryW * uvC.y;
+    TriangleShading decoded;
+    const TriangleShading* shading = &decoded;
+    if(tris->shading != NULL) {
+        shading = &tris->shading[i];
+    }
+    else {
+        decoded = triangle_decode_shading(tris, i);
+    }
+    float texU = baryU * shading->uvs[0].x + baryV * shading->uvs[1].x + baryW * shading->uvs[2].x;
+    float texV = baryU * shading->uvs[0].y + baryV * shading->uvs[1].y + baryW * shading->uvs[2].y;
 
-    float normX = baryU * normA.x + baryV * normB.x + baryW * normC.x;
-    float normY = baryU * normA.y + baryV * normB.y + baryW * normC.y;
-    float normZ = baryU * normA.z + baryV * normB.z + baryW * normC.z;
+    float normX = baryU * shading->normals[0].x + baryV * shading->normals[1].x + baryW * shading->normals[2].x;
+    float normY = baryU * shading->normals[0].y + baryV * shading->normals[1].y + baryW * shading->normals[2].y;
+    float normZ = baryU * shading->normals[0].z + baryV * shading->normals[1].z + baryW * shading->normals[2].z;
 
-    info->uv = vec2_build(texU, texV);
-    info->normal = vec3_normalize(vec3_build(normX, normY, normZ));
+    surface.uv = vec2_build(texU, texV);
+    surface.uvScale = shading->uvScale;
+    surface.normal = vec3_normalize(vec3_build(normX, normY, normZ));
+    return surface;
 }
 
-void mesh_intersect(Model model, Ray ray, HitInfo* info) {
-    Mesh mesh = model.mesh;
-    for(int i = 0; i < mesh.faceCount; i++) {
-        Face face = mesh.faces[i];
-        Vec3* verts = malloc(3 * sizeof(Vec3));
-        Vec3* norms = malloc(3 * sizeof(Vec3));
-        Vec2* uvs = malloc(3 * sizeof(Vec2));
-        verts[0] = mesh.vertices[face.v[0]];
-        verts[1] = mesh.vertices[face.v[1]];
-        verts[2] = mesh.vertices[face.v[2]];
-        norms[0] = mesh.normals[face.vn[0]];
-        norms[1] = mesh.normals[face.vn[1]];
-        norms[2] = mesh.normals[face.vn[2]];
-        uvs[0] = mesh.uvs[face.vt[0]];
-        uvs[1] = mesh.uvs[face.vt[1]];
-        uvs[2] = mesh.uvs[face.vt[2]];
-
-        face_intersect(verts, norms, uvs, ray, info, model.material);
+typedef struct MeshLeafContext {
+    const Mesh* mesh;
+    Ray ray;
+    WatertightRay wr;
+    HitInfo* info;
+} MeshLeafContext;
+
+void mesh_leaf_intersect(void* ctx, const int* prims, int count) {
+    MeshLeafContext* leaf = (MeshLeafContext*)ctx;
+    // The triangles are stored in leaf order, so the leaf is a contiguous range
+    int first = (int)(prims - leaf->mesh->bvh.primIndices);
+    for(int i = first; i < first + count; i++) {
+        face_intersect(&leaf->mesh->tris, i, &leaf->wr, leaf->ray, leaf->info);
+    }
+}
 
-        free(verts);
-        free(norms);
-        free(uvs);
+void mesh_intersect(const Model* model, Ray ray, HitInfo* info) {
+    if(model->mesh->tris.count == 0) {
+        return;
     }
+    MeshLeafContext ctx;
+    ctx.mesh = model->mesh;
+    ctx.ray = model_object_ray(model, ray);
+    ctx.wr = watertight_ray_create(ctx.ray.direction);
+    ctx.info = info;
+    bvh_intersect(&model->mesh->bvh, ctx.ray.origin, ctx.ray.direction, &info->hitDistance, mesh_leaf_intersect, &ctx);
+}
+
+// Surface of a model at a hit found by mesh_intersect, back in world space
+SurfaceHit model_surface(const Model* model, int prim, float baryU, float baryV, Ray ray, float t) {
+    SurfaceHit surface = triangle_surface(&model->mesh->tris, prim, baryU, baryV, model_object_ray(model, ray), t, model->material);
+    surface.position = ray_hit_position(ray, t);
+    surface.normal = vec3_normalize(transform_normal(&model->toObject, surface.normal));
+    // Texels are spread over a surface scaled with the model
+    surface.uvScale /= model->scale;
+    return surface;
 }
 
 void freeMesh(Mesh *mesh) {
-    free(mesh->vertices);
-    free(mesh->normals);
-    free(mesh->uvs);
-    free(mesh->faces);
+    mesh_free_array(mesh, mesh->vertices);
+    mesh_free_array(mesh, mesh->normals);
+    mesh_free_array(mesh, mesh->uvs);
+    mesh_free_array(mesh, mesh->faces);
+    mesh_free_array(mesh, mesh->compactVertices);
+    mesh_release_accel(mesh);
+    if(mesh->mapping != NULL) {
+        munmap(mesh->mapping, mesh->mappingSize);
+        mesh->mapping = NULL;
+    }
 }
 
 #endif /* GEOMETR_H */
\ No newline at end of file
@@ -0,0 +1,146 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "Vectors.h"
+
+// Encodings used by compact meshes: half floats for uvs, octahedral normals
+// in two 16 bit snorms, and positions on a 16 bit grid spanning the mesh
+// bounds. Encoding is only done when a mesh is built, decoding when a hit
+// is shaded.
+
+// Rounds to the nearest half, ties to even. Too large values become infinity.
+uint16_t float_to_half(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    uint32_t exponent = (bits >> 23) & 0xffu;
+    uint32_t mantissa = bits & 0x7fffffu;
+    if(exponent == 0xffu) {
+        return (uint16_t)(sign | 0x7c00u | (mantissa != 0 ? 0x200u : 0u));
+    }
+    int e = (int)exponent - 127 + 15;
+    if(e >= 31) {
+        return (uint16_t)(sign | 0x7c00u);
+    }
+    if(e <= 0) {
+        // Subnormal half, or zero when too small
+        if(e < -10) {
+            return (uint16_t)sign;
+        }
+        mantissa |= 0x800000u;
+        int shift = 14 - e;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1u);
+        uint32_t halfway = 1u << (shift - 1);
+        if(rest > halfway || (rest == halfway && (half & 1u))) {
+            half++;
+        }
+        return (uint16_t)(sign | half);
+    }
+    uint32_t half = ((uint32_t)e << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fffu;
+    // A carry out of the mantissa correctly bumps the exponent
+    if(rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+        half++;
+    }
+    return (uint16_t)(sign | half);
+}
+
+float half_to_float(uint16_t half) {
+    uint32_t sign = (uint32_t)(half & 0x8000u) << 16;
+    uint32_t exponent = (half >> 10) & 0x1fu;
+    uint32_t mantissa = half & 0x3ffu;
+    if(exponent == 0) {
+        float value = (float)mantissa * (1.0f / 16777216.0f);
+        return sign != 0 ? -value : value;
+    }
+    uint32_t bits = exponent == 0x1fu ? (sign | 0x7f800000u | (mantissa << 13)) : (sign | ((exponent + 112u) << 23) | (mantissa << 13));
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+uint16_t snorm16_encode(float value) {
+    value = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+    return (uint16_t)(int16_t)lrintf(value * 32767.0f);
+}
+
+float snorm16_decode(uint16_t value) {
+    float decoded = (float)(int16_t)value * (1.0f / 32767.0f);
+    return decoded < -1.0f ? -1.0f : decoded;
+}
+
+// Folds the lower half of the octahedron over the upper one
+void octahedral_wrap(float* u, float* v) {
+    float wrappedU = (1.0f - fabsf(*v)) * (*u >= 0.0f ? 1.0f : -1.0f);
+    float wrappedV = (1.0f - fabsf(*u)) * (*v >= 0.0f ? 1.0f : -1.0f);
+    *u = wrappedU;
+    *v = wrappedV;
+}
+
+// Unit vector projected on the octahedron |x| + |y| + |z| = 1, then unfolded
+// on the square [-1, 1]^2
+uint32_t octahedral_encode(Vec3 n) {
+    float length = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    if(!(length > 0.0f)) {
+        return 0;
+    }
+    float u = n.x / length;
+    float v = n.y / length;
+    if(n.z < 0.0f) {
+        octahedral_wrap(&u, &v);
+    }
+    return (uint32_t)snorm16_encode(u) | ((uint32_t)snorm16_encode(v) << 16);
+}
+
+Vec3 octahedral_decode(uint32_t encoded) {
+    float u = snorm16_decode((uint16_t)(encoded & 0xffffu));
+    float v = snorm16_decode((uint16_t)(encoded >> 16));
+    float z = 1.0f - fabsf(u) - fabsf(v);
+    if(z < 0.0f) {
+        octahedral_wrap(&u, &v);
+    }
+    return vec3_normalize(vec3_build(u, v, z));
+}
+
+// Grid of 65536 steps per axis over a box. Axes where the box is flat get a
+// step of 0 and every position decodes to the minimum.
+typedef struct QuantizeGrid {
+    Vec3 origin;
+    Vec3 step;
+} QuantizeGrid;
+
+QuantizeGrid quantize_grid_create(Vec3 min, Vec3 max) {
+    QuantizeGrid grid;
+    grid.origin = min;
+    grid.step = vec3_mul(vec3_sub(max, min), 1.0f / 65535.0f);
+    return grid;
+}
+
+uint16_t quantize_axis(float value, float origin, float step) {
+    if(!(step > 0.0f)) {
+        return 0;
+    }
+    float q = rintf((value - origin) / step);
+    return (uint16_t)(q < 0.0f ? 0.0f : (q > 65535.0f ? 65535.0f : q));
+}
+
+void quantize_position(const QuantizeGrid* grid, Vec3 p, uint16_t out[3]) {
+    out[0] = quantize_axis(p.x, grid->origin.x, grid->step.x);
+    out[1] = quantize_axis(p.y, grid->origin.y, grid->step.y);
+    out[2] = quantize_axis(p.z, grid->origin.z, grid->step.z);
+}
+
+Vec3 dequantize_position(const QuantizeGrid* grid, const uint16_t q[3]) {
+    return vec3_build(grid->origin.x + (float)q[0] * grid->step.x,
+                      grid->origin.y + (float)q[1] * grid->step.y,
+                      grid->origin.z + (float)q[2] * grid->step.z);
+}
+
+#endif /* QUANTIZE_H */
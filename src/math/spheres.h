@@ -0,0 +1,230 @@
+#ifndef SPHERES_H
+#define SPHERES_H
+
+#pragma once
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "geometry.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPHERES_SIMD 1
+#else
+#define SPHERES_SIMD 0
+#endif
+
+// Sphere geometry in structure of arrays form for the top level BVH: slot i
+// holds the object at position i of its primIndices, so the objects of a
+// leaf are a run of slots and up to BVH_MAX_LEAF_PRIMS spheres are tested
+// at once with SSE, AVX2 or AVX-512, picked at runtime. Slots of models and
+// the padding past the last one hold NaN, which no ray hits.
+// The kernels only pick the spheres a ray may hit before tMax, with some
+// slack for rounding differences. Those are tested again with
+// sphere_hit_distance, so hits are exactly the ones of the scalar test.
+
+#define SPHERES_PADDING 16
+// Relative rounding slack of the candidate test
+#define SPHERES_SLACK 1e-5f
+
+typedef struct SphereSoA {
+    float* centerX;
+    float* centerY;
+    float* centerZ;
+    float* radius2;
+    int count;
+    int capacity;
+} SphereSoA;
+
+typedef struct SphereKernels {
+    const char* name;
+    // Spheres tested by one instruction, also how cheap the BVH builder
+    // takes a sphere to be
+    int width;
+    // Bit i is set when the ray may hit the sphere in slot first + i before
+    // tMax. count is at most BVH_MAX_LEAF_PRIMS.
+    unsigned int (*candidates)(const SphereSoA* soa, int first, int count, const Ray* ray, float tMax);
+} SphereKernels;
+
+// Makes room for count slots, every slot left empty. Returns 0 when it
+// cannot be allocated.
+int sphere_soa_reset(SphereSoA* soa, int count) {
+    if(count + SPHERES_PADDING > soa->capacity) {
+        free(soa->centerX);
+        int capacity = count + SPHERES_PADDING;
+        // One block, the four arrays each start on a cache line
+        size_t stride = ((size_t)capacity + 15) & ~(size_t)15;
+        soa->centerX = (float*)aligned_alloc(64, 4 * stride * sizeof(float));
+        if(soa->centerX == NULL) {
+            perror("Failed to allocate sphere slots");
+            memset(soa, 0, sizeof(SphereSoA));
+            return 0;
+        }
+        soa->centerY = soa->centerX + stride;
+        soa->centerZ = soa->centerY + stride;
+        soa->radius2 = soa->centerZ + stride;
+        soa->capacity = capacity;
+    }
+    soa->count = count;
+    for(int i = 0; i < soa->capacity; i++) {
+        soa->centerX[i] = NAN;
+        soa->centerY[i] = NAN;
+        soa->centerZ[i] = NAN;
+        soa->radius2[i] = NAN;
+    }
+    return 1;
+}
+
+void sphere_soa_set(SphereSoA* soa, int slot, const Sphere* sphere) {
+    soa->centerX[slot] = sphere->center.x;
+    soa->centerY[slot] = sphere->center.y;
+    soa->centerZ[slot] = sphere->center.z;
+    soa->radius2[slot] = sphere->radius * sphere->radius;
+}
+
+void freeSphereSoA(SphereSoA* soa) {
+    free(soa->centerX);
+    memset(soa, 0, sizeof(SphereSoA));
+}
+
+// Same quantities as sphere_hit_distance, with the distances in float
+unsigned int sphere_candidates_scalar(const SphereSoA* soa, int first, int count, const Ray* ray, float tMax) {
+    float a = vec3_dot(ray->direction, ray->direction);
+    unsigned int mask = 0;
+    for(int i = 0; i < count; i++) {
+        int slot = first + i;
+        Vec3 oc = vec3_build(soa->centerX[slot] - ray->origin.x, soa->centerY[slot] - ray->origin.y, soa->centerZ[slot] - ray->origin.z);
+        float b = -2.0f * vec3_dot(ray->direction, oc);
+        float c = vec3_dot(oc, oc) - soa->radius2[slot];
+        float discriminant = b * b - 4 * a * c;
+        if(!(discriminant >= -SPHERES_SLACK * (b * b + fabsf(4 * a * c)))) {
+            continue;
+        }
+        float root = sqrtf(fmaxf(discriminant, 0.0f));
+        float slack = SPHERES_SLACK * (fabsf(b) + root);
+        if(-b - root <= tMax * (2.0f * a) + slack && -b + root > -slack) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+#if SPHERES_SIMD
+
+unsigned int sphere_candidates_sse(const SphereSoA* soa, int first, int count, const Ray* ray, float tMax) {
+    __m128 ox = _mm_set1_ps(ray->origin.x), oy = _mm_set1_ps(ray->origin.y), oz = _mm_set1_ps(ray->origin.z);
+    __m128 dx = _mm_set1_ps(ray->direction.x), dy = _mm_set1_ps(ray->direction.y), dz = _mm_set1_ps(ray->direction.z);
+    float a = vec3_dot(ray->direction, ray->direction);
+    __m128 fourA = _mm_set1_ps(4 * a);
+    __m128 limit = _mm_set1_ps(tMax * (2.0f * a));
+    __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    unsigned int mask = 0;
+    for(int i = 0; i < count; i += 4) {
+        int slot = first + i;
+        __m128 ocx = _mm_sub_ps(_mm_loadu_ps(&soa->centerX[slot]), ox);
+        __m128 ocy = _mm_sub_ps(_mm_loadu_ps(&soa->centerY[slot]), oy);
+        __m128 ocz = _mm_sub_ps(_mm_loadu_ps(&soa->centerZ[slot]), oz);
+        __m128 b = _mm_mul_ps(_mm_set1_ps(-2.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz)));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_loadu_ps(&soa->radius2[slot]));
+        __m128 bb = _mm_mul_ps(b, b);
+        __m128 fourAC = _mm_mul_ps(fourA, c);
+        __m128 discriminant = _mm_sub_ps(bb, fourAC);
+        __m128 hit = _mm_cmpge_ps(discriminant, _mm_mul_ps(_mm_set1_ps(-SPHERES_SLACK), _mm_add_ps(bb, _mm_and_ps(fourAC, absMask))));
+        __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+        __m128 slack = _mm_mul_ps(_mm_set1_ps(SPHERES_SLACK), _mm_add_ps(_mm_and_ps(b, absMask), root));
+        __m128 minusB = _mm_sub_ps(_mm_setzero_ps(), b);
+        hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_sub_ps(minusB, root), _mm_add_ps(limit, slack)));
+        hit = _mm_and_ps(hit, _mm_cmpgt_ps(_mm_add_ps(minusB, root), _mm_sub_ps(_mm_setzero_ps(), slack)));
+        mask |= (unsigned int)_mm_movemask_ps(hit) << i;
+    }
+    return mask & ((1u << count) - 1u);
+}
+
+__attribute__((target("avx2")))
+unsigned int sphere_candidates_avx2(const SphereSoA* soa, int first, int count, const Ray* ray, float tMax) {
+    __m256 ox = _mm256_set1_ps(ray->origin.x), oy = _mm256_set1_ps(ray->origin.y), oz = _mm256_set1_ps(ray->origin.z);
+    __m256 dx = _mm256_set1_ps(ray->direction.x), dy = _mm256_set1_ps(ray->direction.y), dz = _mm256_set1_ps(ray->direction.z);
+    float a = vec3_dot(ray->direction, ray->direction);
+    __m256 fourA = _mm256_set1_ps(4 * a);
+    __m256 limit = _mm256_set1_ps(tMax * (2.0f * a));
+    __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    unsigned int mask = 0;
+    for(int i = 0; i < count; i += 8) {
+        int slot = first + i;
+        __m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(&soa->centerX[slot]), ox);
+        __m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(&soa->centerY[slot]), oy);
+        __m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(&soa->centerZ[slot]), oz);
+        __m256 b = _mm256_mul_ps(_mm256_set1_ps(-2.0f), _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_loadu_ps(&soa->radius2[slot]));
+        __m256 bb = _mm256_mul_ps(b, b);
+        __m256 fourAC = _mm256_mul_ps(fourA, c);
+        __m256 discriminant = _mm256_sub_ps(bb, fourAC);
+        __m256 hit = _mm256_cmp_ps(discriminant, _mm256_mul_ps(_mm256_set1_ps(-SPHERES_SLACK), _mm256_add_ps(bb, _mm256_and_ps(fourAC, absMask))), _CMP_GE_OQ);
+        __m256 root = _mm256_sqrt_ps(_mm256_max_ps(discriminant, _mm256_setzero_ps()));
+        __m256 slack = _mm256_mul_ps(_mm256_set1_ps(SPHERES_SLACK), _mm256_add_ps(_mm256_and_ps(b, absMask), root));
+        __m256 minusB = _mm256_sub_ps(_mm256_setzero_ps(), b);
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_sub_ps(minusB, root), _mm256_add_ps(limit, slack), _CMP_LE_OQ));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(minusB, root), _mm256_sub_ps(_mm256_setzero_ps(), slack), _CMP_GT_OQ));
+        mask |= (unsigned int)_mm256_movemask_ps(hit) << i;
+    }
+    return mask & ((1u << count) - 1u);
+}
+
+__attribute__((target("avx512f")))
+unsigned int sphere_candidates_avx512(const SphereSoA* soa, int first, int count, const Ray* ray, float tMax) {
+    __m512 ox = _mm512_set1_ps(ray->origin.x), oy = _mm512_set1_ps(ray->origin.y), oz = _mm512_set1_ps(ray->origin.z);
+    __m512 dx = _mm512_set1_ps(ray->direction.x), dy = _mm512_set1_ps(ray->direction.y), dz = _mm512_set1_ps(ray->direction.z);
+    float a = vec3_dot(ray->direction, ray->direction);
+    __m512 fourA = _mm512_set1_ps(4 * a);
+    __m512 limit = _mm512_set1_ps(tMax * (2.0f * a));
+    // A leaf holds at most 16 spheres, one pass covers it
+    __m512 ocx = _mm512_sub_ps(_mm512_loadu_ps(&soa->centerX[first]), ox);
+    __m512 ocy = _mm512_sub_ps(_mm512_loadu_ps(&soa->centerY[first]), oy);
+    __m512 ocz = _mm512_sub_ps(_mm512_loadu_ps(&soa->centerZ[first]), oz);
+    __m512 b = _mm512_mul_ps(_mm512_set1_ps(-2.0f), _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, ocx), _mm512_mul_ps(dy, ocy)), _mm512_mul_ps(dz, ocz)));
+    __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz)), _mm512_loadu_ps(&soa->radius2[first]));
+    __m512 bb = _mm512_mul_ps(b, b);
+    __m512 fourAC = _mm512_mul_ps(fourA, c);
+    __m512 discriminant = _mm512_sub_ps(bb, fourAC);
+    __mmask16 hit = _mm512_cmp_ps_mask(discriminant, _mm512_mul_ps(_mm512_set1_ps(-SPHERES_SLACK), _mm512_add_ps(bb, _mm512_abs_ps(fourAC))), _CMP_GE_OQ);
+    __m512 root = _mm512_sqrt_ps(_mm512_max_ps(discriminant, _mm512_setzero_ps()));
+    __m512 slack = _mm512_mul_ps(_mm512_set1_ps(SPHERES_SLACK), _mm512_add_ps(_mm512_abs_ps(b), root));
+    __m512 minusB = _mm512_sub_ps(_mm512_setzero_ps(), b);
+    hit &= _mm512_cmp_ps_mask(_mm512_sub_ps(minusB, root), _mm512_add_ps(limit, slack), _CMP_LE_OQ);
+    hit &= _mm512_cmp_ps_mask(_mm512_add_ps(minusB, root), _mm512_sub_ps(_mm512_setzero_ps(), slack), _CMP_GT_OQ);
+    return (unsigned int)hit & ((1u << count) - 1u);
+}
+
+#endif /* SPHERES_SIMD */
+
+// Picks the widest kernel the CPU supports
+SphereKernels sphere_select_kernels() {
+    SphereKernels kernels;
+    kernels.name = "scalar";
+    kernels.width = 1;
+    kernels.candidates = sphere_candidates_scalar;
+#if SPHERES_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        kernels.name = "AVX-512";
+        kernels.width = 16;
+        kernels.candidates = sphere_candidates_avx512;
+    }
+    else if(__builtin_cpu_supports("avx2")) {
+        kernels.name = "AVX2";
+        kernels.width = 8;
+        kernels.candidates = sphere_candidates_avx2;
+    }
+    else {
+        kernels.name = "SSE";
+        kernels.width = 4;
+        kernels.candidates = sphere_candidates_sse;
+    }
+#endif
+    return kernels;
+}
+
+#endif /* SPHERES_H */
@@ -0,0 +1,148 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#pragma once
+
+#include <math.h>
+
+#include "Vectors.h"
+#include "bvh.h"
+
+// Affine transforms stored as the top three rows of a 4x4 matrix, m[row][3]
+// being the translation. Points are column vectors: p' = M p.
+
+typedef struct Transform {
+    float m[3][4];
+} Transform;
+
+Transform transform_identity() {
+    Transform t;
+    for(int row = 0; row < 3; row++) {
+        for(int col = 0; col < 4; col++) {
+            t.m[row][col] = row == col ? 1.0f : 0.0f;
+        }
+    }
+    return t;
+}
+
+Transform transform_translation(Vec3 offset) {
+    Transform t = transform_identity();
+    t.m[0][3] = offset.x;
+    t.m[1][3] = offset.y;
+    t.m[2][3] = offset.z;
+    return t;
+}
+
+Transform transform_scale(Vec3 scale) {
+    Transform t = transform_identity();
+    t.m[0][0] = scale.x;
+    t.m[1][1] = scale.y;
+    t.m[2][2] = scale.z;
+    return t;
+}
+
+// Rotation by angles in degrees around x, then y, then z
+Transform transform_rotation(Vec3 degrees) {
+    float cx = cosf(deg2rad(degrees.x)), sx = sinf(deg2rad(degrees.x));
+    float cy = cosf(deg2rad(degrees.y)), sy = sinf(deg2rad(degrees.y));
+    float cz = cosf(deg2rad(degrees.z)), sz = sinf(deg2rad(degrees.z));
+    Transform t = transform_identity();
+    t.m[0][0] = cy * cz;
+    t.m[0][1] = sx * sy * cz - cx * sz;
+    t.m[0][2] = cx * sy * cz + sx * sz;
+    t.m[1][0] = cy * sz;
+    t.m[1][1] = sx * sy * sz + cx * cz;
+    t.m[1][2] = cx * sy * sz - sx * cz;
+    t.m[2][0] = -sy;
+    t.m[2][1] = sx * cy;
+    t.m[2][2] = cx * cy;
+    return t;
+}
+
+// a * b, which applies b first
+Transform transform_multiply(const Transform* a, const Transform* b) {
+    Transform t;
+    for(int row = 0; row < 3; row++) {
+        for(int col = 0; col < 4; col++) {
+            float sum = col == 3 ? a->m[row][3] : 0.0f;
+            for(int k = 0; k < 3; k++) {
+                sum += a->m[row][k] * b->m[k][col];
+            }
+            t.m[row][col] = sum;
+        }
+    }
+    return t;
+}
+
+float transform_determinant(const Transform* t) {
+    const float (*m)[4] = t->m;
+    return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+         - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+         + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+}
+
+// Returns 0 and leaves inverse alone when the transform flattens space
+int transform_invert(const Transform* t, Transform* inverse) {
+    float det = transform_determinant(t);
+    if(det == 0.0f || !isfinite(det)) {
+        return 0;
+    }
+    const float (*m)[4] = t->m;
+    float inv = 1.0f / det;
+    Transform r;
+    r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv;
+    r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv;
+    r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv;
+    r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv;
+    r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv;
+    r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv;
+    r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv;
+    r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv;
+    r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv;
+    for(int row = 0; row < 3; row++) {
+        r.m[row][3] = -(r.m[row][0] * m[0][3] + r.m[row][1] * m[1][3] + r.m[row][2] * m[2][3]);
+    }
+    *inverse = r;
+    return 1;
+}
+
+Vec3 transform_point(const Transform* t, Vec3 p) {
+    return vec3_build(t->m[0][0] * p.x + t->m[0][1] * p.y + t->m[0][2] * p.z + t->m[0][3],
+                      t->m[1][0] * p.x + t->m[1][1] * p.y + t->m[1][2] * p.z + t->m[1][3],
+                      t->m[2][0] * p.x + t->m[2][1] * p.y + t->m[2][2] * p.z + t->m[2][3]);
+}
+
+Vec3 transform_vector(const Transform* t, Vec3 v) {
+    return vec3_build(t->m[0][0] * v.x + t->m[0][1] * v.y + t->m[0][2] * v.z,
+                      t->m[1][0] * v.x + t->m[1][1] * v.y + t->m[1][2] * v.z,
+                      t->m[2][0] * v.x + t->m[2][1] * v.y + t->m[2][2] * v.z);
+}
+
+// Moves a normal out of the space inverse maps to, with the transpose of
+// inverse. The result is not normalized.
+Vec3 transform_normal(const Transform* inverse, Vec3 n) {
+    return vec3_build(inverse->m[0][0] * n.x + inverse->m[1][0] * n.y + inverse->m[2][0] * n.z,
+                      inverse->m[0][1] * n.x + inverse->m[1][1] * n.y + inverse->m[2][1] * n.z,
+                      inverse->m[0][2] * n.x + inverse->m[1][2] * n.y + inverse->m[2][2] * n.z);
+}
+
+Vec3 transform_get_translation(const Transform* t) {
+    return vec3_build(t->m[0][3], t->m[1][3], t->m[2][3]);
+}
+
+// How much lengths grow on average, the cube root of the volume change
+float transform_scale_factor(const Transform* t) {
+    return cbrtf(fabsf(transform_determinant(t)));
+}
+
+// Box around the transformed corners of box
+AABB transform_bounds(const Transform* t, AABB box) {
+    AABB result = aabb_empty();
+    for(int corner = 0; corner < 8; corner++) {
+        Vec3 p = vec3_build(corner & 1 ? box.max.x : box.min.x, corner & 2 ? box.max.y : box.min.y, corner & 4 ? box.max.z : box.min.z);
+        result = aabb_grow(result, transform_point(t, p));
+    }
+    return result;
+}
+
+#endif /* TRANSFORM_H */
@@ -0,0 +1,305 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "math/geometry.h"
+#include "objLoader.h"
+#include "utils/utils.h"
+
+// Parsing an OBJ and building its BVH is done once: the result is written
+// next to the source as "<file>.meshcache", a header followed by the mesh
+// arrays, the BVH and the compiled triangles, each section 64 byte aligned.
+// Loading a cache is a single private mmap with the Mesh pointing straight
+// into it, so nothing is parsed or copied. The cache holds the mesh in object
+// space, the models place it with their transform. It is rebuilt whenever the
+// size or modification time of the OBJ changes, or the layout of the structs
+// does. Compact meshes go to "<file>.compact.meshcache", with the compact
+// vertices in place of the OBJ arrays.
+
+#define MESH_CACHE_MAGIC "PTMESH\0"
+#define MESH_CACHE_VERSION 4
+
+enum {
+    MESH_CACHE_VERTICES,
+    MESH_CACHE_NORMALS,
+    MESH_CACHE_UVS,
+    MESH_CACHE_FACES,
+    MESH_CACHE_NODES,
+    MESH_CACHE_PRIM_INDICES,
+    MESH_CACHE_TRIANGLES,
+    MESH_CACHE_COMPACT_VERTICES,
+    MESH_CACHE_SECTIONS
+};
+
+typedef struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    // Struct sizes, a cache written by a different layout is rejected
+    uint32_t vec3Size, faceSize, nodeSize, shadingSize, compactVertexSize;
+    int32_t compact;
+    // Identifies the OBJ the cache was built from
+    uint64_t sourceSize;
+    int64_t sourceMtimeSec, sourceMtimeNsec;
+    int32_t vertexCount, normalCount, uvCount, faceCount;
+    int32_t nodeCount, primCount;
+    int32_t compactVertexCount;
+    // Quantization grid of a compact mesh
+    float gridOrigin[3], gridStep[3];
+    uint64_t offsets[MESH_CACHE_SECTIONS];
+    uint64_t sizes[MESH_CACHE_SECTIONS];
+    uint64_t fileSize;
+} MeshCacheHeader;
+
+void mesh_cache_path(const char* filename, int compact, char* path, size_t pathSize) {
+    snprintf(path, pathSize, compact ? "%s.compact.meshcache" : "%s.meshcache", filename);
+}
+
+void mesh_cache_header_init(MeshCacheHeader* header, const struct stat* source, int compact) {
+    memset(header, 0, sizeof(MeshCacheHeader));
+    memcpy(header->magic, MESH_CACHE_MAGIC, sizeof(header->magic));
+    header->version = MESH_CACHE_VERSION;
+    header->vec3Size = sizeof(Vec3);
+    header->faceSize = sizeof(Face);
+    header->nodeSize = sizeof(BVHNode);
+    header->shadingSize = sizeof(TriangleShading);
+    header->compactVertexSize = sizeof(CompactVertex);
+    header->compact = compact;
+    header->sourceSize = (uint64_t)source->st_size;
+    header->sourceMtimeSec = (int64_t)source->st_mtim.tv_sec;
+    header->sourceMtimeNsec = (int64_t)source->st_mtim.tv_nsec;
+}
+
+int mesh_cache_header_matches(const MeshCacheHeader* header, const MeshCacheHeader* expected, size_t fileSize) {
+    if(memcmp(header->magic, expected->magic, sizeof(header->magic)) != 0 || header->version != expected->version) {
+        return 0;
+    }
+    if(header->vec3Size != expected->vec3Size || header->faceSize != expected->faceSize ||
+       header->nodeSize != expected->nodeSize || header->shadingSize != expected->shadingSize ||
+       header->compactVertexSize != expected->compactVertexSize || header->compact != expected->compact) {
+        return 0;
+    }
+    if(header->sourceSize != expected->sourceSize || header->sourceMtimeSec != expected->sourceMtimeSec ||
+       header->sourceMtimeNsec != expected->sourceMtimeNsec) {
+        return 0;
+    }
+    if(header->fileSize != fileSize) {
+        return 0;
+    }
+    for(int i = 0; i < MESH_CACHE_SECTIONS; i++) {
+        if(header->offsets[i] % 64 != 0 || header->offsets[i] > fileSize || header->sizes[i] > fileSize - header->offsets[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Points mesh into a mapped cache. Returns 0 when the section sizes do not
+// agree with the counts of the header.
+int mesh_cache_bind(Mesh* mesh, const MeshCacheHeader* header, char* base, size_t size) {
+    const uint64_t* sizes = header->sizes;
+    if(header->vertexCount < 0 || header->normalCount < 0 || header->uvCount < 0 || header->faceCount <= 0 ||
+       header->compactVertexCount < 0 || (header->compact && header->compactVertexCount == 0) ||
+       header->nodeCount < 2 || header->primCount != header->faceCount ||
+       sizes[MESH_CACHE_VERTICES] != (uint64_t)header->vertexCount * sizeof(Vec3) ||
+       sizes[MESH_CACHE_NORMALS] != (uint64_t)header->normalCount * sizeof(Vec3) ||
+       sizes[MESH_CACHE_UVS] != (uint64_t)header->uvCount * sizeof(Vec2) ||
+       sizes[MESH_CACHE_FACES] != (header->compact ? 0 : (uint64_t)header->faceCount * sizeof(Face)) ||
+       sizes[MESH_CACHE_NODES] != (uint64_t)header->nodeCount * sizeof(BVHNode) ||
+       sizes[MESH_CACHE_PRIM_INDICES] != (uint64_t)header->primCount * sizeof(int) ||
+       sizes[MESH_CACHE_COMPACT_VERTICES] != (uint64_t)header->compactVertexCount * sizeof(CompactVertex) ||
+       sizes[MESH_CACHE_TRIANGLES] != triangles_block_bytes(header->faceCount, header->compact)) {
+        return 0;
+    }
+
+    memset(mesh, 0, sizeof(Mesh));
+    mesh->mapping = base;
+    mesh->mappingSize = size;
+    mesh->vertexCount = header->vertexCount;
+    mesh->normalCount = header->normalCount;
+    mesh->uvCount = header->uvCount;
+    mesh->faceCount = header->faceCount;
+    mesh->vertices = (Vec3*)(base + header->offsets[MESH_CACHE_VERTICES]);
+    mesh->normals = (Vec3*)(base + header->offsets[MESH_CACHE_NORMALS]);
+    mesh->uvs = (Vec2*)(base + header->offsets[MESH_CACHE_UVS]);
+    mesh->faces = (Face*)(base + header->offsets[MESH_CACHE_FACES]);
+    mesh->bvh.nodes = (BVHNode*)(base + header->offsets[MESH_CACHE_NODES]);
+    mesh->bvh.primIndices = (int*)(base + header->offsets[MESH_CACHE_PRIM_INDICES]);
+    mesh->bvh.nodeCount = header->nodeCount;
+    mesh->bvh.primCount = header->primCount;
+    triangles_bind(&mesh->tris, base + header->offsets[MESH_CACHE_TRIANGLES], header->faceCount, header->compact);
+    if(header->compact) {
+        // The OBJ arrays are empty, the faces only survive as compiled triangles
+        mesh->vertices = NULL;
+        mesh->normals = NULL;
+        mesh->uvs = NULL;
+        mesh->faces = NULL;
+        mesh->compactVertices = (CompactVertex*)(base + header->offsets[MESH_CACHE_COMPACT_VERTICES]);
+        mesh->compactVertexCount = header->compactVertexCount;
+        mesh->tris.vertices = mesh->compactVertices;
+        mesh->tris.grid.origin = vec3_build(header->gridOrigin[0], header->gridOrigin[1], header->gridOrigin[2]);
+        mesh->tris.grid.step = vec3_build(header->gridStep[0], header->gridStep[1], header->gridStep[2]);
+    }
+    return 1;
+}
+
+// Maps the cache of an OBJ. Returns 0 when there is no usable cache.
+int mesh_cache_load(const char* path, const struct stat* source, int compact, Mesh* mesh) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MeshCacheHeader)) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    // Private and writable, pages are only copied once they are written to
+    // and the file itself never changes
+    char* base = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        perror("Failed to map mesh cache");
+        return 0;
+    }
+
+    MeshCacheHeader expected;
+    mesh_cache_header_init(&expected, source, compact);
+    const MeshCacheHeader* header = (const MeshCacheHeader*)base;
+    if(!mesh_cache_header_matches(header, &expected, size) || !mesh_cache_bind(mesh, header, base, size)) {
+        munmap(base, size);
+        return 0;
+    }
+    madvise(base, size, MADV_WILLNEED);
+    return 1;
+}
+
+int mesh_cache_write_section(FILE* file, uint64_t offset, const void* data, uint64_t size) {
+    if(fseek(file, (long)offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    return size == 0 || fwrite(data, 1, size, file) == size;
+}
+
+// Writes the cache through a temporary file renamed at the end, so a reader
+// never sees a half written cache
+int mesh_cache_save(const char* path, const struct stat* source, const Mesh* mesh) {
+    int compact = mesh->tris.shading == NULL;
+    MeshCacheHeader header;
+    mesh_cache_header_init(&header, source, compact);
+    header.vertexCount = mesh->vertexCount;
+    header.normalCount = mesh->normalCount;
+    header.uvCount = mesh->uvCount;
+    header.faceCount = mesh->faceCount;
+    header.nodeCount = mesh->bvh.nodeCount;
+    header.primCount = mesh->bvh.primCount;
+    header.compactVertexCount = mesh->compactVertexCount;
+    header.gridOrigin[0] = mesh->tris.grid.origin.x;
+    header.gridOrigin[1] = mesh->tris.grid.origin.y;
+    header.gridOrigin[2] = mesh->tris.grid.origin.z;
+    header.gridStep[0] = mesh->tris.grid.step.x;
+    header.gridStep[1] = mesh->tris.grid.step.y;
+    header.gridStep[2] = mesh->tris.grid.step.z;
+
+    const void* data[MESH_CACHE_SECTIONS] = {
+        mesh->vertices, mesh->normals, mesh->uvs, mesh->faces,
+        mesh->bvh.nodes, mesh->bvh.primIndices, mesh->tris.block, mesh->compactVertices
+    };
+    header.sizes[MESH_CACHE_VERTICES] = (uint64_t)mesh->vertexCount * sizeof(Vec3);
+    header.sizes[MESH_CACHE_NORMALS] = (uint64_t)mesh->normalCount * sizeof(Vec3);
+    header.sizes[MESH_CACHE_UVS] = (uint64_t)mesh->uvCount * sizeof(Vec2);
+    header.sizes[MESH_CACHE_FACES] = compact ? 0 : (uint64_t)mesh->faceCount * sizeof(Face);
+    header.sizes[MESH_CACHE_NODES] = (uint64_t)mesh->bvh.nodeCount * sizeof(BVHNode);
+    header.sizes[MESH_CACHE_PRIM_INDICES] = (uint64_t)mesh->bvh.primCount * sizeof(int);
+    header.sizes[MESH_CACHE_TRIANGLES] = triangles_block_bytes(mesh->faceCount, compact);
+    header.sizes[MESH_CACHE_COMPACT_VERTICES] = (uint64_t)mesh->compactVertexCount * sizeof(CompactVertex);
+
+    uint64_t offset = (sizeof(MeshCacheHeader) + 63) & ~(uint64_t)63;
+    for(int i = 0; i < MESH_CACHE_SECTIONS; i++) {
+        header.offsets[i] = offset;
+        offset = (offset + header.sizes[i] + 63) & ~(uint64_t)63;
+    }
+    header.fileSize = offset;
+
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int)getpid());
+    FILE* file = fopen(tmpPath, "wb");
+    if(file == NULL) {
+        perror("Failed to create mesh cache");
+        return 0;
+    }
+    int ok = fwrite(&header, sizeof(MeshCacheHeader), 1, file) == 1;
+    for(int i = 0; i < MESH_CACHE_SECTIONS && ok; i++) {
+        ok = mesh_cache_write_section(file, header.offsets[i], data[i], header.sizes[i]);
+    }
+    // Extend the file to the padded size of the last section
+    ok = ok && ftruncate(fileno(file), (off_t)header.fileSize) == 0;
+    ok = fclose(file) == 0 && ok;
+    if(!ok || rename(tmpPath, path) != 0) {
+        perror("Failed to write mesh cache");
+        remove(tmpPath);
+        return 0;
+    }
+    return 1;
+}
+
+// Loads an OBJ with its BVH and compiled triangles, from the cache when it is
+// up to date, otherwise by parsing the OBJ and writing a new cache. A compact
+// mesh is built with mesh_build_compact. What is not mapped from the cache is
+// allocated from arena (the C allocator when NULL).
+void mesh_set_source(Mesh* mesh, const struct stat* source) {
+    mesh->sourceSize = (uint64_t)source->st_size;
+    mesh->sourceMtimeSec = (int64_t)source->st_mtim.tv_sec;
+    mesh->sourceMtimeNsec = (int64_t)source->st_mtim.tv_nsec;
+}
+
+int loadObjCached(const char* filename, int compact, Arena* arena, Mesh* mesh) {
+    memset(mesh, 0, sizeof(Mesh));
+    struct stat source;
+    if(stat(filename, &source) != 0) {
+        perror("Failed to open OBJ file");
+        return 0;
+    }
+
+    char path[4096];
+    mesh_cache_path(filename, compact, path, sizeof(path));
+    double start = wallTime();
+    if(mesh_cache_load(path, &source, compact, mesh)) {
+        mesh->arena = arena;
+        mesh_set_source(mesh, &source);
+        printf("Mesh cache: %s, %d triangles, mapped in %.3f ms\n", path, mesh->faceCount, (wallTime() - start) * 1000.0);
+        return 1;
+    }
+
+    // The OBJ arrays of a compact mesh are dropped once it is built, so
+    // they stay out of the arena
+    if(!loadObj(filename, mesh, compact ? NULL : arena)) {
+        return 0;
+    }
+    if(compact) {
+        mesh->arena = arena;
+        mesh_build_compact(mesh);
+    }
+    else {
+        mesh_build_accel(mesh);
+    }
+    mesh_set_source(mesh, &source);
+    if(mesh->tris.count == mesh->faceCount && mesh->faceCount > 0) {
+        if(mesh_cache_save(path, &source, mesh)) {
+            printf("Mesh cache: wrote %s\n", path);
+        }
+    }
+    return 1;
+}
+
+#endif /* MESHCACHE_H */
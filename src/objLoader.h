@@ -0,0 +1,433 @@
+#ifndef OBJLOADER_H
+#define OBJLOADER_H
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "math/geometry.h"
+#include "utils/threadpool.h"
+
+// The OBJ file is memory mapped and cut into chunks at line boundaries.
+// A first parallel pass counts the elements of every chunk, a prefix sum
+// gives each chunk its place in the final arrays, and a second parallel pass
+// parses straight into them. Faces can be "v", "v/vt", "v//vn" or "v/vt/vn",
+// with negative (relative) indices, and polygons are fan triangulated.
+
+// Chunks smaller than this are not worth a thread
+#define OBJ_MIN_CHUNK_SIZE (1 << 20)
+
+typedef struct ObjChunk {
+    const char* start;
+    const char* end;
+    // Elements of the chunk (pass 1), then where they start in the mesh arrays
+    int vertexCount, uvCount, normalCount, faceCount;
+    int vertexOffset, uvOffset, normalOffset, faceOffset;
+    int badLines;
+} ObjChunk;
+
+typedef struct ObjParse {
+    Mesh* mesh;
+    ObjChunk* chunks;
+    int pass;
+} ObjParse;
+
+static const double objPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+const char* obj_skip_spaces(const char* p, const char* end) {
+    while(p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
+
+const char* obj_next_line(const char* p, const char* end) {
+    while(p < end && *p != '\n') {
+        p++;
+    }
+    return p < end ? p + 1 : end;
+}
+
+int obj_is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Parses a decimal float such as "-1.25e-3". Returns NULL if no number starts at p.
+const char* obj_parse_float(const char* p, const char* end, float* out) {
+    p = obj_skip_spaces(p, end);
+    int negative = 0;
+    if(p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    unsigned long long mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    while(p < end && obj_is_digit(*p)) {
+        if(mantissa < 100000000000000000ULL) {
+            mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+        }
+        else {
+            exponent++;
+        }
+        p++;
+        digits++;
+    }
+    if(p < end && *p == '.') {
+        p++;
+        while(p < end && obj_is_digit(*p)) {
+            if(mantissa < 100000000000000000ULL) {
+                mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+                exponent--;
+            }
+            p++;
+            digits++;
+        }
+    }
+    if(digits == 0) {
+        return NULL;
+    }
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        int expNegative = 0;
+        if(q < end && (*q == '-' || *q == '+')) {
+            expNegative = *q == '-';
+            q++;
+        }
+        if(q < end && obj_is_digit(*q)) {
+            int e = 0;
+            while(q < end && obj_is_digit(*q)) {
+                if(e < 10000) {
+                    e = e * 10 + (*q - '0');
+                }
+                q++;
+            }
+            exponent += expNegative ? -e : e;
+            p = q;
+        }
+    }
+
+    double value = (double)mantissa;
+    if(exponent < 0) {
+        value = exponent >= -22 ? value / objPowersOfTen[-exponent] : value * pow(10.0, exponent);
+    }
+    else if(exponent > 0) {
+        value = exponent <= 22 ? value * objPowersOfTen[exponent] : value * pow(10.0, exponent);
+    }
+    *out = (float)(negative ? -value : value);
+    return p;
+}
+
+const char* obj_parse_int(const char* p, const char* end, int* out) {
+    int negative = 0;
+    if(p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if(p >= end || !obj_is_digit(*p)) {
+        return NULL;
+    }
+    long value = 0;
+    while(p < end && obj_is_digit(*p)) {
+        if(value < 1000000000L) {
+            value = value * 10 + (*p - '0');
+        }
+        p++;
+    }
+    *out = (int)(negative ? -value : value);
+    return p;
+}
+
+// Turns a 1-based or negative OBJ index into a 0-based one, -1 if invalid.
+// count is the number of elements declared before the face line.
+int obj_resolve_index(int index, int count) {
+    int resolved = index > 0 ? index - 1 : count + index;
+    return (index != 0 && resolved >= 0 && resolved < count) ? resolved : -1;
+}
+
+// Reads one "v", "v/vt", "v//vn" or "v/vt/vn" face corner. Missing uv or
+// normal indices are set to 0, which obj_resolve_index treats as absent.
+const char* obj_parse_corner(const char* p, const char* end, int* v, int* vt, int* vn) {
+    *vt = 0;
+    *vn = 0;
+    p = obj_parse_int(p, end, v);
+    if(p == NULL) {
+        return NULL;
+    }
+    if(p < end && *p == '/') {
+        p++;
+        if(p < end && *p != '/') {
+            p = obj_parse_int(p, end, vt);
+            if(p == NULL) {
+                return NULL;
+            }
+        }
+        if(p < end && *p == '/') {
+            p = obj_parse_int(p + 1, end, vn);
+            if(p == NULL) {
+                return NULL;
+            }
+        }
+    }
+    return p;
+}
+
+int obj_is_line_end(const char* p, const char* end) {
+    return p >= end || *p == '\n' || *p == '\r' || *p == '#';
+}
+
+int obj_count_corners(const char* p, const char* end) {
+    int corners = 0;
+    while(1) {
+        p = obj_skip_spaces(p, end);
+        if(obj_is_line_end(p, end)) {
+            return corners;
+        }
+        corners++;
+        while(p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+            p++;
+        }
+    }
+}
+
+void obj_parse_chunk(void* ctx, int workerId, int chunkIndex) {
+    (void)workerId;
+    ObjParse* parse = (ObjParse*)ctx;
+    ObjChunk* chunk = &parse->chunks[chunkIndex];
+    Mesh* mesh = parse->mesh;
+    const char* end = chunk->end;
+    int counting = parse->pass == 0;
+
+    // Running element counts, global in the second pass so relative indices resolve
+    int vertices = counting ? 0 : chunk->vertexOffset;
+    int uvs = counting ? 0 : chunk->uvOffset;
+    int normals = counting ? 0 : chunk->normalOffset;
+    int faces = counting ? 0 : chunk->faceOffset;
+    int badLines = 0;
+
+    for(const char* line = chunk->start; line < end; line = obj_next_line(line, end)) {
+        const char* p = obj_skip_spaces(line, end);
+        if(end - p < 2) {
+            continue;
+        }
+        if(p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            if(!counting) {
+                Vec3 v = vec3_build(0.0f, 0.0f, 0.0f);
+                const char* q = obj_parse_float(p + 1, end, &v.x);
+                q = q ? obj_parse_float(q, end, &v.y) : NULL;
+                q = q ? obj_parse_float(q, end, &v.z) : NULL;
+                badLines += q == NULL;
+                mesh->vertices[vertices] = v;
+            }
+            vertices++;
+        }
+        else if(p[0] == 'v' && p[1] == 't' && end - p > 2 && (p[2] == ' ' || p[2] == '\t')) {
+            if(!counting) {
+                Vec2 uv = vec2_build(0.0f, 0.0f);
+                const char* q = obj_parse_float(p + 2, end, &uv.x);
+                badLines += q == NULL;
+                // The v coordinate is optional in OBJ
+                if(q != NULL && obj_parse_float(q, end, &uv.y) == NULL) {
+                    uv.y = 0.0f;
+                }
+                mesh->uvs[uvs] = uv;
+            }
+            uvs++;
+        }
+        else if(p[0] == 'v' && p[1] == 'n' && end - p > 2 && (p[2] == ' ' || p[2] == '\t')) {
+            if(!counting) {
+                Vec3 n = vec3_build(0.0f, 0.0f, 0.0f);
+                const char* q = obj_parse_float(p + 2, end, &n.x);
+                q = q ? obj_parse_float(q, end, &n.y) : NULL;
+                q = q ? obj_parse_float(q, end, &n.z) : NULL;
+                badLines += q == NULL;
+                mesh->normals[normals] = n;
+            }
+            normals++;
+        }
+        else if(p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            int corners = obj_count_corners(p + 1, end);
+            if(corners < 3) {
+                badLines += counting ? 0 : 1;
+                continue;
+            }
+            if(counting) {
+                faces += corners - 2;
+                continue;
+            }
+            // Fan triangulation around the first corner; a broken corner
+            // invalidates every triangle of the polygon
+            Face first = {0}, previous = {0};
+            int valid = 1;
+            const char* q = p + 1;
+            for(int c = 0; c < corners; c++) {
+                int v, vt, vn;
+                q = valid ? obj_parse_corner(obj_skip_spaces(q, end), end, &v, &vt, &vn) : NULL;
+                if(q == NULL) {
+                    valid = 0;
+                }
+                Face corner = {0};
+                if(valid) {
+                    corner.v[0] = obj_resolve_index(v, vertices);
+                    corner.vt[0] = vt != 0 ? obj_resolve_index(vt, uvs) : -1;
+                    corner.vn[0] = vn != 0 ? obj_resolve_index(vn, normals) : -1;
+                    valid = corner.v[0] >= 0;
+                }
+                if(c == 0) {
+                    first = corner;
+                }
+                else if(c >= 2) {
+                    Face f;
+                    f.v[0] = first.v[0];
+                    f.vt[0] = first.vt[0];
+                    f.vn[0] = first.vn[0];
+                    f.v[1] = previous.v[0];
+                    f.vt[1] = previous.vt[0];
+                    f.vn[1] = previous.vn[0];
+                    f.v[2] = corner.v[0];
+                    f.vt[2] = corner.vt[0];
+                    f.vn[2] = corner.vn[0];
+                    mesh->faces[faces + c - 2] = f;
+                }
+                previous = corner;
+            }
+            if(!valid) {
+                // Marked for removal once every chunk is parsed
+                for(int c = 0; c < corners - 2; c++) {
+                    mesh->faces[faces + c].v[0] = -1;
+                }
+                badLines++;
+            }
+            faces += corners - 2;
+        }
+    }
+
+    if(counting) {
+        chunk->vertexCount = vertices;
+        chunk->uvCount = uvs;
+        chunk->normalCount = normals;
+        chunk->faceCount = faces;
+    }
+    chunk->badLines = badLines;
+}
+
+// The mesh arrays are allocated from arena, or the C allocator when it is NULL
+int loadObj(const char *filename, Mesh *mesh, Arena* arena) {
+    memset(mesh, 0, sizeof(Mesh));
+    mesh->arena = arena;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file %s\n", filename);
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Unable to read file %s\n", filename);
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    const char* data = (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        perror("Failed to map OBJ file");
+        return 0;
+    }
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+
+    int nbThreads = threadpool_default_thread_count();
+    int nbChunks = (int)(size / OBJ_MIN_CHUNK_SIZE) + 1;
+    nbChunks = nbChunks < nbThreads ? nbChunks : nbThreads;
+    ObjChunk* chunks = (ObjChunk*)calloc(nbChunks, sizeof(ObjChunk));
+    int* order = (int*)malloc(nbChunks * sizeof(int));
+    if(chunks == NULL || order == NULL) {
+        perror("Failed to allocate OBJ chunks");
+        free(chunks);
+        free(order);
+        munmap((void*)data, size);
+        return 0;
+    }
+
+    const char* end = data + size;
+    const char* start = data;
+    for(int i = 0; i < nbChunks; i++) {
+        const char* chunkEnd = i == nbChunks - 1 ? end : data + size / nbChunks * (i + 1);
+        if(chunkEnd < start) {
+            chunkEnd = start;
+        }
+        // Move the cut to just after the next newline
+        if(chunkEnd > data && chunkEnd < end && chunkEnd[-1] != '\n') {
+            chunkEnd = obj_next_line(chunkEnd, end);
+        }
+        chunks[i].start = start;
+        chunks[i].end = chunkEnd;
+        order[i] = i;
+        start = chunkEnd;
+    }
+
+    ObjParse parse = { mesh, chunks, 0 };
+    threadpool_run(nbThreads, order, nbChunks, obj_parse_chunk, &parse);
+
+    for(int i = 0; i < nbChunks; i++) {
+        chunks[i].vertexOffset = mesh->vertexCount;
+        chunks[i].uvOffset = mesh->uvCount;
+        chunks[i].normalOffset = mesh->normalCount;
+        chunks[i].faceOffset = mesh->faceCount;
+        mesh->vertexCount += chunks[i].vertexCount;
+        mesh->uvCount += chunks[i].uvCount;
+        mesh->normalCount += chunks[i].normalCount;
+        mesh->faceCount += chunks[i].faceCount;
+    }
+
+    mesh->vertices = (Vec3*)arena_alloc(arena, ARENA_MESH, (mesh->vertexCount + 1) * sizeof(Vec3), 64);
+    mesh->uvs = (Vec2*)arena_alloc(arena, ARENA_MESH, (mesh->uvCount + 1) * sizeof(Vec2), 64);
+    mesh->normals = (Vec3*)arena_alloc(arena, ARENA_MESH, (mesh->normalCount + 1) * sizeof(Vec3), 64);
+    mesh->faces = (Face*)arena_alloc(arena, ARENA_MESH, (mesh->faceCount + 1) * sizeof(Face), 64);
+    if(mesh->vertices == NULL || mesh->uvs == NULL || mesh->normals == NULL || mesh->faces == NULL) {
+        perror("Failed to allocate mesh");
+        freeMesh(mesh);
+        memset(mesh, 0, sizeof(Mesh));
+        free(chunks);
+        free(order);
+        munmap((void*)data, size);
+        return 0;
+    }
+
+    parse.pass = 1;
+    threadpool_run(nbThreads, order, nbChunks, obj_parse_chunk, &parse);
+    munmap((void*)data, size);
+
+    int badLines = 0;
+    for(int i = 0; i < nbChunks; i++) {
+        badLines += chunks[i].badLines;
+    }
+    free(chunks);
+    free(order);
+
+    // Drop the triangles of faces that referenced missing vertices
+    int kept = 0;
+    for(int i = 0; i < mesh->faceCount; i++) {
+        if(mesh->faces[i].v[0] >= 0) {
+            mesh->faces[kept++] = mesh->faces[i];
+        }
+    }
+    mesh->faceCount = kept;
+
+    if(badLines > 0) {
+        fprintf(stderr, "%s: skipped %d malformed lines\n", filename, badLines);
+    }
+    return 1;
+}
+
+#endif /* OBJLOADER_H */
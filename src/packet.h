@@ -0,0 +1,552 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#pragma once
+
+#include <assert.h>
+#include <float.h>
+#include <string.h>
+
+#include "scene.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACKET_SIMD 1
+#else
+#define PACKET_SIMD 0
+#endif
+
+// Camera rays of a small pixel block are traced together, 4, 8 or 16 at a
+// time, with SSE or AVX2 kernels picked at runtime. The packet only finds
+// which primitive each ray hits first: the hit is then recomputed with the
+// scalar code so shading sees exactly the same HitInfo as a scalar ray.
+
+#define PACKET_MAX_SIZE 16
+// Triangles are tested with a slightly enlarged edge tolerance so a packet
+// never misses a hit the watertight scalar test would find
+#define PACKET_EDGE_EPSILON 1e-5f
+// Packets whose rays spread more than this (cosine to the mean direction)
+// are traced as scalar rays instead
+#define PACKET_COHERENCE_COS 0.95f
+
+typedef struct RayPacket {
+    _Alignas(64) float ox[PACKET_MAX_SIZE];
+    _Alignas(64) float oy[PACKET_MAX_SIZE];
+    _Alignas(64) float oz[PACKET_MAX_SIZE];
+    _Alignas(64) float dx[PACKET_MAX_SIZE];
+    _Alignas(64) float dy[PACKET_MAX_SIZE];
+    _Alignas(64) float dz[PACKET_MAX_SIZE];
+    _Alignas(64) float idx[PACKET_MAX_SIZE];
+    _Alignas(64) float idy[PACKET_MAX_SIZE];
+    _Alignas(64) float idz[PACKET_MAX_SIZE];
+    _Alignas(64) float t[PACKET_MAX_SIZE];
+    // Object hit by each lane in top level order (-1 for a miss), and the
+    // compiled triangle index when the object is a model
+    int object[PACKET_MAX_SIZE];
+    int prim[PACKET_MAX_SIZE];
+    int size;
+} RayPacket;
+
+typedef struct PacketKernels {
+    const char* name;
+    int width;
+    // Lanes of active whose ray enters the node before its current hit. The
+    // smallest entry distance among them is written to nearest.
+    unsigned int (*aabb)(const BVHNode* node, const RayPacket* packet, unsigned int active, float* nearest);
+    void (*sphere)(const Sphere* sphere, RayPacket* packet, unsigned int active, int object);
+    void (*triangles)(const TriangleSoA* tris, int first, int count, RayPacket* packet, unsigned int active, int object);
+} PacketKernels;
+
+typedef void (*PacketLeafFunc)(void* ctx, const int* prims, int count, unsigned int active);
+
+void packet_init(RayPacket* packet, const Ray* rays, int size) {
+    memset(packet, 0, sizeof(RayPacket));
+    packet->size = size;
+    for(int i = 0; i < PACKET_MAX_SIZE; i++) {
+        Ray ray = rays[i < size ? i : 0];
+        packet->ox[i] = ray.origin.x;
+        packet->oy[i] = ray.origin.y;
+        packet->oz[i] = ray.origin.z;
+        packet->dx[i] = ray.direction.x;
+        packet->dy[i] = ray.direction.y;
+        packet->dz[i] = ray.direction.z;
+        packet->idx[i] = 1.0f / ray.direction.x;
+        packet->idy[i] = 1.0f / ray.direction.y;
+        packet->idz[i] = 1.0f / ray.direction.z;
+        packet->t[i] = FLT_MAX;
+        packet->object[i] = -1;
+        packet->prim[i] = -1;
+    }
+}
+
+int packet_is_coherent(const Ray* rays, int size) {
+    Vec3 mean = vec3_build(0.0f, 0.0f, 0.0f);
+    for(int i = 0; i < size; i++) {
+        mean = vec3_add(mean, vec3_normalize(rays[i].direction));
+    }
+    mean = vec3_normalize(mean);
+    for(int i = 0; i < size; i++) {
+        if(vec3_dot(vec3_normalize(rays[i].direction), mean) < PACKET_COHERENCE_COS) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void packet_record_hits(RayPacket* packet, unsigned int hits, int object, int prim) {
+    while(hits) {
+        int lane = __builtin_ctz(hits);
+        packet->object[lane] = object;
+        packet->prim[lane] = prim;
+        hits &= hits - 1;
+    }
+}
+
+#if PACKET_SIMD
+
+__m128 packet_lane_mask_sse(unsigned int lanes) {
+    __m128i bits = _mm_and_si128(_mm_set1_epi32((int)lanes), _mm_setr_epi32(1, 2, 4, 8));
+    return _mm_castsi128_ps(_mm_cmpgt_epi32(bits, _mm_setzero_si128()));
+}
+
+__attribute__((target("avx2")))
+__m256 packet_lane_mask_avx2(unsigned int lanes) {
+    __m256i bits = _mm256_and_si256(_mm256_set1_epi32((int)lanes), _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128));
+    return _mm256_castsi256_ps(_mm256_cmpgt_epi32(bits, _mm256_setzero_si256()));
+}
+
+unsigned int packet_aabb_sse(const BVHNode* node, const RayPacket* p, unsigned int active, float* nearest) {
+    unsigned int mask = 0;
+    float best = FLT_MAX;
+    for(int c = 0; c < p->size; c += 4) {
+        unsigned int lanes = (active >> c) & 0xFu;
+        if(lanes == 0) {
+            continue;
+        }
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min[0]), _mm_load_ps(&p->ox[c])), _mm_load_ps(&p->idx[c]));
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max[0]), _mm_load_ps(&p->ox[c])), _mm_load_ps(&p->idx[c]));
+        __m128 tNear = _mm_min_ps(t1, t2);
+        __m128 tFar = _mm_max_ps(t1, t2);
+        t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min[1]), _mm_load_ps(&p->oy[c])), _mm_load_ps(&p->idy[c]));
+        t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max[1]), _mm_load_ps(&p->oy[c])), _mm_load_ps(&p->idy[c]));
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+        tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+        t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->min[2]), _mm_load_ps(&p->oz[c])), _mm_load_ps(&p->idz[c]));
+        t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->max[2]), _mm_load_ps(&p->oz[c])), _mm_load_ps(&p->idz[c]));
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+        tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+        __m128 hit = _mm_and_ps(_mm_cmpge_ps(tFar, tNear), _mm_cmpgt_ps(tFar, _mm_setzero_ps()));
+        hit = _mm_and_ps(hit, _mm_cmplt_ps(tNear, _mm_load_ps(&p->t[c])));
+        unsigned int bits = (unsigned int)_mm_movemask_ps(hit) & lanes;
+        if(bits) {
+            float nears[4];
+            _mm_storeu_ps(nears, tNear);
+            for(int i = 0; i < 4; i++) {
+                if((bits >> i) & 1u) {
+                    best = fminf(best, nears[i]);
+                }
+            }
+            mask |= bits << c;
+        }
+    }
+    *nearest = best;
+    return mask;
+}
+
+void packet_sphere_sse(const Sphere* sphere, RayPacket* p, unsigned int active, int object) {
+    __m128 cx = _mm_set1_ps(sphere->center.x);
+    __m128 cy = _mm_set1_ps(sphere->center.y);
+    __m128 cz = _mm_set1_ps(sphere->center.z);
+    __m128 r2 = _mm_set1_ps(sphere->radius * sphere->radius);
+    for(int c = 0; c < p->size; c += 4) {
+        unsigned int lanes = (active >> c) & 0xFu;
+        if(lanes == 0) {
+            continue;
+        }
+        __m128 dx = _mm_load_ps(&p->dx[c]);
+        __m128 dy = _mm_load_ps(&p->dy[c]);
+        __m128 dz = _mm_load_ps(&p->dz[c]);
+        __m128 ocx = _mm_sub_ps(cx, _mm_load_ps(&p->ox[c]));
+        __m128 ocy = _mm_sub_ps(cy, _mm_load_ps(&p->oy[c]));
+        __m128 ocz = _mm_sub_ps(cz, _mm_load_ps(&p->oz[c]));
+        __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 b = _mm_mul_ps(_mm_set1_ps(-2.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz)));
+        __m128 cc = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), r2);
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_set1_ps(4.0f), _mm_mul_ps(a, cc)));
+        __m128 root = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+        __m128 t = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), b), root), _mm_mul_ps(_mm_set1_ps(2.0f), a));
+        __m128 tCur = _mm_load_ps(&p->t[c]);
+        __m128 hit = _mm_and_ps(_mm_cmpge_ps(disc, _mm_setzero_ps()), _mm_cmpgt_ps(t, _mm_setzero_ps()));
+        hit = _mm_and_ps(hit, _mm_cmplt_ps(t, tCur));
+        hit = _mm_and_ps(hit, packet_lane_mask_sse(lanes));
+        unsigned int bits = (unsigned int)_mm_movemask_ps(hit);
+        if(bits) {
+            _mm_store_ps(&p->t[c], _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, tCur)));
+            packet_record_hits(p, bits << c, object, -1);
+        }
+    }
+}
+
+void packet_triangles_sse(const TriangleSoA* tris, int first, int count, RayPacket* p, unsigned int active, int object) {
+    for(int i = first; i < first + count; i++) {
+        float v0x = tris->x[0][i], v0y = tris->y[0][i], v0z = tris->z[0][i];
+        __m128 e1x = _mm_set1_ps(tris->x[1][i] - v0x);
+        __m128 e1y = _mm_set1_ps(tris->y[1][i] - v0y);
+        __m128 e1z = _mm_set1_ps(tris->z[1][i] - v0z);
+        __m128 e2x = _mm_set1_ps(tris->x[2][i] - v0x);
+        __m128 e2y = _mm_set1_ps(tris->y[2][i] - v0y);
+        __m128 e2z = _mm_set1_ps(tris->z[2][i] - v0z);
+        for(int c = 0; c < p->size; c += 4) {
+            unsigned int lanes = (active >> c) & 0xFu;
+            if(lanes == 0) {
+                continue;
+            }
+            __m128 dx = _mm_load_ps(&p->dx[c]);
+            __m128 dy = _mm_load_ps(&p->dy[c]);
+            __m128 dz = _mm_load_ps(&p->dz[c]);
+            __m128 qx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            __m128 qy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            __m128 qz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+            __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, qx), _mm_mul_ps(e1y, qy)), _mm_mul_ps(e1z, qz));
+            // A positive determinant is a front face, the only side the scalar test hits
+            __m128 hit = _mm_cmpgt_ps(det, _mm_setzero_ps());
+            if((_mm_movemask_ps(hit) & lanes) == 0) {
+                continue;
+            }
+            __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+            __m128 sx = _mm_sub_ps(_mm_load_ps(&p->ox[c]), _mm_set1_ps(v0x));
+            __m128 sy = _mm_sub_ps(_mm_load_ps(&p->oy[c]), _mm_set1_ps(v0y));
+            __m128 sz = _mm_sub_ps(_mm_load_ps(&p->oz[c]), _mm_set1_ps(v0z));
+            __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, qx), _mm_mul_ps(sy, qy)), _mm_mul_ps(sz, qz)), invDet);
+            __m128 rx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+            __m128 ry = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+            __m128 rz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+            __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, rx), _mm_mul_ps(dy, ry)), _mm_mul_ps(dz, rz)), invDet);
+            __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, rx), _mm_mul_ps(e2y, ry)), _mm_mul_ps(e2z, rz)), invDet);
+            __m128 tCur = _mm_load_ps(&p->t[c]);
+            __m128 eps = _mm_set1_ps(-PACKET_EDGE_EPSILON);
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(u, eps));
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(v, eps));
+            hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f + PACKET_EDGE_EPSILON)));
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(t, _mm_setzero_ps()));
+            hit = _mm_and_ps(hit, _mm_cmplt_ps(t, tCur));
+            hit = _mm_and_ps(hit, packet_lane_mask_sse(lanes));
+            unsigned int bits = (unsigned int)_mm_movemask_ps(hit);
+            if(bits) {
+                _mm_store_ps(&p->t[c], _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, tCur)));
+                packet_record_hits(p, bits << c, object, i);
+            }
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+unsigned int packet_aabb_avx2(const BVHNode* node, const RayPacket* p, unsigned int active, float* nearest) {
+    unsigned int mask = 0;
+    float best = FLT_MAX;
+    for(int c = 0; c < p->size; c += 8) {
+        unsigned int lanes = (active >> c) & 0xFFu;
+        if(lanes == 0) {
+            continue;
+        }
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->min[0]), _mm256_load_ps(&p->ox[c])), _mm256_load_ps(&p->idx[c]));
+        __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->max[0]), _mm256_load_ps(&p->ox[c])), _mm256_load_ps(&p->idx[c]));
+        __m256 tNear = _mm256_min_ps(t1, t2);
+        __m256 tFar = _mm256_max_ps(t1, t2);
+        t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->min[1]), _mm256_load_ps(&p->oy[c])), _mm256_load_ps(&p->idy[c]));
+        t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->max[1]), _mm256_load_ps(&p->oy[c])), _mm256_load_ps(&p->idy[c]));
+        tNear = _mm256_max_ps(tNear, _mm256_min_ps(t1, t2));
+        tFar = _mm256_min_ps(tFar, _mm256_max_ps(t1, t2));
+        t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->min[2]), _mm256_load_ps(&p->oz[c])), _mm256_load_ps(&p->idz[c]));
+        t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node->max[2]), _mm256_load_ps(&p->oz[c])), _mm256_load_ps(&p->idz[c]));
+        tNear = _mm256_max_ps(tNear, _mm256_min_ps(t1, t2));
+        tFar = _mm256_min_ps(tFar, _mm256_max_ps(t1, t2));
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tFar, tNear, _CMP_GE_OQ), _mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GT_OQ));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(tNear, _mm256_load_ps(&p->t[c]), _CMP_LT_OQ));
+        unsigned int bits = (unsigned int)_mm256_movemask_ps(hit) & lanes;
+        if(bits) {
+            float nears[8];
+            _mm256_storeu_ps(nears, tNear);
+            for(int i = 0; i < 8; i++) {
+                if((bits >> i) & 1u) {
+                    best = fminf(best, nears[i]);
+                }
+            }
+            mask |= bits << c;
+        }
+    }
+    *nearest = best;
+    return mask;
+}
+
+__attribute__((target("avx2")))
+void packet_sphere_avx2(const Sphere* sphere, RayPacket* p, unsigned int active, int object) {
+    __m256 cx = _mm256_set1_ps(sphere->center.x);
+    __m256 cy = _mm256_set1_ps(sphere->center.y);
+    __m256 cz = _mm256_set1_ps(sphere->center.z);
+    __m256 r2 = _mm256_set1_ps(sphere->radius * sphere->radius);
+    for(int c = 0; c < p->size; c += 8) {
+        unsigned int lanes = (active >> c) & 0xFFu;
+        if(lanes == 0) {
+            continue;
+        }
+        __m256 dx = _mm256_load_ps(&p->dx[c]);
+        __m256 dy = _mm256_load_ps(&p->dy[c]);
+        __m256 dz = _mm256_load_ps(&p->dz[c]);
+        __m256 ocx = _mm256_sub_ps(cx, _mm256_load_ps(&p->ox[c]));
+        __m256 ocy = _mm256_sub_ps(cy, _mm256_load_ps(&p->oy[c]));
+        __m256 ocz = _mm256_sub_ps(cz, _mm256_load_ps(&p->oz[c]));
+        __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        __m256 b = _mm256_mul_ps(_mm256_set1_ps(-2.0f), _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz)));
+        __m256 cc = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), r2);
+        __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_set1_ps(4.0f), _mm256_mul_ps(a, cc)));
+        __m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, _mm256_setzero_ps()));
+        __m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), b), root), _mm256_mul_ps(_mm256_set1_ps(2.0f), a));
+        __m256 tCur = _mm256_load_ps(&p->t[c]);
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(t, _mm256_setzero_ps(), _CMP_GT_OQ));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, tCur, _CMP_LT_OQ));
+        hit = _mm256_and_ps(hit, packet_lane_mask_avx2(lanes));
+        unsigned int bits = (unsigned int)_mm256_movemask_ps(hit);
+        if(bits) {
+            _mm256_store_ps(&p->t[c], _mm256_blendv_ps(tCur, t, hit));
+            packet_record_hits(p, bits << c, object, -1);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void packet_triangles_avx2(const TriangleSoA* tris, int first, int count, RayPacket* p, unsigned int active, int object) {
+    for(int i = first; i < first + count; i++) {
+        float v0x = tris->x[0][i], v0y = tris->y[0][i], v0z = tris->z[0][i];
+        __m256 e1x = _mm256_set1_ps(tris->x[1][i] - v0x);
+        __m256 e1y = _mm256_set1_ps(tris->y[1][i] - v0y);
+        __m256 e1z = _mm256_set1_ps(tris->z[1][i] - v0z);
+        __m256 e2x = _mm256_set1_ps(tris->x[2][i] - v0x);
+        __m256 e2y = _mm256_set1_ps(tris->y[2][i] - v0y);
+        __m256 e2z = _mm256_set1_ps(tris->z[2][i] - v0z);
+        for(int c = 0; c < p->size; c += 8) {
+            unsigned int lanes = (active >> c) & 0xFFu;
+            if(lanes == 0) {
+                continue;
+            }
+            __m256 dx = _mm256_load_ps(&p->dx[c]);
+            __m256 dy = _mm256_load_ps(&p->dy[c]);
+            __m256 dz = _mm256_load_ps(&p->dz[c]);
+            __m256 qx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+            __m256 qy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+            __m256 qz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+            __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, qx), _mm256_mul_ps(e1y, qy)), _mm256_mul_ps(e1z, qz));
+            __m256 hit = _mm256_cmp_ps(det, _mm256_setzero_ps(), _CMP_GT_OQ);
+            if(((unsigned int)_mm256_movemask_ps(hit) & lanes) == 0) {
+                continue;
+            }
+            __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+            __m256 sx = _mm256_sub_ps(_mm256_load_ps(&p->ox[c]), _mm256_set1_ps(v0x));
+            __m256 sy = _mm256_sub_ps(_mm256_load_ps(&p->oy[c]), _mm256_set1_ps(v0y));
+            __m256 sz = _mm256_sub_ps(_mm256_load_ps(&p->oz[c]), _mm256_set1_ps(v0z));
+            __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, qx), _mm256_mul_ps(sy, qy)), _mm256_mul_ps(sz, qz)), invDet);
+            __m256 rx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+            __m256 ry = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+            __m256 rz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+            __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, rx), _mm256_mul_ps(dy, ry)), _mm256_mul_ps(dz, rz)), invDet);
+            __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, rx), _mm256_mul_ps(e2y, ry)), _mm256_mul_ps(e2z, rz)), invDet);
+            __m256 tCur = _mm256_load_ps(&p->t[c]);
+            __m256 eps = _mm256_set1_ps(-PACKET_EDGE_EPSILON);
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, eps, _CMP_GE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(v, eps, _CMP_GE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f + PACKET_EDGE_EPSILON), _CMP_LE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, _mm256_setzero_ps(), _CMP_GE_OQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, tCur, _CMP_LT_OQ));
+            hit = _mm256_and_ps(hit, packet_lane_mask_avx2(lanes));
+            unsigned int bits = (unsigned int)_mm256_movemask_ps(hit);
+            if(bits) {
+                _mm256_store_ps(&p->t[c], _mm256_blendv_ps(tCur, t, hit));
+                packet_record_hits(p, bits << c, object, i);
+            }
+        }
+    }
+}
+
+#endif /* PACKET_SIMD */
+
+// Picks the widest kernels the CPU supports. A width of 0 means packets are
+// not available and the renderer stays on scalar rays.
+PacketKernels packet_select_kernels() {
+    PacketKernels kernels;
+    memset(&kernels, 0, sizeof(PacketKernels));
+    kernels.name = "scalar";
+#if PACKET_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernels.name = "AVX2";
+        kernels.width = 8;
+        kernels.aabb = packet_aabb_avx2;
+        kernels.sphere = packet_sphere_avx2;
+        kernels.triangles = packet_triangles_avx2;
+    }
+    else {
+        kernels.name = "SSE";
+        kernels.width = 4;
+        kernels.aabb = packet_aabb_sse;
+        kernels.sphere = packet_sphere_sse;
+        kernels.triangles = packet_triangles_sse;
+    }
+#endif
+    return kernels;
+}
+
+// Same traversal as bvh_intersect, but a node is entered as long as one
+// lane of the packet reaches it, and only those lanes go on below it
+void packet_bvh_traverse(const PacketKernels* kernels, const BVH* bvh, RayPacket* packet, unsigned int active, PacketLeafFunc leafFunc, void* ctx) {
+    const BVHNode* nodes = bvh->nodes;
+    if(nodes == NULL) {
+        return;
+    }
+    float nearest;
+    active = kernels->aabb(&nodes[0], packet, active, &nearest);
+    if(active == 0) {
+        return;
+    }
+
+    int stack[BVH_STACK_SIZE];
+    unsigned int stackMask[BVH_STACK_SIZE];
+    int stackSize = 0;
+    int nodeIndex = 0;
+    while(1) {
+        const BVHNode* node = &nodes[nodeIndex];
+        if(node->count > 0) {
+            leafFunc(ctx, &bvh->primIndices[node->leftFirst], node->count, active);
+        }
+        else {
+            int left = node->leftFirst;
+            float nearLeft, nearRight;
+            unsigned int maskLeft = kernels->aabb(&nodes[left], packet, active, &nearLeft);
+            unsigned int maskRight = kernels->aabb(&nodes[left + 1], packet, active, &nearRight);
+            int near = left, far = left + 1;
+            unsigned int maskNear = maskLeft, maskFar = maskRight;
+            if(maskNear == 0 || (maskFar != 0 && nearRight < nearLeft)) {
+                near = left + 1;
+                far = left;
+                maskNear = maskRight;
+                maskFar = maskLeft;
+            }
+            if(maskNear != 0) {
+                if(maskFar != 0) {
+                    // bvh_subdivide keeps leaves within BVH_MAX_DEPTH
+                    assert(stackSize < BVH_STACK_SIZE);
+                    stack[stackSize] = far;
+                    stackMask[stackSize++] = maskFar;
+                }
+                nodeIndex = near;
+                active = maskNear;
+                continue;
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        stackSize--;
+        nodeIndex = stack[stackSize];
+        active = stackMask[stackSize];
+    }
+}
+
+typedef struct PacketMeshContext {
+    const PacketKernels* kernels;
+    const Mesh* mesh;
+    RayPacket* packet;
+    int object;
+} PacketMeshContext;
+
+void packet_mesh_leaf(void* ctx, const int* prims, int count, unsigned int active) {
+    PacketMeshContext* leaf = (PacketMeshContext*)ctx;
+    int first = (int)(prims - leaf->mesh->bvh.primIndices);
+    leaf->kernels->triangles(&leaf->mesh->tris, first, count, leaf->packet, active, leaf->object);
+}
+
+typedef struct PacketSceneContext {
+    const PacketKernels* kernels;
+    Scene* scene;
+    RayPacket* packet;
+} PacketSceneContext;
+
+// Copy of a packet with its rays moved into the object space of a model.
+// Distances along the rays are the same in both spaces.
+void packet_to_object(const RayPacket* packet, const Model* model, RayPacket* local) {
+    *local = *packet;
+    for(int i = 0; i < PACKET_MAX_SIZE; i++) {
+        Ray ray = model_object_ray(model, ray_create(vec3_build(packet->ox[i], packet->oy[i], packet->oz[i]), vec3_build(packet->dx[i], packet->dy[i], packet->dz[i])));
+        local->ox[i] = ray.origin.x;
+        local->oy[i] = ray.origin.y;
+        local->oz[i] = ray.origin.z;
+        local->dx[i] = ray.direction.x;
+        local->dy[i] = ray.direction.y;
+        local->dz[i] = ray.direction.z;
+        local->idx[i] = 1.0f / ray.direction.x;
+        local->idy[i] = 1.0f / ray.direction.y;
+        local->idz[i] = 1.0f / ray.direction.z;
+    }
+}
+
+void packet_scene_leaf(void* ctx, const int* prims, int count, unsigned int active) {
+    PacketSceneContext* leaf = (PacketSceneContext*)ctx;
+    int nbSpheres = leaf->scene->info->nbSpheres;
+    for(int i = 0; i < count; i++) {
+        int object = prims[i];
+        if(object < nbSpheres) {
+            leaf->kernels->sphere(&leaf->scene->spheres[object], leaf->packet, active, object);
+        }
+        else {
+            const Model* model = &leaf->scene->models[object - nbSpheres];
+            if(model->mesh->tris.count == 0) {
+                continue;
+            }
+            RayPacket local;
+            packet_to_object(leaf->packet, model, &local);
+            PacketMeshContext meshCtx = { leaf->kernels, model->mesh, &local, object };
+            packet_bvh_traverse(leaf->kernels, &model->mesh->bvh, &local, active, packet_mesh_leaf, &meshCtx);
+            memcpy(leaf->packet->t, local.t, sizeof(local.t));
+            memcpy(leaf->packet->object, local.object, sizeof(local.object));
+            memcpy(leaf->packet->prim, local.prim, sizeof(local.prim));
+        }
+    }
+}
+
+// Finds the closest hit of every ray and turns it into a full HitInfo by
+// running the scalar test on the primitive that was hit. Rays whose scalar
+// test disagrees are traced again with intersect_scene.
+void packet_intersect_scene(const PacketKernels* kernels, Scene* scene, const Ray* rays, int size, HitInfo* hits) {
+    COUNTER_ADD(COUNTER_PACKET_RAYS, size);
+    RayPacket packet;
+    packet_init(&packet, rays, size);
+    unsigned int active = size >= 32 ? 0xFFFFFFFFu : (1u << size) - 1u;
+    PacketSceneContext ctx = { kernels, scene, &packet };
+    packet_bvh_traverse(kernels, &scene->topLevel, &packet, active, packet_scene_leaf, &ctx);
+
+    int nbSpheres = scene->info->nbSpheres;
+    for(int i = 0; i < size; i++) {
+        hits[i] = hitInfo_create();
+        int object = packet.object[i];
+        if(object < 0) {
+            continue;
+        }
+        if(object < nbSpheres) {
+            sphere_intersect(&scene->spheres[object], &rays[i], &hits[i]);
+        }
+        else {
+            Model* model = &scene->models[object - nbSpheres];
+            Ray local = model_object_ray(model, rays[i]);
+            WatertightRay wr = watertight_ray_create(local.direction);
+            face_intersect(&model->mesh->tris, packet.prim[i], &wr, local, &hits[i]);
+        }
+        if(hits[i].hitDistance < FLT_MAX) {
+            hits[i].object = object;
+        }
+        else {
+            hits[i] = intersect_scene(scene, rays[i]);
+        }
+    }
+}
+
+#endif /* PACKET_H */
@@ -1,7 +1,16 @@
 #include "scene.h"
+#include "packet.h"
+#include "wavefront.h"
+#include "framebuffer.h"
+#include "denoise.h"
 #include "math/geometry.h"
 #include "utils/utils.h"
+#include "utils/threadpool.h"
+#include "utils/counters.h"
+#include "utils/writePPM.h"
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
 
 Vec3 getColor(const Ray ray) {
     Vec3 unitVector = vec3_normalize(ray.direction);
@@ -9,30 +18,27 @@ Vec3 getColor(const Ray ray) {
     return vec3_add(vec3_mul(vec3_build(1.0f, 1.0f, 1.0f), (1.0f - a)), vec3_mul(vec3_build(0.5f, 0.7f, 1.0f), a));
 }
 
-Vec3 getTextureColor(Vec2 uv, Material mat) {
-    if(mat.texture == NULL) {
-        return mat.albedo;
-    }
-
-    Texture* tex = mat.texture;
-    int posX = (int)(tex->width * uv.x);
-    int posY = (int)(tex->height * uv.y);
+// Cones of textured lookups are kept from turning into lines at grazing angles
+#define TEXTURE_MIN_COSINE 0.05f
+// Spread a diffuse bounce adds to the ray cone. The bounce scatters over
+// the whole hemisphere, so what it hits only needs a blurry texture.
+#define TEXTURE_DIFFUSE_SPREAD 0.5f
 
-    if(posY >= tex->height) {
-        posY -= 1;
+// footprint is the width of the ray cone at the hit
+Vec3 getTextureColor(Scene* scene, const SurfaceHit* surface, const Material* mat, Ray ray, float footprint) {
+    if(mat->texture == NULL) {
+        return mat->albedo;
     }
 
-    if(posX >= tex->width) {
-        posX -= 1;
+    Texture* tex = mat->texture;
+    float lod = 0.0f;
+    if(scene->info->textureFilter == TEXTURE_TRILINEAR) {
+        // Texels under the footprint, which stretches as the surface turns away
+        float cosine = fabsf(vec3_dot(surface->normal, ray.direction)) / vec3_length(ray.direction);
+        float texels = footprint * surface->uvScale * sqrtf((float)tex->width * (float)tex->height) / fmaxf(cosine, TEXTURE_MIN_COSINE);
+        lod = texels > 1.0f ? log2f(texels) : 0.0f;
     }
-
-    int index = (posY * tex->width + posX);
-
-    float rChannel = (float)tex->texture[index].r / 255.0f;
-    float gChannel = (float)tex->texture[index].g / 255.0f;
-    float bChannel = (float)tex->texture[index].b / 255.0f;
-    
-    return vec3_build(rChannel, gChannel, bChannel);
+    return texture_sample(tex, surface->uv, lod, scene->info->textureFilter);
 }
 
 float linearToGamma(float color) {
@@ -42,103 +48,1123 @@ float linearToGamma(float color) {
     return 0;
 }
 
-Vec3 shade(Scene* scene, Ray* ray, HitInfo hit) {
-    return vec3_add(scene->ambiantLight, hit.material.albedo);
+Vec3 shade(Scene* scene, Ray* ray, SurfaceHit surface) {
+    return vec3_add(scene->ambiantLight, scene->materials[surface.material].albedo);
+}
+
+// Ray segments traced by this thread since its last tile
+_Thread_local long long traceLocalRays = 0;
+
+// Even bright paths stop now and then, so paths between mirrors end too
+#define ROULETTE_MAX_SURVIVAL 0.95f
+
+// Shadow rays start this far above the surface so they do not hit it again
+#define SHADOW_RAY_EPSILON 1e-4f
+
+float mis_power_heuristic(float pdf, float otherPdf) {
+    float a = pdf * pdf;
+    float b = otherPdf * otherPdf;
+    return a + b > 0.0f ? a / (a + b) : 0.0f;
+}
+
+// Solid angle of a sphere seen from p, as 1 - cos of the half angle of its
+// cone. Returns 0 when p is inside the sphere.
+float sphere_cone_size(Sphere light, Vec3 p) {
+    Vec3 toCenter = vec3_sub(light.center, p);
+    float dist2 = vec3_dot(toCenter, toCenter);
+    float radius2 = light.radius * light.radius;
+    if(dist2 <= radius2) {
+        return 0.0f;
+    }
+    float sin2 = radius2 / dist2;
+    float cosMax = sqrtf(1.0f - sin2);
+    // Same as 1 - cosMax without the cancellation for small or far spheres
+    return sin2 / (1.0f + cosMax);
+}
+
+// How likely a light is picked for a shadow ray from p: its solid angle
+// times its brightness
+float light_selection_weight(Scene* scene, Sphere light, Vec3 p) {
+    const Material* material = &scene->materials[light.material];
+    Vec3 emitted = vec3_mul(material->emissionColor, material->emissionStrength);
+    float luminance = 0.2126f * emitted.x + 0.7152f * emitted.y + 0.0722f * emitted.z;
+    return sphere_cone_size(light, p) * luminance;
 }
 
-Vec3 trace(Scene* scene, Ray* ray) {
-    Vec3 color = vec3_build(0.0f, 0.0f, 0.0f);
-    Vec3 rayColor = vec3_build(1.0f, 1.0f, 1.0f);
+// Sum of the selection weights of the lights seen from p, skipping the
+// object p lies on
+float light_selection_total(Scene* scene, Vec3 p, int exclude) {
+    float total = 0.0f;
+    for(int i = 0; i < scene->nbLights; i++) {
+        if(scene->lights[i] != exclude) {
+            total += light_selection_weight(scene, scene->spheres[scene->lights[i]], p);
+        }
+    }
+    return total;
+}
+
+// Density of sample_direct_light picking a direction towards the light:
+// selecting it, then a direction uniform in the solid angle of its cone
+float sphere_light_pdf(Scene* scene, int light, Vec3 p, int exclude) {
+    float total = light_selection_total(scene, p, exclude);
+    float coneSize = sphere_cone_size(scene->spheres[light], p);
+    if(total <= 0.0f || coneSize <= 0.0f) {
+        return 0.0f;
+    }
+    float selection = light_selection_weight(scene, scene->spheres[light], p) / total;
+    return selection / (2.0f * PI * coneSize);
+}
+
+// Picks a direction uniformly inside the cone subtended by the sphere
+Vec3 sphere_sample_direction(Sphere light, Vec3 p, float coneSize, Sampler* sampler) {
+    Vec3 w = vec3_normalize(vec3_sub(light.center, p));
+    Vec3 axis = fabsf(w.x) > 0.9f ? vec3_build(0.0f, 1.0f, 0.0f) : vec3_build(1.0f, 0.0f, 0.0f);
+    Vec3 u = vec3_normalize(vec3_cross(axis, w));
+    Vec3 v = vec3_cross(w, u);
+
+    float cosTheta = 1.0f - random01(sampler) * coneSize;
+    float sinTheta = sqrtf(fmaxf(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = 2.0f * PI * random01(sampler);
+    Vec3 dir = vec3_mul(u, cosf(phi) * sinTheta);
+    dir = vec3_add(dir, vec3_mul(v, sinf(phi) * sinTheta));
+    return vec3_add(dir, vec3_mul(w, cosTheta));
+}
+
+// Shadow ray towards a light, with the light it brings to its path when
+// nothing blocks it. light is -1 when there is no shadow ray.
+typedef struct ShadowRay {
+    Ray ray;
+    int light;
+    Vec3 contribution;
+} ShadowRay;
+
+// Light reaching a diffuse hit straight from the emissive spheres. One
+// light is picked by light_selection_weight and gets one shadow ray, which
+// is weighted against the cosine sampled bounce with the power heuristic.
+// Returns the light, or -1 when no light can be sampled, with the shadow ray
+// and what it brings through radiance. The albedo is left to the caller.
+int sample_light_ray(Scene* scene, const SurfaceHit* surface, int object, Sampler* sampler, Ray* shadowRay, Vec3* radiance) {
+    Vec3 origin = vec3_add(surface->position, vec3_mul(surface->normal, SHADOW_RAY_EPSILON));
+    float total = light_selection_total(scene, origin, object);
+    if(total <= 0.0f) {
+        return -1;
+    }
+    sampler_seek(sampler, SAMPLE_LIGHT_PICK);
+    float pick = random01(sampler) * total;
+    int index = -1;
+    // Weight of the picked light, rounding can leave pick positive after a
+    // light of zero weight that must not stand for it
+    float chosenWeight = 0.0f;
+    for(int i = 0; i < scene->nbLights && pick >= 0.0f; i++) {
+        if(scene->lights[i] == object) {
+            continue;
+        }
+        float weight = light_selection_weight(scene, scene->spheres[scene->lights[i]], origin);
+        if(weight > 0.0f) {
+            index = scene->lights[i];
+            chosenWeight = weight;
+        }
+        pick -= weight;
+    }
+    if(index < 0) {
+        return -1;
+    }
+
+    Sphere sphere = scene->spheres[index];
+    float coneSize = sphere_cone_size(sphere, origin);
+    sampler_seek(sampler, SAMPLE_LIGHT_DIRECTION);
+    Vec3 dir = sphere_sample_direction(sphere, origin, coneSize, sampler);
+    float cosine = vec3_dot(surface->normal, dir);
+    if(cosine <= 0.0f) {
+        return -1;
+    }
+    float lightPdf = chosenWeight / total / (2.0f * PI * coneSize);
+    if(!(lightPdf > 0.0f)) {
+        return -1;
+    }
+    *shadowRay = ray_create(origin, dir);
+    float bsdfPdf = cosine / PI;
+    const Material* material = &scene->materials[sphere.material];
+    Vec3 emitted = vec3_mul(material->emissionColor, material->emissionStrength);
+    // Lambert BRDF (albedo / PI) times the cosine, over the light pdf
+    *radiance = vec3_mul(emitted, mis_power_heuristic(lightPdf, bsdfPdf) * bsdfPdf / lightPdf);
+    return index;
+}
+
+// What a path carries from one bounce to the next
+typedef struct PathState {
+    Vec3 color;
+    Vec3 throughput;
+    // Set when the previous hit sampled the lights, its emission is then MIS weighted
+    int lightsSampled;
+    Vec3 lastPosition;
+    int lastObject;
+    float lastBsdfPdf;
+    // Ray cone used to pick texture mip levels: its width at the last hit and
+    // how fast it widens
+    float coneWidth;
+    float coneSpread;
+} PathState;
+
+PathState path_state_create(Scene* scene) {
+    PathState path;
+    path.color = vec3_build(0.0f, 0.0f, 0.0f);
+    path.throughput = vec3_build(1.0f, 1.0f, 1.0f);
+    path.lightsSampled = 0;
+    path.lastPosition = vec3_build(0.0f, 0.0f, 0.0f);
+    path.lastObject = -1;
+    path.lastBsdfPdf = 0.0f;
+    path.coneWidth = 0.0f;
+    path.coneSpread = camera_pixel_spread(scene->camera, scene->info->height);
+    return path;
+}
+
+// One bounce of a path: adds the light found at the hit, picks the shadow
+// ray of the hit and turns ray into the next ray. The shadow ray is left to
+// the caller, whose contribution goes to path->color when it is visible.
+// Returns 0 when the path ends here.
+int path_shade(Scene* scene, PathState* path, Ray* ray, const HitInfo* hit, int bounce, Sampler* sampler, ShadowRay* shadow) {
+    shadow->light = -1;
+    if(hit->object < 0) {
+        COUNTER_INC(COUNTER_ESCAPES);
+        path->color = vec3_add(path->color, vec3_vec3_mul(getColor(*ray), path->throughput));
+        return 0;
+    }
+    SurfaceHit surface = scene_hit_surface(scene, *ray, hit);
+    const Material* material = &scene->materials[surface.material];
+
+    Vec3 emittedLight = vec3_mul(material->emissionColor, material->emissionStrength);
+    if(path->lightsSampled && hit->object < scene->info->nbSpheres && material->emissionStrength > 0.0f) {
+        // This light was also sampled from the previous hit
+        float lightPdf = sphere_light_pdf(scene, hit->object, path->lastPosition, path->lastObject);
+        emittedLight = vec3_mul(emittedLight, mis_power_heuristic(path->lastBsdfPdf, lightPdf));
+    }
+    path->color = vec3_add(path->color, vec3_vec3_mul(emittedLight, path->throughput));
+    float footprint = path->coneWidth + path->coneSpread * hit->hitDistance * vec3_length(ray->direction);
+    Vec3 hitColor = getTextureColor(scene, &surface, material, *ray, footprint);
+    //vec3_print(hitColor);
+
+    // Next event estimation only handles the pure diffuse part
+    path->lightsSampled = scene->info->directLighting && scene->nbLights > 0 && material->specular == 0.0f;
+    if(path->lightsSampled) {
+        Vec3 radiance;
+        shadow->light = sample_light_ray(scene, &surface, hit->object, sampler, &shadow->ray, &radiance);
+        if(shadow->light >= 0) {
+            shadow->contribution = vec3_vec3_mul(vec3_vec3_mul(radiance, hitColor), path->throughput);
+        }
+        path->lastPosition = vec3_add(surface.position, vec3_mul(surface.normal, SHADOW_RAY_EPSILON));
+        path->lastObject = hit->object;
+    }
+
+    sampler_seek(sampler, SAMPLE_BSDF);
+    Vec3 diffuseDir = vec3_add(surface.normal, random_unit_vector(sampler));
+    Vec3 specularDir = vec3_reflect(ray->direction, surface.normal);
+    Vec3 newDir = vec3_lerp(diffuseDir, specularDir, material->specular);
+    Vec3 newOrigin = surface.position;
+    ray->direction = newDir;
+    ray->origin = newOrigin;
+    path->coneWidth = footprint;
+    path->coneSpread += (1.0f - material->specular) * TEXTURE_DIFFUSE_SPREAD;
+    if(path->lightsSampled) {
+        path->lastBsdfPdf = fmaxf(vec3_dot(surface.normal, vec3_normalize(newDir)), 0.0f) / PI;
+    }
+
+    path->throughput = vec3_vec3_mul(path->throughput, hitColor);
+
+    // Nothing further down a path with no throughput left can add light
+    float throughput = fmaxf(path->throughput.x, fmaxf(path->throughput.y, path->throughput.z));
+    if(throughput <= 0.0f) {
+        return 0;
+    }
+    // Russian roulette: dim paths are likely to stop and the survivors are
+    // scaled up by the same amount, which keeps the estimate unbiased
+    if(bounce + 1 >= scene->info->rouletteDepth) {
+        float survival = fminf(throughput, ROULETTE_MAX_SURVIVAL);
+        sampler_seek(sampler, SAMPLE_ROULETTE);
+        if(random01(sampler) >= survival) {
+            return 0;
+        }
+        path->throughput = vec3_div(path->throughput, survival);
+    }
+    return 1;
+}
+
+// firstHit, when not NULL, is the already known intersection of the camera ray
+Vec3 trace_path(Scene* scene, Ray* ray, Sampler* sampler, const HitInfo* firstHit) {
+    PathState path = path_state_create(scene);
+    COUNTER_INC(COUNTER_PATHS);
+    int pathLength = 0;
     for(int bounce = 0; bounce <= scene->info->maxRayDepth; bounce++) {
-        HitInfo hit = intersect_scene(scene, *ray);
-        if(!hit.hasHit) {
-            color = vec3_add(color, vec3_vec3_mul(getColor(*ray), rayColor));
+        sampler_set_bounce(sampler, bounce + 1);
+        traceLocalRays++;
+        pathLength++;
+        COUNTER_INC(COUNTER_BOUNCES);
+        HitInfo hit = (bounce == 0 && firstHit != NULL) ? *firstHit : intersect_scene(scene, *ray);
+        ShadowRay shadow;
+        int alive = path_shade(scene, &path, ray, &hit, bounce, sampler, &shadow);
+        if(shadow.light >= 0) {
+            HitInfo shadowHit = intersect_scene(scene, shadow.ray);
+            if(shadowHit.object == shadow.light) {
+                path.color = vec3_add(path.color, shadow.contribution);
+            }
+        }
+        if(!alive) {
             break;
         }
-        Vec3 diffuseDir = vec3_add(hit.normal, random_unit_vector());
-        Vec3 specularDir = vec3_reflect(ray->direction, hit.normal);
-        Vec3 newDir = vec3_lerp(diffuseDir, specularDir, hit.material.specular);
-        Vec3 newOrigin = hit.hitPosition;
-        ray->direction = newDir;
-        ray->origin = newOrigin;
-
-        Vec3 emittedLight = vec3_mul(hit.material.emissionColor, hit.material.emissionStrength);
-        color = vec3_add(color, vec3_vec3_mul(emittedLight, rayColor));
-        Vec3 hitColor = getTextureColor(hit.uv, hit.material);
-        //vec3_print(hitColor);
-        rayColor = vec3_vec3_mul(rayColor, hitColor);
     }
+    COUNTER_PATH_LENGTH(pathLength);
 
-    return color;
+    return path.color;
 }
 
-unsigned char* renderScene(Scene* scene) {
-    printf("Starting path tracing\n");
+Vec3 trace(Scene* scene, Ray* ray, Sampler* sampler) {
+    return trace_path(scene, ray, sampler, NULL);
+}
+
+#define TILE_SIZE 16
+
+// A pixel is converged when the 95% confidence interval of its mean
+// luminance is within targetError of the mean. The floor keeps dark pixels
+// from needing an absurd number of samples to reach a relative error.
+#define ADAPTIVE_CONFIDENCE 1.96f
+#define ADAPTIVE_LUMINANCE_FLOOR 0.1f
+
+typedef struct RenderJob {
+    Scene* scene;
+    float* camToWorld;
+    unsigned char* pixelData;
+    // Finished tiles are added to the framebuffer of the scene under this
+    // lock, checkpoints copy it under the lock and write the copy after
+    pthread_mutex_t framebufferLock;
+    double lastCheckpoint;
+    // Settings the checkpoints are saved with, worked out once per render
+    // since the scene hash reads every texel. checkpointing is set while a
+    // tile writes the copy, checkpoint.pixels is NULL without checkpoints.
+    CheckpointSettings checkpointSettings;
+    Framebuffer checkpoint;
+    int checkpointing;
+    int tilesX;
+    int tilesY;
+    PacketKernels kernels;
+    // One queue per worker with the wavefront engine, NULL otherwise
+    WavefrontQueue* queues;
+    atomic_int tilesDone;
+    atomic_llong samplesDone;
+    atomic_llong raysDone;
+} RenderJob;
 
+int pixel_stats_done(const SceneInfo* info, const PixelStats* stats) {
+    if(stats->count >= info->rayPerPixel) {
+        return 1;
+    }
+    int minSamples = info->minRayPerPixel > 2 ? info->minRayPerPixel : 2;
+    if(info->targetError <= 0.0f || stats->count < minSamples) {
+        return 0;
+    }
+    float variance = stats->m2 / (stats->count - 1);
+    float error = ADAPTIVE_CONFIDENCE * sqrtf(variance / stats->count);
+    return error <= info->targetError * (stats->mean + ADAPTIVE_LUMINANCE_FLOOR);
+}
+
+// Sampler of one sample of an image pixel, drawing from the sample pattern
+// of the render
+Sampler pixel_sampler(Scene* scene, unsigned int pixel, unsigned int sample) {
+    unsigned int width = scene->info->width;
+    return sampler_create_pixel(scene->info->sampler, pixel % width, pixel / width, width, sample, scene->info->rayPerPixel);
+}
+
+Ray camera_ray(Scene* scene, float* matrix, int x, int y, Sampler* sampler) {
     int width = scene->info->width;
     int height = scene->info->height;
+    sampler_seek(sampler, SAMPLE_CAMERA_PIXEL);
+    float randomOffsetX = (1.0f - (random01(sampler) * 2.0f)) / 2.0f;
+    float randomOffsetY = (1.0f - (random01(sampler) * 2.0f)) / 2.0f;
 
+    float pX = (2 * ((x + 0.5f + randomOffsetX) / (float)(width)) - 1) * tan(scene->camera->fov / 2 * PI / 180.0f) * scene->camera->aspectRatio;
+    float pY = (1 - 2 * ((y + 0.5f + randomOffsetY) / (float)height)) * tan(scene->camera->fov / 2.0f * PI / 180.0f);
 
+    Vec3 pixelPosCamSpace = vec3_build(pX, pY, -1.0f);
 
-    // Allocate memory for the pixel data
-    unsigned char *pixelData = (unsigned char *)malloc(width * height * 3 * sizeof(unsigned char));
-    if (pixelData == NULL) {
-        perror("Failed to allocate memory");
-        return (unsigned char*) 1;
+    Vec4 originWorld = vec4_mat4_mult(vec4_build_from_vec3(scene->camera->position, 1.0f), matrix);
+    Vec3 originWorldv3 = vec3_build(originWorld.x, originWorld.y, originWorld.z);
+    Vec4 pixelPos = vec4_mat4_mult(vec4_build_from_vec3(pixelPosCamSpace, 1.0f), matrix);
+    Vec3 pixelPosWorld = vec3_build(pixelPos.x, pixelPos.y, pixelPos.z);
+
+    Vec3 direction = vec3_normalize(vec3_sub(pixelPosWorld, originWorldv3));
+
+    return ray_create(originWorldv3, direction);
+}
+
+// Samples a pixel until it converges or reaches rayPerPixel samples, going
+// on from the samples it already has
+void renderPixel(Scene* scene, float* matrix, int x, int y, PixelStats* stats) {
+    while(!pixel_stats_done(scene->info, stats)) {
+        Sampler sampler = pixel_sampler(scene, y * scene->info->width + x, stats->count);
+        Ray ray = camera_ray(scene, matrix, x, y, &sampler);
+        pixel_stats_add(stats, trace(scene, &ray, &sampler));
     }
+}
 
-    float* matrix = (float*)malloc(4 * 4 * sizeof(float));
+// Renders a block of up to PACKET_MAX_SIZE pixels, tracing the camera rays
+// of each sample as one packet. Converged pixels drop out of the packet.
+// stats holds the samples the pixels already have.
+// Samplers are keyed exactly like in renderPixel so both paths produce the
+// same image.
+void renderPacketBlock(RenderJob* job, int startX, int startY, int blockW, int blockH, PixelStats* stats) {
+    Scene* scene = job->scene;
+    int size = blockW * blockH;
+    Ray rays[PACKET_MAX_SIZE];
+    Sampler samplers[PACKET_MAX_SIZE];
+    HitInfo hits[PACKET_MAX_SIZE];
+    int pixels[PACKET_MAX_SIZE];
+    while(1) {
+        int active = 0;
+        for(int i = 0; i < size; i++) {
+            if(pixel_stats_done(scene->info, &stats[i])) {
+                continue;
+            }
+            int x = startX + i % blockW;
+            int y = startY + i / blockW;
+            samplers[active] = pixel_sampler(scene, y * scene->info->width + x, stats[i].count);
+            rays[active] = camera_ray(scene, job->camToWorld, x, y, &samplers[active]);
+            pixels[active++] = i;
+        }
+        if(active == 0) {
+            break;
+        }
+        int coherent = packet_is_coherent(rays, active);
+        if(coherent) {
+            packet_intersect_scene(&job->kernels, scene, rays, active, hits);
+        }
+        for(int i = 0; i < active; i++) {
+            pixel_stats_add(&stats[pixels[i]], trace_path(scene, &rays[i], &samplers[i], coherent ? &hits[i] : NULL));
+        }
+    }
+}
 
-    computeCamToWorld(scene->camera, matrix);
+// Each wavefront round takes up to this many samples of every pixel of a tile
+#define WAVEFRONT_ROUND_SAMPLES 8
+#define WAVEFRONT_QUEUE_SIZE (TILE_SIZE * TILE_SIZE * WAVEFRONT_ROUND_SAMPLES)
 
-    // Initialize the pixel data (example: gradient pattern)
-    for (int y = 0; y < height; y++) {
-        printf("Scanlines left: %d\n", height - y);
-        for (int x = 0; x < width; x++) {
-            Vec3 avgColor = vec3_build(0.0f, 0.0f, 0.0f);
-            for(int rpp = 0; rpp < scene->info->rayPerPixel; rpp++) {
-                float randomOffsetX = (1.0f - (random01() * 2.0f)) / 2.0f;
-                float randomOffsetY = (1.0f - (random01() * 2.0f)) / 2.0f;
+// Samples a pixel takes in the next wavefront round: the ones renderPixel
+// takes before it next checks for convergence, so both engines stop every
+// pixel after the same samples
+int wavefront_round_samples(const SceneInfo* info, const PixelStats* stats) {
+    if(pixel_stats_done(info, stats)) {
+        return 0;
+    }
+    int samples = info->rayPerPixel - stats->count;
+    if(info->targetError > 0.0f) {
+        int minSamples = info->minRayPerPixel > 2 ? info->minRayPerPixel : 2;
+        int needed = stats->count < minSamples ? minSamples - stats->count : 1;
+        samples = needed < samples ? needed : samples;
+    }
+    return samples < WAVEFRONT_ROUND_SAMPLES ? samples : WAVEFRONT_ROUND_SAMPLES;
+}
 
-                float pX = (2 * ((x + 0.5f + randomOffsetX) / (float)(width)) - 1) * tan(scene->camera->fov / 2 * PI / 180.0f) * scene->camera->aspectRatio;
-                float pY = (1 - 2 * ((y + 0.5f + randomOffsetY) / (float)height)) * tan(scene->camera->fov / 2.0f * PI / 180.0f);
+PathState wavefront_load_path(const WavefrontQueue* queue, int path) {
+    PathState state;
+    state.color = vec3_build(queue->colorR[path], queue->colorG[path], queue->colorB[path]);
+    state.throughput = vec3_build(queue->throughputR[path], queue->throughputG[path], queue->throughputB[path]);
+    state.lightsSampled = queue->lightsSampled[path];
+    state.lastPosition = vec3_build(queue->lastX[path], queue->lastY[path], queue->lastZ[path]);
+    state.lastObject = queue->lastObject[path];
+    state.lastBsdfPdf = queue->lastBsdfPdf[path];
+    state.coneWidth = queue->coneWidth[path];
+    state.coneSpread = queue->coneSpread[path];
+    return state;
+}
 
-                Vec3 pixelPosCamSpace = vec3_build(pX, pY, -1.0f);
+void wavefront_store_path(WavefrontQueue* queue, int path, const PathState* state) {
+    queue->colorR[path] = state->color.x;
+    queue->colorG[path] = state->color.y;
+    queue->colorB[path] = state->color.z;
+    queue->throughputR[path] = state->throughput.x;
+    queue->throughputG[path] = state->throughput.y;
+    queue->throughputB[path] = state->throughput.z;
+    queue->lightsSampled[path] = state->lightsSampled;
+    queue->lastX[path] = state->lastPosition.x;
+    queue->lastY[path] = state->lastPosition.y;
+    queue->lastZ[path] = state->lastPosition.z;
+    queue->lastObject[path] = state->lastObject;
+    queue->lastBsdfPdf[path] = state->lastBsdfPdf;
+    queue->coneWidth[path] = state->coneWidth;
+    queue->coneSpread[path] = state->coneSpread;
+}
 
-                Vec4 originWorld = vec4_mat4_mult(vec4_build_from_vec3(scene->camera->position, 1.0f), matrix);
-                Vec3 originWorldv3 = vec3_build(originWorld.x, originWorld.y, originWorld.z);
-                Vec4 pixelPos = vec4_mat4_mult(vec4_build_from_vec3(pixelPosCamSpace, 1.0f), matrix);
-                Vec3 pixelPosWorld = vec3_build(pixelPos.x, pixelPos.y, pixelPos.z);
+// Finds the closest hit of the listed rays. Runs of neighbouring rays in
+// the list are traced as one packet when their directions are close enough.
+void wavefront_intersect(RenderJob* job, const RaySoA* rays, const int* items, int count, HitInfo* hits) {
+    Scene* scene = job->scene;
+    int packetSize = job->kernels.width > 0 && scene->info->packetSize >= 4 ? scene->info->packetSize : 1;
+    Ray packetRays[PACKET_MAX_SIZE];
+    HitInfo packetHits[PACKET_MAX_SIZE];
+    for(int first = 0; first < count; first += packetSize) {
+        int size = count - first < packetSize ? count - first : packetSize;
+        for(int i = 0; i < size; i++) {
+            packetRays[i] = ray_soa_load(rays, items[first + i]);
+        }
+        if(size > 1 && packet_is_coherent(packetRays, size)) {
+            packet_intersect_scene(&job->kernels, scene, packetRays, size, packetHits);
+            for(int i = 0; i < size; i++) {
+                hits[items[first + i]] = packetHits[i];
+            }
+            continue;
+        }
+        for(int i = 0; i < size; i++) {
+            hits[items[first + i]] = intersect_scene(scene, packetRays[i]);
+        }
+    }
+}
 
-                Vec3 direction = vec3_normalize(vec3_sub(pixelPosWorld, originWorldv3));
+// Moves every path of the queue forward one bounce at a time until they
+// have all ended. Each bounce intersects the rays binned by direction,
+// shades the hits binned by material, then traces the shadow rays the
+// shading queued, binned by direction too.
+void wavefront_trace(RenderJob* job, WavefrontQueue* queue) {
+    Scene* scene = job->scene;
+    for(int bounce = 0; bounce <= scene->info->maxRayDepth && queue->activeCount > 0; bounce++) {
+        int count = queue->activeCount;
+        traceLocalRays += count;
+        COUNTER_ADD(COUNTER_BOUNCES, count);
 
-                Ray ray = ray_create(originWorldv3, direction);
+        // Camera rays are already grouped by pixel
+        if(bounce > 0) {
+            wavefront_direction_keys(queue, &queue->rays, queue->active, count);
+            wavefront_sort(queue, queue->active, count);
+        }
+        wavefront_intersect(job, &queue->rays, queue->active, count, queue->hits);
 
-                avgColor = vec3_add(avgColor, trace(scene, &ray));
+        // Misses go in the first bin
+        for(int i = 0; i < count; i++) {
+            int path = queue->active[i];
+            int object = queue->hits[path].object;
+            queue->keys[path] = object < 0 ? 0 : scene_object_material(scene, object) + 1;
+        }
+        wavefront_sort(queue, queue->active, count);
+        queue->shadowCount = 0;
+        int alive = 0;
+        for(int i = 0; i < count; i++) {
+            int path = queue->active[i];
+            PathState state = wavefront_load_path(queue, path);
+            Ray ray = ray_soa_load(&queue->rays, path);
+            Sampler sampler = pixel_sampler(scene, queue->imagePixel[path], queue->sample[path]);
+            sampler_set_bounce(&sampler, bounce + 1);
+            ShadowRay shadow;
+            int going = path_shade(scene, &state, &ray, &queue->hits[path], bounce, &sampler, &shadow);
+            wavefront_store_path(queue, path, &state);
+            ray_soa_store(&queue->rays, path, ray);
+            if(shadow.light >= 0) {
+                int index = queue->shadowCount++;
+                ray_soa_store(&queue->shadowRays, index, shadow.ray);
+                queue->shadowR[index] = shadow.contribution.x;
+                queue->shadowG[index] = shadow.contribution.y;
+                queue->shadowB[index] = shadow.contribution.z;
+                queue->shadowLight[index] = shadow.light;
+                queue->shadowPath[index] = path;
+                queue->shadowOrder[index] = index;
             }
-            int index = (y * width + x) * 3;
+            if(going && bounce < scene->info->maxRayDepth) {
+                queue->active[alive++] = path;
+            }
+            else {
+                COUNTER_PATH_LENGTH(bounce + 1);
+            }
+        }
+        queue->activeCount = alive;
+
+        int shadows = queue->shadowCount;
+        wavefront_direction_keys(queue, &queue->shadowRays, queue->shadowOrder, shadows);
+        wavefront_sort(queue, queue->shadowOrder, shadows);
+        wavefront_intersect(job, &queue->shadowRays, queue->shadowOrder, shadows, queue->shadowHits);
+        for(int i = 0; i < shadows; i++) {
+            if(queue->shadowHits[i].object == queue->shadowLight[i]) {
+                int path = queue->shadowPath[i];
+                queue->colorR[path] += queue->shadowR[i];
+                queue->colorG[path] += queue->shadowG[i];
+                queue->colorB[path] += queue->shadowB[i];
+            }
+        }
+    }
+}
+
+// Renders a tile with the wavefront engine. Every round starts the next
+// samples of all the pixels that have not converged as one batch of paths.
+// Samplers are keyed like in renderPixel, so the image is the same.
+void renderWavefrontTile(RenderJob* job, WavefrontQueue* queue, int startX, int startY, int endX, int endY, PixelStats* tileStats) {
+    Scene* scene = job->scene;
+    PathState start = path_state_create(scene);
+    while(1) {
+        int count = 0;
+        for (int y = startY; y < endY; y++) {
+            for (int x = startX; x < endX; x++) {
+                int local = (y - startY) * TILE_SIZE + (x - startX);
+                int samples = wavefront_round_samples(scene->info, &tileStats[local]);
+                for(int s = 0; s < samples; s++) {
+                    int path = count++;
+                    queue->tilePixel[path] = local;
+                    queue->imagePixel[path] = y * scene->info->width + x;
+                    queue->sample[path] = tileStats[local].count + s;
+                    queue->active[path] = path;
+                    Sampler sampler = pixel_sampler(scene, queue->imagePixel[path], queue->sample[path]);
+                    ray_soa_store(&queue->rays, path, camera_ray(scene, job->camToWorld, x, y, &sampler));
+                    wavefront_store_path(queue, path, &start);
+                }
+            }
+        }
+        if(count == 0) {
+            break;
+        }
+        COUNTER_ADD(COUNTER_PATHS, count);
+        queue->activeCount = count;
+        wavefront_trace(job, queue);
+        // Paths are in pixel then sample order, so every pixel gets its samples in order
+        for(int path = 0; path < count; path++) {
+            pixel_stats_add(&tileStats[queue->tilePixel[path]], vec3_build(queue->colorR[path], queue->colorG[path], queue->colorB[path]));
+        }
+    }
+}
 
-            int rChannel;
-            int gChannel;
-            int bChannel;
+CheckpointSettings renderCheckpointSettings(Scene* scene) {
+    CheckpointSettings settings;
+    memset(&settings, 0, sizeof(CheckpointSettings));
+    settings.maxRayDepth = scene->info->maxRayDepth;
+    settings.directLighting = scene->info->directLighting;
+    settings.rouletteDepth = scene->info->rouletteDepth;
+    settings.textureFilter = scene->info->textureFilter;
+    settings.sampler = scene->info->sampler;
+    settings.strata = scene->info->sampler == SAMPLER_STRATIFIED ? scene->info->rayPerPixel : 0;
+    settings.compactMeshes = scene->info->compactMeshes;
+    settings.nbSpheres = scene->info->nbSpheres;
+    settings.nbModels = scene->info->nbModels;
+    settings.nbMaterials = scene->nbMaterials;
+    settings.sceneHash = scene_content_hash(scene);
+    return settings;
+}
 
-            avgColor = vec3_div(avgColor, scene->info->rayPerPixel);
+// Pixels covered by a tile, the last row and column of tiles can be smaller
+void tileBounds(int tile, int width, int height, int* startX, int* startY, int* endX, int* endY) {
+    int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    *startX = (tile % tilesX) * TILE_SIZE;
+    *startY = (tile / tilesX) * TILE_SIZE;
+    *endX = *startX + TILE_SIZE < width ? *startX + TILE_SIZE : width;
+    *endY = *startY + TILE_SIZE < height ? *startY + TILE_SIZE : height;
+}
+
+void renderTile(void* ctx, int workerId, int tile) {
+    RenderJob* job = (RenderJob*)ctx;
+    int width = job->scene->info->width;
+    int height = job->scene->info->height;
+
+    int startX, startY, endX, endY;
+    tileBounds(tile, width, height, &startX, &startY, &endX, &endY);
+
+    // Each worker renders into its own tile and only touches the shared image once the tile is done
+    Framebuffer* fb = &job->scene->framebuffer;
+    PixelStats tileStats[TILE_SIZE * TILE_SIZE];
+    long long tileSamples = 0;
+    for (int y = startY; y < endY; y++) {
+        for (int x = startX; x < endX; x++) {
+            tileStats[(y - startY) * TILE_SIZE + (x - startX)] = fb->pixels[y * width + x];
+            tileSamples -= fb->pixels[y * width + x].count;
+        }
+    }
+    int packetSize = job->kernels.width > 0 ? job->scene->info->packetSize : 0;
+    if(job->queues != NULL) {
+        renderWavefrontTile(job, &job->queues[workerId], startX, startY, endX, endY, tileStats);
+    }
+    else if(packetSize >= 4) {
+        // 4 rays cover 2x2 pixels, 8 rays 4x2 and 16 rays 4x4
+        int blockW = packetSize >= 8 ? 4 : 2;
+        int blockH = packetSize / blockW;
+        PixelStats stats[PACKET_MAX_SIZE];
+        for (int by = startY; by < endY; by += blockH) {
+            for (int bx = startX; bx < endX; bx += blockW) {
+                int w = bx + blockW < endX ? blockW : endX - bx;
+                int h = by + blockH < endY ? blockH : endY - by;
+                for(int i = 0; i < w * h; i++) {
+                    stats[i] = tileStats[(by - startY + i / w) * TILE_SIZE + (bx - startX + i % w)];
+                }
+                renderPacketBlock(job, bx, by, w, h, stats);
+                for(int i = 0; i < w * h; i++) {
+                    tileStats[(by - startY + i / w) * TILE_SIZE + (bx - startX + i % w)] = stats[i];
+                }
+            }
+        }
+    }
+    else {
+        for (int y = startY; y < endY; y++) {
+            for (int x = startX; x < endX; x++) {
+                renderPixel(job->scene, job->camToWorld, x, y, &tileStats[(y - startY) * TILE_SIZE + (x - startX)]);
+            }
+        }
+    }
+
+    unsigned char tileData[TILE_SIZE * TILE_SIZE * 3];
+    for (int y = startY; y < endY; y++) {
+        for (int x = startX; x < endX; x++) {
+            PixelStats* stats = &tileStats[(y - startY) * TILE_SIZE + (x - startX)];
+            tileSamples += stats->count;
+            Vec3 avgColor = pixel_stats_color(stats);
 
             vec3_clamp(vec3_build(0.0f, 0.0f, 0.0f), vec3_build(1.0f, 1.0f, 1.0f), &avgColor);
 
-            rChannel = (int)(255.999 * avgColor.x);
-            gChannel = (int)(255.999 * avgColor.y);
-            bChannel = (int)(255.999 * avgColor.z);
+            int index = ((y - startY) * TILE_SIZE + (x - startX)) * 3;
+            tileData[index] = (int)(255.999 * avgColor.x);
+            tileData[index + 1] = (int)(255.999 * avgColor.y);
+            tileData[index + 2] = (int)(255.999 * avgColor.z);
+        }
+    }
+
+    for (int y = startY; y < endY; y++) {
+        memcpy(&job->pixelData[(y * width + startX) * 3], &tileData[(y - startY) * TILE_SIZE * 3], (endX - startX) * 3);
+    }
+
+    pthread_mutex_lock(&job->framebufferLock);
+    for (int y = startY; y < endY; y++) {
+        memcpy(&fb->pixels[y * width + startX], &tileStats[(y - startY) * TILE_SIZE], (endX - startX) * sizeof(PixelStats));
+    }
+    const SceneInfo* info = job->scene->info;
+    int checkpoint = 0;
+    if(job->checkpoint.pixels != NULL && !job->checkpointing && wallTime() - job->lastCheckpoint >= info->checkpointInterval) {
+        // Tiles still being rendered are saved with the samples they had
+        memcpy(job->checkpoint.pixels, fb->pixels, (size_t)fb->width * fb->height * sizeof(PixelStats));
+        job->checkpointing = 1;
+        checkpoint = 1;
+    }
+    pthread_mutex_unlock(&job->framebufferLock);
+
+    // The other threads go on adding tiles while the copy is written
+    if(checkpoint) {
+        framebuffer_save_checkpoint(&job->checkpoint, &job->checkpointSettings, info->checkpointFile);
+        pthread_mutex_lock(&job->framebufferLock);
+        job->lastCheckpoint = wallTime();
+        job->checkpointing = 0;
+        pthread_mutex_unlock(&job->framebufferLock);
+    }
 
-            pixelData[index] = (rChannel);
-            pixelData[index + 1] = (gChannel);
-            pixelData[index + 2] = (bChannel);
+    atomic_fetch_add(&job->samplesDone, tileSamples);
+    atomic_fetch_add(&job->raysDone, traceLocalRays);
+    traceLocalRays = 0;
+    counters_flush();
+
+    int nbTiles = job->tilesX * job->tilesY;
+    int done = atomic_fetch_add(&job->tilesDone, 1) + 1;
+    int step = nbTiles / 20 > 0 ? nbTiles / 20 : 1;
+    if(job->scene->info->verbose && (done % step == 0 || done == nbTiles)) {
+        printf("Tiles left: %d\n", nbTiles - done);
+    }
+}
+
+// Orders the tiles along a Morton curve so consecutive tiles, and the slice
+// of tiles each worker starts with, stay close together in the image.
+int* mortonTileOrder(int tilesX, int tilesY) {
+    int* order = (int*)malloc(tilesX * tilesY * sizeof(int));
+    if(order == NULL) {
+        return NULL;
+    }
+    int side = 1;
+    while(side < tilesX || side < tilesY) {
+        side *= 2;
+    }
+    int count = 0;
+    for(unsigned int code = 0; code < (unsigned int)(side * side); code++) {
+        unsigned int tx = 0, ty = 0;
+        for(int bit = 0; bit < 16; bit++) {
+            tx |= ((code >> (2 * bit)) & 1u) << bit;
+            ty |= ((code >> (2 * bit + 1)) & 1u) << bit;
+        }
+        if((int)tx < tilesX && (int)ty < tilesY) {
+            order[count++] = ty * tilesX + tx;
         }
     }
+    return order;
+}
 
-    free(matrix);
+// Writes the samples taken by every pixel as a blue (few) to red (many) image
+void writeSampleHeatmap(const char* filename, const Framebuffer* fb, int maxSamples) {
+    int width = fb->width;
+    int height = fb->height;
+    unsigned char* heatmap = (unsigned char*)malloc(width * height * 3 * sizeof(unsigned char));
+    if(heatmap == NULL) {
+        perror("Failed to allocate heatmap");
+        return;
+    }
+    for(int i = 0; i < width * height; i++) {
+        float t = maxSamples > 0 ? (float)fb->pixels[i].count / (float)maxSamples : 0.0f;
+        float r = fminf(fmaxf(2.0f * t - 1.0f, 0.0f), 1.0f);
+        float g = 1.0f - fabsf(2.0f * t - 1.0f);
+        float b = fminf(fmaxf(1.0f - 2.0f * t, 0.0f), 1.0f);
+        heatmap[i * 3] = (unsigned char)(255.999f * r);
+        heatmap[i * 3 + 1] = (unsigned char)(255.999f * g);
+        heatmap[i * 3 + 2] = (unsigned char)(255.999f * b);
+    }
+    writePPM(filename, width, height, heatmap);
+    free(heatmap);
+}
+
+// Camera rays averaged into the features of a pixel. They are the rays of
+// its first samples, so the features line up with the antialiased color.
+#define FEATURE_SAMPLES 4
+// Mirrors show what they reflect: the albedo follows up to this many
+// bounces on materials at least FEATURE_MIRROR_SPECULAR specular
+#define FEATURE_MIRROR_BOUNCES 4
+#define FEATURE_MIRROR_SPECULAR 0.9f
 
-    printf("Path tracing finished\n");
+typedef struct FeatureJob {
+    Scene* scene;
+    float* camToWorld;
+    Denoiser* denoiser;
+    atomic_llong rays;
+} FeatureJob;
+
+// Albedo seen by a camera ray, through mirrors. The normal and depth are
+// those of the first hit, left alone when the ray escapes. The mirror rays
+// traced are added to rays.
+Vec3 feature_albedo(Scene* scene, Ray ray, HitInfo hit, Vec3* normal, float* depth, long long* rays) {
+    Vec3 weight = vec3_build(1.0f, 1.0f, 1.0f);
+    float spread = camera_pixel_spread(scene->camera, scene->info->height);
+    float footprint = 0.0f;
+    for(int bounce = 0; hit.object >= 0; bounce++) {
+        SurfaceHit surface = scene_hit_surface(scene, ray, &hit);
+        const Material* material = &scene->materials[surface.material];
+        footprint += spread * hit.hitDistance * vec3_length(ray.direction);
+        Vec3 albedo = getTextureColor(scene, &surface, material, ray, footprint);
+        if(bounce == 0) {
+            *normal = vec3_add(*normal, surface.normal);
+            *depth += hit.hitDistance * vec3_length(ray.direction);
+        }
+        if(material->specular < FEATURE_MIRROR_SPECULAR || bounce == FEATURE_MIRROR_BOUNCES) {
+            return vec3_vec3_mul(weight, albedo);
+        }
+        weight = vec3_vec3_mul(weight, albedo);
+        ray = ray_create(surface.position, vec3_reflect(ray.direction, surface.normal));
+        hit = intersect_scene(scene, ray);
+        (*rays)++;
+    }
+    return vec3_vec3_mul(weight, getColor(ray));
+}
+
+void renderFeatureTile(void* ctx, int workerId, int tile) {
+    (void)workerId;
+    FeatureJob* job = (FeatureJob*)ctx;
+    Scene* scene = job->scene;
+    int width = scene->info->width;
+    int startX, startY, endX, endY;
+    tileBounds(tile, width, scene->info->height, &startX, &startY, &endX, &endY);
+    long long rays = 0;
+    for(int y = startY; y < endY; y++) {
+        for(int x = startX; x < endX; x++) {
+            Vec3 albedo = vec3_build(0.0f, 0.0f, 0.0f);
+            Vec3 normal = vec3_build(0.0f, 0.0f, 0.0f);
+            float depth = 0.0f;
+            int hits = 0;
+            for(int s = 0; s < FEATURE_SAMPLES; s++) {
+                Sampler sampler = pixel_sampler(scene, y * width + x, s);
+                Ray ray = camera_ray(scene, job->camToWorld, x, y, &sampler);
+                HitInfo hit = intersect_scene(scene, ray);
+                rays++;
+                hits += hit.object >= 0;
+                albedo = vec3_add(albedo, feature_albedo(scene, ray, hit, &normal, &depth, &rays));
+            }
+            albedo = vec3_div(albedo, FEATURE_SAMPLES);
+            normal = vec3_length(normal) > 0.0f ? vec3_normalize(normal) : normal;
+            depth = hits > 0 ? depth / hits : 0.0f;
+
+            const PixelStats* stats = &scene->framebuffer.pixels[y * width + x];
+            Vec3 color = pixel_stats_color(stats);
+            vec3_clamp(vec3_build(0.0f, 0.0f, 0.0f), vec3_build(1.0f, 1.0f, 1.0f), &color);
+            // Variance of the mean, a pixel without enough samples to tell
+            // is taken as very noisy
+            float variance = stats->count > 1 ? stats->m2 / (stats->count - 1) / stats->count : 1.0f;
+            denoiser_set_pixel(job->denoiser, x, y, color, variance, albedo, normal, depth);
+        }
+    }
+    atomic_fetch_add(&job->rays, rays);
+}
+
+// Replaces the image in pixelData by the denoised framebuffer of the scene.
+// The features are traced first, then filtered along with the color.
+// Returns 0 and leaves pixelData alone when it could not be allocated.
+int renderDenoise(Scene* scene, unsigned char* pixelData) {
+    double start = wallTime();
+    int width = scene->info->width;
+    int height = scene->info->height;
+    Denoiser denoiser;
+    if(!denoiser_init(&denoiser, width, height)) {
+        return 0;
+    }
+    FeatureJob job;
+    job.scene = scene;
+    job.denoiser = &denoiser;
+    job.camToWorld = (float*)malloc(4 * 4 * sizeof(float));
+    atomic_init(&job.rays, 0);
+    int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    int* tiles = mortonTileOrder(tilesX, tilesY);
+    if(job.camToWorld == NULL || tiles == NULL) {
+        perror("Failed to allocate feature pass");
+        free(job.camToWorld);
+        free(tiles);
+        freeDenoiser(&denoiser);
+        return 0;
+    }
+    computeCamToWorld(scene->camera, job.camToWorld);
+    threadpool_run(scene->info->nbThreads, tiles, tilesX * tilesY, renderFeatureTile, &job);
+    free(tiles);
+    free(job.camToWorld);
+    double featureTime = wallTime() - start;
+    scene->stats.featureRays = atomic_load(&job.rays);
+
+    if(scene->info->featuresFile != NULL) {
+        denoiser_write_features(&denoiser, scene->info->featuresFile);
+    }
+    if(!denoiser_run(&denoiser, scene->info->nbThreads)) {
+        freeDenoiser(&denoiser);
+        return 0;
+    }
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            Vec3 color = denoiser_color(&denoiser, x, y);
+            vec3_clamp(vec3_build(0.0f, 0.0f, 0.0f), vec3_build(1.0f, 1.0f, 1.0f), &color);
+            int index = (y * width + x) * 3;
+            pixelData[index] = (int)(255.999 * color.x);
+            pixelData[index + 1] = (int)(255.999 * color.y);
+            pixelData[index + 2] = (int)(255.999 * color.z);
+        }
+    }
+    scene->stats.denoiseTime = wallTime() - start;
+    if(scene->info->verbose) {
+        printf("Denoised in %.3f s (features %.3f s for %lld rays, %d passes with %s kernels)\n", scene->stats.denoiseTime, featureTime, scene->stats.featureRays, DENOISE_ITERATIONS, denoiser.kernels.name);
+        if(scene->info->featuresFile != NULL) {
+            printf("Features drawn to %s_albedo.ppm, %s_normal.ppm and %s_depth.ppm\n", scene->info->featuresFile, scene->info->featuresFile, scene->info->featuresFile);
+        }
+    }
+    freeDenoiser(&denoiser);
+    return 1;
+}
+
+// One queue per render thread, sized for the materials of the scene
+WavefrontQueue* createWavefrontQueues(Scene* scene) {
+    int count = scene->info->nbThreads > 0 ? scene->info->nbThreads : 1;
+    WavefrontQueue* queues = (WavefrontQueue*)calloc(count, sizeof(WavefrontQueue));
+    if(queues == NULL) {
+        perror("Failed to allocate wavefront queues");
+        return NULL;
+    }
+    int bins = scene->nbMaterials + 1 > WAVEFRONT_DIRECTION_BINS ? scene->nbMaterials + 1 : WAVEFRONT_DIRECTION_BINS;
+    for(int i = 0; i < count; i++) {
+        if(!wavefront_queue_init(&queues[i], WAVEFRONT_QUEUE_SIZE, bins)) {
+            for(int j = 0; j < i; j++) {
+                freeWavefrontQueue(&queues[j]);
+            }
+            free(queues);
+            return NULL;
+        }
+    }
+    return queues;
+}
+
+void freeWavefrontQueues(Scene* scene, WavefrontQueue* queues) {
+    if(queues == NULL) {
+        return;
+    }
+    int count = scene->info->nbThreads > 0 ? scene->info->nbThreads : 1;
+    for(int i = 0; i < count; i++) {
+        freeWavefrontQueue(&queues[i]);
+    }
+    free(queues);
+}
+
+// Settings the checkpoints of the render are saved and checked with. They
+// are only worked out when the render saves or resumes a checkpoint, since
+// the scene hash reads every texel.
+CheckpointSettings renderJobCheckpointSettings(Scene* scene) {
+    CheckpointSettings settings;
+    memset(&settings, 0, sizeof(CheckpointSettings));
+    if(scene->info->checkpointFile != NULL || scene->info->resumeFile != NULL) {
+        settings = renderCheckpointSettings(scene);
+    }
+    return settings;
+}
+
+// Empties the framebuffer, or fills it from the checkpoint the render resumes
+// from. Returns 0 when the render cannot go on.
+int renderPrepareFramebuffer(Scene* scene, const CheckpointSettings* settings) {
+    if(!framebuffer_reset(&scene->framebuffer, scene->info->width, scene->info->height)) {
+        return 0;
+    }
+    const char* resumeFile = scene->info->resumeFile;
+    if(resumeFile == NULL) {
+        return 1;
+    }
+    int loaded = framebuffer_load_checkpoint(&scene->framebuffer, settings, resumeFile);
+    if(loaded < 0) {
+        return 0;
+    }
+    if(scene->info->verbose && loaded) {
+        printf("Resuming from %s with %lld samples\n", resumeFile, framebuffer_samples(&scene->framebuffer));
+    }
+    else if(scene->info->verbose) {
+        printf("No checkpoint at %s, starting from scratch\n", resumeFile);
+    }
+    return 1;
+}
+
+// Sets up a job that renders tiles of the scene into its framebuffer and
+// pixelData, saving checkpoints with settings unless it is NULL. Returns 0
+// when it could not be allocated.
+int render_job_init(RenderJob* job, Scene* scene, unsigned char* pixelData, const CheckpointSettings* settings) {
+    job->scene = scene;
+    job->camToWorld = (float*)malloc(4 * 4 * sizeof(float));
+    if(job->camToWorld == NULL) {
+        perror("Failed to allocate camera matrix");
+        return 0;
+    }
+    computeCamToWorld(scene->camera, job->camToWorld);
+    job->pixelData = pixelData;
+    pthread_mutex_init(&job->framebufferLock, NULL);
+    job->lastCheckpoint = wallTime();
+    memset(&job->checkpointSettings, 0, sizeof(CheckpointSettings));
+    memset(&job->checkpoint, 0, sizeof(Framebuffer));
+    job->checkpointing = 0;
+    if(settings != NULL && scene->info->checkpointFile != NULL) {
+        job->checkpointSettings = *settings;
+        if(!framebuffer_reset(&job->checkpoint, scene->info->width, scene->info->height)) {
+            pthread_mutex_destroy(&job->framebufferLock);
+            free(job->camToWorld);
+            return 0;
+        }
+    }
+    job->tilesX = (scene->info->width + TILE_SIZE - 1) / TILE_SIZE;
+    job->tilesY = (scene->info->height + TILE_SIZE - 1) / TILE_SIZE;
+    job->kernels = packet_select_kernels();
+    job->queues = NULL;
+    atomic_init(&job->tilesDone, 0);
+    atomic_init(&job->samplesDone, 0);
+    atomic_init(&job->raysDone, 0);
+    traceLocalRays = 0;
+    // The counters cover this render only
+    counters_reset();
+
+    if(scene->info->wavefront) {
+        job->queues = createWavefrontQueues(scene);
+        if(job->queues == NULL) {
+            freeFramebuffer(&job->checkpoint);
+            pthread_mutex_destroy(&job->framebufferLock);
+            free(job->camToWorld);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void render_job_free(RenderJob* job) {
+    freeWavefrontQueues(job->scene, job->queues);
+    freeFramebuffer(&job->checkpoint);
+    pthread_mutex_destroy(&job->framebufferLock);
+    free(job->camToWorld);
+}
+
+// Writes what is asked for besides the image once the framebuffer holds the
+// whole render, and prints how it went
+void renderReport(Scene* scene, const CheckpointSettings* settings) {
+    SceneInfo* info = scene->info;
+    if(info->heatmapFile != NULL) {
+        writeSampleHeatmap(info->heatmapFile, &scene->framebuffer, info->rayPerPixel);
+    }
+    // The finished render can be picked up again to add samples
+    int checkpointed = 0;
+    if(info->checkpointFile != NULL) {
+        checkpointed = framebuffer_save_checkpoint(&scene->framebuffer, settings, info->checkpointFile);
+    }
+
+    if(info->verbose) {
+        printf("Path tracing finished\n");
+        long long maxSamples = (long long)info->width * info->height * info->rayPerPixel;
+        printf("Samples: %lld (%.2f per pixel, %.1f%% of %d per pixel)\n", scene->stats.samples, (double)scene->stats.samples / ((double)info->width * info->height), 100.0 * scene->stats.samples / (double)maxSamples, info->rayPerPixel);
+        printf("Rays traced: %lld, %.0f rays per second\n", scene->stats.rays, scene->stats.rays / scene->stats.renderTime);
+        if(info->heatmapFile != NULL) {
+            printf("Samples per pixel drawn to %s\n", info->heatmapFile);
+        }
+        if(checkpointed) {
+            printf("Checkpoint written to %s\n", info->checkpointFile);
+        }
+    }
+}
+
+unsigned char* renderScene(Scene* scene) {
+    int verbose = scene->info->verbose;
+    if(verbose) {
+        printf("Starting path tracing\n");
+    }
+    double start = wallTime();
+
+    int width = scene->info->width;
+    int height = scene->info->height;
+
+    // Allocate memory for the pixel data
+    unsigned char *pixelData = (unsigned char *)malloc(width * height * 3 * sizeof(unsigned char));
+    if (pixelData == NULL) {
+        perror("Failed to allocate memory");
+        return NULL;
+    }
+
+    // Objects may have moved since the last render, so refit (or build) the top level BVH
+    scene_refit_accel(scene);
+    scene_collect_lights(scene);
+
+    // Samples are added to the framebuffer, which starts empty unless the render goes on from a checkpoint
+    CheckpointSettings settings = renderJobCheckpointSettings(scene);
+    if(!renderPrepareFramebuffer(scene, &settings)) {
+        free(pixelData);
+        return NULL;
+    }
+
+    RenderJob job;
+    if(!render_job_init(&job, scene, pixelData, &settings)) {
+        free(pixelData);
+        return NULL;
+    }
+
+    int* tiles = mortonTileOrder(job.tilesX, job.tilesY);
+    if(tiles == NULL) {
+        perror("Failed to allocate tiles");
+        render_job_free(&job);
+        free(pixelData);
+        return NULL;
+    }
+
+    if(verbose) {
+        printf("Rendering %d tiles on %d threads\n", job.tilesX * job.tilesY, scene->info->nbThreads);
+        if(job.queues != NULL) {
+            printf("Wavefront engine: up to %d paths per tile at a time\n", WAVEFRONT_QUEUE_SIZE);
+        }
+        if(scene->info->packetSize >= 4 && job.kernels.width > 0) {
+            printf("%s rays traced in packets of %d with %s kernels\n", job.queues != NULL ? "Coherent" : "Camera", scene->info->packetSize, job.kernels.name);
+        }
+        if(scene->info->targetError > 0.0f) {
+            printf("Adaptive sampling: %d to %d samples per pixel, target error %.3f\n", scene->info->minRayPerPixel, scene->info->rayPerPixel, scene->info->targetError);
+        }
+    }
+    threadpool_run(scene->info->nbThreads, tiles, job.tilesX * job.tilesY, renderTile, &job);
+
+    free(tiles);
+    render_job_free(&job);
+
+    // The denoiser is timed on its own, rays per second are those of the render
+    scene->stats.renderTime = wallTime() - start;
+    scene->stats.samples = atomic_load(&job.samplesDone);
+    scene->stats.rays = atomic_load(&job.raysDone);
+    scene->stats.denoiseTime = 0.0;
+    scene->stats.featureRays = 0;
+    if(scene->info->denoise) {
+        renderDenoise(scene, pixelData);
+    }
+    renderReport(scene, &settings);
+    if(verbose) {
+        counters_print();
+    }
 
     return pixelData;
-}
\ No newline at end of file
+}
@@ -0,0 +1,207 @@
+#ifndef PRESETS_H
+#define PRESETS_H
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+#include "scene.h"
+#include "meshCache.h"
+#include "texture.h"
+
+// Built-in scenes that can be picked from the command line. A preset knows
+// how many objects it needs so the scene can be created for it, then fills
+// the scene in. The camera is the same for every preset, since the camera
+// code only works well for the default one.
+
+typedef int (*PresetSetup)(Scene* scene, Texture* tex);
+
+typedef struct ScenePreset {
+    const char* name;
+    const char* description;
+    int nbSpheres;
+    int nbModels;
+    PresetSetup setup;
+} ScenePreset;
+
+// The texture is optional, materials are left untextured when it failed to load
+Texture* preset_texture(Texture* tex) {
+    return tex != NULL && tex->levelCount > 0 ? tex : NULL;
+}
+
+Material preset_light() {
+    return material_create(vec3_build(0.0f, 0.0f, 0.0f), vec3_build(1.0f, 1.0f, 1.0f), 2.0f, 0.0f, NULL);
+}
+
+int preset_default(Scene* scene, Texture* tex) {
+    int red = scene_add_material(scene, material_create(vec3_build(0.0f, 1.0f, 0.0f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, preset_texture(tex)));
+    int green = scene_add_material(scene, material_green());
+    int textured = scene_add_material(scene, material_create(vec3_build(1.0f, 1.0f, 1.0f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, preset_texture(tex)));
+    int light = scene_add_material(scene, preset_light());
+    if(red < 0 || green < 0 || textured < 0 || light < 0) {
+        return 0;
+    }
+
+    scene->spheres[0] = sphere_create(0.5f, vec3_build(0.0f, 0.0f, -5.0f), green);
+    scene->spheres[1] = sphere_create(100.0f, vec3_build(0.0f, -100.5f, -5.0f), red);
+    scene->spheres[2] = sphere_create(0.75f, vec3_build(-1.0f, 0.25f, -5.5f), textured);
+    scene->spheres[3] = sphere_create(10.0f, vec3_build(7.5f, 2.5f, -25.0f), light);
+    scene->spheres[4] = sphere_create(20.0f, vec3_build(-7.5f, 2.5f, 25.0f), light);
+    return 1;
+}
+
+int preset_mesh(Scene* scene, Texture* tex) {
+    int ground = scene_add_material(scene, material_create(vec3_build(0.0f, 1.0f, 0.0f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, preset_texture(tex)));
+    int blue = scene_add_material(scene, material_blue());
+    int light = scene_add_material(scene, preset_light());
+    if(ground < 0 || blue < 0 || light < 0) {
+        return 0;
+    }
+    Mesh loaded;
+    if(!loadObjCached("../assets/mesh/sphere.obj", scene->info->compactMeshes, &scene->arena, &loaded)) {
+        return 0;
+    }
+    const Mesh* mesh = scene_add_mesh(scene, loaded);
+    if(mesh == NULL) {
+        return 0;
+    }
+
+    scene->spheres[0] = sphere_create(100.0f, vec3_build(0.0f, -100.5f, -5.0f), ground);
+    scene->spheres[1] = sphere_create(0.75f, vec3_build(-1.0f, 0.25f, -5.5f), blue);
+    scene->spheres[2] = sphere_create(10.0f, vec3_build(7.5f, 2.5f, -25.0f), light);
+    scene->spheres[3] = sphere_create(20.0f, vec3_build(-7.5f, 2.5f, 25.0f), light);
+    // Same material as the ground
+    scene->models[0] = model_create(mesh, transform_translation(vec3_build(0.5f, 0.0f, -5.0f)), ground);
+    return 1;
+}
+
+#define PRESET_FOREST_SIZE 100
+
+// Ten thousand instances of the icosphere, each with its own rotation, scale
+// and position. The mesh is loaded once, every model only adds a transform.
+int preset_forest(Scene* scene, Texture* tex) {
+    int ground = scene_add_material(scene, material_create(vec3_build(0.5f, 0.5f, 0.5f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, preset_texture(tex)));
+    int light = scene_add_material(scene, preset_light());
+    int colors[3] = {
+        scene_add_material(scene, material_red()),
+        scene_add_material(scene, material_green()),
+        scene_add_material(scene, material_blue())
+    };
+    if(ground < 0 || light < 0 || colors[0] < 0 || colors[1] < 0 || colors[2] < 0) {
+        return 0;
+    }
+    Mesh loaded;
+    if(!loadObjCached("../assets/mesh/icosphere.obj", scene->info->compactMeshes, &scene->arena, &loaded)) {
+        return 0;
+    }
+    const Mesh* mesh = scene_add_mesh(scene, loaded);
+    if(mesh == NULL) {
+        return 0;
+    }
+
+    scene->spheres[0] = sphere_create(100.0f, vec3_build(0.0f, -100.5f, -5.0f), ground);
+    scene->spheres[1] = sphere_create(10.0f, vec3_build(7.5f, 12.5f, -25.0f), light);
+    // Fixed seed so the forest is the same on every run and every worker
+    Sampler sampler = sampler_create(0, 0);
+    for(int i = 0; i < PRESET_FOREST_SIZE * PRESET_FOREST_SIZE; i++) {
+        int gx = i % PRESET_FOREST_SIZE;
+        int gz = i / PRESET_FOREST_SIZE;
+        float size = random_range(&sampler, 0.04f, 0.1f);
+        Vec3 position = vec3_build(-10.0f + 0.2f * gx + random_range(&sampler, -0.05f, 0.05f), -0.5f + size, -2.0f - 0.2f * gz + random_range(&sampler, -0.05f, 0.05f));
+        Vec3 angles = vec3_build(random_range(&sampler, 0.0f, 360.0f), random_range(&sampler, 0.0f, 360.0f), random_range(&sampler, 0.0f, 360.0f));
+        // Squashed a little along one axis so the rotation shows
+        Vec3 scale = vec3_build(size, size * random_range(&sampler, 0.6f, 1.0f), size);
+        Transform rotation = transform_rotation(angles);
+        Transform scaling = transform_scale(scale);
+        Transform local = transform_multiply(&rotation, &scaling);
+        Transform placement = transform_translation(position);
+        scene->models[i] = model_create(mesh, transform_multiply(&placement, &local), colors[i % 3]);
+    }
+    return 1;
+}
+
+#define PRESET_GRID_SIZE 20
+
+// A field of small spheres, mostly there to load the top level BVH
+int preset_spheres(Scene* scene, Texture* tex) {
+    (void)tex;
+    int ground = scene_add_material(scene, material_create(vec3_build(0.5f, 0.5f, 0.5f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, NULL));
+    int light = scene_add_material(scene, preset_light());
+    int colors[3] = {
+        scene_add_material(scene, material_red()),
+        scene_add_material(scene, material_green()),
+        scene_add_material(scene, material_blue())
+    };
+    int mirrors[3];
+    for(int k = 0; k < 3; k++) {
+        Material mirror = scene->materials[colors[k]];
+        mirror.specular = 1.0f;
+        mirrors[k] = scene_add_material(scene, mirror);
+    }
+    if(ground < 0 || light < 0 || colors[0] < 0 || colors[1] < 0 || colors[2] < 0 || mirrors[0] < 0 || mirrors[1] < 0 || mirrors[2] < 0) {
+        return 0;
+    }
+
+    scene->spheres[0] = sphere_create(100.0f, vec3_build(0.0f, -100.5f, -5.0f), ground);
+    scene->spheres[1] = sphere_create(10.0f, vec3_build(7.5f, 12.5f, -25.0f), light);
+    for(int i = 0; i < PRESET_GRID_SIZE * PRESET_GRID_SIZE; i++) {
+        int gx = i % PRESET_GRID_SIZE;
+        int gz = i / PRESET_GRID_SIZE;
+        Vec3 center = vec3_build(-5.0f + 0.5f * gx, -0.35f, -3.0f - 0.5f * gz);
+        // Every seventh sphere is a mirror
+        int material = i % 7 == 0 ? mirrors[i % 3] : colors[i % 3];
+        scene->spheres[2 + i] = sphere_create(0.15f, center, material);
+    }
+    return 1;
+}
+
+#define PRESET_PARTICLE_COUNT 50000
+
+// A cloud of fifty thousand tiny spheres, where the top level leaves are
+// full of spheres and the SIMD sphere tests do most of the work
+int preset_particles(Scene* scene, Texture* tex) {
+    (void)tex;
+    int ground = scene_add_material(scene, material_create(vec3_build(0.5f, 0.5f, 0.5f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, NULL));
+    int light = scene_add_material(scene, preset_light());
+    int colors[3] = {
+        scene_add_material(scene, material_red()),
+        scene_add_material(scene, material_green()),
+        scene_add_material(scene, material_blue())
+    };
+    if(ground < 0 || light < 0 || colors[0] < 0 || colors[1] < 0 || colors[2] < 0) {
+        return 0;
+    }
+
+    scene->spheres[0] = sphere_create(100.0f, vec3_build(0.0f, -100.5f, -5.0f), ground);
+    scene->spheres[1] = sphere_create(10.0f, vec3_build(7.5f, 12.5f, -25.0f), light);
+    // Fixed seed so the cloud is the same on every run and every worker
+    Sampler sampler = sampler_create(0, 0);
+    for(int i = 0; i < PRESET_PARTICLE_COUNT; i++) {
+        Vec3 center = vec3_build(random_range(&sampler, -4.0f, 4.0f), random_range(&sampler, -0.45f, 2.0f), random_range(&sampler, -12.0f, -3.0f));
+        float radius = random_range(&sampler, 0.015f, 0.04f);
+        scene->spheres[2 + i] = sphere_create(radius, center, colors[i % 3]);
+    }
+    return 1;
+}
+
+static const ScenePreset scenePresets[] = {
+    { "default", "five spheres, two of them lights", 5, 0, preset_default },
+    { "mesh", "the sphere.obj mesh next to spheres", 4, 1, preset_mesh },
+    { "spheres", "a field of 400 small spheres", 2 + PRESET_GRID_SIZE * PRESET_GRID_SIZE, 0, preset_spheres },
+    { "forest", "10000 instances of the icosphere.obj mesh", 2, PRESET_FOREST_SIZE * PRESET_FOREST_SIZE, preset_forest },
+    { "particles", "a cloud of 50000 tiny spheres", 2 + PRESET_PARTICLE_COUNT, 0, preset_particles },
+};
+
+#define SCENE_PRESET_COUNT ((int)(sizeof(scenePresets) / sizeof(scenePresets[0])))
+
+const ScenePreset* preset_find(const char* name) {
+    for(int i = 0; i < SCENE_PRESET_COUNT; i++) {
+        if(strcmp(scenePresets[i].name, name) == 0) {
+            return &scenePresets[i];
+        }
+    }
+    return NULL;
+}
+
+#endif /* PRESETS_H */
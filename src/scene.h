@@ -4,7 +4,9 @@
 #pragma once
 
 #include "math/geometry.h"
+#include "math/spheres.h"
 #include "math/camera.h"
+#include "framebuffer.h"
 
 typedef struct SceneInfo {
     int rayPerPixel;
@@ -13,14 +15,91 @@ typedef struct SceneInfo {
     int maxRayDepth;
     int nbSpheres;
     int nbModels;
+    int nbThreads;
+    // Camera rays traced together (4, 8 or 16), 0 traces every ray on its own
+    int packetSize;
+    // Adaptive sampling: once a pixel has minRayPerPixel samples it stops as
+    // soon as its error estimate is below targetError, rayPerPixel is then
+    // the maximum. A targetError of 0 always takes rayPerPixel samples.
+    int minRayPerPixel;
+    float targetError;
+    // When set, the samples taken by every pixel are written there as an image
+    const char* heatmapFile;
+    // Sample the emissive spheres directly at diffuse hits
+    int directLighting;
+    // Bounces after which paths go through Russian roulette, a value of
+    // maxRayDepth or more turns it off
+    int rouletteDepth;
+    // Progress and statistics printed by renderScene
+    int verbose;
+    // Render with the wavefront engine, which moves all the paths of a tile
+    // forward one bounce at a time instead of tracing them one by one
+    int wavefront;
+    TextureFilter textureFilter;
+    // Where the samples of image pixels come from, see utils/sampler.h
+    SamplerType sampler;
+    // Back the scene arena with huge pages
+    int hugePages;
+    // Load the meshes in compact form, see mesh_build_compact
+    int compactMeshes;
+    // When set, the framebuffer is saved there every checkpointInterval
+    // seconds and at the end of the render
+    const char* checkpointFile;
+    double checkpointInterval;
+    // Checkpoint the render starts from instead of an empty framebuffer
+    const char* resumeFile;
+    // Filter the finished image with the denoiser, guided by first-hit features
+    int denoise;
+    // When set, the features of the denoiser are written as images named
+    // after this prefix
+    const char* featuresFile;
 } SceneInfo;
 
+// Filled by renderScene
+typedef struct RenderStats {
+    double renderTime;
+    // One camera ray per sample
+    long long samples;
+    // Every ray segment traced, camera rays included
+    long long rays;
+    // Spent on the denoiser after the render, features included, and not
+    // part of renderTime
+    double denoiseTime;
+    // Rays traced for the denoiser features, camera rays included, not
+    // part of rays
+    long long featureRays;
+} RenderStats;
+
 typedef struct Scene {
     Camera* camera;
     SceneInfo* info;
     Sphere* spheres;
     Model* models;
+    // Spheres and models refer to their material by its index in this table
+    Material* materials;
+    int nbMaterials;
+    int materialCapacity;
+    // Meshes the models are instances of, each one is loaded once whatever
+    // the number of models placed with it
+    Mesh** meshes;
+    int nbMeshes;
+    int meshCapacity;
     Vec3 ambiantLight;
+    // Top level BVH whose leaves are objects: spheres first, then models
+    BVH topLevel;
+    // Spheres again in top level slot order, for the SIMD leaf tests
+    SphereSoA sphereSoA;
+    SphereKernels sphereKernels;
+    // Indices of the emissive spheres, sampled directly by the path tracer
+    int* lights;
+    int nbLights;
+    RenderStats stats;
+    // Samples of every pixel of the last render
+    Framebuffer framebuffer;
+    // Everything loaded for the scene: spheres, models, materials, meshes
+    // and textures. What changes from one render to the next (top level BVH,
+    // lights, framebuffer) uses the C allocator.
+    Arena arena;
 } Scene;
 
 SceneInfo scene_info_create(int rayPerPixel, int width, int height, int maxRayDepth, int nbSpheres, int nbModels) {
@@ -31,6 +110,24 @@ SceneInfo scene_info_create(int rayPerPixel, int width, int height, int maxRayDe
     info.maxRayDepth = maxRayDepth;
     info.nbSpheres = nbSpheres;
     info.nbModels = nbModels;
+    info.nbThreads = 1;
+    info.packetSize = 8;
+    info.minRayPerPixel = 8;
+    info.targetError = 0.0f;
+    info.heatmapFile = NULL;
+    info.directLighting = 1;
+    info.rouletteDepth = 3;
+    info.verbose = 1;
+    info.wavefront = 0;
+    info.textureFilter = TEXTURE_TRILINEAR;
+    info.sampler = SAMPLER_RANDOM;
+    info.compactMeshes = 0;
+    info.hugePages = 0;
+    info.checkpointFile = NULL;
+    info.checkpointInterval = 60.0;
+    info.resumeFile = NULL;
+    info.denoise = 0;
+    info.featuresFile = NULL;
     return info;
 }
 
@@ -38,8 +135,9 @@ Scene scene_create(Camera* cam, SceneInfo* info) {
     Scene scene;
     scene.camera = cam;
     scene.info = info;
-    scene.spheres = (Sphere*)malloc(info->nbSpheres * sizeof(Sphere));
-    scene.models = (Model*)malloc(info->nbModels * sizeof(Model));
+    scene.arena = arena_create(info->hugePages);
+    scene.spheres = (Sphere*)arena_alloc(&scene.arena, ARENA_SCENE, info->nbSpheres * sizeof(Sphere), 64);
+    scene.models = (Model*)arena_alloc(&scene.arena, ARENA_SCENE, info->nbModels * sizeof(Model), 64);
     if(scene.spheres == NULL) {
         perror("Failed to allocate spheres\n");
     }
@@ -47,26 +145,329 @@ Scene scene_create(Camera* cam, SceneInfo* info) {
         perror("Failed to allocate models\n");
     }
     scene.ambiantLight = vec3_build(0.6f, 0.6f, 0.6f);
+    memset(&scene.topLevel, 0, sizeof(BVH));
+    memset(&scene.sphereSoA, 0, sizeof(SphereSoA));
+    scene.sphereKernels = sphere_select_kernels();
+    memset(&scene.stats, 0, sizeof(RenderStats));
+    memset(&scene.framebuffer, 0, sizeof(Framebuffer));
+    scene.lights = NULL;
+    scene.nbLights = 0;
+    scene.materials = NULL;
+    scene.nbMaterials = 0;
+    scene.materialCapacity = 0;
+    scene.meshes = NULL;
+    scene.nbMeshes = 0;
+    scene.meshCapacity = 0;
     return scene;
 }
 
-HitInfo intersect_scene(Scene* scene, Ray ray) {
-    HitInfo bestHit = hitInfo_create();
+AABB scene_object_bounds(Scene* scene, int object) {
+    if(object < scene->info->nbSpheres) {
+        Sphere* sphere = &scene->spheres[object];
+        Vec3 r = vec3_build(sphere->radius, sphere->radius, sphere->radius);
+        AABB box;
+        box.min = vec3_sub(sphere->center, r);
+        box.max = vec3_add(sphere->center, r);
+        return box;
+    }
+    return model_bounds(&scene->models[object - scene->info->nbSpheres]);
+}
+
+AABB* scene_compute_object_bounds(Scene* scene) {
+    int count = scene->info->nbSpheres + scene->info->nbModels;
+    AABB* bounds = (AABB*)malloc(count * sizeof(AABB));
+    if(bounds == NULL) {
+        perror("Failed to allocate object bounds");
+        return NULL;
+    }
+    for(int i = 0; i < count; i++) {
+        bounds[i] = scene_object_bounds(scene, i);
+    }
+    return bounds;
+}
+
+// Copies the spheres to the slots the top level BVH put them in
+void scene_update_sphere_slots(Scene* scene) {
+    const BVH* bvh = &scene->topLevel;
+    if(!sphere_soa_reset(&scene->sphereSoA, bvh->primCount)) {
+        return;
+    }
+    for(int slot = 0; slot < bvh->primCount; slot++) {
+        int object = bvh->primIndices[slot];
+        if(object < scene->info->nbSpheres) {
+            sphere_soa_set(&scene->sphereSoA, slot, &scene->spheres[object]);
+        }
+    }
+}
+
+// Builds the top level BVH over every sphere and model of the scene
+void scene_build_accel(Scene* scene) {
+    int count = scene->info->nbSpheres + scene->info->nbModels;
+    AABB* bounds = scene_compute_object_bounds(scene);
+    Vec3* centroids = (Vec3*)malloc(count * sizeof(Vec3));
+    float* costs = (float*)malloc(count * sizeof(float));
+    if(bounds == NULL || centroids == NULL || costs == NULL) {
+        free(bounds);
+        free(centroids);
+        free(costs);
+        return;
+    }
+    for(int i = 0; i < count; i++) {
+        centroids[i] = vec3_mul(vec3_add(bounds[i].min, bounds[i].max), 0.5f);
+        // Spheres are tested sphereKernels.width at a time, leaves hold more
+        costs[i] = i < scene->info->nbSpheres ? 1.0f / scene->sphereKernels.width : 1.0f;
+    }
+    freeBVH(&scene->topLevel);
+    // Rebuilt for every frame, so it stays out of the scene arena
+    bvh_build(&scene->topLevel, bounds, centroids, costs, count, NULL, ARENA_SCENE);
+    scene_update_sphere_slots(scene);
+    free(bounds);
+    free(centroids);
+    free(costs);
+}
+
+// Updates the top level bounds after objects moved, without rebuilding it
+void scene_refit_accel(Scene* scene) {
+    if(scene->topLevel.nodes == NULL) {
+        scene_build_accel(scene);
+        return;
+    }
+    AABB* bounds = scene_compute_object_bounds(scene);
+    if(bounds == NULL) {
+        return;
+    }
+    bvh_refit(&scene->topLevel, bounds);
+    scene_update_sphere_slots(scene);
+    free(bounds);
+}
+
+// Adds a material to the table and returns its index, -1 on failure
+int scene_add_material(Scene* scene, Material material) {
+    if(scene->nbMaterials == scene->materialCapacity) {
+        int capacity = scene->materialCapacity > 0 ? scene->materialCapacity * 2 : 8;
+        Material* materials = (Material*)arena_grow(&scene->arena, ARENA_SCENE, scene->materials, scene->materialCapacity * sizeof(Material), capacity * sizeof(Material), 64);
+        if(materials == NULL) {
+            perror("Failed to allocate materials");
+            return -1;
+        }
+        scene->materials = materials;
+        scene->materialCapacity = capacity;
+    }
+    scene->materials[scene->nbMaterials] = material;
+    return scene->nbMaterials++;
+}
+
+// Hands a mesh loaded with the scene arena to the scene, which frees it with
+// the scene. Returns where the scene keeps it for model_create, NULL on
+// failure (the mesh is then freed).
+const Mesh* scene_add_mesh(Scene* scene, Mesh mesh) {
+    if(mesh.tris.count == 0 && mesh.faceCount > 0) {
+        mesh_build_accel(&mesh);
+    }
+    Mesh* stored = (Mesh*)arena_alloc(&scene->arena, ARENA_MESH, sizeof(Mesh), 64);
+    if(stored != NULL && scene->nbMeshes == scene->meshCapacity) {
+        int capacity = scene->meshCapacity > 0 ? scene->meshCapacity * 2 : 4;
+        Mesh** meshes = (Mesh**)arena_grow(&scene->arena, ARENA_SCENE, scene->meshes, scene->meshCapacity * sizeof(Mesh*), capacity * sizeof(Mesh*), 64);
+        if(meshes == NULL) {
+            stored = NULL;
+        }
+        else {
+            scene->meshes = meshes;
+            scene->meshCapacity = capacity;
+        }
+    }
+    if(stored == NULL) {
+        perror("Failed to allocate meshes");
+        freeMesh(&mesh);
+        return NULL;
+    }
+    *stored = mesh;
+    scene->meshes[scene->nbMeshes++] = stored;
+    return stored;
+}
+
+// Lists the emissive spheres, the materials may have changed since the last render
+void scene_collect_lights(Scene* scene) {
+    free(scene->lights);
+    scene->lights = NULL;
+    scene->nbLights = 0;
     for(int i = 0; i < scene->info->nbSpheres; i++) {
-        sphere_intersect(scene->spheres[i], ray, &bestHit);
+        if(scene->materials[scene->spheres[i].material].emissionStrength > 0.0f) {
+            scene->nbLights++;
+        }
+    }
+    if(scene->nbLights == 0) {
+        return;
+    }
+    scene->lights = (int*)malloc(scene->nbLights * sizeof(int));
+    if(scene->lights == NULL) {
+        perror("Failed to allocate lights");
+        scene->nbLights = 0;
+        return;
+    }
+    int count = 0;
+    for(int i = 0; i < scene->info->nbSpheres; i++) {
+        if(scene->materials[scene->spheres[i].material].emissionStrength > 0.0f) {
+            scene->lights[count++] = i;
+        }
+    }
+}
+
+// FNV-1a of size bytes, continued from hash
+uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for(size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// Fingerprint of what the image depends on in the scene: the camera, the
+// spheres, the models, their materials and textures. Meshes count by their
+// size and the size and modification time of their OBJ file, so changing
+// the file changes the hash without hashing every triangle.
+uint64_t scene_content_hash(const Scene* scene) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    hash = hash_bytes(hash, scene->camera, sizeof(Camera));
+    hash = hash_bytes(hash, &scene->ambiantLight, sizeof(Vec3));
+    hash = hash_bytes(hash, scene->spheres, (size_t)scene->info->nbSpheres * sizeof(Sphere));
+    for(int i = 0; i < scene->nbMeshes; i++) {
+        const Mesh* mesh = scene->meshes[i];
+        hash = hash_bytes(hash, &mesh->vertexCount, sizeof(int));
+        hash = hash_bytes(hash, &mesh->faceCount, sizeof(int));
+        hash = hash_bytes(hash, &mesh->sourceSize, sizeof(uint64_t));
+        hash = hash_bytes(hash, &mesh->sourceMtimeSec, sizeof(int64_t));
+        hash = hash_bytes(hash, &mesh->sourceMtimeNsec, sizeof(int64_t));
     }
     for(int i = 0; i < scene->info->nbModels; i++) {
-        mesh_intersect(scene->models[i], ray, &bestHit);
+        const Model* model = &scene->models[i];
+        // Meshes by their index in the table, their address changes every run
+        int mesh = -1;
+        for(int j = 0; j < scene->nbMeshes; j++) {
+            if(scene->meshes[j] == model->mesh) {
+                mesh = j;
+                break;
+            }
+        }
+        hash = hash_bytes(hash, &mesh, sizeof(int));
+        hash = hash_bytes(hash, &model->toWorld, sizeof(Transform));
+        hash = hash_bytes(hash, &model->material, sizeof(int));
+    }
+    for(int i = 0; i < scene->nbMaterials; i++) {
+        const Material* material = &scene->materials[i];
+        hash = hash_bytes(hash, &material->albedo, sizeof(Vec3));
+        hash = hash_bytes(hash, &material->emissionColor, sizeof(Vec3));
+        hash = hash_bytes(hash, &material->emissionStrength, sizeof(float));
+        hash = hash_bytes(hash, &material->specular, sizeof(float));
+        const Texture* texture = material->texture;
+        int size[2] = {texture != NULL ? texture->width : 0, texture != NULL ? texture->height : 0};
+        hash = hash_bytes(hash, size, sizeof(size));
+        // The other levels are filtered from the first one
+        for(int y = 0; y < size[1]; y++) {
+            for(int x = 0; x < size[0]; x++) {
+                hash = hash_bytes(hash, texture_texel(&texture->levels[0], x, y), sizeof(Pixel));
+            }
+        }
+    }
+    return hash;
+}
+
+// Intersects one object and records it in info when it is the new closest hit
+void scene_object_intersect(Scene* scene, int object, Ray ray, HitInfo* info) {
+    float closest = info->hitDistance;
+    if(object < scene->info->nbSpheres) {
+        sphere_intersect(&scene->spheres[object], &ray, info);
+    }
+    else {
+        mesh_intersect(&scene->models[object - scene->info->nbSpheres], ray, info);
+    }
+    if(info->hitDistance < closest) {
+        info->object = object;
+    }
+}
+
+typedef struct SceneLeafContext {
+    Scene* scene;
+    Ray ray;
+    HitInfo* info;
+} SceneLeafContext;
+
+// The spheres of the leaf go through the SIMD kernel first, only the ones it
+// picks get the exact test, in the same order as before
+void scene_leaf_intersect(void* ctx, const int* prims, int count) {
+    SceneLeafContext* leaf = (SceneLeafContext*)ctx;
+    Scene* scene = leaf->scene;
+    HitInfo* info = leaf->info;
+    int first = (int)(prims - scene->topLevel.primIndices);
+    unsigned int candidates = 0;
+    for(int i = 0; i < count; i++) {
+        // Leaves of objects sharing a centroid can be longer than a kernel call
+        if(i % BVH_MAX_LEAF_PRIMS == 0) {
+            int chunk = count - i < BVH_MAX_LEAF_PRIMS ? count - i : BVH_MAX_LEAF_PRIMS;
+            candidates = scene->sphereSoA.count > 0 ? scene->sphereKernels.candidates(&scene->sphereSoA, first + i, chunk, &leaf->ray, info->hitDistance) : ~0u;
+        }
+        int object = prims[i];
+        if(object >= scene->info->nbSpheres) {
+            scene_object_intersect(scene, object, leaf->ray, info);
+            continue;
+        }
+        COUNTER_INC(COUNTER_SPHERE_TESTS);
+        float t;
+        if((candidates >> (i % BVH_MAX_LEAF_PRIMS)) & 1u && sphere_hit_distance(&scene->spheres[object], &leaf->ray, &t) && t < info->hitDistance) {
+            COUNTER_INC(COUNTER_SPHERE_HITS);
+            info->hitDistance = t;
+            info->prim = -1;
+            info->object = object;
+        }
+    }
+}
+
+HitInfo intersect_scene(Scene* scene, Ray ray) {
+    COUNTER_INC(COUNTER_SCENE_RAYS);
+    HitInfo bestHit = hitInfo_create();
+    if(scene->topLevel.nodes != NULL) {
+        SceneLeafContext ctx = { scene, ray, &bestHit };
+        bvh_intersect(&scene->topLevel, ray.origin, ray.direction, &bestHit.hitDistance, scene_leaf_intersect, &ctx);
+        return bestHit;
+    }
+    for(int i = 0; i < scene->info->nbSpheres + scene->info->nbModels; i++) {
+        scene_object_intersect(scene, i, ray, &bestHit);
     }
     return bestHit;
 }
 
+int scene_object_material(Scene* scene, int object) {
+    if(object < scene->info->nbSpheres) {
+        return scene->spheres[object].material;
+    }
+    return scene->models[object - scene->info->nbSpheres].material;
+}
+
+// Works out the surface attributes of the closest hit of a query
+SurfaceHit scene_hit_surface(Scene* scene, Ray ray, const HitInfo* hit) {
+    if(hit->object < scene->info->nbSpheres) {
+        return sphere_surface(&scene->spheres[hit->object], ray, hit->hitDistance);
+    }
+    const Model* model = &scene->models[hit->object - scene->info->nbSpheres];
+    return model_surface(model, hit->prim, hit->u, hit->v, ray, hit->hitDistance);
+}
+
+// Textures loaded with the scene arena go away with it as well
 void freeScene(Scene* scene) {
-    free(scene->spheres);
-    for(int i = 0; i < scene->info->nbModels; i++) {
-        freeMesh(&scene->models[i].mesh);
+    // Only unmaps the mesh caches, the rest of the meshes is in the arena
+    for(int i = 0; i < scene->nbMeshes; i++) {
+        freeMesh(scene->meshes[i]);
     }
-    free(scene->models);
+    freeBVH(&scene->topLevel);
+    freeSphereSoA(&scene->sphereSoA);
+    free(scene->lights);
+    freeFramebuffer(&scene->framebuffer);
+    arena_destroy(&scene->arena);
+    scene->spheres = NULL;
+    scene->models = NULL;
+    scene->materials = NULL;
+    scene->meshes = NULL;
+    scene->nbMeshes = 0;
 }
 
 #endif /* SCENE_H */
\ No newline at end of file
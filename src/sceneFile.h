@@ -0,0 +1,695 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scene.h"
+#include "meshCache.h"
+#include "texture.h"
+#include "math/camera.h"
+
+// Scenes described in a text file, one statement per line and '#' starting
+// a comment. Names are given to textures, materials and objects so the
+// statements after them can refer to them. Paths are relative to the file.
+//
+//   width 400                  render settings, the command line wins
+//   height 300
+//   spp 25
+//   depth 50
+//   frames 48                  length of the animation (default 1)
+//   ambient 0.6 0.6 0.6
+//   camera fov 60 position 0 0 0 target 0 0 -1 up 0 1 0
+//   texture checker cc.ppm
+//   material ground albedo 0 1 0 texture checker
+//   material lamp albedo 0 0 0 emission 1 1 1 2
+//   material mirror albedo 1 1 1 specular 1
+//   sphere ball radius 0.5 center 0 0 -5 material ground
+//   model bunny file bunny.obj center 0.5 0 -5 material mirror
+//   model tilted file bunny.obj center 2 0 -5 rotate 0 45 0 scale 0.5 material mirror
+//   key 0 camera position 0 0 0 target 0 0 -1
+//   key 47 ball position 1 0 -5
+//
+// A key places the camera or an object at a frame, frames in between are
+// interpolated linearly and frames outside the keys hold the nearest one.
+// Objects without keys stay where they were declared. Everything is loaded
+// once: the frames of a sequence only move the camera and the objects, so
+// meshes, their BVH and textures stay loaded from one frame to the next.
+// Models naming the same file are instances of one mesh. A model is scaled
+// (one factor or one per axis), then rotated (degrees around x, y, z), then
+// moved to its center.
+
+#define SCENE_FILE_NAME_SIZE 64
+#define SCENE_FILE_PATH_SIZE 4096
+#define SCENE_FILE_MAX_TOKENS 64
+// Object index of the camera in keys
+#define SCENE_FILE_CAMERA -1
+
+typedef struct SceneFileTexture {
+    char name[SCENE_FILE_NAME_SIZE];
+    // Loaded into the scene arena by scene_file_setup
+    char* file;
+    Texture texture;
+} SceneFileTexture;
+
+typedef struct SceneFileMaterial {
+    char name[SCENE_FILE_NAME_SIZE];
+    Material material;
+    // Index in the textures, -1 for none
+    int texture;
+} SceneFileMaterial;
+
+typedef struct SceneFileObject {
+    char name[SCENE_FILE_NAME_SIZE];
+    int isModel;
+    float radius;
+    Vec3 center;
+    // Model only, degrees around x, y then z
+    Vec3 rotation;
+    Vec3 scale;
+    int material;
+    // Index among the spheres or the models of the scene
+    int slot;
+    // OBJ file of a model, NULL for a sphere
+    char* file;
+} SceneFileObject;
+
+typedef struct SceneFileKey {
+    int frame;
+    // Index in the objects, or SCENE_FILE_CAMERA
+    int object;
+    Vec3 position;
+    // Only for the camera
+    Vec3 target;
+} SceneFileKey;
+
+typedef struct SceneFile {
+    // Render settings, 0 when the file leaves them to the command line
+    int width;
+    int height;
+    int rayPerPixel;
+    int maxRayDepth;
+    int frames;
+    Vec3 ambient;
+    Camera camera;
+
+    SceneFileTexture* textures;
+    int nbTextures;
+    int textureCapacity;
+    SceneFileMaterial* materials;
+    int nbMaterials;
+    int materialCapacity;
+    SceneFileObject* objects;
+    int nbObjects;
+    int objectCapacity;
+    int nbSpheres;
+    int nbModels;
+    SceneFileKey* keys;
+    int nbKeys;
+    int keyCapacity;
+} SceneFile;
+
+// Tokens of the line being parsed, with where it comes from for the errors
+typedef struct SceneFileLine {
+    const char* path;
+    int number;
+    char* tokens[SCENE_FILE_MAX_TOKENS];
+    int count;
+    int next;
+} SceneFileLine;
+
+// Makes room for one more element, returns 0 when it cannot
+int scene_file_reserve(void** array, int count, int* capacity, size_t size) {
+    if(count < *capacity) {
+        return 1;
+    }
+    int newCapacity = *capacity > 0 ? *capacity * 2 : 8;
+    void* grown = realloc(*array, newCapacity * size);
+    if(grown == NULL) {
+        perror("Failed to allocate scene file entries");
+        return 0;
+    }
+    *array = grown;
+    *capacity = newCapacity;
+    return 1;
+}
+
+int scene_file_error(const SceneFileLine* line, const char* message, const char* detail) {
+    fprintf(stderr, "%s:%d: %s%s%s\n", line->path, line->number, message, detail != NULL ? " " : "", detail != NULL ? detail : "");
+    return 0;
+}
+
+int scene_file_has_token(const SceneFileLine* line) {
+    return line->next < line->count;
+}
+
+const char* scene_file_word(SceneFileLine* line) {
+    if(line->next >= line->count) {
+        return NULL;
+    }
+    return line->tokens[line->next++];
+}
+
+int scene_file_float(SceneFileLine* line, float* out) {
+    const char* word = scene_file_word(line);
+    char* end;
+    if(word == NULL) {
+        return scene_file_error(line, "missing number", NULL);
+    }
+    *out = strtof(word, &end);
+    if(*end != '\0') {
+        return scene_file_error(line, "not a number:", word);
+    }
+    return 1;
+}
+
+int scene_file_int(SceneFileLine* line, int min, int* out) {
+    const char* word = scene_file_word(line);
+    char* end;
+    if(word == NULL) {
+        return scene_file_error(line, "missing number", NULL);
+    }
+    long value = strtol(word, &end, 10);
+    if(*end != '\0' || value < min || value > 1000000000L) {
+        return scene_file_error(line, "invalid integer:", word);
+    }
+    *out = (int)value;
+    return 1;
+}
+
+int scene_file_vec3(SceneFileLine* line, Vec3* out) {
+    return scene_file_float(line, &out->x) && scene_file_float(line, &out->y) && scene_file_float(line, &out->z);
+}
+
+int scene_file_next_is_number(const SceneFileLine* line) {
+    char* end;
+    if(!scene_file_has_token(line)) {
+        return 0;
+    }
+    strtof(line->tokens[line->next], &end);
+    return *end == '\0';
+}
+
+// One factor for every axis, or three
+int scene_file_scale(SceneFileLine* line, Vec3* out) {
+    if(!scene_file_float(line, &out->x)) {
+        return 0;
+    }
+    if(!scene_file_next_is_number(line)) {
+        out->y = out->x;
+        out->z = out->x;
+        return 1;
+    }
+    return scene_file_float(line, &out->y) && scene_file_float(line, &out->z);
+}
+
+int scene_file_name(SceneFileLine* line, char* name) {
+    const char* word = scene_file_word(line);
+    if(word == NULL) {
+        return scene_file_error(line, "missing name", NULL);
+    }
+    if(strlen(word) >= SCENE_FILE_NAME_SIZE || strcmp(word, "camera") == 0) {
+        return scene_file_error(line, "invalid name:", word);
+    }
+    strcpy(name, word);
+    return 1;
+}
+
+// Path of a file named in the scene file, relative to the directory of the scene file
+int scene_file_resolve(const SceneFileLine* line, const char* file, char* out) {
+    const char* slash = strrchr(line->path, '/');
+    int dirLength = file[0] != '/' && slash != NULL ? (int)(slash - line->path) + 1 : 0;
+    if(dirLength + strlen(file) >= SCENE_FILE_PATH_SIZE) {
+        return scene_file_error(line, "path too long:", file);
+    }
+    memcpy(out, line->path, dirLength);
+    strcpy(out + dirLength, file);
+    return 1;
+}
+
+int scene_file_find_texture(const SceneFile* file, const char* name) {
+    for(int i = 0; i < file->nbTextures; i++) {
+        if(strcmp(file->textures[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int scene_file_find_material(const SceneFile* file, const char* name) {
+    for(int i = 0; i < file->nbMaterials; i++) {
+        if(strcmp(file->materials[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int scene_file_find_object(const SceneFile* file, const char* name) {
+    for(int i = 0; i < file->nbObjects; i++) {
+        if(strcmp(file->objects[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int scene_file_parse_camera(SceneFile* file, SceneFileLine* line) {
+    int ok = 1;
+    while(ok && scene_file_has_token(line)) {
+        const char* key = scene_file_word(line);
+        if(strcmp(key, "fov") == 0) {
+            ok = scene_file_float(line, &file->camera.fov);
+        }
+        else if(strcmp(key, "position") == 0) {
+            ok = scene_file_vec3(line, &file->camera.position);
+        }
+        else if(strcmp(key, "target") == 0) {
+            ok = scene_file_vec3(line, &file->camera.target);
+        }
+        else if(strcmp(key, "up") == 0) {
+            ok = scene_file_vec3(line, &file->camera.up);
+        }
+        else {
+            ok = scene_file_error(line, "unknown camera setting", key);
+        }
+    }
+    return ok;
+}
+
+int scene_file_parse_texture(SceneFile* file, SceneFileLine* line) {
+    SceneFileTexture texture;
+    memset(&texture, 0, sizeof(SceneFileTexture));
+    char path[SCENE_FILE_PATH_SIZE];
+    if(!scene_file_name(line, texture.name)) {
+        return 0;
+    }
+    const char* source = scene_file_word(line);
+    if(source == NULL) {
+        return scene_file_error(line, "expected: texture NAME FILE", NULL);
+    }
+    if(scene_file_find_texture(file, texture.name) >= 0) {
+        return scene_file_error(line, "texture declared twice:", texture.name);
+    }
+    if(!scene_file_resolve(line, source, path)) {
+        return 0;
+    }
+    if(access(path, R_OK) != 0) {
+        return scene_file_error(line, "cannot read texture", path);
+    }
+    texture.file = strdup(path);
+    if(texture.file == NULL || !scene_file_reserve((void**)&file->textures, file->nbTextures, &file->textureCapacity, sizeof(SceneFileTexture))) {
+        free(texture.file);
+        return 0;
+    }
+    file->textures[file->nbTextures++] = texture;
+    return 1;
+}
+
+int scene_file_parse_material(SceneFile* file, SceneFileLine* line) {
+    SceneFileMaterial material;
+    memset(&material, 0, sizeof(SceneFileMaterial));
+    material.material = material_create(vec3_build(1.0f, 1.0f, 1.0f), vec3_build(0.0f, 0.0f, 0.0f), 0.0f, 0.0f, NULL);
+    material.texture = -1;
+    int ok = scene_file_name(line, material.name);
+    if(ok && scene_file_find_material(file, material.name) >= 0) {
+        return scene_file_error(line, "material declared twice:", material.name);
+    }
+    while(ok && scene_file_has_token(line)) {
+        const char* key = scene_file_word(line);
+        if(strcmp(key, "albedo") == 0) {
+            ok = scene_file_vec3(line, &material.material.albedo);
+        }
+        else if(strcmp(key, "emission") == 0) {
+            ok = scene_file_vec3(line, &material.material.emissionColor) && scene_file_float(line, &material.material.emissionStrength);
+        }
+        else if(strcmp(key, "specular") == 0) {
+            ok = scene_file_float(line, &material.material.specular);
+        }
+        else if(strcmp(key, "texture") == 0) {
+            const char* name = scene_file_word(line);
+            material.texture = name != NULL ? scene_file_find_texture(file, name) : -1;
+            if(material.texture < 0) {
+                ok = scene_file_error(line, "unknown texture", name);
+            }
+        }
+        else {
+            ok = scene_file_error(line, "unknown material setting", key);
+        }
+    }
+    if(!ok || !scene_file_reserve((void**)&file->materials, file->nbMaterials, &file->materialCapacity, sizeof(SceneFileMaterial))) {
+        return 0;
+    }
+    file->materials[file->nbMaterials++] = material;
+    return 1;
+}
+
+// Parses a sphere or a model
+int scene_file_parse_object(SceneFile* file, SceneFileLine* line, int isModel) {
+    SceneFileObject object;
+    memset(&object, 0, sizeof(SceneFileObject));
+    object.isModel = isModel;
+    object.scale = vec3_build(1.0f, 1.0f, 1.0f);
+    object.material = -1;
+    int ok = scene_file_name(line, object.name);
+    if(ok && scene_file_find_object(file, object.name) >= 0) {
+        return scene_file_error(line, "object declared twice:", object.name);
+    }
+    while(ok && scene_file_has_token(line)) {
+        const char* key = scene_file_word(line);
+        if(strcmp(key, "center") == 0) {
+            ok = scene_file_vec3(line, &object.center);
+        }
+        else if(strcmp(key, "material") == 0) {
+            const char* name = scene_file_word(line);
+            object.material = name != NULL ? scene_file_find_material(file, name) : -1;
+            if(object.material < 0) {
+                ok = scene_file_error(line, "unknown material", name);
+            }
+        }
+        else if(!isModel && strcmp(key, "radius") == 0) {
+            ok = scene_file_float(line, &object.radius);
+        }
+        else if(isModel && strcmp(key, "rotate") == 0) {
+            ok = scene_file_vec3(line, &object.rotation);
+        }
+        else if(isModel && strcmp(key, "scale") == 0) {
+            ok = scene_file_scale(line, &object.scale);
+        }
+        else if(isModel && strcmp(key, "file") == 0) {
+            const char* source = scene_file_word(line);
+            char path[SCENE_FILE_PATH_SIZE];
+            ok = source != NULL ? scene_file_resolve(line, source, path) : scene_file_error(line, "missing file", NULL);
+            if(ok) {
+                free(object.file);
+                object.file = strdup(path);
+                ok = object.file != NULL;
+            }
+        }
+        else {
+            ok = scene_file_error(line, isModel ? "unknown model setting" : "unknown sphere setting", key);
+        }
+    }
+    if(ok && object.material < 0) {
+        ok = scene_file_error(line, "missing material for", object.name);
+    }
+    if(ok && isModel && object.file == NULL) {
+        ok = scene_file_error(line, "missing file for", object.name);
+    }
+    if(ok && !isModel && !(object.radius > 0.0f)) {
+        ok = scene_file_error(line, "missing or invalid radius for", object.name);
+    }
+    if(!ok || !scene_file_reserve((void**)&file->objects, file->nbObjects, &file->objectCapacity, sizeof(SceneFileObject))) {
+        free(object.file);
+        return 0;
+    }
+    object.slot = isModel ? file->nbModels++ : file->nbSpheres++;
+    file->objects[file->nbObjects++] = object;
+    return 1;
+}
+
+int scene_file_parse_key(SceneFile* file, SceneFileLine* line) {
+    SceneFileKey key;
+    memset(&key, 0, sizeof(SceneFileKey));
+    if(!scene_file_int(line, 0, &key.frame)) {
+        return 0;
+    }
+    const char* name = scene_file_word(line);
+    if(name == NULL) {
+        return scene_file_error(line, "expected: key FRAME camera|OBJECT ...", NULL);
+    }
+    int hasPosition = 0, hasTarget = 0;
+    if(strcmp(name, "camera") == 0) {
+        key.object = SCENE_FILE_CAMERA;
+    }
+    else if((key.object = scene_file_find_object(file, name)) < 0) {
+        return scene_file_error(line, "unknown object", name);
+    }
+    int ok = 1;
+    while(ok && scene_file_has_token(line)) {
+        const char* setting = scene_file_word(line);
+        if(strcmp(setting, "position") == 0) {
+            ok = scene_file_vec3(line, &key.position);
+            hasPosition = 1;
+        }
+        else if(key.object == SCENE_FILE_CAMERA && strcmp(setting, "target") == 0) {
+            ok = scene_file_vec3(line, &key.target);
+            hasTarget = 1;
+        }
+        else {
+            ok = scene_file_error(line, "unknown key setting", setting);
+        }
+    }
+    if(ok && (!hasPosition || (key.object == SCENE_FILE_CAMERA && !hasTarget))) {
+        ok = scene_file_error(line, key.object == SCENE_FILE_CAMERA ? "a camera key needs a position and a target" : "a key needs a position", NULL);
+    }
+    if(!ok || !scene_file_reserve((void**)&file->keys, file->nbKeys, &file->keyCapacity, sizeof(SceneFileKey))) {
+        return 0;
+    }
+    file->keys[file->nbKeys++] = key;
+    return 1;
+}
+
+int scene_file_parse_setting(SceneFileLine* line, int* out) {
+    return scene_file_int(line, 1, out);
+}
+
+int scene_file_parse_line(SceneFile* file, SceneFileLine* line) {
+    const char* statement = scene_file_word(line);
+    int ok;
+    if(strcmp(statement, "width") == 0) {
+        ok = scene_file_parse_setting(line, &file->width);
+    }
+    else if(strcmp(statement, "height") == 0) {
+        ok = scene_file_parse_setting(line, &file->height);
+    }
+    else if(strcmp(statement, "spp") == 0) {
+        ok = scene_file_parse_setting(line, &file->rayPerPixel);
+    }
+    else if(strcmp(statement, "depth") == 0) {
+        ok = scene_file_int(line, 0, &file->maxRayDepth);
+    }
+    else if(strcmp(statement, "frames") == 0) {
+        ok = scene_file_parse_setting(line, &file->frames);
+    }
+    else if(strcmp(statement, "ambient") == 0) {
+        ok = scene_file_vec3(line, &file->ambient);
+    }
+    else if(strcmp(statement, "camera") == 0) {
+        ok = scene_file_parse_camera(file, line);
+    }
+    else if(strcmp(statement, "texture") == 0) {
+        ok = scene_file_parse_texture(file, line);
+    }
+    else if(strcmp(statement, "material") == 0) {
+        ok = scene_file_parse_material(file, line);
+    }
+    else if(strcmp(statement, "sphere") == 0) {
+        ok = scene_file_parse_object(file, line, 0);
+    }
+    else if(strcmp(statement, "model") == 0) {
+        ok = scene_file_parse_object(file, line, 1);
+    }
+    else if(strcmp(statement, "key") == 0) {
+        ok = scene_file_parse_key(file, line);
+    }
+    else {
+        return scene_file_error(line, "unknown statement", statement);
+    }
+    if(ok && scene_file_has_token(line)) {
+        ok = scene_file_error(line, "unexpected", line->tokens[line->next]);
+    }
+    return ok;
+}
+
+void freeSceneFile(SceneFile* file) {
+    for(int i = 0; i < file->nbTextures; i++) {
+        freeTexture(&file->textures[i].texture);
+        free(file->textures[i].file);
+    }
+    free(file->textures);
+    free(file->materials);
+    for(int i = 0; i < file->nbObjects; i++) {
+        free(file->objects[i].file);
+    }
+    free(file->objects);
+    free(file->keys);
+    memset(file, 0, sizeof(SceneFile));
+}
+
+// Reads a scene file, its textures and meshes are loaded by scene_file_setup.
+// Returns 0 after printing what is wrong.
+int loadSceneFile(const char* path, SceneFile* file) {
+    memset(file, 0, sizeof(SceneFile));
+    file->frames = 1;
+    file->ambient = vec3_build(0.6f, 0.6f, 0.6f);
+    file->camera = camera_create(60.0f, vec3_build(0.0f, 0.0f, 0.0f), vec3_build(0.0f, 0.0f, -1.0f), vec3_build(0.0f, 1.0f, 0.0f), 1.0f, 1000.0f, 1.0f);
+
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL) {
+        perror("Failed to open scene file");
+        return 0;
+    }
+    char buffer[SCENE_FILE_PATH_SIZE + 256];
+    SceneFileLine line;
+    line.path = path;
+    line.number = 0;
+    int ok = 1;
+    while(ok && fgets(buffer, sizeof(buffer), fp) != NULL) {
+        line.number++;
+        char* comment = strchr(buffer, '#');
+        if(comment != NULL) {
+            *comment = '\0';
+        }
+        line.count = 0;
+        line.next = 0;
+        char* save = NULL;
+        for(char* token = strtok_r(buffer, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save)) {
+            if(line.count == SCENE_FILE_MAX_TOKENS) {
+                ok = scene_file_error(&line, "line too long", NULL);
+                break;
+            }
+            line.tokens[line.count++] = token;
+        }
+        if(ok && line.count > 0) {
+            ok = scene_file_parse_line(file, &line);
+        }
+    }
+    fclose(fp);
+    if(ok && file->nbObjects == 0) {
+        fprintf(stderr, "%s: the scene has no sphere or model\n", path);
+        ok = 0;
+    }
+    if(!ok) {
+        freeSceneFile(file);
+    }
+    return ok;
+}
+
+// Transform of a model placed at position
+Transform scene_file_model_transform(const SceneFileObject* object, Vec3 position) {
+    Transform rotation = transform_rotation(object->rotation);
+    Transform scale = transform_scale(object->scale);
+    Transform local = transform_multiply(&rotation, &scale);
+    Transform translation = transform_translation(position);
+    return transform_multiply(&translation, &local);
+}
+
+// Model declared before object with the same file, NULL if it is the first
+const Model* scene_file_find_instance(const SceneFile* file, const Scene* scene, const SceneFileObject* object) {
+    for(const SceneFileObject* other = file->objects; other < object; other++) {
+        if(other->isModel && strcmp(other->file, object->file) == 0) {
+            return &scene->models[other->slot];
+        }
+    }
+    return NULL;
+}
+
+// Fills a scene created for file->nbSpheres spheres and file->nbModels
+// models. The textures and meshes are loaded into the scene arena, the
+// materials point to the textures of the scene file, which has to outlive
+// the scene. Returns 0 when a texture or a mesh failed to load,
+// scene->info->nbModels is then the number of models that were loaded.
+int scene_file_setup(SceneFile* file, Scene* scene) {
+    scene->ambiantLight = file->ambient;
+    for(int i = 0; i < file->nbTextures; i++) {
+        Texture* texture = &file->textures[i].texture;
+        *texture = loadTexture(file->textures[i].file, &scene->arena);
+        if(texture->levelCount == 0) {
+            fprintf(stderr, "Failed to load texture %s\n", file->textures[i].file);
+            scene->info->nbModels = 0;
+            return 0;
+        }
+    }
+    for(int i = 0; i < file->nbMaterials; i++) {
+        Material material = file->materials[i].material;
+        int texture = file->materials[i].texture;
+        material.texture = texture >= 0 ? &file->textures[texture].texture : NULL;
+        if(scene_add_material(scene, material) != i) {
+            scene->info->nbModels = 0;
+            return 0;
+        }
+    }
+    int loadedModels = 0;
+    for(int i = 0; i < file->nbObjects; i++) {
+        SceneFileObject* object = &file->objects[i];
+        if(!object->isModel) {
+            scene->spheres[object->slot] = sphere_create(object->radius, object->center, object->material);
+            continue;
+        }
+        // Every file is loaded once, whatever the number of models using it
+        const Model* instance = scene_file_find_instance(file, scene, object);
+        const Mesh* mesh = instance != NULL ? instance->mesh : NULL;
+        Mesh loaded;
+        if(mesh == NULL && loadObjCached(object->file, scene->info->compactMeshes, &scene->arena, &loaded)) {
+            mesh = scene_add_mesh(scene, loaded);
+        }
+        if(mesh == NULL) {
+            scene->info->nbModels = loadedModels;
+            return 0;
+        }
+        scene->models[object->slot] = model_create(mesh, scene_file_model_transform(object, object->center), object->material);
+        loadedModels++;
+    }
+    return 1;
+}
+
+// Finds where the keys of an object put it at a frame. Returns 0 when the
+// object has no key.
+int scene_file_key_at(const SceneFile* file, int object, int frame, Vec3* position, Vec3* target) {
+    const SceneFileKey* before = NULL;
+    const SceneFileKey* after = NULL;
+    for(int i = 0; i < file->nbKeys; i++) {
+        const SceneFileKey* key = &file->keys[i];
+        if(key->object != object) {
+            continue;
+        }
+        if(key->frame <= frame && (before == NULL || key->frame >= before->frame)) {
+            before = key;
+        }
+        if(key->frame >= frame && (after == NULL || key->frame < after->frame)) {
+            after = key;
+        }
+    }
+    if(before == NULL && after == NULL) {
+        return 0;
+    }
+    if(before == NULL || after == NULL || before->frame == after->frame) {
+        const SceneFileKey* key = before != NULL ? before : after;
+        *position = key->position;
+        *target = key->target;
+        return 1;
+    }
+    float t = (float)(frame - before->frame) / (float)(after->frame - before->frame);
+    *position = vec3_add(before->position, vec3_mul(vec3_sub(after->position, before->position), t));
+    *target = vec3_add(before->target, vec3_mul(vec3_sub(after->target, before->target), t));
+    return 1;
+}
+
+// Moves the camera and the objects of the scene to where they are at a
+// frame. Only the transforms of the models change, so the meshes and their
+// BVH stay as they are and only the top level one is refit by the next render.
+void scene_file_apply_frame(const SceneFile* file, Scene* scene, int frame) {
+    Vec3 position, target;
+    if(scene_file_key_at(file, SCENE_FILE_CAMERA, frame, &position, &target)) {
+        scene->camera->position = position;
+        scene->camera->target = target;
+    }
+    for(int i = 0; i < file->nbObjects; i++) {
+        const SceneFileObject* object = &file->objects[i];
+        if(!scene_file_key_at(file, i, frame, &position, &target)) {
+            continue;
+        }
+        if(!object->isModel) {
+            scene->spheres[object->slot].center = position;
+            continue;
+        }
+        model_set_position(&scene->models[object->slot], position);
+    }
+}
+
+#endif /* SCENEFILE_H */
@@ -7,17 +7,122 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+
+#include "math/Vectors.h"
+#include "utils/arena.h"
 
 typedef struct {
     unsigned char r, g, b;
 } Pixel;
 
+// Textures are stored as a mip chain built at load time. Every level is cut
+// into 8x8 texel tiles stored one after the other (3 cache lines each), with
+// the texels of a tile in Morton order, so the texels a filtered lookup
+// reads are next to each other in memory whatever the direction it walks.
+#define TEXTURE_TILE_SIZE 8
+#define TEXTURE_TILE_TEXELS (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE)
+#define TEXTURE_MAX_LEVELS 32
+
+typedef enum TextureFilter {
+    TEXTURE_NEAREST,
+    TEXTURE_BILINEAR,
+    // Bilinear in the two mip levels around the level of detail
+    TEXTURE_TRILINEAR,
+    TEXTURE_FILTER_COUNT
+} TextureFilter;
+
+static const char* textureFilterNames[TEXTURE_FILTER_COUNT] = {
+    "nearest",
+    "bilinear",
+    "trilinear"
+};
+
+typedef struct TextureLevel {
+    int width;
+    int height;
+    int tilesX;
+    Pixel* texels;
+} TextureLevel;
+
 typedef struct {
+    // Size of the first level
     int width;
     int height;
-    Pixel* texture;
+    int levelCount;
+    TextureLevel levels[TEXTURE_MAX_LEVELS];
+    // Holds the texels, which go away with it. NULL when they come from the
+    // C allocator and freeTexture frees them.
+    Arena* arena;
 } Texture;
 
+// Channel values as floats, so lookups do not divide
+float textureChannelLut[256];
+
+void texture_init_lut() {
+    for(int i = 0; i < 256; i++) {
+        textureChannelLut[i] = (float)i / 255.0f;
+    }
+}
+
+// Position of a texel inside its tile, its 3 bit coordinates interleaved
+int texture_tile_offset(int x, int y) {
+    return (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2) | ((x & 4) << 2) | ((y & 4) << 3);
+}
+
+Pixel* texture_texel(const TextureLevel* level, int x, int y) {
+    int tile = (y / TEXTURE_TILE_SIZE) * level->tilesX + x / TEXTURE_TILE_SIZE;
+    return &level->texels[tile * TEXTURE_TILE_TEXELS + texture_tile_offset(x % TEXTURE_TILE_SIZE, y % TEXTURE_TILE_SIZE)];
+}
+
+int texture_level_init(TextureLevel* level, int width, int height, Arena* arena) {
+    level->width = width;
+    level->height = height;
+    level->tilesX = (width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+    int tilesY = (height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+    level->texels = (Pixel*)arena_alloc(arena, ARENA_TEXTURE, (size_t)level->tilesX * tilesY * TEXTURE_TILE_TEXELS * sizeof(Pixel), 64);
+    return level->texels != NULL;
+}
+
+// Each level averages 2x2 texels of the one above it, down to 1x1
+int texture_build_levels(Texture* tex, const Pixel* pixels) {
+    if(!texture_level_init(&tex->levels[0], tex->width, tex->height, tex->arena)) {
+        return 0;
+    }
+    tex->levelCount = 1;
+    for(int y = 0; y < tex->height; y++) {
+        for(int x = 0; x < tex->width; x++) {
+            *texture_texel(&tex->levels[0], x, y) = pixels[y * tex->width + x];
+        }
+    }
+    while(tex->levelCount < TEXTURE_MAX_LEVELS) {
+        const TextureLevel* src = &tex->levels[tex->levelCount - 1];
+        if(src->width == 1 && src->height == 1) {
+            break;
+        }
+        TextureLevel* dst = &tex->levels[tex->levelCount];
+        if(!texture_level_init(dst, src->width > 1 ? src->width / 2 : 1, src->height > 1 ? src->height / 2 : 1, tex->arena)) {
+            return 0;
+        }
+        tex->levelCount++;
+        for(int y = 0; y < dst->height; y++) {
+            for(int x = 0; x < dst->width; x++) {
+                int x1 = 2 * x + 1 < src->width ? 2 * x + 1 : 2 * x;
+                int y1 = 2 * y + 1 < src->height ? 2 * y + 1 : 2 * y;
+                const Pixel* a = texture_texel(src, 2 * x, 2 * y);
+                const Pixel* b = texture_texel(src, x1, 2 * y);
+                const Pixel* c = texture_texel(src, 2 * x, y1);
+                const Pixel* d = texture_texel(src, x1, y1);
+                Pixel* out = texture_texel(dst, x, y);
+                out->r = (unsigned char)((a->r + b->r + c->r + d->r + 2) / 4);
+                out->g = (unsigned char)((a->g + b->g + c->g + d->g + 2) / 4);
+                out->b = (unsigned char)((a->b + b->b + c->b + d->b + 2) / 4);
+            }
+        }
+    }
+    return 1;
+}
+
 void skip_whitespace_and_comments(FILE* fp) {
     int c;
     while ((c = fgetc(fp)) != EOF) {
@@ -32,8 +137,80 @@ void skip_whitespace_and_comments(FILE* fp) {
     }
 }
 
-Texture loadTexture(const char* filename) {
+void freeTexture(Texture* tex) {
+    if(tex->arena == NULL) {
+        for(int i = 0; i < tex->levelCount; i++) {
+            free(tex->levels[i].texels);
+        }
+    }
+    tex->levelCount = 0;
+}
+
+// Nearest texel, the one the texture was looked up with before the mip chain
+Vec3 texture_nearest(const Texture* tex, Vec2 uv) {
+    const TextureLevel* level = &tex->levels[0];
+    int posX = (int)(level->width * uv.x);
+    int posY = (int)(level->height * uv.y);
+    posX = posX < 0 ? 0 : (posX >= level->width ? level->width - 1 : posX);
+    posY = posY < 0 ? 0 : (posY >= level->height ? level->height - 1 : posY);
+    const Pixel* texel = texture_texel(level, posX, posY);
+    return vec3_build(textureChannelLut[texel->r], textureChannelLut[texel->g], textureChannelLut[texel->b]);
+}
+
+// Bilinear lookup in one level, clamped at the edges
+Vec3 texture_bilinear(const Texture* tex, int levelIndex, Vec2 uv) {
+    const TextureLevel* level = &tex->levels[levelIndex];
+    float x = uv.x * level->width - 0.5f;
+    float y = uv.y * level->height - 0.5f;
+    float floorX = floorf(x);
+    float floorY = floorf(y);
+    float tx = x - floorX;
+    float ty = y - floorY;
+    int x0 = (int)fminf(fmaxf(floorX, 0.0f), (float)(level->width - 1));
+    int y0 = (int)fminf(fmaxf(floorY, 0.0f), (float)(level->height - 1));
+    int x1 = (int)fminf(fmaxf(floorX + 1.0f, 0.0f), (float)(level->width - 1));
+    int y1 = (int)fminf(fmaxf(floorY + 1.0f, 0.0f), (float)(level->height - 1));
+    const Pixel* texels[4] = {
+        texture_texel(level, x0, y0),
+        texture_texel(level, x1, y0),
+        texture_texel(level, x0, y1),
+        texture_texel(level, x1, y1)
+    };
+    float weights[4] = { (1.0f - tx) * (1.0f - ty), tx * (1.0f - ty), (1.0f - tx) * ty, tx * ty };
+    float r = 0.0f, g = 0.0f, b = 0.0f;
+    for(int i = 0; i < 4; i++) {
+        r += weights[i] * textureChannelLut[texels[i]->r];
+        g += weights[i] * textureChannelLut[texels[i]->g];
+        b += weights[i] * textureChannelLut[texels[i]->b];
+    }
+    return vec3_build(r, g, b);
+}
+
+// lod is the mip level wanted, 0 is the full size texture and every level
+// up halves it
+Vec3 texture_sample(const Texture* tex, Vec2 uv, float lod, TextureFilter filter) {
+    // Coordinates that are not numbers read the first row or column, like
+    // the nearest lookup clamps them
+    uv.x = isnan(uv.x) ? 0.0f : uv.x;
+    uv.y = isnan(uv.y) ? 0.0f : uv.y;
+    if(filter == TEXTURE_NEAREST) {
+        return texture_nearest(tex, uv);
+    }
+    if(filter == TEXTURE_BILINEAR || !(lod > 0.0f)) {
+        return texture_bilinear(tex, 0, uv);
+    }
+    if(lod >= tex->levelCount - 1) {
+        return texture_bilinear(tex, tex->levelCount - 1, uv);
+    }
+    int level = (int)lod;
+    float t = lod - level;
+    return vec3_lerp(texture_bilinear(tex, level, uv), texture_bilinear(tex, level + 1, uv), t);
+}
+
+// The texels are allocated from arena, or the C allocator when it is NULL
+Texture loadTexture(const char* filename, Arena* arena) {
     Texture tex = {0};
+    tex.arena = arena;
     FILE* fp = fopen(filename, "rb");
     if(!fp) {
         perror("Failed to open file");
@@ -87,12 +264,13 @@ Texture loadTexture(const char* filename) {
     
     tex.height = height;
     tex.width = width;
-    tex.texture = pixels;
+    texture_init_lut();
+    if(!texture_build_levels(&tex, pixels)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        freeTexture(&tex);
+    }
+    free(pixels);
     return tex;
 }
 
-void freeTexture(Texture* tex) {
-    free(tex->texture);
-}
-
 #endif /* TEXTURE_H */
\ No newline at end of file
@@ -0,0 +1,249 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Memory that lives as long as a scene: the loaders carve the spheres,
+// models, meshes, BVHs and textures out of a few large blocks mapped from
+// the system, and the whole scene goes away with one arena_destroy. Nothing
+// is freed on its own, arena_free only frees memory the arena does not own,
+// so code handed a NULL arena or memory from elsewhere keeps working. Blocks
+// can be backed by huge pages, which cuts the page faults and TLB misses of
+// big meshes. The arena is not thread safe, scenes are loaded by one thread.
+
+#define ARENA_BLOCK_SIZE ((size_t)4 << 20)
+#define ARENA_HUGE_PAGE_SIZE ((size_t)2 << 20)
+// Alignment of every allocation, a cache line and enough for any SIMD load
+#define ARENA_MIN_ALIGN 64
+
+typedef enum ArenaTag {
+    ARENA_SCENE,
+    ARENA_MESH,
+    ARENA_TEXTURE,
+    ARENA_TAG_COUNT
+} ArenaTag;
+
+static const char* arenaTagNames[ARENA_TAG_COUNT] = {
+    "scene",
+    "mesh",
+    "texture"
+};
+
+// Header at the start of every block
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    // Mapped with MAP_HUGETLB, otherwise only advised to use huge pages
+    int hugeTlb;
+} ArenaBlock;
+
+typedef struct ArenaStats {
+    // Bytes handed out and still in use, peak is the highest it went
+    size_t used;
+    size_t peak;
+    long long allocations;
+} ArenaStats;
+
+typedef struct Arena {
+    // The block allocations are made from comes first, filled blocks after it
+    ArenaBlock* blocks;
+    int hugePages;
+    int blockCount;
+    int hugeTlbBlocks;
+    // Bytes mapped from the system
+    size_t reserved;
+    ArenaStats stats[ARENA_TAG_COUNT];
+} Arena;
+
+Arena arena_create(int hugePages) {
+    Arena arena;
+    memset(&arena, 0, sizeof(Arena));
+    arena.hugePages = hugePages;
+    return arena;
+}
+
+size_t arena_align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+ArenaBlock* arena_map_block(Arena* arena, size_t size) {
+    void* base = MAP_FAILED;
+    int hugeTlb = 0;
+    if(arena->hugePages) {
+        size = arena_align_up(size, ARENA_HUGE_PAGE_SIZE);
+#ifdef MAP_HUGETLB
+        // Only works when huge pages were reserved, transparent ones otherwise
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        hugeTlb = base != MAP_FAILED;
+#endif
+    }
+    if(base == MAP_FAILED) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(base == MAP_FAILED) {
+            perror("Failed to map arena block");
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if(arena->hugePages) {
+            madvise(base, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    ArenaBlock* block = (ArenaBlock*)base;
+    block->next = NULL;
+    block->size = size;
+    block->used = arena_align_up(sizeof(ArenaBlock), ARENA_MIN_ALIGN);
+    block->hugeTlb = hugeTlb;
+    arena->blockCount++;
+    arena->hugeTlbBlocks += hugeTlb;
+    arena->reserved += size;
+    return block;
+}
+
+void arena_account(Arena* arena, ArenaTag tag, size_t released, size_t added) {
+    ArenaStats* stats = &arena->stats[tag];
+    stats->used = stats->used - released + added;
+    stats->peak = stats->used > stats->peak ? stats->used : stats->peak;
+}
+
+// Zeroed memory aligned to align (a power of two, at least ARENA_MIN_ALIGN
+// is used). Without an arena it comes from the C allocator and has to be
+// given to arena_free. Returns NULL when it cannot be allocated.
+void* arena_alloc(Arena* arena, ArenaTag tag, size_t size, size_t align) {
+    align = align < ARENA_MIN_ALIGN ? ARENA_MIN_ALIGN : align;
+    if(arena == NULL) {
+        void* memory = aligned_alloc(align, arena_align_up(size > 0 ? size : 1, align));
+        if(memory != NULL) {
+            memset(memory, 0, size);
+        }
+        return memory;
+    }
+    ArenaBlock* block = arena->blocks;
+    size_t offset = block != NULL ? arena_align_up(block->used, align) : 0;
+    if(block == NULL || offset + size > block->size) {
+        size_t header = arena_align_up(sizeof(ArenaBlock), align);
+        // Big allocations get a block of their own, put behind the current
+        // one so its free space is still used
+        int dedicated = header + size > ARENA_BLOCK_SIZE / 4;
+        ArenaBlock* fresh = arena_map_block(arena, dedicated ? header + size : ARENA_BLOCK_SIZE);
+        if(fresh == NULL) {
+            return NULL;
+        }
+        if(dedicated && block != NULL) {
+            fresh->next = block->next;
+            block->next = fresh;
+        }
+        else {
+            fresh->next = block;
+            arena->blocks = fresh;
+        }
+        block = fresh;
+        offset = header;
+    }
+    void* memory = (char*)block + offset;
+    block->used = offset + size;
+    arena->stats[tag].allocations++;
+    arena_account(arena, tag, 0, size);
+    return memory;
+}
+
+ArenaBlock* arena_find_block(const Arena* arena, const void* ptr) {
+    if(arena == NULL || ptr == NULL) {
+        return NULL;
+    }
+    for(ArenaBlock* block = arena->blocks; block != NULL; block = block->next) {
+        if((const char*)ptr >= (const char*)block && (const char*)ptr < (const char*)block + block->size) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+int arena_owns(const Arena* arena, const void* ptr) {
+    return arena_find_block(arena, ptr) != NULL;
+}
+
+// Resizes an array, in place when it ends its block and the block has room,
+// otherwise by copying it (the old copy stays in the arena until it is
+// destroyed). ptr can be NULL. New bytes are zeroed.
+void* arena_grow(Arena* arena, ArenaTag tag, void* ptr, size_t oldSize, size_t newSize, size_t align) {
+    ArenaBlock* block = arena_find_block(arena, ptr);
+    if(block != NULL) {
+        size_t offset = (size_t)((char*)ptr - (char*)block);
+        if(offset + oldSize == block->used && offset + newSize <= block->size) {
+            block->used = offset + newSize;
+            // Memory past used is kept zeroed for the next allocations
+            if(newSize > oldSize) {
+                memset((char*)ptr + oldSize, 0, newSize - oldSize);
+            }
+            else {
+                memset((char*)ptr + newSize, 0, oldSize - newSize);
+            }
+            arena_account(arena, tag, oldSize, newSize);
+            return ptr;
+        }
+    }
+    void* grown = arena_alloc(arena, tag, newSize, align);
+    if(grown == NULL) {
+        return NULL;
+    }
+    if(ptr != NULL) {
+        memcpy(grown, ptr, oldSize < newSize ? oldSize : newSize);
+        if(block != NULL) {
+            arena_account(arena, tag, oldSize, 0);
+        }
+        else {
+            free(ptr);
+        }
+    }
+    return grown;
+}
+
+// Frees memory that does not belong to the arena, arena memory is only
+// released by arena_destroy
+void arena_free(const Arena* arena, void* ptr) {
+    if(!arena_owns(arena, ptr)) {
+        free(ptr);
+    }
+}
+
+// Unmaps every block at once
+void arena_destroy(Arena* arena) {
+    ArenaBlock* block = arena->blocks;
+    while(block != NULL) {
+        ArenaBlock* next = block->next;
+        munmap(block, block->size);
+        block = next;
+    }
+    *arena = arena_create(arena->hugePages);
+}
+
+size_t arena_used(const Arena* arena) {
+    size_t used = 0;
+    for(int i = 0; i < ARENA_TAG_COUNT; i++) {
+        used += arena->stats[i].used;
+    }
+    return used;
+}
+
+void arena_print_stats(const Arena* arena, FILE* file) {
+    double mb = 1.0 / (1024.0 * 1024.0);
+    fprintf(file, "Scene Memory: %.2f MB used in %d blocks of %.2f MB", (double)arena_used(arena) * mb, arena->blockCount, (double)arena->reserved * mb);
+    if(arena->hugePages) {
+        fprintf(file, ", %d on reserved huge pages", arena->hugeTlbBlocks);
+    }
+    fprintf(file, "\n");
+    for(int i = 0; i < ARENA_TAG_COUNT; i++) {
+        const ArenaStats* stats = &arena->stats[i];
+        fprintf(file, "  %-8s %.2f MB used, %.2f MB peak, %lld allocations\n", arenaTagNames[i], (double)stats->used * mb, (double)stats->peak * mb, stats->allocations);
+    }
+}
+
+#endif /* ARENA_H */
@@ -0,0 +1,184 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+// Hot path event counters. Every thread counts in its own thread local array
+// and adds it to the totals with counters_flush() (once per tile while
+// rendering), so counting is a plain increment. Building with
+// -DPATHTRACER_NO_COUNTERS removes the increments altogether.
+
+typedef enum CounterId {
+    // Paths started by trace, one per camera sample
+    COUNTER_PATHS,
+    // Path segments, the camera ray included
+    COUNTER_BOUNCES,
+    // Rays that missed everything and took the sky color
+    COUNTER_ESCAPES,
+    // Closest hit queries through intersect_scene
+    COUNTER_SCENE_RAYS,
+    // Camera rays intersected as packets instead
+    COUNTER_PACKET_RAYS,
+    COUNTER_SPHERE_TESTS,
+    COUNTER_SPHERE_HITS,
+    COUNTER_TRIANGLE_TESTS,
+    COUNTER_TRIANGLE_HITS,
+    COUNTER_BVH_TRAVERSALS,
+    COUNTER_BVH_NODES,
+    // Candidates drawn by the rejection loop of random_unit_vector
+    COUNTER_UNIT_VECTOR_ITERATIONS,
+    COUNTER_COUNT
+} CounterId;
+
+// Path lengths (segments traced) are also counted, the last bucket holds
+// every longer path
+#define PATH_LENGTH_BUCKETS 64
+
+static const char* counterNames[COUNTER_COUNT] = {
+    "paths",
+    "bounces",
+    "escapes",
+    "scene_rays",
+    "packet_rays",
+    "sphere_tests",
+    "sphere_hits",
+    "triangle_tests",
+    "triangle_hits",
+    "bvh_traversals",
+    "bvh_nodes",
+    "unit_vector_iterations"
+};
+
+#ifndef PATHTRACER_NO_COUNTERS
+
+_Thread_local unsigned long long counterLocal[COUNTER_COUNT];
+atomic_ullong counterTotals[COUNTER_COUNT];
+_Thread_local unsigned long long pathLengthLocal[PATH_LENGTH_BUCKETS];
+atomic_ullong pathLengthTotals[PATH_LENGTH_BUCKETS];
+
+#define COUNTER_ADD(id, n) (counterLocal[(id)] += (n))
+#define COUNTER_INC(id) (counterLocal[(id)]++)
+#define COUNTER_PATH_LENGTH(length) (pathLengthLocal[(length) < PATH_LENGTH_BUCKETS - 1 ? (length) : PATH_LENGTH_BUCKETS - 1]++)
+
+void counters_flush() {
+    for(int i = 0; i < COUNTER_COUNT; i++) {
+        if(counterLocal[i] != 0) {
+            atomic_fetch_add(&counterTotals[i], counterLocal[i]);
+            counterLocal[i] = 0;
+        }
+    }
+    for(int i = 0; i < PATH_LENGTH_BUCKETS; i++) {
+        if(pathLengthLocal[i] != 0) {
+            atomic_fetch_add(&pathLengthTotals[i], pathLengthLocal[i]);
+            pathLengthLocal[i] = 0;
+        }
+    }
+}
+
+// Clears the totals and the counts of the calling thread
+void counters_reset() {
+    for(int i = 0; i < COUNTER_COUNT; i++) {
+        atomic_store(&counterTotals[i], 0);
+        counterLocal[i] = 0;
+    }
+    for(int i = 0; i < PATH_LENGTH_BUCKETS; i++) {
+        atomic_store(&pathLengthTotals[i], 0);
+        pathLengthLocal[i] = 0;
+    }
+}
+
+unsigned long long counters_get(CounterId id) {
+    return atomic_load(&counterTotals[id]);
+}
+
+unsigned long long counters_path_length(int length) {
+    return atomic_load(&pathLengthTotals[length]);
+}
+
+#else
+
+#define COUNTER_ADD(id, n) ((void)0)
+#define COUNTER_INC(id) ((void)0)
+#define COUNTER_PATH_LENGTH(length) ((void)0)
+
+void counters_flush() {
+}
+
+void counters_reset() {
+}
+
+unsigned long long counters_get(CounterId id) {
+    (void)id;
+    return 0;
+}
+
+unsigned long long counters_path_length(int length) {
+    (void)length;
+    return 0;
+}
+
+#endif /* PATHTRACER_NO_COUNTERS */
+
+int counters_enabled() {
+#ifndef PATHTRACER_NO_COUNTERS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+// Buckets up to the last non empty one
+int counters_path_buckets_used() {
+    int used = PATH_LENGTH_BUCKETS;
+    while(used > 0 && counters_path_length(used - 1) == 0) {
+        used--;
+    }
+    return used;
+}
+
+void counters_print() {
+    if(!counters_enabled()) {
+        return;
+    }
+    printf("Counters:\n");
+    for(int i = 0; i < COUNTER_COUNT; i++) {
+        printf("  %-24s %llu\n", counterNames[i], counters_get((CounterId)i));
+    }
+    unsigned long long traversals = counters_get(COUNTER_BVH_TRAVERSALS);
+    if(traversals > 0) {
+        printf("Average BVH nodes visited per traversal: %.2f\n", (double)counters_get(COUNTER_BVH_NODES) / (double)traversals);
+    }
+    unsigned long long paths = counters_get(COUNTER_PATHS);
+    if(paths > 0) {
+        printf("Average path length: %.2f\n", (double)counters_get(COUNTER_BOUNCES) / (double)paths);
+        printf("Path lengths:");
+        for(int i = 0; i < counters_path_buckets_used(); i++) {
+            printf(" %d:%llu", i, counters_path_length(i));
+        }
+        printf("%s\n", counters_path_buckets_used() == PATH_LENGTH_BUCKETS ? "+" : "");
+    }
+}
+
+// Writes the totals as one JSON object, {} when the counters are compiled out.
+// indent is the indentation of the closing brace.
+void counters_write_json(FILE* file, int indent) {
+    if(!counters_enabled()) {
+        fprintf(file, "{}");
+        return;
+    }
+    fprintf(file, "{\n");
+    for(int i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(file, "%*s\"%s\": %llu,\n", indent + 2, "", counterNames[i], counters_get((CounterId)i));
+    }
+    // Paths of length i are in element i, the last bucket also counts longer paths
+    fprintf(file, "%*s\"path_lengths\": [", indent + 2, "");
+    for(int i = 0; i < counters_path_buckets_used(); i++) {
+        fprintf(file, "%s%llu", i > 0 ? ", " : "", counters_path_length(i));
+    }
+    fprintf(file, "]\n%*s}", indent, "");
+}
+
+#endif /* COUNTERS_H */
@@ -0,0 +1,213 @@
+#ifndef NET_H
+#define NET_H
+
+#pragma once
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Stream sockets for the distributed renderer. An address is either
+// "unix:PATH" for a Unix socket or "HOST:PORT" for TCP, with HOST left
+// empty (":PORT") to listen on every interface.
+
+#define NET_UNIX_PREFIX "unix:"
+
+int net_unix_address(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 0;
+    }
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+// Resolves a TCP address, the caller frees the list with freeaddrinfo
+struct addrinfo* net_tcp_address(const char* address, int passive) {
+    const char* colon = strrchr(address, ':');
+    if(colon == NULL) {
+        fprintf(stderr, "Invalid address '%s' (expected unix:PATH or HOST:PORT)\n", address);
+        return NULL;
+    }
+    char host[256];
+    size_t hostLength = (size_t)(colon - address);
+    if(hostLength >= sizeof(host)) {
+        fprintf(stderr, "Host name too long: %s\n", address);
+        return NULL;
+    }
+    memcpy(host, address, hostLength);
+    host[hostLength] = '\0';
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    struct addrinfo* list = NULL;
+    int error = getaddrinfo(hostLength > 0 ? host : NULL, colon + 1, &hints, &list);
+    if(error != 0) {
+        fprintf(stderr, "Cannot resolve '%s': %s\n", address, gai_strerror(error));
+        return NULL;
+    }
+    return list;
+}
+
+// Small messages go out at once instead of waiting to be merged
+void net_set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Returns a listening socket or -1. A Unix socket left by an earlier run is
+// replaced.
+int net_listen(const char* address) {
+    if(strncmp(address, NET_UNIX_PREFIX, strlen(NET_UNIX_PREFIX)) == 0) {
+        struct sockaddr_un addr;
+        if(!net_unix_address(address + strlen(NET_UNIX_PREFIX), &addr)) {
+            return -1;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) {
+            perror("Failed to create socket");
+            return -1;
+        }
+        unlink(addr.sun_path);
+        if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+            perror("Failed to listen");
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo* list = net_tcp_address(address, 1);
+    if(list == NULL) {
+        return -1;
+    }
+    int fd = -1;
+    for(struct addrinfo* ai = list; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 64) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+    if(fd < 0) {
+        perror("Failed to listen");
+    }
+    return fd;
+}
+
+int net_connect_once(const char* address) {
+    if(strncmp(address, NET_UNIX_PREFIX, strlen(NET_UNIX_PREFIX)) == 0) {
+        struct sockaddr_un addr;
+        if(!net_unix_address(address + strlen(NET_UNIX_PREFIX), &addr)) {
+            return -1;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo* list = net_tcp_address(address, 0);
+    if(list == NULL) {
+        return -1;
+    }
+    int fd = -1;
+    for(struct addrinfo* ai = list; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+    if(fd >= 0) {
+        net_set_nodelay(fd);
+    }
+    return fd;
+}
+
+// Keeps trying for timeout seconds, so workers can be started before the
+// coordinator is listening. Returns the socket or -1.
+int net_connect(const char* address, double timeout) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(1) {
+        int fd = net_connect_once(address);
+        if(fd >= 0) {
+            return fd;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9 >= timeout) {
+            fprintf(stderr, "Failed to connect to %s: %s\n", address, strerror(errno));
+            return -1;
+        }
+        usleep(100000);
+    }
+}
+
+// Sends have to finish within this many seconds, a peer that stops reading is given up on
+void net_set_send_timeout(int fd, double seconds) {
+    struct timeval tv;
+    tv.tv_sec = (time_t)seconds;
+    tv.tv_usec = (suseconds_t)((seconds - (double)tv.tv_sec) * 1e6);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Returns 0 when the peer is gone. A closed peer does not raise SIGPIPE.
+int net_send_all(int fd, const void* data, size_t size) {
+    const char* bytes = (const char*)data;
+    while(size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if(sent <= 0) {
+            return 0;
+        }
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+    return 1;
+}
+
+// Returns 0 when the peer closed the connection before size bytes came
+int net_recv_all(int fd, void* data, size_t size) {
+    char* bytes = (char*)data;
+    while(size > 0) {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if(received < 0 && errno == EINTR) {
+            continue;
+        }
+        if(received <= 0) {
+            return 0;
+        }
+        bytes += received;
+        size -= (size_t)received;
+    }
+    return 1;
+}
+
+#endif /* NET_H */
@@ -0,0 +1,370 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#pragma once
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+// Random numbers are drawn from a counter-based generator: every value is a
+// hash of (pixel, sample, bounce, counter), so a pixel gets the same numbers
+// whatever thread renders it and in whatever order the tiles are scheduled.
+//
+// The samples of an image pixel can instead come from a low discrepancy
+// pattern, which spreads the samples of a pixel evenly and converges faster.
+// Each bounce then has SAMPLER_BOUNCE_DIMENSIONS dimensions with a fixed
+// use (sampler_seek picks one), and dimension d of sample i is point i of
+// the pattern in dimension bounce * SAMPLER_BOUNCE_DIMENSIONS + d:
+//  - stratified: rayPerPixel strata per dimension, shuffled and jittered
+//  - sobol: pairs of dimensions are the first two Sobol dimensions, Owen
+//    scrambled, with the point order shuffled for every pair
+//  - halton: one prime base per dimension, Owen scrambled
+// Pixels of a 64x64 block share one scrambling and every dimension is
+// rotated by a blue noise mask, so the error left between neighbouring
+// pixels is high frequency noise. Dimensions past what a pattern covers
+// fall back to the hash.
+
+typedef enum SamplerType {
+    SAMPLER_RANDOM,
+    SAMPLER_STRATIFIED,
+    SAMPLER_SOBOL,
+    SAMPLER_HALTON,
+    SAMPLER_TYPE_COUNT
+} SamplerType;
+
+static const char* samplerTypeNames[SAMPLER_TYPE_COUNT] = {
+    "random",
+    "stratified",
+    "sobol",
+    "halton"
+};
+
+// Dimensions of a bounce. The camera is bounce 0, path bounces start at 1.
+// 2D samples take an even dimension and the next one.
+#define SAMPLE_CAMERA_PIXEL 0
+#define SAMPLE_LIGHT_DIRECTION 0
+#define SAMPLE_BSDF 2
+#define SAMPLE_LIGHT_PICK 4
+#define SAMPLE_ROULETTE 5
+#define SAMPLER_BOUNCE_DIMENSIONS 6
+
+#define SAMPLER_HALTON_DIMENSIONS 64
+#define BLUE_NOISE_SIZE 64
+#define BLUE_NOISE_SIGMA 1.9
+
+typedef struct Sampler {
+    unsigned int pixel;
+    unsigned int sample;
+    unsigned int key;
+    unsigned int counter;
+    SamplerType type;
+    unsigned int bounce;
+    // Samples per pixel, the strata of the stratified pattern
+    unsigned int count;
+    // Scrambling of the block of the pixel and its place in the blue noise mask
+    unsigned int seed;
+    unsigned int noiseX;
+    unsigned int noiseY;
+} Sampler;
+
+// PCG output permutation used as an integer hash
+unsigned int pcg_hash(unsigned int input) {
+    unsigned int state = input * 747796405u + 2891336453u;
+    unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+unsigned int reverse_bits(unsigned int x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of a 32 bit fraction: every bit is flipped depending on
+// the bits above it (Laine and Karras hash, run on the reversed bits)
+unsigned int owen_scramble(unsigned int x, unsigned int seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// Generator matrix of the second Sobol dimension, the first one is the
+// identity (the bits of the index reversed)
+static const unsigned int sobolDirections[32] = {
+    0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+    0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+    0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+    0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu
+};
+
+unsigned int sobol_sample(unsigned int index, int dimension) {
+    if(dimension == 0) {
+        return reverse_bits(index);
+    }
+    unsigned int bits = 0;
+    for(int k = 0; index != 0; k++, index >>= 1) {
+        if(index & 1u) {
+            bits ^= sobolDirections[k];
+        }
+    }
+    return bits;
+}
+
+// Bijection of [0, n) picked by seed (Kensler's hashed permutation)
+unsigned int permute_index(unsigned int i, unsigned int n, unsigned int seed) {
+    unsigned int w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893du;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fu;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while(i >= n);
+    return (i + seed) % n;
+}
+
+static const unsigned short haltonPrimes[SAMPLER_HALTON_DIMENSIONS] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+    137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+    227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+};
+
+// Radical inverse of index in a prime base as a 32 bit fraction, every digit
+// permuted depending on the digits before it
+unsigned int halton_sample(unsigned int index, int dimension, unsigned int seed) {
+    unsigned int base = haltonPrimes[dimension];
+    double invBase = 1.0 / base;
+    double scale = 1.0;
+    double value = 0.0;
+    unsigned int prefix = 0;
+    // Digits past 2^-32 no longer change the result
+    while(scale * 4294967296.0 > 1.0) {
+        unsigned int digit = index % base;
+        index /= base;
+        digit = permute_index(digit, base, pcg_hash(seed ^ prefix));
+        prefix = prefix * base + digit + 1;
+        scale *= invBase;
+        value += digit * scale;
+    }
+    return value < 1.0 ? (unsigned int)(value * 4294967296.0) : 0xffffffffu;
+}
+
+// Ranks 0 to 4095 of a 64x64 void and cluster blue noise mask: the first k
+// pixels by rank are as evenly spread as k pixels can be
+static unsigned short blueNoiseRanks[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+static pthread_once_t blueNoiseOnce = PTHREAD_ONCE_INIT;
+
+// Adds or removes the Gaussian energy of a point of the mask, which wraps around
+void blue_noise_splat(int* energy, const int* kernel, int point, int sign) {
+    int px = point % BLUE_NOISE_SIZE;
+    int py = point / BLUE_NOISE_SIZE;
+    for(int y = 0; y < BLUE_NOISE_SIZE; y++) {
+        const int* row = &kernel[((y - py) & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE];
+        for(int x = 0; x < BLUE_NOISE_SIZE; x++) {
+            energy[y * BLUE_NOISE_SIZE + x] += sign * row[(x - px) & (BLUE_NOISE_SIZE - 1)];
+        }
+    }
+}
+
+// The set point with the most energy (tightest cluster) or the free one with
+// the least (largest void)
+int blue_noise_extreme(const int* energy, const unsigned char* points, int cluster) {
+    int best = -1;
+    for(int i = 0; i < BLUE_NOISE_SIZE * BLUE_NOISE_SIZE; i++) {
+        if(points[i] != cluster) {
+            continue;
+        }
+        if(best < 0 || (cluster ? energy[i] > energy[best] : energy[i] < energy[best])) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Energies are integers so the mask is the same on every machine
+void blue_noise_build(void) {
+    enum { cells = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE };
+    int kernel[cells];
+    for(int y = 0; y < BLUE_NOISE_SIZE; y++) {
+        for(int x = 0; x < BLUE_NOISE_SIZE; x++) {
+            int dx = x < BLUE_NOISE_SIZE / 2 ? x : BLUE_NOISE_SIZE - x;
+            int dy = y < BLUE_NOISE_SIZE / 2 ? y : BLUE_NOISE_SIZE - y;
+            kernel[y * BLUE_NOISE_SIZE + x] = (int)lround(65536.0 * exp(-(dx * dx + dy * dy) / (2.0 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA)));
+        }
+    }
+    static int energy[cells];
+    static int removed[cells];
+    static unsigned char points[cells];
+    static unsigned char remaining[cells];
+    memset(energy, 0, sizeof(energy));
+
+    // A tenth of the pixels at random, then points move from the tightest
+    // cluster to the largest void until that no longer changes anything
+    int ones = 0;
+    for(int i = 0; i < cells; i++) {
+        points[i] = pcg_hash(i) % 10 == 0;
+        if(points[i]) {
+            blue_noise_splat(energy, kernel, i, 1);
+            ones++;
+        }
+    }
+    for(int i = 0; i < cells; i++) {
+        int cluster = blue_noise_extreme(energy, points, 1);
+        points[cluster] = 0;
+        blue_noise_splat(energy, kernel, cluster, -1);
+        int hole = blue_noise_extreme(energy, points, 0);
+        points[hole] = 1;
+        blue_noise_splat(energy, kernel, hole, 1);
+        if(hole == cluster) {
+            break;
+        }
+    }
+
+    // The points of that pattern are ranked by removing the tightest
+    // clusters, the rest by filling the largest voids
+    memcpy(removed, energy, sizeof(energy));
+    memcpy(remaining, points, sizeof(points));
+    for(int rank = ones - 1; rank >= 0; rank--) {
+        int cluster = blue_noise_extreme(removed, remaining, 1);
+        remaining[cluster] = 0;
+        blue_noise_splat(removed, kernel, cluster, -1);
+        blueNoiseRanks[cluster] = rank;
+    }
+    for(int rank = ones; rank < cells; rank++) {
+        int hole = blue_noise_extreme(energy, points, 0);
+        points[hole] = 1;
+        blue_noise_splat(energy, kernel, hole, 1);
+        blueNoiseRanks[hole] = rank;
+    }
+}
+
+void sampler_set_bounce(Sampler* sampler, unsigned int bounce) {
+    sampler->key = pcg_hash(sampler->pixel ^ pcg_hash(sampler->sample ^ pcg_hash(bounce)));
+    sampler->counter = 0;
+    sampler->bounce = bounce;
+}
+
+// Bounce 0 holds the camera dimensions, path bounces start at 1
+Sampler sampler_create(unsigned int pixel, unsigned int sample) {
+    Sampler sampler;
+    sampler.pixel = pixel;
+    sampler.sample = sample;
+    sampler.type = SAMPLER_RANDOM;
+    sampler.count = 0;
+    sampler.seed = 0;
+    sampler.noiseX = 0;
+    sampler.noiseY = 0;
+    sampler_set_bounce(&sampler, 0);
+    return sampler;
+}
+
+// Sampler of a sample of the image pixel (x, y), count being the samples
+// per pixel
+Sampler sampler_create_pixel(SamplerType type, unsigned int x, unsigned int y, unsigned int width, unsigned int sample, unsigned int count) {
+    Sampler sampler = sampler_create(y * width + x, sample);
+    sampler.type = type;
+    sampler.count = count;
+    sampler.seed = pcg_hash(x / BLUE_NOISE_SIZE ^ pcg_hash(y / BLUE_NOISE_SIZE));
+    sampler.noiseX = x % BLUE_NOISE_SIZE;
+    sampler.noiseY = y % BLUE_NOISE_SIZE;
+    if(type != SAMPLER_RANDOM) {
+        pthread_once(&blueNoiseOnce, blue_noise_build);
+    }
+    return sampler;
+}
+
+// Moves to one of the dimensions of the bounce. Numbers of the random
+// sampler have no fixed dimension, they go on in order.
+void sampler_seek(Sampler* sampler, unsigned int dimension) {
+    if(sampler->type != SAMPLER_RANDOM) {
+        sampler->counter = dimension;
+    }
+}
+
+unsigned int sampler_next(Sampler* sampler) {
+    return pcg_hash(sampler->key ^ (sampler->counter++ * 0x9E3779B9u));
+}
+
+// Value of the pattern of the sampler in the current dimension as a 32 bit
+// fraction. Returns 0 when the pattern does not cover it.
+int sampler_pattern(const Sampler* sampler, unsigned int* bits) {
+    if(sampler->type == SAMPLER_RANDOM || sampler->counter >= SAMPLER_BOUNCE_DIMENSIONS) {
+        return 0;
+    }
+    unsigned int dimension = sampler->bounce * SAMPLER_BOUNCE_DIMENSIONS + sampler->counter;
+    unsigned int seed = pcg_hash(sampler->seed ^ pcg_hash(dimension));
+    switch(sampler->type) {
+        case SAMPLER_STRATIFIED: {
+            if(sampler->sample >= sampler->count) {
+                return 0;
+            }
+            unsigned int stratum = permute_index(sampler->sample, sampler->count, seed);
+            float jitter = (float)(pcg_hash(sampler->key ^ sampler->counter) >> 8) * (1.0f / 16777216.0f);
+            *bits = (unsigned int)((stratum + jitter) / sampler->count * 4294967040.0f);
+            break;
+        }
+        case SAMPLER_SOBOL: {
+            // Both dimensions of a pair take the same point
+            unsigned int index = owen_scramble(sampler->sample, pcg_hash(sampler->seed ^ pcg_hash(dimension / 2 + 0x5bd1e995u)));
+            *bits = owen_scramble(sobol_sample(index, dimension & 1), seed);
+            break;
+        }
+        case SAMPLER_HALTON:
+            if(dimension >= SAMPLER_HALTON_DIMENSIONS) {
+                return 0;
+            }
+            *bits = halton_sample(sampler->sample, dimension, seed);
+            break;
+        default:
+            return 0;
+    }
+    // Rotated by the rank of the pixel in the mask, shifted differently for
+    // every dimension
+    unsigned int shift = pcg_hash(dimension ^ 0x68e31da4u);
+    unsigned int noiseX = (sampler->noiseX + shift) % BLUE_NOISE_SIZE;
+    unsigned int noiseY = (sampler->noiseY + (shift >> 8)) % BLUE_NOISE_SIZE;
+    *bits += ((unsigned int)blueNoiseRanks[noiseY * BLUE_NOISE_SIZE + noiseX] << 20) + (1u << 19);
+    return 1;
+}
+
+// Uniform in [0, 1)
+float random01(Sampler* sampler) {
+    unsigned int bits;
+    if(sampler_pattern(sampler, &bits)) {
+        sampler->counter++;
+        return (float)(bits >> 8) * (1.0f / 16777216.0f);
+    }
+    return (float)(sampler_next(sampler) >> 8) * (1.0f / 16777216.0f);
+}
+
+float random_range(Sampler* sampler, float min, float max) {
+    return min + (max - min) * random01(sampler);
+}
+
+#endif /* SAMPLER_H */
@@ -0,0 +1,151 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#pragma once
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Work is given to the pool as task ids 0..nbTasks-1. Each worker gets a
+// contiguous slice of the ids in its own deque: the owner pops from the front
+// so it walks its slice in order, and idle workers steal from the back of the
+// other deques so they take work that is far from what the owner is on.
+
+typedef void (*TaskFunc)(void* ctx, int workerId, int task);
+
+typedef struct TaskDeque {
+    const int* tasks;
+    int front;
+    int back;
+    pthread_mutex_t lock;
+    char padding[64];
+} TaskDeque;
+
+typedef struct ThreadPool {
+    int nbThreads;
+    TaskDeque* deques;
+    TaskFunc func;
+    void* ctx;
+} ThreadPool;
+
+typedef struct Worker {
+    ThreadPool* pool;
+    int id;
+} Worker;
+
+int threadpool_default_thread_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if(count < 1) {
+        return 1;
+    }
+    return (int)count;
+}
+
+int deque_pop_front(TaskDeque* deque, int* task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->front < deque->back) {
+        *task = deque->tasks[deque->front++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+int deque_steal_back(TaskDeque* deque, int* task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->front < deque->back) {
+        *task = deque->tasks[--deque->back];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+void* threadpool_worker(void* arg) {
+    Worker* worker = (Worker*)arg;
+    ThreadPool* pool = worker->pool;
+    int task;
+    while(1) {
+        if(deque_pop_front(&pool->deques[worker->id], &task)) {
+            pool->func(pool->ctx, worker->id, task);
+            continue;
+        }
+        int stolen = 0;
+        for(int i = 1; i < pool->nbThreads && !stolen; i++) {
+            int victim = (worker->id + i) % pool->nbThreads;
+            stolen = deque_steal_back(&pool->deques[victim], &task);
+        }
+        if(!stolen) {
+            // Tasks are never added once the pool runs, so empty deques mean we are done
+            break;
+        }
+        pool->func(pool->ctx, worker->id, task);
+    }
+    return NULL;
+}
+
+// Runs func on every task in tasks[] with nbThreads workers. The calling
+// thread acts as worker 0. Returns once every task has been executed.
+void threadpool_run(int nbThreads, const int* tasks, int nbTasks, TaskFunc func, void* ctx) {
+    if(nbThreads < 1) {
+        nbThreads = 1;
+    }
+    if(nbThreads > nbTasks && nbTasks > 0) {
+        nbThreads = nbTasks;
+    }
+
+    ThreadPool pool;
+    pool.nbThreads = nbThreads;
+    pool.func = func;
+    pool.ctx = ctx;
+    pool.deques = (TaskDeque*)malloc(nbThreads * sizeof(TaskDeque));
+    pthread_t* threads = (pthread_t*)malloc(nbThreads * sizeof(pthread_t));
+    Worker* workers = (Worker*)malloc(nbThreads * sizeof(Worker));
+    if(pool.deques == NULL || threads == NULL || workers == NULL) {
+        perror("Failed to allocate thread pool");
+        free(pool.deques);
+        free(threads);
+        free(workers);
+        return;
+    }
+
+    for(int i = 0; i < nbThreads; i++) {
+        int start = (int)((long)nbTasks * i / nbThreads);
+        int end = (int)((long)nbTasks * (i + 1) / nbThreads);
+        pool.deques[i].tasks = tasks + start;
+        pool.deques[i].front = 0;
+        pool.deques[i].back = end - start;
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    for(int i = 1; i < nbThreads; i++) {
+        if(pthread_create(&threads[i], NULL, threadpool_worker, &workers[i]) != 0) {
+            perror("Failed to create worker thread");
+            // The deque of a missing worker still gets drained through stealing
+            workers[i].pool = NULL;
+        }
+    }
+
+    threadpool_worker(&workers[0]);
+
+    for(int i = 1; i < nbThreads; i++) {
+        if(workers[i].pool != NULL) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for(int i = 0; i < nbThreads; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(pool.deques);
+    free(threads);
+    free(workers);
+}
+
+#endif /* THREADPOOL_H */
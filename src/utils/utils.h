@@ -3,6 +3,9 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <time.h>
+
+#include "sampler.h"
 
 #pragma once
 
@@ -12,12 +15,10 @@ float deg2rad(float angle) {
     return angle * PI/180;
 }
 
-float random01() {
-    return (double)rand() / (double)RAND_MAX;
-}
-
-float random_range(float min, float max) {
-    return min + rand() / (RAND_MAX / (max - min + 1) + 1);
+double wallTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
 }
 
 #endif /* UTILS_H */
\ No newline at end of file
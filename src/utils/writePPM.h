@@ -1,3 +1,8 @@
+#ifndef WRITEPPM_H
+#define WRITEPPM_H
+
+#pragma once
+
 #include <stdio.h>
 
 // Function to write a PPM file
@@ -17,4 +22,31 @@ void writePPM(const char *filename, int width, int height, const unsigned char *
     fwrite(pixelData, 1, width * height * 3, file);
 
     fclose(file);
-}
\ No newline at end of file
+}
+
+// Writes a color PFM, the float version of PPM. Rows go bottom to top and
+// the sign of the scale gives the byte order of the floats (negative for
+// little endian). Returns 0 on failure.
+int writePFM(const char *filename, int width, int height, const float *pixelData) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("Failed to open file");
+        return 0;
+    }
+
+    const unsigned int one = 1;
+    int littleEndian = *(const unsigned char*)&one == 1;
+    fprintf(file, "PF\n%d %d\n%s\n", width, height, littleEndian ? "-1.0" : "1.0");
+
+    int ok = 1;
+    for (int y = height - 1; y >= 0 && ok; y--) {
+        ok = fwrite(pixelData + (size_t)y * width * 3, sizeof(float), (size_t)width * 3, file) == (size_t)width * 3;
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        perror("Failed to write PFM file");
+    }
+    return ok;
+}
+
+#endif /* WRITEPPM_H */
@@ -0,0 +1,223 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#pragma once
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "math/geometry.h"
+#include "math/quantize.h"
+
+// Queues of the wavefront renderer. Instead of following one path to the
+// end, a tile starts every path of a round of samples at once and moves them
+// all forward one bounce per pass: every ray is intersected, then every hit
+// is shaded, then every shadow ray is traced. Between passes the paths are
+// binned by ray direction (so rays traced together go through the same BVH
+// nodes and can share packets) and by material (so the same shading code
+// and textures are used back to back). One queue belongs to each worker.
+
+// Directions are binned on a grid over the octahedral map of the sphere
+#define WAVEFRONT_DIRECTION_GRID 16
+#define WAVEFRONT_DIRECTION_BINS (WAVEFRONT_DIRECTION_GRID * WAVEFRONT_DIRECTION_GRID)
+
+typedef struct RaySoA {
+    float* originX;
+    float* originY;
+    float* originZ;
+    float* dirX;
+    float* dirY;
+    float* dirZ;
+} RaySoA;
+
+typedef struct WavefrontQueue {
+    int capacity;
+    int bins;
+    // Next ray of every path of the round
+    RaySoA rays;
+    // Light gathered so far and throughput
+    float* colorR;
+    float* colorG;
+    float* colorB;
+    float* throughputR;
+    float* throughputG;
+    float* throughputB;
+    // Where the last hit sampled the lights from, to MIS weight the emission
+    // the next ray finds
+    int* lightsSampled;
+    float* lastX;
+    float* lastY;
+    float* lastZ;
+    int* lastObject;
+    float* lastBsdfPdf;
+    // Ray cone of the texture lookups
+    float* coneWidth;
+    float* coneSpread;
+    // Pixel of the tile the path belongs to, and the image pixel and sample
+    // number its sampler is keyed on
+    int* tilePixel;
+    int* imagePixel;
+    int* sample;
+    HitInfo* hits;
+    // Paths still going, in the order the current pass visits them
+    int* active;
+    int activeCount;
+    // Shadow rays queued by the shading pass, with the light they bring to
+    // their path when nothing is in the way
+    RaySoA shadowRays;
+    float* shadowR;
+    float* shadowG;
+    float* shadowB;
+    int* shadowLight;
+    int* shadowPath;
+    int* shadowOrder;
+    HitInfo* shadowHits;
+    int shadowCount;
+    // Scratch space of the binning
+    int* keys;
+    int* scratch;
+    int* binCounts;
+    void* memory;
+} WavefrontQueue;
+
+size_t wavefront_aligned(size_t bytes) {
+    return (bytes + 63) & ~(size_t)63;
+}
+
+// Hands out 64 byte aligned pieces of the block of a queue
+void* wavefront_carve(char** cursor, size_t bytes) {
+    void* piece = *cursor;
+    *cursor += wavefront_aligned(bytes);
+    return piece;
+}
+
+void wavefront_carve_rays(char** cursor, RaySoA* rays, int capacity) {
+    size_t bytes = (size_t)capacity * sizeof(float);
+    rays->originX = (float*)wavefront_carve(cursor, bytes);
+    rays->originY = (float*)wavefront_carve(cursor, bytes);
+    rays->originZ = (float*)wavefront_carve(cursor, bytes);
+    rays->dirX = (float*)wavefront_carve(cursor, bytes);
+    rays->dirY = (float*)wavefront_carve(cursor, bytes);
+    rays->dirZ = (float*)wavefront_carve(cursor, bytes);
+}
+
+// Room for capacity paths and as many shadow rays, with keys in [0, bins)
+int wavefront_queue_init(WavefrontQueue* queue, int capacity, int bins) {
+    memset(queue, 0, sizeof(WavefrontQueue));
+    size_t floats = wavefront_aligned((size_t)capacity * sizeof(float));
+    size_t ints = wavefront_aligned((size_t)capacity * sizeof(int));
+    size_t hits = wavefront_aligned((size_t)capacity * sizeof(HitInfo));
+    // Two ray queues, 15 other float and 11 int arrays
+    size_t size = 27 * floats + 11 * ints + 2 * hits + wavefront_aligned((size_t)bins * sizeof(int));
+    char* cursor = (char*)aligned_alloc(64, size);
+    if(cursor == NULL) {
+        perror("Failed to allocate wavefront queue");
+        return 0;
+    }
+    queue->memory = cursor;
+    queue->capacity = capacity;
+    queue->bins = bins;
+
+    size_t floatBytes = (size_t)capacity * sizeof(float);
+    size_t intBytes = (size_t)capacity * sizeof(int);
+    wavefront_carve_rays(&cursor, &queue->rays, capacity);
+    queue->colorR = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->colorG = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->colorB = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->throughputR = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->throughputG = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->throughputB = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->lightsSampled = (int*)wavefront_carve(&cursor, intBytes);
+    queue->lastX = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->lastY = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->lastZ = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->lastObject = (int*)wavefront_carve(&cursor, intBytes);
+    queue->lastBsdfPdf = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->coneWidth = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->coneSpread = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->tilePixel = (int*)wavefront_carve(&cursor, intBytes);
+    queue->imagePixel = (int*)wavefront_carve(&cursor, intBytes);
+    queue->sample = (int*)wavefront_carve(&cursor, intBytes);
+    queue->hits = (HitInfo*)wavefront_carve(&cursor, (size_t)capacity * sizeof(HitInfo));
+    queue->active = (int*)wavefront_carve(&cursor, intBytes);
+    wavefront_carve_rays(&cursor, &queue->shadowRays, capacity);
+    queue->shadowR = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->shadowG = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->shadowB = (float*)wavefront_carve(&cursor, floatBytes);
+    queue->shadowLight = (int*)wavefront_carve(&cursor, intBytes);
+    queue->shadowPath = (int*)wavefront_carve(&cursor, intBytes);
+    queue->shadowOrder = (int*)wavefront_carve(&cursor, intBytes);
+    queue->shadowHits = (HitInfo*)wavefront_carve(&cursor, (size_t)capacity * sizeof(HitInfo));
+    queue->keys = (int*)wavefront_carve(&cursor, intBytes);
+    queue->scratch = (int*)wavefront_carve(&cursor, intBytes);
+    queue->binCounts = (int*)wavefront_carve(&cursor, (size_t)bins * sizeof(int));
+    return 1;
+}
+
+void freeWavefrontQueue(WavefrontQueue* queue) {
+    free(queue->memory);
+    memset(queue, 0, sizeof(WavefrontQueue));
+}
+
+Ray ray_soa_load(const RaySoA* rays, int i) {
+    return ray_create(vec3_build(rays->originX[i], rays->originY[i], rays->originZ[i]), vec3_build(rays->dirX[i], rays->dirY[i], rays->dirZ[i]));
+}
+
+void ray_soa_store(RaySoA* rays, int i, Ray ray) {
+    rays->originX[i] = ray.origin.x;
+    rays->originY[i] = ray.origin.y;
+    rays->originZ[i] = ray.origin.z;
+    rays->dirX[i] = ray.direction.x;
+    rays->dirY[i] = ray.direction.y;
+    rays->dirZ[i] = ray.direction.z;
+}
+
+// Cell of the direction on the octahedral map, the direction does not need
+// to be normalized
+int wavefront_direction_bin(float dx, float dy, float dz) {
+    float length = fabsf(dx) + fabsf(dy) + fabsf(dz);
+    if(!(length > 0.0f)) {
+        return 0;
+    }
+    float u = dx / length;
+    float v = dy / length;
+    if(dz < 0.0f) {
+        octahedral_wrap(&u, &v);
+    }
+    int x = (int)((u * 0.5f + 0.5f) * WAVEFRONT_DIRECTION_GRID);
+    int y = (int)((v * 0.5f + 0.5f) * WAVEFRONT_DIRECTION_GRID);
+    x = x < 0 ? 0 : (x >= WAVEFRONT_DIRECTION_GRID ? WAVEFRONT_DIRECTION_GRID - 1 : x);
+    y = y < 0 ? 0 : (y >= WAVEFRONT_DIRECTION_GRID ? WAVEFRONT_DIRECTION_GRID - 1 : y);
+    return y * WAVEFRONT_DIRECTION_GRID + x;
+}
+
+// Sets the key of every listed item to the bin of its ray direction
+void wavefront_direction_keys(WavefrontQueue* queue, const RaySoA* rays, const int* items, int count) {
+    for(int i = 0; i < count; i++) {
+        int item = items[i];
+        queue->keys[item] = wavefront_direction_bin(rays->dirX[item], rays->dirY[item], rays->dirZ[item]);
+    }
+}
+
+// Stable counting sort of items on queue->keys[item]
+void wavefront_sort(WavefrontQueue* queue, int* items, int count) {
+    int* counts = queue->binCounts;
+    memset(counts, 0, queue->bins * sizeof(int));
+    for(int i = 0; i < count; i++) {
+        counts[queue->keys[items[i]]]++;
+    }
+    int offset = 0;
+    for(int b = 0; b < queue->bins; b++) {
+        int binCount = counts[b];
+        counts[b] = offset;
+        offset += binCount;
+    }
+    for(int i = 0; i < count; i++) {
+        queue->scratch[counts[queue->keys[items[i]]]++] = items[i];
+    }
+    memcpy(items, queue->scratch, count * sizeof(int));
+}
+
+#endif /* WAVEFRONT_H */